@@ -0,0 +1,458 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h> //Für intptr_t
+#include <errno.h>
+#include <poll.h> //Für poll() beim Preload
+#include <time.h> //Für clock_gettime()
+#include <pthread.h> //Ein Thread pro Verbindung
+#include <getopt.h> //Für die Optionen
+#include "twmailer-clientlib.h" //Protokoll und Verbindungen
+
+#define PRELOAD_WINDOW 64 //Preload: so viele SENDs pro Verbindung gleichzeitig unterwegs
+#define HISTOGRAM_SUB_BUCKETS 16 //Unterteilung jeder Zweierpotenz (ca. 6% Auflösung)
+#define HISTOGRAM_BUCKETS (64 * HISTOGRAM_SUB_BUCKETS)
+
+enum bench_command { BENCH_SEND, BENCH_LIST, BENCH_READ, BENCH_DEL, BENCH_COMMANDS };
+
+const char *command_names[BENCH_COMMANDS] = { "SEND", "LIST", "READ", "DEL" };
+
+//Latenz-Histogramm mit logarithmischen Buckets (Werte in Mikrosekunden):
+struct histogram {
+    unsigned long counts[HISTOGRAM_BUCKETS];
+    unsigned long total;
+    unsigned long errors; //ERR-Antworten
+    unsigned long max;
+};
+
+//Einstellungen für einen Lauf:
+struct bench_config {
+    const char *host;
+    const char *port;
+    int connections; //gleichzeitige Verbindungen (ein Thread pro Verbindung)
+    int duration; //Sekunden
+    int mailboxes; //Anzahl verschiedener Empfänger
+    int message_size; //Bytes Text pro SEND
+    int preload; //Nachrichten pro Mailbox vor dem Messen
+    int weights[BENCH_COMMANDS]; //Anteile von SEND/LIST/READ/DEL
+    int weight_total;
+    long list_limit; //LIST <0> <limit>, 0 = ganze Mailbox
+};
+
+//Zustand eines Verbindungs-Threads:
+struct bench_worker {
+    pthread_t thread;
+    int index;
+    struct twm_connection *connection;
+    unsigned int seed; //für rand_r()
+    struct histogram histograms[BENCH_COMMANDS];
+    int failed; //1 = Verbindung abgebrochen
+};
+
+struct bench_config config;
+char *message_body; //Text für SEND (message_size Bytes, Zeilen zu 72 Zeichen)
+long *sent_per_mailbox; //Anzahl zugestellter Nachrichten pro Mailbox (für READ/DEL-Nummern)
+int preload_errors; //Preload-SENDs mit ERR vom Server
+volatile int measuring = 0; //1 = Latenzen werden gezählt
+volatile int stop_requested = 0;
+
+void *bench_thread(void *data);
+struct twm_connection *connect_server(void);
+int preload(struct bench_worker *worker); //Preload-SENDs gepipelined, -1 = Verbindungsfehler oder ERR
+void preload_done(struct twm_request *request, void *user_data); //Callback: zugestellte Nachricht zählen
+int run_command(struct bench_worker *worker, enum bench_command command);
+enum bench_command pick_command(struct bench_worker *worker);
+long long now_us(void);
+void histogram_add(struct histogram *histogram, unsigned long value);
+unsigned long histogram_percentile(const struct histogram *histogram, double percentile);
+void histogram_merge(struct histogram *target, const struct histogram *source);
+int parse_mix(const char *mix);
+void usage(const char *program);
+
+int main(int argc, char **argv) {
+    int opt;
+    long fail_p99 = 0; //>0: Exit-Code 1, wenn ein p99 darüber liegt (Regression-Gate)
+
+    static struct option long_options[] = {
+        { "connections", required_argument, NULL, 'c' },
+        { "duration", required_argument, NULL, 'd' },
+        { "mailboxes", required_argument, NULL, 'm' },
+        { "size", required_argument, NULL, 's' },
+        { "preload", required_argument, NULL, 'p' },
+        { "mix", required_argument, NULL, 'x' },
+        { "list-limit", required_argument, NULL, 'l' },
+        { "fail-p99", required_argument, NULL, 'f' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    //Standardwerte:
+    config.connections = 16;
+    config.duration = 10;
+    config.mailboxes = 64;
+    config.message_size = 1024;
+    config.preload = 20;
+    config.list_limit = 0;
+    parse_mix("40:30:25:5");
+
+    while ((opt = getopt_long(argc, argv, "c:d:m:s:p:x:l:f:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'c':
+            config.connections = atoi(optarg);
+            break;
+        case 'd':
+            config.duration = atoi(optarg);
+            break;
+        case 'm':
+            config.mailboxes = atoi(optarg);
+            break;
+        case 's':
+            config.message_size = atoi(optarg);
+            break;
+        case 'p':
+            config.preload = atoi(optarg);
+            break;
+        case 'x':
+            if (parse_mix(optarg) == -1) {
+                fprintf(stderr, "Invalid mix: %s (expected SEND:LIST:READ:DEL weights, e.g. 40:30:25:5)\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'l':
+            config.list_limit = atol(optarg);
+            break;
+        case 'f':
+            fail_p99 = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind < 2 || config.connections < 1 || config.duration < 1 || config.mailboxes < 1 || config.message_size < 0 || config.preload < 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    config.host = argv[optind];
+    config.port = argv[optind + 1];
+
+    //Nachrichtentext: druckbare Zeichen, Zeilenumbruch alle 72 Zeichen, kein "."-Abschluss
+    message_body = malloc(config.message_size + 1);
+    sent_per_mailbox = calloc(config.mailboxes, sizeof(long));
+    struct bench_worker *workers = calloc(config.connections, sizeof(struct bench_worker));
+    if (!message_body || !sent_per_mailbox || !workers) {
+        perror("Failed to allocate benchmark state");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < config.message_size; i++) {
+        message_body[i] = (i % 73 == 72) ? '\n' : 'a' + i % 26;
+    }
+    message_body[config.message_size] = '\0';
+
+    printf("Benchmark: %d connections, %d s, %d mailboxes, %d byte messages, mix SEND:LIST:READ:DEL = %d:%d:%d:%d\n",
+           config.connections, config.duration, config.mailboxes, config.message_size,
+           config.weights[BENCH_SEND], config.weights[BENCH_LIST], config.weights[BENCH_READ], config.weights[BENCH_DEL]);
+
+    //Verbindungen aufbauen, Threads starten (zuerst Preload, dann Messung):
+    for (int i = 0; i < config.connections; i++) {
+        workers[i].index = i;
+        workers[i].seed = (unsigned int)(time(NULL) ^ (i * 2654435761u));
+        workers[i].connection = connect_server();
+        if (!workers[i].connection) {
+            return EXIT_FAILURE;
+        }
+    }
+    long long preload_start = now_us();
+    for (int i = 0; i < config.connections; i++) {
+        if (pthread_create(&workers[i].thread, NULL, bench_thread, &workers[i]) != 0) {
+            perror("Failed to create benchmark thread");
+            return EXIT_FAILURE;
+        }
+    }
+
+    //Warten bis alle Threads mit dem Preload fertig sind:
+    while (1) {
+        long total = 0;
+        int failed = 0;
+        for (int i = 0; i < config.mailboxes; i++) {
+            total += __atomic_load_n(&sent_per_mailbox[i], __ATOMIC_RELAXED);
+        }
+        for (int i = 0; i < config.connections; i++) {
+            failed |= __atomic_load_n(&workers[i].failed, __ATOMIC_RELAXED);
+        }
+        if (failed) {
+            fprintf(stderr, "Preload failed (%d SEND(s) rejected by the server)\n", __atomic_load_n(&preload_errors, __ATOMIC_RELAXED));
+            return EXIT_FAILURE;
+        }
+        if (total >= (long)config.mailboxes * config.preload) {
+            break;
+        }
+        usleep(10000);
+    }
+    printf("Preload of %ld messages took %.2f s\n", (long)config.mailboxes * config.preload, (now_us() - preload_start) / 1e6);
+
+    long long start = now_us();
+    measuring = 1;
+    sleep(config.duration);
+    stop_requested = 1;
+    long long elapsed = now_us() - start;
+
+    //Ergebnisse zusammenführen:
+    struct histogram totals[BENCH_COMMANDS];
+    memset(totals, 0, sizeof(totals));
+    int failures = 0;
+    for (int i = 0; i < config.connections; i++) {
+        pthread_join(workers[i].thread, NULL);
+        twm_close(workers[i].connection);
+        failures += workers[i].failed;
+        for (int c = 0; c < BENCH_COMMANDS; c++) {
+            histogram_merge(&totals[c], &workers[i].histograms[c]);
+        }
+    }
+
+    unsigned long total_ops = 0;
+    int gate_failed = failures > 0;
+    printf("\n%-6s %10s %8s %12s %10s %10s %10s %10s\n", "cmd", "ops", "errors", "ops/s", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+    for (int c = 0; c < BENCH_COMMANDS; c++) {
+        if (totals[c].total == 0) {
+            continue;
+        }
+        unsigned long p99 = histogram_percentile(&totals[c], 99.0);
+        printf("%-6s %10lu %8lu %12.0f %10lu %10lu %10lu %10lu\n", command_names[c], totals[c].total, totals[c].errors,
+               totals[c].total / (elapsed / 1e6), histogram_percentile(&totals[c], 50.0), p99,
+               histogram_percentile(&totals[c], 99.9), totals[c].max);
+        total_ops += totals[c].total;
+        if (fail_p99 > 0 && p99 > (unsigned long)fail_p99) {
+            gate_failed = 1;
+        }
+    }
+    printf("%-6s %10lu %8s %12.0f\n", "total", total_ops, "", total_ops / (elapsed / 1e6));
+    if (failures > 0) {
+        printf("%d connection(s) failed\n", failures);
+    }
+
+    free(workers);
+    free(sent_per_mailbox);
+    free(message_body);
+    return gate_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void *bench_thread(void *data) {
+    struct bench_worker *worker = data;
+
+    if (preload(worker) == -1) {
+        worker->failed = 1;
+        return NULL;
+    }
+    while (!measuring) {
+        usleep(1000);
+    }
+
+    //Messung: geschlossene Schleife, immer genau eine offene Anfrage pro Verbindung
+    while (!stop_requested) {
+        enum bench_command command = pick_command(worker);
+        long long start = now_us();
+        int result = run_command(worker, command);
+        if (result == -1) {
+            worker->failed = 1;
+            break;
+        }
+        histogram_add(&worker->histograms[command], now_us() - start);
+        if (result == 1) {
+            worker->histograms[command].errors++;
+        }
+    }
+    return NULL;
+}
+
+struct twm_connection *connect_server(void) {
+    struct twm_connection *connection = twm_connect(config.host, config.port);
+    if (!connection || twm_wait(connection, NULL) == -1) { //verbunden, sobald CAPA beantwortet ist
+        perror("Connect error");
+        if (connection) {
+            twm_close(connection);
+        }
+        return NULL;
+    }
+    return connection;
+}
+
+//Preload: jede Verbindung befüllt ihren Anteil der Mailboxen, ohne auf jede Antwort zu warten
+int preload(struct bench_worker *worker) {
+    for (int mailbox = worker->index; mailbox < config.mailboxes; mailbox += config.connections) {
+        for (int i = 0; i < config.preload; i++) {
+            char username[32], subject[64];
+            snprintf(username, sizeof(username), "mb%d", mailbox);
+            snprintf(subject, sizeof(subject), "Preload %d", i);
+            if (!twm_send(worker->connection, "bench", username, subject, message_body, config.message_size, preload_done, (void *)(intptr_t)mailbox) && twm_failed(worker->connection)) {
+                return -1;
+            }
+            //Fenster voll: auf Antworten warten
+            while (twm_pending(worker->connection) >= PRELOAD_WINDOW) {
+                struct pollfd pfd = { twm_fd(worker->connection), twm_events(worker->connection), 0 };
+                if ((poll(&pfd, 1, -1) == -1 && errno != EINTR) || twm_process(worker->connection, pfd.revents) == -1) {
+                    return -1;
+                }
+            }
+            if (__atomic_load_n(&preload_errors, __ATOMIC_RELAXED) > 0) {
+                return -1;
+            }
+        }
+    }
+    if (twm_wait(worker->connection, NULL) == -1 || __atomic_load_n(&preload_errors, __ATOMIC_RELAXED) > 0) {
+        return -1;
+    }
+    return 0;
+}
+
+void preload_done(struct twm_request *request, void *user_data) {
+    //Nur OK zählt als zugestellt: sonst würden READ/DEL später Nummern verwenden, die es nicht gibt
+    if (request->status == TWM_OK) {
+        __atomic_fetch_add(&sent_per_mailbox[(intptr_t)user_data], 1, __ATOMIC_RELAXED);
+    } else if (request->status == TWM_ERR) {
+        __atomic_fetch_add(&preload_errors, 1, __ATOMIC_RELAXED);
+    }
+    twm_request_free(request);
+}
+
+//Rückgabe: 0 = OK, 1 = ERR vom Server, -1 = Verbindungsfehler
+int run_command(struct bench_worker *worker, enum bench_command command) {
+    char username[32];
+    int mailbox = rand_r(&worker->seed) % config.mailboxes;
+    long known = __atomic_load_n(&sent_per_mailbox[mailbox], __ATOMIC_RELAXED);
+    long message_id = known > 0 ? 1 + rand_r(&worker->seed) % known : 1;
+    struct twm_request *request;
+
+    snprintf(username, sizeof(username), "mb%d", mailbox);
+    switch (command) {
+    case BENCH_SEND:
+        request = twm_send(worker->connection, "bench", username, "Benchmark message", message_body, config.message_size, NULL, NULL);
+        break;
+    case BENCH_LIST:
+        request = twm_list(worker->connection, username, 0, config.list_limit > 0 ? config.list_limit : -1, NULL, NULL);
+        break;
+    case BENCH_READ:
+        request = twm_read(worker->connection, username, message_id, NULL, NULL); //ERR z.B. wenn bereits gelöscht
+        break;
+    default:
+        request = twm_del(worker->connection, username, message_id, NULL, NULL);
+        break;
+    }
+    if (!request || twm_wait(worker->connection, request) == -1) {
+        if (request) {
+            twm_request_free(request);
+        }
+        return -1;
+    }
+
+    int result = request->status == TWM_OK ? 0 : 1;
+    if (command == BENCH_SEND && result == 0) {
+        __atomic_fetch_add(&sent_per_mailbox[mailbox], 1, __ATOMIC_RELAXED);
+    }
+    twm_request_free(request);
+    return result;
+}
+
+enum bench_command pick_command(struct bench_worker *worker) {
+    int value = rand_r(&worker->seed) % config.weight_total;
+    for (int c = 0; c < BENCH_COMMANDS; c++) {
+        if (value < config.weights[c]) {
+            return c;
+        }
+        value -= config.weights[c];
+    }
+    return BENCH_SEND;
+}
+
+long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void histogram_add(struct histogram *histogram, unsigned long value) {
+    int bucket;
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        bucket = value; //kleine Werte exakt
+    } else {
+        //Zweierpotenz + die nächsten 4 Bits als Unterteilung
+        int exponent = 63 - __builtin_clzl(value);
+        int sub = (value >> (exponent - 4)) & (HISTOGRAM_SUB_BUCKETS - 1);
+        bucket = (exponent - 3) * HISTOGRAM_SUB_BUCKETS + sub;
+    }
+    if (bucket >= HISTOGRAM_BUCKETS) {
+        bucket = HISTOGRAM_BUCKETS - 1;
+    }
+    histogram->counts[bucket]++;
+    histogram->total++;
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+unsigned long histogram_percentile(const struct histogram *histogram, double percentile) {
+    unsigned long rank = (unsigned long)(histogram->total * percentile / 100.0 + 0.5);
+    unsigned long seen = 0;
+
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        seen += histogram->counts[bucket];
+        if (seen >= rank) {
+            if (bucket < HISTOGRAM_SUB_BUCKETS) {
+                return bucket;
+            }
+            //Obergrenze des Buckets zurückgeben
+            int exponent = bucket / HISTOGRAM_SUB_BUCKETS + 3;
+            int sub = bucket % HISTOGRAM_SUB_BUCKETS;
+            unsigned long upper = ((unsigned long)(HISTOGRAM_SUB_BUCKETS + sub + 1) << (exponent - 4)) - 1;
+            return upper < histogram->max ? upper : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+void histogram_merge(struct histogram *target, const struct histogram *source) {
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        target->counts[bucket] += source->counts[bucket];
+    }
+    target->total += source->total;
+    target->errors += source->errors;
+    if (source->max > target->max) {
+        target->max = source->max;
+    }
+}
+
+int parse_mix(const char *mix) {
+    int weights[BENCH_COMMANDS];
+    if (sscanf(mix, "%d:%d:%d:%d", &weights[0], &weights[1], &weights[2], &weights[3]) != 4) {
+        return -1;
+    }
+    int total = 0;
+    for (int c = 0; c < BENCH_COMMANDS; c++) {
+        if (weights[c] < 0) {
+            return -1;
+        }
+        total += weights[c];
+    }
+    if (total == 0) {
+        return -1;
+    }
+    memcpy(config.weights, weights, sizeof(weights));
+    config.weight_total = total;
+    return 0;
+}
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options] <ip> <port>\n"
+                    "  --connections N   concurrent connections (default 16)\n"
+                    "  --duration S      measured seconds (default 10)\n"
+                    "  --mailboxes N     number of receiver mailboxes (default 64)\n"
+                    "  --size BYTES      message body size (default 1024)\n"
+                    "  --preload N       messages per mailbox before measuring (default 20)\n"
+                    "  --mix S:L:R:D     weights of SEND:LIST:READ:DEL (default 40:30:25:5)\n"
+                    "  --list-limit N    use LIST 0 N instead of full LIST\n"
+                    "  --fail-p99 US     exit with 1 if any command's p99 exceeds US microseconds\n", program);
+}
@@ -1,63 +1,79 @@
-#include <sys/types.h>
-#include <sys/socket.h> //Für Sockets
-#include <netinet/in.h>
-#include <arpa/inet.h> //Für Umwandlung von IP-Adressen
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h> //Für Ein- und Ausgabe z.B. printf() und fgets()
 #include <string.h> //Für Funktionen wie strcmp() und strcat()
-#include <ctype.h> //Für Funktionen zur Zeichenverarbeitung wie isdigit()
+#include <poll.h> //Für poll() im Batch-Modus
+#include "twmailer-clientlib.h" //Protokoll, Verbindung und Antworten
 
 #define BUF 4096 //Buffergröße = 4096 Bytes
+#define BATCH_BUF 65536 //Batch-Modus: so viele Bytes dürfen ungesendet warten, bevor weitere Befehle gelesen werden
+
+void print_response(struct twm_request *request, void *user_data); //Callback: Antwort ausgeben und freigeben
+void print_list_response(struct twm_request *request); //LIST/SEARCH: Anzahl, dann Betreffzeilen
+void print_stats_response(struct twm_request *request); //STATS: Statistikzeilen
+void print_read_response(struct twm_request *request); //READ: Nachricht, OK
+int read_input_line(FILE *input, char *line, size_t size); //Zeile ohne \n lesen, -1 = EOF
+int parse_message_number(const char *text, long *id); //-1 = keine Zahl
+struct twm_request *read_batch_command(struct twm_connection *connection, FILE *input, const char *line); //Felder lesen und Befehl einreihen
+int pump(struct twm_connection *connection, int timeout_ms); //ein poll() und verarbeiten, -1 = Verbindung abgebrochen
+int run_batch(struct twm_connection *connection, FILE *input); //Befehle gepipelined senden und Antworten ausgeben
 
 int main(int argc, char **argv) {
-    int create_socket;
-    struct sockaddr_in address; //zum Speichern der Serveradresse
+    struct twm_connection *connection;
     char buffer[BUF]; //Buffer fürs Speichern von Daten
-    int size; //Hilfsvariable für die Größe von empfangenen Daten
+    FILE *batch_input = NULL; //gesetzt = Batch-Modus
 
     if (argc < 3) { //Mindestens 3 Argumente: Programmname (immer), IP, Port-Nummer
-        fprintf(stderr, "Usage: %s <ip> <port>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <ip> <port> [--batch [file]]\n", argv[0]);
         return EXIT_FAILURE;
     }
 
-    //Socket ersetllen:
-    if ((create_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        perror("Socket error");
-        return EXIT_FAILURE;
+    //Batch-Modus: Befehle aus Datei oder stdin, ohne Eingabeaufforderungen
+    if (argc >= 4) {
+        if (strcmp(argv[3], "--batch") != 0) {
+            fprintf(stderr, "Usage: %s <ip> <port> [--batch [file]]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        batch_input = argc >= 5 ? fopen(argv[4], "r") : stdin;
+        if (!batch_input) {
+            perror("Failed to open batch file");
+            return EXIT_FAILURE;
+        }
     }
 
-    //Serveradresse initialisieren:
-    address.sin_family = AF_INET; //Adressfamilie IPv4
-    address.sin_port = htons(atoi(argv[2])); //Portnummer (wird in Netzwerkbyte-Reihenfolge konvertiert)
-    if (inet_aton(argv[1], &address.sin_addr) == 0) { //IP-Adresse konvertieren
-        fprintf(stderr, "Invalid IP address\n");
+    //Server Verbindung herstellen (die Bibliothek meldet dabei "CAPA deflate" an und entpackt selbst):
+    connection = twm_connect(argv[1], argv[2]);
+    if (!connection || twm_wait(connection, NULL) == -1) {
+        perror("Connect error");
         return EXIT_FAILURE;
     }
 
-    //Server Verbindung herstellen:
-    if (connect(create_socket, (struct sockaddr *)&address, sizeof(address)) == -1) {
-        perror("Connect error");
-        return EXIT_FAILURE;
+    if (batch_input) {
+        int result = run_batch(connection, batch_input);
+        twm_close(connection);
+        return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
-    printf("Connected to the server. Available commands: SEND, LIST, READ, DELETE, QUIT\n");
+    printf("Connected to the server. Available commands: SEND, LIST, READ, DELETE, SEARCH, STATS, QUIT\n");
 
     while (1) {
         printf(">> ");
-        fgets(buffer, BUF, stdin); //Eingabe lesen
+        if (!fgets(buffer, BUF, stdin)) { //Eingabe lesen, EOF wie QUIT behandeln
+            strcpy(buffer, "QUIT");
+        }
         buffer[strcspn(buffer, "\n")] = 0; //Zeilenumbruch \n entfernen
+        struct twm_request *request = NULL;
 
         //SEND:
         if (strncmp(buffer, "SEND", 4) == 0) {
-            char sender[9], receiver[9], subject[81], message[BUF], temp[BUF]; //char arrays für die Attribute
+            char sender[9], receiver[BUF], subject[81], message[BUF], temp[BUF]; //char arrays für die Attribute
             //Eingabe Absender:
             printf("Sender (max. 8 digits): ");
             fgets(sender, sizeof(sender), stdin);
             sender[strcspn(sender, "\n")] = 0; //Zeilenumbruch \n entfernen
 
-            //Eingabe Empfänger:
-            printf("Receiver (max. 8 digits): ");
+            //Eingabe Empfänger (mehrere durch Komma getrennt):
+            printf("Receiver(s) (max. 8 digits each, separated by commas): ");
             fgets(receiver, sizeof(receiver), stdin);
             receiver[strcspn(receiver, "\n")] = 0; //Zeilenumbruch \n entfernen
 
@@ -78,17 +94,9 @@ int main(int argc, char **argv) {
                 strcat(message, "\n"); //Zeilenumbruch nach jeder Zeile hinzufügen
             }
 
-            //Alle Infos in finalen Buffer schreiben:
-            int snprintf_result = snprintf(buffer, sizeof(buffer), "SEND\n%s\n%s\n%s\n%s\n.\n", sender, receiver, subject, message);
-            if (snprintf_result >= sizeof(buffer) || snprintf_result < 0) {
-                fprintf(stderr, "Error: Message too long to send\n");
-                continue; //Nachricht nicht senden, wenn ein Fehler mit Buffer
-            }
-
-            //Nachricht an Server senden:
-            send(create_socket, buffer, strlen(buffer), 0);
-
-        } 
+            //Nachricht an Server senden (mit Längenangabe, der Text darf auch "." Zeilen enthalten):
+            request = twm_send(connection, sender, receiver, subject, message, strlen(message), print_response, NULL);
+        }
         //LIST:
         else if (strncmp(buffer, "LIST", 4) == 0) {
             char username[8];
@@ -96,41 +104,21 @@ int main(int argc, char **argv) {
             fgets(username, sizeof(username), stdin); //Einlesen von Benutzername
             username[strcspn(username, "\n")] = 0; //Zeilenumbruch \n entfernen
 
-            snprintf(buffer, sizeof(buffer), "LIST\n%s\n", username); //LIST-Befehl mit dem Benutzernamen kombinieren
-            send(create_socket, buffer, strlen(buffer), 0);
-
-            char response[BUF]; //Serverantwort empfangen
-            int total_messages = 0;
-
-            while (1) {
-                ssize_t size = recv(create_socket, response, sizeof(response) - 1, 0);
-                if (size <= 0) { //Fehler oder Server geschlossen
-                    if (size == 0) {
-                        printf("Server closed the connection.\n");
-                    } else {
-                        perror("Recv error");
-                    }
-                    break;
-                }
-                
-                response[size] = '\0'; //Empfangenes Null-terminieren
-
-                //Überprüfen, ob die empfangene Nachricht Zahl (Anzahl der Nachrichten) ist
-                if (isdigit(response[0])) { 
-                    printf("Count of messages of the user: %s", response); //Ausgabe der Anzahl der Nachrichten
-                    break;
-                } else { //Ausgabe der Betreffzeilen
-                    printf("%s", response);
-                    total_messages++;
-                    continue;
-                }
+            request = twm_list(connection, username, 0, -1, print_response, NULL); //Antwort: Anzahl, danach genau so viele Zeilen
+        }
 
-            }
-            if (total_messages == 0) { //wenn keine Nachricht vorhanden
-                printf("No messages found for the user.\n");
-                continue;
-            }
-            continue;
+        //SEARCH (Treffer im Format von LIST):
+        else if (strncmp(buffer, "SEARCH", 6) == 0) {
+            char username[9], terms[BUF];
+            printf("Username (max. 8 digits): ");
+            fgets(username, sizeof(username), stdin);
+            username[strcspn(username, "\n")] = 0; //Zeilenumbruch \n entfernen
+
+            printf("Search terms: ");
+            fgets(terms, sizeof(terms), stdin);
+            terms[strcspn(terms, "\n")] = 0;
+
+            request = twm_search(connection, username, terms, print_response, NULL);
         }
 
         //READ und DEL:
@@ -147,46 +135,200 @@ int main(int argc, char **argv) {
             fgets(message_number, sizeof(message_number), stdin);
             message_number[strcspn(message_number, "\n")] = 0; //Zeilenumbruch \n entfernen
 
-            //Befehl mit Benutzername + Nachrichtennummer kombinieren:
-            int snprintf_result = snprintf(buffer, sizeof(buffer), "%s\n%s\n%s\n", strncmp(buffer, "READ", 4) == 0 ? "READ" : "DEL", username, message_number);
-            if (snprintf_result >= sizeof(buffer) || snprintf_result < 0) {
-                fprintf(stderr, "Error: Command too long to send\n");
+            //Server response: READ liefert die Nachricht, DEL nur OK/ERR
+            long id;
+            if (parse_message_number(message_number, &id) == -1) {
+                printf("ERR\n");
                 continue;
             }
-
-            send(create_socket, buffer, strlen(buffer), 0);
-
-            //Server response:
-            size = recv(create_socket, buffer, BUF - 1, 0);
-            if (size == -1) {
-                perror("Recv error");
+            if (strncmp(buffer, "READ", 4) == 0) {
+                request = twm_read(connection, username, id, print_response, NULL);
             } else {
-                buffer[size] = '\0';  //Empfangene Nachricht Null-terminieren
-                printf("%s\n", buffer); //Antwort ausgeben
+                request = twm_del(connection, username, id, print_response, NULL);
             }
-            continue;
+        }
+        //STATS (Zähler und Latenzen des Servers):
+        else if (strncmp(buffer, "STATS", 5) == 0) {
+            request = twm_stats(connection, print_response, NULL);
         }
         // QUIT:
         else if (strncmp(buffer, "QUIT", 4) == 0) {
-            send(create_socket, "QUIT\n", 5, 0); //QUIT-Befehl an den Server senden
-            break; //Schleife beenden
+            break; //Schleife beenden, twm_close() sendet QUIT
         } 
         else { //wenn nicht SEND, LIST, READ, DEL oder QUIT eingegeben wurde:
-            printf("Unknown command. Available commands: SEND, LIST, READ, DEL, QUIT\n");
+            printf("Unknown command. Available commands: SEND, LIST, READ, DEL, SEARCH, STATS, QUIT\n");
             continue;
         }
 
-            //Serverantwort empfangen und anzeigen:
-            size = recv(create_socket, buffer, BUF - 1, 0);
-            if (size == -1) {
-                perror("Recv error");
-            } else {
-                buffer[size] = '\0';
-                printf("%s\n", buffer);
-            }
+        //Auf die Antwort warten, ausgegeben wird sie im Callback:
+        if (!request) {
+            fprintf(stderr, "Error: Invalid input\n");
+            continue;
+        }
+        if (twm_wait(connection, NULL) == -1) {
+            printf("Server closed the connection.\n");
+            break;
+        }
     }
 
-    //Socket nach QUIT schließen:
-    close(create_socket);
+    //Verbindung nach QUIT schließen:
+    twm_close(connection);
     return EXIT_SUCCESS;
 }
+
+void print_response(struct twm_request *request, void *user_data) {
+    (void)user_data; //gleicher Callback für alle Befehle
+    if (request->status == TWM_FAILED) {
+        //Verbindung abgebrochen: meldet der Aufrufer von twm_wait()
+    } else if (request->status == TWM_ERR) {
+        printf("ERR\n");
+    } else if (request->command == TWM_LIST || request->command == TWM_SEARCH) {
+        print_list_response(request);
+    } else if (request->command == TWM_STATS) {
+        print_stats_response(request);
+    } else if (request->command == TWM_READ) {
+        print_read_response(request);
+    } else {
+        printf("OK\n"); //SEND/DEL
+    }
+    twm_request_free(request);
+}
+
+void print_list_response(struct twm_request *request) {
+    printf("Count of messages of the user: %ld\n", request->count); //Ausgabe der Anzahl der Nachrichten
+    for (long i = 0; i < request->count; i++) {
+        printf("%s\n", request->lines[i]); //Ausgabe der Betreffzeilen mit Nachrichtennummer
+    }
+    if (request->count == 0) { //wenn keine Nachricht vorhanden
+        printf("No messages found for the user.\n");
+    }
+}
+
+void print_stats_response(struct twm_request *request) {
+    for (long i = 0; i < request->count; i++) {
+        printf("%s\n", request->lines[i]);
+    }
+}
+
+void print_read_response(struct twm_request *request) {
+    //Nachricht mit Kopf (komprimierte hat die Bibliothek schon entpackt), dann das abschließende OK
+    fwrite(request->message, 1, request->message_len, stdout);
+    printf("OK\n");
+}
+
+int read_input_line(FILE *input, char *line, size_t size) {
+    if (!fgets(line, size, input)) {
+        return -1;
+    }
+    line[strcspn(line, "\n")] = 0; //Zeilenumbruch \n entfernen
+    return 0;
+}
+
+int parse_message_number(const char *text, long *id) {
+    char *end;
+    *id = strtol(text, &end, 10);
+    return end == text || *end != '\0' ? -1 : 0;
+}
+
+struct twm_request *read_batch_command(struct twm_connection *connection, FILE *input, const char *line) {
+    char field[3][BUF], text[BUF];
+    long offset, limit, id;
+
+    //Gleiches Eingabeformat wie im interaktiven Modus: Befehl, dann die Felder zeilenweise
+    if (strncmp(line, "SEND", 4) == 0) { //Sender, Empfänger, Betreff, Text bis "."
+        char *body = NULL;
+        size_t body_len = 0, capacity = 0;
+        for (int i = 0; i < 3; i++) {
+            if (read_input_line(input, field[i], sizeof(field[i])) == -1) {
+                return NULL;
+            }
+        }
+        while (read_input_line(input, text, sizeof(text)) == 0 && strcmp(text, ".") != 0) {
+            size_t len = strlen(text);
+            if (body_len + len + 1 > capacity) {
+                capacity = (body_len + len + 1) * 2;
+                char *grown = realloc(body, capacity);
+                if (!grown) {
+                    free(body);
+                    return NULL;
+                }
+                body = grown;
+            }
+            memcpy(body + body_len, text, len);
+            body[body_len + len] = '\n';
+            body_len += len + 1;
+        }
+        struct twm_request *request = twm_send(connection, field[0], field[1], field[2], body ? body : "", body_len, print_response, NULL);
+        free(body); //Text liegt jetzt im Sendepuffer
+        return request;
+    }
+    if (strncmp(line, "LIST", 4) == 0) { //Benutzername (Paging-Argumente bleiben erhalten)
+        if (read_input_line(input, field[0], sizeof(field[0])) == -1) {
+            return NULL;
+        }
+        if (sscanf(line + 4, "%ld %ld", &offset, &limit) != 2) {
+            offset = 0;
+            limit = -1;
+        }
+        return twm_list(connection, field[0], offset, limit, print_response, NULL);
+    }
+    if (strncmp(line, "SEARCH", 6) == 0) { //Benutzername, Suchbegriffe; Antwort wie LIST
+        if (read_input_line(input, field[0], sizeof(field[0])) == -1 || read_input_line(input, field[1], sizeof(field[1])) == -1) {
+            return NULL;
+        }
+        return twm_search(connection, field[0], field[1], print_response, NULL);
+    }
+    if (strncmp(line, "STATS", 5) == 0) { //keine Felder
+        return twm_stats(connection, print_response, NULL);
+    }
+    if (strncmp(line, "READ", 4) == 0 || strncmp(line, "DEL", 3) == 0) { //Benutzername, Nachrichtennummer
+        if (read_input_line(input, field[0], sizeof(field[0])) == -1 || read_input_line(input, field[1], sizeof(field[1])) == -1) {
+            return NULL;
+        }
+        if (parse_message_number(field[1], &id) == -1) {
+            id = 0; //gibt es nicht, der Server antwortet ERR
+        }
+        return line[0] == 'R' ? twm_read(connection, field[0], id, print_response, NULL) : twm_del(connection, field[0], id, print_response, NULL);
+    }
+    fprintf(stderr, "Unknown command in batch: %s\n", line);
+    return NULL;
+}
+
+int pump(struct twm_connection *connection, int timeout_ms) {
+    struct pollfd pfd = { twm_fd(connection), twm_events(connection), 0 };
+    if (poll(&pfd, 1, timeout_ms) > 0) {
+        return twm_process(connection, pfd.revents);
+    }
+    return twm_failed(connection) ? -1 : 0;
+}
+
+int run_batch(struct twm_connection *connection, FILE *input) {
+    char line[BUF];
+    int interactive = isatty(fileno(input)); //Eingabe vom Terminal: jede Antwort sofort abwarten
+
+    //Befehle werden nur eingereiht, Antworten gibt der Callback in derselben Reihenfolge aus;
+    //gewartet wird nur, wenn zu viel ungesendet ist (Server liest nicht schnell genug):
+    while (read_input_line(input, line, sizeof(line)) == 0) {
+        if (line[0] == '\0' || line[0] == '#') { //Leerzeilen und Kommentare überspringen
+            continue;
+        }
+        if (strncmp(line, "QUIT", 4) == 0) {
+            break;
+        }
+        if (!read_batch_command(connection, input, line) && twm_failed(connection)) {
+            break;
+        }
+        if (interactive ? twm_wait(connection, NULL) : pump(connection, 0)) {
+            break;
+        }
+        while (twm_unsent(connection) > BATCH_BUF && pump(connection, -1) == 0) {
+        }
+    }
+
+    //Restliche Antworten abholen:
+    if (twm_wait(connection, NULL) == -1) {
+        printf("Server closed the connection.\n");
+        return -1;
+    }
+    return 0;
+}
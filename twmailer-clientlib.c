@@ -0,0 +1,718 @@
+#include <sys/types.h>
+#include <sys/socket.h> //Für Sockets
+#include <netinet/in.h>
+#include <netinet/tcp.h> //Für TCP_NODELAY
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h> //Für poll() in twm_wait() und im Pool
+#include <netdb.h> //Für getaddrinfo()
+#include <zlib.h> //Für komprimierte Nachrichten (CAPA deflate)
+#include "twmailer-clientlib.h"
+
+#define TWM_BUF 65536 //Empfangspuffer pro Verbindung (Nachrichten werden direkt in ihren eigenen Puffer kopiert)
+#define TWM_OUTPUT_MIN 4096 //Startgröße des Sendepuffers, wächst bei Bedarf
+
+struct twm_connection {
+    int socket;
+    int connecting; //1 = connect() läuft noch
+    int failed; //1 = Verbindung abgebrochen, alle Anfragen sind TWM_FAILED
+    int deflate; //Server schickt komprimierte Texte unverändert (CAPA deflate)
+    char *output; //gepufferte Anfragen, ab output_sent noch nicht gesendet
+    size_t output_len;
+    size_t output_sent;
+    size_t output_capacity;
+    struct twm_request *head; //Anfragen ohne Antwort in Sende-Reihenfolge
+    struct twm_request *tail;
+    long pending;
+    size_t input_start; //erstes ungelesenes Byte in input
+    size_t input_end;
+    char input[TWM_BUF];
+};
+
+struct twm_server {
+    char host[256];
+    char port[16];
+    int count;
+    struct twm_connection **connections;
+};
+
+struct twm_pool {
+    struct twm_server *servers;
+    int server_count;
+    struct pollfd *fds; //für twm_pool_run()
+    struct twm_connection **polled; //Verbindung zu fds[i]
+    int fd_capacity;
+};
+
+static int open_socket(struct twm_connection *connection, const char *host, const char *port); //connect() starten und CAPA einreihen
+static struct twm_request *submit(struct twm_connection *connection, enum twm_command command, const char *data, size_t len, const char *body, size_t body_len, twm_callback callback, void *user_data);
+static int output_reserve(struct twm_connection *connection, size_t len); //Sendepuffer vergrößern
+static int flush_output(struct twm_connection *connection); //nicht blockierend senden, -1 = Fehler
+static int receive_input(struct twm_connection *connection); //lesen bis EAGAIN und Antworten zuordnen
+static int parse_responses(struct twm_connection *connection); //vollständige Antworten abschließen, -1 = Protokollfehler
+static char *take_line(struct twm_connection *connection); //nächste Zeile ohne \n, NULL = noch nicht vollständig
+static int finish_read(struct twm_connection *connection, struct twm_request *request); //komprimierte Nachricht entpacken
+static void complete(struct twm_connection *connection, struct twm_request *request, enum twm_status status); //aus der Warteschlange nehmen und abschließen
+static void finish(struct twm_request *request, enum twm_status status); //Status setzen, Callback aufrufen
+static void fail_connection(struct twm_connection *connection); //alle offenen Anfragen mit TWM_FAILED abschließen
+static int valid_field(const char *field); //keine Zeilenumbrüche
+static unsigned long hash_username(const char *username); //FNV-1a
+
+struct twm_connection *twm_connect(const char *host, const char *port) {
+    struct twm_connection *connection = calloc(1, sizeof(struct twm_connection));
+    if (!connection) {
+        return NULL;
+    }
+    if (open_socket(connection, host, port) == -1) {
+        int error = errno;
+        if (connection->socket != -1) {
+            close(connection->socket);
+        }
+        free(connection->output);
+        free(connection);
+        errno = error;
+        return NULL;
+    }
+    return connection;
+}
+
+static int open_socket(struct twm_connection *connection, const char *host, const char *port) {
+    struct addrinfo hints, *result, *entry;
+
+    connection->socket = -1;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int error = getaddrinfo(host, port, &hints, &result);
+    if (error != 0) {
+        errno = error == EAI_SYSTEM ? errno : EHOSTUNREACH;
+        return -1;
+    }
+
+    //Erste Adresse, bei der connect() startet (Fehler beim Aufbau meldet erst twm_process):
+    for (entry = result; entry && connection->socket == -1; entry = entry->ai_next) {
+        connection->socket = socket(entry->ai_family, entry->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, entry->ai_protocol);
+        if (connection->socket == -1) {
+            continue;
+        }
+        if (connect(connection->socket, entry->ai_addr, entry->ai_addrlen) == 0) {
+            connection->connecting = 0;
+        } else if (errno == EINPROGRESS) {
+            connection->connecting = 1;
+        } else {
+            close(connection->socket);
+            connection->socket = -1;
+        }
+    }
+    freeaddrinfo(result);
+    if (connection->socket == -1) {
+        return -1;
+    }
+    int flag = 1;
+    setsockopt(connection->socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)); //gepipelinte Anfragen sammelt der Sendepuffer
+
+    //Komprimierte Texte kann die Bibliothek selbst entpacken:
+    struct twm_request *capa = submit(connection, TWM_CAPA, "CAPA deflate\n", 13, NULL, 0, NULL, NULL);
+    if (!capa) {
+        return -1;
+    }
+    capa->internal = 1;
+    return 0;
+}
+
+void twm_close(struct twm_connection *connection) {
+    if (!connection) {
+        return;
+    }
+    if (!connection->failed && !connection->connecting) {
+        flush_output(connection);
+        send(connection->socket, "QUIT\n", 5, MSG_NOSIGNAL); //nur ein Versuch, der Server erkennt auch das Schließen
+    }
+    fail_connection(connection);
+    close(connection->socket);
+    free(connection->output);
+    free(connection);
+}
+
+int twm_fd(const struct twm_connection *connection) {
+    return connection->socket;
+}
+
+short twm_events(const struct twm_connection *connection) {
+    if (connection->connecting) {
+        return POLLOUT;
+    }
+    return POLLIN | (connection->output_sent < connection->output_len ? POLLOUT : 0);
+}
+
+long twm_pending(const struct twm_connection *connection) {
+    return connection->pending;
+}
+
+size_t twm_unsent(const struct twm_connection *connection) {
+    return connection->output_len - connection->output_sent;
+}
+
+int twm_failed(const struct twm_connection *connection) {
+    return connection->failed;
+}
+
+int twm_process(struct twm_connection *connection, short revents) {
+    if (connection->failed) {
+        return -1;
+    }
+    if (connection->connecting) {
+        if (!(revents & (POLLOUT | POLLERR | POLLHUP))) {
+            return 0;
+        }
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(connection->socket, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0) {
+            errno = error ? error : errno;
+            fail_connection(connection);
+            return -1;
+        }
+        connection->connecting = 0;
+    }
+    if (flush_output(connection) == -1) {
+        fail_connection(connection);
+        return -1;
+    }
+    if ((revents & (POLLIN | POLLERR | POLLHUP)) && receive_input(connection) == -1) {
+        fail_connection(connection);
+        return -1;
+    }
+    return 0;
+}
+
+int twm_wait(struct twm_connection *connection, struct twm_request *request) {
+    while (request ? request->status == TWM_PENDING : connection->pending > 0) {
+        struct pollfd pfd = { connection->socket, twm_events(connection), 0 };
+        if (connection->failed) {
+            return -1;
+        }
+        if (poll(&pfd, 1, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (twm_process(connection, pfd.revents) == -1) {
+            return -1;
+        }
+    }
+    return request && request->status == TWM_FAILED ? -1 : 0;
+}
+
+struct twm_request *twm_send(struct twm_connection *connection, const char *sender, const char *receivers, const char *subject, const char *body, size_t body_len, twm_callback callback, void *user_data) {
+    if (!valid_field(sender) || !valid_field(receivers) || !valid_field(subject)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    //Immer mit Längenangabe: der Text muss weder nach "." durchsucht noch verändert werden
+    size_t len = strlen(sender) + strlen(receivers) + strlen(subject) + 32;
+    char *header = malloc(len);
+    if (!header) {
+        return NULL;
+    }
+    int header_len = snprintf(header, len, "SEND %zu\n%s\n%s\n%s\n", body_len, sender, receivers, subject);
+    struct twm_request *request = submit(connection, TWM_SEND, header, header_len, body, body_len, callback, user_data);
+    free(header);
+    return request;
+}
+
+struct twm_request *twm_list(struct twm_connection *connection, const char *username, long offset, long limit, twm_callback callback, void *user_data) {
+    char data[128];
+    int len;
+
+    if (!valid_field(username) || strlen(username) > 64) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (limit < 0) {
+        len = snprintf(data, sizeof(data), "LIST\n%s\n", username);
+    } else {
+        len = snprintf(data, sizeof(data), "LIST %ld %ld\n%s\n", offset, limit, username);
+    }
+    return submit(connection, TWM_LIST, data, len, NULL, 0, callback, user_data);
+}
+
+struct twm_request *twm_read(struct twm_connection *connection, const char *username, long id, twm_callback callback, void *user_data) {
+    char data[128];
+
+    if (!valid_field(username) || strlen(username) > 64) {
+        errno = EINVAL;
+        return NULL;
+    }
+    int len = snprintf(data, sizeof(data), "READ\n%s\n%ld\n", username, id);
+    return submit(connection, TWM_READ, data, len, NULL, 0, callback, user_data);
+}
+
+struct twm_request *twm_del(struct twm_connection *connection, const char *username, long id, twm_callback callback, void *user_data) {
+    char data[128];
+
+    if (!valid_field(username) || strlen(username) > 64) {
+        errno = EINVAL;
+        return NULL;
+    }
+    int len = snprintf(data, sizeof(data), "DEL\n%s\n%ld\n", username, id);
+    return submit(connection, TWM_DEL, data, len, NULL, 0, callback, user_data);
+}
+
+struct twm_request *twm_search(struct twm_connection *connection, const char *username, const char *terms, twm_callback callback, void *user_data) {
+    if (!valid_field(username) || !valid_field(terms)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t len = strlen(username) + strlen(terms) + 16;
+    char *data = malloc(len);
+    if (!data) {
+        return NULL;
+    }
+    int data_len = snprintf(data, len, "SEARCH\n%s\n%s\n", username, terms);
+    struct twm_request *request = submit(connection, TWM_SEARCH, data, data_len, NULL, 0, callback, user_data);
+    free(data);
+    return request;
+}
+
+struct twm_request *twm_stats(struct twm_connection *connection, twm_callback callback, void *user_data) {
+    return submit(connection, TWM_STATS, "STATS\n", 6, NULL, 0, callback, user_data);
+}
+
+void twm_request_free(struct twm_request *request) {
+    if (!request) {
+        return;
+    }
+    for (long i = 0; request->lines && i < request->count; i++) {
+        free(request->lines[i]);
+    }
+    free(request->lines);
+    free(request->message);
+    free(request);
+}
+
+static struct twm_request *submit(struct twm_connection *connection, enum twm_command command, const char *data, size_t len, const char *body, size_t body_len, twm_callback callback, void *user_data) {
+    if (connection->failed) {
+        errno = ENOTCONN;
+        return NULL;
+    }
+    struct twm_request *request = calloc(1, sizeof(struct twm_request));
+    if (!request || output_reserve(connection, len + body_len) == -1) {
+        free(request);
+        return NULL;
+    }
+    request->command = command;
+    request->status = TWM_PENDING;
+    request->callback = callback;
+    request->user_data = user_data;
+
+    memcpy(connection->output + connection->output_len, data, len);
+    if (body_len > 0) {
+        memcpy(connection->output + connection->output_len + len, body, body_len);
+    }
+    connection->output_len += len + body_len;
+    if (connection->tail) {
+        connection->tail->next = request;
+    } else {
+        connection->head = request;
+    }
+    connection->tail = request;
+    connection->pending++;
+
+    //Gleich senden, soweit der Socket es annimmt (spart bei einzelnen Anfragen ein poll()),
+    //einen Fehler meldet der nächste twm_process - der Aufrufer bekommt die Anfrage immer zuerst:
+    if (!connection->connecting) {
+        flush_output(connection);
+    }
+    return request;
+}
+
+static int output_reserve(struct twm_connection *connection, size_t len) {
+    //Gesendetes vorne verwerfen, bevor der Puffer wächst:
+    if (connection->output_sent > 0) {
+        memmove(connection->output, connection->output + connection->output_sent, connection->output_len - connection->output_sent);
+        connection->output_len -= connection->output_sent;
+        connection->output_sent = 0;
+    }
+    if (connection->output_len + len <= connection->output_capacity) {
+        return 0;
+    }
+    size_t capacity = connection->output_capacity ? connection->output_capacity : TWM_OUTPUT_MIN;
+    while (capacity < connection->output_len + len) {
+        capacity *= 2;
+    }
+    char *output = realloc(connection->output, capacity);
+    if (!output) {
+        return -1;
+    }
+    connection->output = output;
+    connection->output_capacity = capacity;
+    return 0;
+}
+
+static int flush_output(struct twm_connection *connection) {
+    while (connection->output_sent < connection->output_len) {
+        ssize_t written = send(connection->socket, connection->output + connection->output_sent, connection->output_len - connection->output_sent, MSG_NOSIGNAL);
+        if (written == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        }
+        connection->output_sent += written;
+    }
+    connection->output_sent = connection->output_len = 0;
+    return 0;
+}
+
+static int receive_input(struct twm_connection *connection) {
+    while (1) {
+        if (connection->input_start > 0) { //Ungelesenes an den Anfang schieben
+            memmove(connection->input, connection->input + connection->input_start, connection->input_end - connection->input_start);
+            connection->input_end -= connection->input_start;
+            connection->input_start = 0;
+        }
+        if (connection->input_end == sizeof(connection->input)) {
+            errno = EPROTO; //Zeile länger als der Puffer
+            return -1;
+        }
+        ssize_t size = recv(connection->socket, connection->input + connection->input_end, sizeof(connection->input) - connection->input_end, 0);
+        if (size == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (size == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        }
+        connection->input_end += size;
+        if (parse_responses(connection) == -1) {
+            errno = EPROTO;
+            return -1;
+        }
+    }
+}
+
+static int parse_responses(struct twm_connection *connection) {
+    char *line;
+
+    //Antworten kommen in der Reihenfolge der Anfragen, die erste offene bekommt die Daten:
+    while (connection->head) {
+        struct twm_request *request = connection->head;
+
+        if (request->stage == 2) { //READ: Nachricht direkt in ihren Puffer
+            size_t available = connection->input_end - connection->input_start;
+            size_t chunk = request->message_len - request->received < available ? request->message_len - request->received : available;
+            memcpy(request->message + request->received, connection->input + connection->input_start, chunk);
+            connection->input_start += chunk;
+            request->received += chunk;
+            if (request->received < request->message_len) {
+                return 0;
+            }
+            request->stage = 3;
+        }
+
+        if ((line = take_line(connection)) == NULL) {
+            return 0; //Rest kommt mit dem nächsten recv()
+        }
+        if (request->stage == 3) { //abschließendes "OK" nach der Nachricht
+            if (strcmp(line, "OK") != 0) {
+                return -1;
+            }
+            complete(connection, request, finish_read(connection, request) == 0 ? TWM_OK : TWM_ERR);
+            continue;
+        }
+        if (request->stage == 1) { //eine Zeile von LIST/SEARCH/STATS
+            if ((request->lines[request->received++] = strdup(line)) == NULL) {
+                return -1;
+            }
+            if ((long)request->received == request->count) {
+                complete(connection, request, TWM_OK);
+            }
+            continue;
+        }
+
+        //Erste Zeile der Antwort:
+        if (strcmp(line, "ERR") == 0) {
+            complete(connection, request, TWM_ERR);
+            continue;
+        }
+        switch (request->command) {
+        case TWM_CAPA:
+            connection->deflate = strstr(line, "deflate") != NULL;
+            complete(connection, request, TWM_OK);
+            break;
+        case TWM_SEND:
+        case TWM_DEL:
+            complete(connection, request, strcmp(line, "OK") == 0 ? TWM_OK : TWM_ERR);
+            break;
+        case TWM_READ:
+            request->message_len = strtoull(line, NULL, 10);
+            if ((request->message = malloc(request->message_len + 1)) == NULL) {
+                return -1;
+            }
+            request->message[request->message_len] = '\0';
+            request->stage = 2;
+            break;
+        default: //LIST/SEARCH/STATS: Anzahl, dann so viele Zeilen
+            request->count = atol(line);
+            if (request->count < 0 || (request->count > 0 && (request->lines = calloc(request->count, sizeof(char *))) == NULL)) {
+                return -1;
+            }
+            request->stage = 1;
+            if (request->count == 0) {
+                complete(connection, request, TWM_OK);
+            }
+            break;
+        }
+    }
+    //Daten ohne offene Anfrage: Server und Client sind nicht mehr synchron
+    return connection->input_start == connection->input_end ? 0 : -1;
+}
+
+static char *take_line(struct twm_connection *connection) {
+    char *start = connection->input + connection->input_start;
+    char *newline = memchr(start, '\n', connection->input_end - connection->input_start);
+    if (!newline) {
+        return NULL;
+    }
+    *newline = '\0';
+    connection->input_start += newline - start + 1;
+    return start;
+}
+
+static int finish_read(struct twm_connection *connection, struct twm_request *request) {
+    size_t position = 0, prefix_len = 0;
+    int lines = 0;
+
+    if (!connection->deflate) {
+        return 0;
+    }
+    //Sender, Empfänger und Betreff sind immer lesbar, die vierte Zeile sagt, ob der Text komprimiert ist:
+    while (lines < 4 && position < request->message_len) {
+        if (request->message[position++] == '\n' && ++lines == 3) {
+            prefix_len = position;
+        }
+    }
+    if (lines < 4 || strncmp(request->message + prefix_len, "Message-Deflate: ", 17) != 0) {
+        return 0;
+    }
+
+    //"Message-Deflate: <Länge>" durch "Message:" und den entpackten Text ersetzen:
+    uLongf plain_len = strtoul(request->message + prefix_len + 17, NULL, 10);
+    char *plain = malloc(prefix_len + 9 + plain_len + 1);
+    if (!plain) {
+        return -1;
+    }
+    memcpy(plain, request->message, prefix_len);
+    memcpy(plain + prefix_len, "Message:\n", 9);
+    if (uncompress((Bytef *)plain + prefix_len + 9, &plain_len, (const Bytef *)request->message + position, request->message_len - position) != Z_OK) {
+        free(plain);
+        return -1;
+    }
+    free(request->message);
+    request->message = plain;
+    request->message_len = prefix_len + 9 + plain_len;
+    request->message[request->message_len] = '\0';
+    return 0;
+}
+
+static void complete(struct twm_connection *connection, struct twm_request *request, enum twm_status status) {
+    connection->head = request->next;
+    if (!connection->head) {
+        connection->tail = NULL;
+    }
+    connection->pending--;
+    finish(request, status);
+}
+
+static void finish(struct twm_request *request, enum twm_status status) {
+    request->next = NULL;
+    request->status = status;
+    if (request->internal) {
+        twm_request_free(request);
+    } else if (request->callback) {
+        request->callback(request, request->user_data); //danach nicht mehr anfassen, der Callback darf freigeben
+    }
+}
+
+static void fail_connection(struct twm_connection *connection) {
+    struct twm_request *request = connection->head;
+
+    //Warteschlange erst abhängen: ein Callback darf die Verbindung über den Pool neu aufbauen
+    connection->failed = 1;
+    connection->output_len = connection->output_sent = 0;
+    connection->head = connection->tail = NULL;
+    connection->pending = 0;
+    while (request) {
+        struct twm_request *next = request->next;
+        finish(request, TWM_FAILED);
+        request = next;
+    }
+}
+
+static int valid_field(const char *field) {
+    return field && strchr(field, '\n') == NULL;
+}
+
+static unsigned long hash_username(const char *username) {
+    unsigned long hash = 14695981039346656037UL;
+    for (; *username; username++) {
+        hash ^= (unsigned char)*username;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+struct twm_pool *twm_pool_create(void) {
+    return calloc(1, sizeof(struct twm_pool));
+}
+
+int twm_pool_add(struct twm_pool *pool, const char *host, const char *port, int connections) {
+    if (connections < 1 || strlen(host) >= sizeof(pool->servers[0].host) || strlen(port) >= sizeof(pool->servers[0].port)) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct twm_server *servers = realloc(pool->servers, (pool->server_count + 1) * sizeof(struct twm_server));
+    if (!servers) {
+        return -1;
+    }
+    pool->servers = servers;
+    struct twm_server *server = &pool->servers[pool->server_count];
+    strcpy(server->host, host);
+    strcpy(server->port, port);
+    server->count = connections;
+    //Verbindungen werden erst bei der ersten Anfrage aufgebaut:
+    if ((server->connections = calloc(connections, sizeof(struct twm_connection *))) == NULL) {
+        return -1;
+    }
+    pool->server_count++;
+    return 0;
+}
+
+struct twm_connection *twm_pool_connection(struct twm_pool *pool, const char *username) {
+    struct twm_server *chosen = NULL;
+    int slot = -1;
+    long best = -1;
+
+    if (pool->server_count == 0) {
+        errno = ENOTCONN;
+        return NULL;
+    }
+    //Server: fest nach Benutzername (Mailbox liegt auf genau einem), sonst der mit der kürzesten Warteschlange;
+    //innerhalb des Servers immer die Verbindung mit den wenigsten offenen Anfragen
+    int first = username ? hash_username(username) % pool->server_count : 0;
+    int last = username ? first + 1 : pool->server_count;
+    for (int s = first; s < last; s++) {
+        struct twm_server *server = &pool->servers[s];
+        for (int i = 0; i < server->count; i++) {
+            struct twm_connection *connection = server->connections[i];
+            long load = connection && !connection->failed ? connection->pending : 0;
+            if (best == -1 || load < best) {
+                best = load;
+                chosen = server;
+                slot = i;
+            }
+        }
+    }
+
+    struct twm_connection **connection = &chosen->connections[slot];
+    if (!*connection) {
+        *connection = twm_connect(chosen->host, chosen->port);
+        return *connection;
+    }
+    if ((*connection)->failed) {
+        //Abgebrochene Verbindung an derselben Adresse neu aufbauen (kann gerade in twm_process stecken):
+        close((*connection)->socket);
+        (*connection)->failed = 0;
+        (*connection)->deflate = 0;
+        (*connection)->input_start = (*connection)->input_end = 0;
+        if (open_socket(*connection, chosen->host, chosen->port) == -1) {
+            (*connection)->failed = 1;
+            return NULL;
+        }
+    }
+    return *connection;
+}
+
+int twm_pool_run(struct twm_pool *pool, int timeout_ms) {
+    int count = 0;
+    long pending = 0;
+
+    for (int s = 0; s < pool->server_count; s++) {
+        count += pool->servers[s].count;
+    }
+    if (count > pool->fd_capacity) {
+        struct pollfd *fds = realloc(pool->fds, count * sizeof(struct pollfd));
+        struct twm_connection **polled = fds ? realloc(pool->polled, count * sizeof(struct twm_connection *)) : NULL;
+        if (fds) {
+            pool->fds = fds;
+        }
+        if (!polled) {
+            return -1;
+        }
+        pool->polled = polled;
+        pool->fd_capacity = count;
+    }
+
+    //Nur Verbindungen mit offenen Anfragen oder ungesendeten Daten:
+    int used = 0;
+    for (int s = 0; s < pool->server_count; s++) {
+        for (int i = 0; i < pool->servers[s].count; i++) {
+            struct twm_connection *connection = pool->servers[s].connections[i];
+            if (!connection || connection->failed || (connection->pending == 0 && twm_unsent(connection) == 0)) {
+                continue;
+            }
+            pool->fds[used].fd = connection->socket;
+            pool->fds[used].events = twm_events(connection);
+            pool->fds[used].revents = 0;
+            pool->polled[used++] = connection;
+        }
+    }
+    if (used == 0) {
+        return 0;
+    }
+    if (poll(pool->fds, used, timeout_ms) == -1 && errno != EINTR) {
+        return -1;
+    }
+    for (int i = 0; i < used; i++) {
+        if (pool->fds[i].revents) {
+            twm_process(pool->polled[i], pool->fds[i].revents); //Fehler: Anfragen sind TWM_FAILED, neu verbunden wird beim nächsten Holen
+        }
+    }
+    for (int s = 0; s < pool->server_count; s++) {
+        for (int i = 0; i < pool->servers[s].count; i++) {
+            pending += pool->servers[s].connections[i] ? pool->servers[s].connections[i]->pending : 0;
+        }
+    }
+    return pending;
+}
+
+int twm_pool_wait(struct twm_pool *pool, struct twm_request *request) {
+    while (request ? request->status == TWM_PENDING : 1) {
+        int pending = twm_pool_run(pool, -1);
+        if (pending == -1) {
+            return -1;
+        }
+        if (!request && pending == 0) {
+            break;
+        }
+    }
+    return request && request->status == TWM_FAILED ? -1 : 0;
+}
+
+void twm_pool_destroy(struct twm_pool *pool) {
+    if (!pool) {
+        return;
+    }
+    for (int s = 0; s < pool->server_count; s++) {
+        for (int i = 0; i < pool->servers[s].count; i++) {
+            twm_close(pool->servers[s].connections[i]);
+        }
+        free(pool->servers[s].connections);
+    }
+    free(pool->servers);
+    free(pool->fds);
+    free(pool->polled);
+    free(pool);
+}
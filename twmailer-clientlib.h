@@ -0,0 +1,75 @@
+#ifndef TWMAILER_CLIENTLIB_H
+#define TWMAILER_CLIENTLIB_H
+
+//Client-Bibliothek für das TWMailer-Protokoll: nicht blockierende Verbindungen, beliebig viele
+//Anfragen hintereinander (Pipelining), Antworten als Future (status abfragen / twm_wait) oder Callback.
+//Eine Verbindung bzw. ein Pool darf immer nur von einem Thread benutzt werden.
+
+#include <stddef.h>
+
+enum twm_command { TWM_SEND, TWM_LIST, TWM_READ, TWM_DEL, TWM_SEARCH, TWM_STATS, TWM_CAPA };
+
+enum twm_status {
+    TWM_PENDING, //Antwort steht noch aus
+    TWM_OK,
+    TWM_ERR, //Server hat ERR geantwortet
+    TWM_FAILED //Verbindung abgebrochen, Anfrage wurde evtl. nicht ausgeführt
+};
+
+struct twm_request;
+struct twm_connection;
+struct twm_pool;
+
+//Wird aufgerufen, sobald die Antwort da ist (auch bei TWM_FAILED); darf twm_request_free() aufrufen
+//und neue Anfragen stellen, aber nicht die eigene Verbindung schließen:
+typedef void (*twm_callback)(struct twm_request *request, void *user_data);
+
+//Anfrage und - sobald status nicht mehr TWM_PENDING ist - ihre Antwort:
+struct twm_request {
+    enum twm_command command;
+    enum twm_status status;
+    long count; //LIST/SEARCH/STATS: Anzahl Zeilen
+    char **lines; //LIST/SEARCH: "<Nummer>: <Betreff>", STATS: Statistikzeilen
+    char *message; //READ: Nachricht mit Kopf (komprimierte bereits entpackt), mit \0 abgeschlossen
+    size_t message_len;
+    twm_callback callback;
+    void *user_data;
+    //intern:
+    struct twm_request *next; //Warteschlange der Verbindung
+    int stage; //Parser: 0 = erste Zeile, 1 = Zeilen, 2 = Nachricht, 3 = abschließendes OK
+    size_t received; //LIST/SEARCH/STATS: Zeilen, READ: Bytes
+    int internal; //von der Bibliothek selbst gestellt (CAPA), wird nach der Antwort freigegeben
+};
+
+//Verbindung: twm_connect() kehrt sofort zurück (Namensauflösung blockiert), alles Weitere
+//läuft über twm_process() mit den Ereignissen aus poll() oder blockierend über twm_wait().
+struct twm_connection *twm_connect(const char *host, const char *port); //NULL = Fehler (errno gesetzt)
+void twm_close(struct twm_connection *connection); //QUIT senden, offene Anfragen werden TWM_FAILED
+int twm_fd(const struct twm_connection *connection);
+short twm_events(const struct twm_connection *connection); //für poll(): POLLIN, POLLOUT solange gesendet werden muss
+int twm_process(struct twm_connection *connection, short revents); //senden/empfangen, -1 = Verbindung unbrauchbar
+int twm_wait(struct twm_connection *connection, struct twm_request *request); //blockierend bis erledigt (NULL = alle), -1 = Verbindungsfehler
+long twm_pending(const struct twm_connection *connection); //Anfragen ohne Antwort
+size_t twm_unsent(const struct twm_connection *connection); //Bytes im Sendepuffer
+int twm_failed(const struct twm_connection *connection);
+
+//Anfragen (werden nur gepuffert, gesendet wird sofort soweit möglich bzw. in twm_process);
+//NULL = ungültige Felder (Zeilenumbruch) oder kein Speicher. Freigeben mit twm_request_free().
+struct twm_request *twm_send(struct twm_connection *connection, const char *sender, const char *receivers, const char *subject, const char *body, size_t body_len, twm_callback callback, void *user_data);
+struct twm_request *twm_list(struct twm_connection *connection, const char *username, long offset, long limit, twm_callback callback, void *user_data); //limit < 0 = ohne Paging
+struct twm_request *twm_read(struct twm_connection *connection, const char *username, long id, twm_callback callback, void *user_data);
+struct twm_request *twm_del(struct twm_connection *connection, const char *username, long id, twm_callback callback, void *user_data);
+struct twm_request *twm_search(struct twm_connection *connection, const char *username, const char *terms, twm_callback callback, void *user_data);
+struct twm_request *twm_stats(struct twm_connection *connection, twm_callback callback, void *user_data);
+void twm_request_free(struct twm_request *request);
+
+//Pool: mehrere Verbindungen zu einem oder mehreren Servern, ein poll() für alle.
+//Mit Benutzername bleibt eine Mailbox immer beim selben Server, ohne wird der am wenigsten belegte genommen.
+struct twm_pool *twm_pool_create(void);
+int twm_pool_add(struct twm_pool *pool, const char *host, const char *port, int connections);
+struct twm_connection *twm_pool_connection(struct twm_pool *pool, const char *username); //abgebrochene werden neu aufgebaut
+int twm_pool_run(struct twm_pool *pool, int timeout_ms); //ein poll() über alle Verbindungen, Rückgabe: offene Anfragen
+int twm_pool_wait(struct twm_pool *pool, struct twm_request *request); //bis erledigt (NULL = alle)
+void twm_pool_destroy(struct twm_pool *pool);
+
+#endif
@@ -0,0 +1,1294 @@
+#define _GNU_SOURCE //Für pthread_rwlockattr_setkind_np()
+#include <sys/types.h>
+#include <sys/socket.h> //Für Sockets
+#include <netinet/in.h>
+#include <netinet/tcp.h> //Für TCP_NODELAY
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h> //Für sigwait() auf SIGHUP
+#include <pthread.h> //Ein Thread pro Client-Verbindung
+#include <getopt.h> //Für die Optionen
+#include <netdb.h> //Für getaddrinfo() beim Verbinden mit den Knoten
+#include <stdint.h>
+#include <sys/time.h> //Für Timeouts der Knoten-Verbindungen
+
+#define BUF 65536 //Empfangspuffer pro Verbindung (Client und jeder Knoten)
+#define LINE_BUF 4096 //Befehls- und Feldzeilen (wie INPUT_BUF im Server, längere werden abgeschnitten)
+#define NODES_MAX 64 //max. Knoten, die der Router je gekannt hat (entfernte bleiben in der Tabelle)
+#define VNODES 160 //Standard für --vnodes: Punkte pro Knoten auf dem Ring
+#define RECIPIENTS_MAX 256 //max. Empfänger pro SEND (wie im Server)
+#define USER_LOCK_SHARDS 256 //Reader/Writer-Locks für Benutzer (Zweierpotenz)
+#define NODE_TIMEOUT 30 //Sekunden ohne Antwort, bis ein Knoten als ausgefallen gilt
+#define SPOOL_MEMORY_MAX (1024 * 1024) //längere SEND-Texte und Antworten puffert der Router in einer temporären Datei
+
+//Gepufferter Leser für eine Verbindung (Client oder Knoten):
+struct reader {
+    int socket;
+    size_t start; //erstes ungelesenes Byte in data
+    size_t end; //Ende der gültigen Daten
+    char data[BUF];
+};
+
+//Ein Server-Knoten aus der Knotendatei ("host:port"):
+struct node {
+    char address[256]; //wie in der Datei, Schlüssel für den Ring
+    char host[256];
+    char port[16];
+    int active; //1 = in der aktuellen Knotendatei, 0 = entfernt (Mailboxen werden wegverteilt)
+};
+
+//Punkt auf dem Consistent-Hash-Ring (virtueller Knoten):
+struct ring_point {
+    uint32_t hash;
+    int node;
+};
+
+struct ring {
+    struct ring_point *points; //nach hash sortiert
+    long count;
+};
+
+//Mailbox, die beim Umverteilen noch auf ihrem alten Knoten liegt:
+struct pending_mailbox {
+    char username[9];
+    int node; //Knoten, auf dem die Nachrichten gerade liegen
+    int moved; //1 = verschoben, ab jetzt gilt der Ring (geschrieben unter dem Benutzer-Lock)
+};
+
+//Zwischenspeicher für einen SEND-Text oder eine Antwort, damit kein Lock auf einen langsamen Client wartet:
+struct spool {
+    char *data;
+    size_t len; //Bytes in data
+    size_t capacity;
+    size_t size; //insgesamt, mit dem Teil in file
+    FILE *file; //alles ab SPOOL_MEMORY_MAX, NULL = nur data
+};
+
+//Zustand eines Client-Threads (und des Umverteil-Threads):
+struct client {
+    struct reader input;
+    struct reader *nodes[NODES_MAX]; //Verbindung zu jedem Knoten, NULL = noch nicht verbunden
+    struct spool body; //Text des laufenden SEND, vollständig gelesen bevor Locks geholt werden
+    struct spool output; //gesammelte Antwort, geht erst nach dem Befehl (ohne Locks) an den Client
+};
+
+//Ziel eines SEND (ein Eintrag pro Knoten):
+struct send_target {
+    int node;
+    struct reader *connection; //NULL = Knoten nicht erreichbar
+};
+
+struct node nodes[NODES_MAX];
+int node_count = 0;
+struct ring *ring = NULL;
+struct ring *next_ring = NULL; //neuer Ring, während prepare_rebalance die Knoten abfragt (sonst NULL)
+struct pending_mailbox *touched = NULL; //in dieser Zeit über den alten Ring benutzte Mailboxen, die umziehen müssen
+long touched_count = 0;
+long touched_capacity = 0;
+pthread_mutex_t touched_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct pending_mailbox *pending = NULL; //nach Benutzername sortiert, NULL = kein Umverteilen
+long pending_count = 0;
+long moved_count = 0; //beim letzten Umverteilen verschobene Mailboxen
+pthread_rwlock_t routing_lock; //Ring, Knotentabelle und pending (exklusiv nur beim Umschalten)
+pthread_rwlock_t user_locks[USER_LOCK_SHARDS]; //geteilt für Anfragen, exklusiv beim Verschieben einer Mailbox
+const char *nodes_file;
+int vnodes = VNODES;
+
+void *clientThread(void *data); //Befehle eines Clients an die Knoten weiterleiten
+int route_command(struct client *client, char *line); //Befehlszeile auswerten, -1 = Verbindung beenden
+int route_send(struct client *client, const char *command); //SEND an die Knoten der Empfänger aufteilen
+int route_mailbox(struct client *client, const char *command, int fields); //LIST/READ/DEL/SEARCH an den Knoten der Mailbox
+int route_stats(struct client *client); //STATS des Routers und aller Knoten
+int read_body(struct client *client, long length); //Text des SEND nach client->body, length -1 = bis "."
+void forward_data(struct send_target *targets, int count, const char *data, size_t len, int more); //an alle erreichbaren Ziele senden
+void forward_spool(struct send_target *targets, int count, struct spool *spool); //gepufferten Text an alle Ziele
+int relay_reply(struct client *client, struct reader *connection, const char *command); //Antwort des Knotens an den Client
+int route_username(const char *username); //Knoten der Mailbox (routing_lock und Benutzer-Lock müssen gehalten werden)
+pthread_rwlock_t *user_lock(const char *username); //Lock-Shard des Benutzers
+void lock_users(char (*names)[9], int count); //Benutzer-Locks geteilt in fester Reihenfolge holen
+void unlock_users(char (*names)[9], int count);
+struct reader *node_connection(struct client *client, int node); //Verbindung zum Knoten, bei Bedarf aufbauen
+void drop_node(struct client *client, int node); //Verbindung nach Fehler schließen (Zustand unbekannt)
+void add_pending(struct pending_mailbox **list, long *count, long *capacity, const char *username, int node); //Mailbox zum Verschieben vormerken
+int prepare_rebalance(struct client *rebalancer); //Knotendatei lesen, neuen Ring bauen, falsch liegende Mailboxen sammeln
+void move_pending(struct client *rebalancer); //gesammelte Mailboxen auf ihren neuen Knoten verschieben
+int move_mailbox(struct client *rebalancer, const char *username, int from, int to); //Nachrichten kopieren, dann alt löschen, Rückgabe: Anzahl
+void *rebalanceThread(void *data); //verschiebt Mailboxen und wartet auf SIGHUP
+int read_nodes_file(char (*addresses)[256]); //Rückgabe: Anzahl Knoten, -1 = Fehler
+struct ring *build_ring(const int *active, int count); //Ring aus allen aktiven Knoten
+int ring_lookup(const struct ring *target, const char *username); //erster Punkt im Uhrzeigersinn
+int compare_points(const void *a, const void *b);
+int compare_pending(const void *a, const void *b);
+int compare_locks(const void *a, const void *b);
+uint32_t hash_key(const char *key); //FNV-1a, danach durchmischt
+int valid_username(const char *username); //1-8 Zeichen, nur Buchstaben und Ziffern
+int fill_reader(struct reader *reader); //Daten nachladen, -1 = Verbindung beendet
+int read_line(struct reader *reader, char *line, size_t size); //Zeile ohne \n, zu lange werden abgeschnitten
+int read_bytes(struct reader *reader, char *data, size_t len);
+int send_all(int socket, const char *data, size_t len, int more); //more = weitere Daten folgen (MSG_MORE)
+int output_append(struct client *client, const char *data, size_t len); //Antwort sammeln
+int flush_output(struct client *client);
+int spool_append(struct spool *spool, const char *data, size_t len);
+int spool_send(struct spool *spool, int socket); //Inhalt senden und leeren
+void spool_reset(struct spool *spool); //leeren, temporäre Datei schließen
+
+int main(int argc, char **argv) {
+    int opt;
+    sigset_t signals;
+    pthread_rwlockattr_t attr;
+    pthread_t rebalance_thread;
+
+    static struct option long_options[] = {
+        { "vnodes", required_argument, NULL, 'v' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "v:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'v':
+            vnodes = atoi(optarg);
+            if (vnodes < 1 || vnodes > 1000) {
+                fprintf(stderr, "Invalid number of virtual nodes (1-1000)\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [--vnodes N] <port> <nodes-file>\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "Usage: %s [--vnodes N] <port> <nodes-file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int port = atoi(argv[optind]);
+    nodes_file = argv[optind + 1];
+
+    //SIGHUP wird nur vom Umverteil-Thread mit sigwait() abgeholt (Maske erben alle Threads):
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    //Umschalten des Rings und Verschieben sollen nicht hinter ständig neuen Anfragen verhungern:
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&routing_lock, &attr);
+    for (int i = 0; i < USER_LOCK_SHARDS; i++) {
+        pthread_rwlock_init(&user_locks[i], &attr);
+    }
+    pthread_rwlockattr_destroy(&attr);
+
+    //Ring vor dem ersten Client aufbauen, falsch liegende Mailboxen verschiebt der Thread:
+    struct client *rebalancer = calloc(1, sizeof(struct client));
+    if (!rebalancer || prepare_rebalance(rebalancer) == -1) {
+        return EXIT_FAILURE;
+    }
+    if (pthread_create(&rebalance_thread, NULL, rebalanceThread, rebalancer) != 0) {
+        perror("Failed to create rebalance thread");
+        return EXIT_FAILURE;
+    }
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd == -1) {
+        perror("Socket error");
+        return EXIT_FAILURE;
+    }
+    int reuse = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        perror("Bind error");
+        return EXIT_FAILURE;
+    }
+    if (listen(listen_fd, SOMAXCONN) == -1) {
+        perror("Listen error");
+        return EXIT_FAILURE;
+    }
+    printf("Router listening on port %d (%d node(s), %d virtual nodes each)\n", port, node_count, vnodes);
+
+    while (1) {
+        int socket_fd = accept(listen_fd, NULL, NULL);
+        if (socket_fd == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("Accept error");
+            }
+            continue;
+        }
+        int flag = 1;
+        setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+        struct client *client = calloc(1, sizeof(struct client));
+        pthread_t thread;
+        if (!client) {
+            close(socket_fd);
+            continue;
+        }
+        client->input.socket = socket_fd;
+        if (pthread_create(&thread, NULL, clientThread, client) != 0) {
+            perror("Failed to create client thread");
+            close(socket_fd);
+            free(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+
+void *clientThread(void *data) {
+    struct client *client = data;
+    char line[LINE_BUF];
+
+    while (read_line(&client->input, line, sizeof(line)) == 0) {
+        line[strcspn(line, "\r")] = '\0'; //CRLF erlauben
+        int result = route_command(client, line);
+        if (flush_output(client) == -1 || result == -1) {
+            break;
+        }
+    }
+
+    for (int i = 0; i < NODES_MAX; i++) {
+        if (client->nodes[i]) {
+            drop_node(client, i);
+        }
+    }
+    spool_reset(&client->body);
+    spool_reset(&client->output);
+    free(client->body.data);
+    free(client->output.data);
+    close(client->input.socket);
+    free(client);
+    return NULL;
+}
+
+int route_command(struct client *client, char *line) {
+    if (strncmp(line, "SEND", 4) == 0 && (line[4] == '\0' || line[4] == ' ')) {
+        return route_send(client, line);
+    } else if (strncmp(line, "LIST", 4) == 0 && (line[4] == '\0' || line[4] == ' ')) {
+        return route_mailbox(client, line, 1);
+    } else if (strcmp(line, "READ") == 0 || strcmp(line, "DEL") == 0 || strcmp(line, "SEARCH") == 0) {
+        return route_mailbox(client, line, 2);
+    } else if (strcmp(line, "STATS") == 0) {
+        return route_stats(client);
+    } else if (strncmp(line, "CAPA", 4) == 0 && (line[4] == '\0' || line[4] == ' ')) {
+        //Keine Fähigkeiten: Knoten liefern immer entpackten Text
+        return output_append(client, "OK\n", 3);
+    } else if (strcmp(line, "QUIT") == 0) {
+        return -1;
+    } else if (line[0] != '\0') { //Leerzeilen zwischen Befehlen ignorieren
+        return output_append(client, "ERR\n", 4);
+    }
+    return 0;
+}
+
+int route_send(struct client *client, const char *command) {
+    char sender[LINE_BUF], receivers[LINE_BUF], subject[LINE_BUF], header[3 * LINE_BUF];
+    char names[RECIPIENTS_MAX][9];
+    int name_nodes[RECIPIENTS_MAX], name_count = 0, valid = 1;
+    struct send_target targets[NODES_MAX];
+    int target_count = 0;
+    long length = -1;
+
+    if (read_line(&client->input, sender, sizeof(sender)) == -1 || read_line(&client->input, receivers, sizeof(receivers)) == -1 || read_line(&client->input, subject, sizeof(subject)) == -1) {
+        return -1;
+    }
+    sender[strcspn(sender, "\r")] = '\0';
+    receivers[strcspn(receivers, "\r")] = '\0';
+    subject[strcspn(subject, "\r")] = '\0';
+    if (command[4] == ' ') { //"SEND <length>": Längenangabe zum Weiterleiten des Texts
+        char *end;
+        length = strtol(command + 5, &end, 10);
+        if (end == command + 5 || (*end != '\0' && *end != ' ') || length < 0) {
+            length = 0; //wie im Server: ungültig, kein Text folgt
+            valid = 0;
+        } else if (*end == ' ') { //"SEND <length> <id>" schickt nur move_mailbox, Text wird gelesen und verworfen
+            valid = 0;
+        }
+    }
+
+    //Empfänger einzeln prüfen ("bob,carol,dave"), ungültige Listen gehen an keinen Knoten:
+    char list[LINE_BUF], *save;
+    snprintf(list, sizeof(list), "%s", receivers);
+    for (char *name = strtok_r(list, ",", &save); name && valid; name = strtok_r(NULL, ",", &save)) {
+        while (*name == ' ') {
+            name++;
+        }
+        if (!valid_username(name) || name_count == RECIPIENTS_MAX) {
+            valid = 0;
+            break;
+        }
+        strcpy(names[name_count++], name);
+    }
+    valid &= name_count > 0;
+
+    //Text zuerst vollständig vom Client holen (ohne Ziel nur lesen und verwerfen),
+    //die Locks warten danach nur noch auf die Knoten, nie auf einen langsamen Client:
+    if (read_body(client, length) == -1) {
+        spool_reset(&client->body);
+        return -1;
+    }
+
+    //Jeder Knoten bekommt nur seine Empfänger, mehrere auf einem Knoten teilen sich dort den Blob:
+    if (valid) {
+        pthread_rwlock_rdlock(&routing_lock);
+        lock_users(names, name_count);
+        for (int i = 0; i < name_count; i++) {
+            name_nodes[i] = route_username(names[i]);
+            int t = 0;
+            while (t < target_count && targets[t].node != name_nodes[i]) {
+                t++;
+            }
+            if (t == target_count) {
+                targets[target_count].node = name_nodes[i];
+                targets[target_count++].connection = node_connection(client, name_nodes[i]);
+            }
+        }
+        for (int t = 0; t < target_count; t++) {
+            if (!targets[t].connection) {
+                continue;
+            }
+            int header_len = snprintf(header, sizeof(header), "%s\n%s\n", command, sender);
+            for (int i = 0, first = 1; i < name_count; i++) {
+                if (name_nodes[i] == targets[t].node) {
+                    header_len += snprintf(header + header_len, sizeof(header) - header_len, "%s%s", first ? "" : ",", names[i]);
+                    first = 0;
+                }
+            }
+            header_len += snprintf(header + header_len, sizeof(header) - header_len, "\n%s\n", subject);
+            forward_data(&targets[t], 1, header, header_len, client->body.size > 0);
+        }
+        forward_spool(targets, target_count, &client->body);
+    }
+    spool_reset(&client->body);
+
+    //OK nur, wenn jeder beteiligte Knoten zugestellt hat:
+    int delivered = valid;
+    for (int t = 0; t < target_count; t++) {
+        char reply[LINE_BUF];
+        if (!targets[t].connection || read_line(targets[t].connection, reply, sizeof(reply)) == -1) {
+            fprintf(stderr, "Node %s did not answer SEND\n", nodes[targets[t].node].address);
+            if (targets[t].connection) {
+                drop_node(client, targets[t].node);
+            }
+            delivered = 0;
+        } else if (strcmp(reply, "OK") != 0) {
+            delivered = 0;
+        }
+    }
+    if (valid) {
+        unlock_users(names, name_count);
+        pthread_rwlock_unlock(&routing_lock);
+    }
+    return delivered ? output_append(client, "OK\n", 3) : output_append(client, "ERR\n", 4);
+}
+
+int route_mailbox(struct client *client, const char *command, int fields) {
+    char username[LINE_BUF], field[LINE_BUF], request[3 * LINE_BUF];
+    char names[1][9];
+
+    //Benutzername, bei READ/DEL/SEARCH noch Nummer bzw. Suchbegriffe:
+    if (read_line(&client->input, username, sizeof(username)) == -1 || (fields == 2 && read_line(&client->input, field, sizeof(field)) == -1)) {
+        return -1;
+    }
+    username[strcspn(username, "\r")] = '\0';
+    if (!valid_username(username)) {
+        return output_append(client, "ERR\n", 4);
+    }
+    int length = snprintf(request, sizeof(request), "%s\n%s\n", command, username);
+    if (fields == 2) {
+        length += snprintf(request + length, sizeof(request) - length, "%s\n", field);
+    }
+
+    //Unter den Locks wird die Antwort nur gesammelt, an den Client geht sie erst danach (clientThread):
+    strcpy(names[0], username);
+    pthread_rwlock_rdlock(&routing_lock);
+    lock_users(names, 1);
+    int node = route_username(username);
+    struct reader *connection = node_connection(client, node);
+    int result;
+    if (!connection || send_all(connection->socket, request, length, 0) == -1) {
+        if (connection) {
+            drop_node(client, node);
+        }
+        result = output_append(client, "ERR\n", 4);
+    } else {
+        result = relay_reply(client, connection, command);
+        if (result != 0) {
+            drop_node(client, node);
+        }
+        result = result == 1 ? 0 : result;
+    }
+    unlock_users(names, 1);
+    pthread_rwlock_unlock(&routing_lock);
+    return result;
+}
+
+int route_stats(struct client *client) {
+    char line[LINE_BUF];
+    char *text = NULL;
+    size_t length = 0;
+
+    //Antwort im LIST-Format: eine Zeile für den Router, danach die Zeilen jedes Knotens mit Adresse davor
+    FILE *out = open_memstream(&text, &length);
+    if (!out) {
+        return output_append(client, "ERR\n", 4);
+    }
+    pthread_rwlock_rdlock(&routing_lock);
+    long remaining = 0;
+    for (long i = 0; i < pending_count; i++) {
+        remaining += !__atomic_load_n(&pending[i].moved, __ATOMIC_RELAXED);
+    }
+    long lines = 1;
+    int active = 0;
+    for (int i = 0; i < node_count; i++) {
+        active += nodes[i].active;
+    }
+    fprintf(out, "router nodes=%d vnodes=%d points=%ld rebalancing=%ld moved=%ld\n", active, vnodes, ring->count, remaining, __atomic_load_n(&moved_count, __ATOMIC_RELAXED));
+    for (int i = 0; i < node_count; i++) {
+        if (!nodes[i].active) {
+            continue;
+        }
+        struct reader *connection = node_connection(client, i);
+        if (!connection || send_all(connection->socket, "STATS\n", 6, 0) == -1 || read_line(connection, line, sizeof(line)) == -1) {
+            if (connection) {
+                drop_node(client, i);
+            }
+            fprintf(out, "node %s unreachable\n", nodes[i].address);
+            lines++;
+            continue;
+        }
+        long count = strcmp(line, "ERR") == 0 ? 0 : atol(line);
+        for (long n = 0; n < count; n++) {
+            if (read_line(connection, line, sizeof(line)) == -1) {
+                drop_node(client, i);
+                break;
+            }
+            fprintf(out, "node %s %s\n", nodes[i].address, line);
+            lines++;
+        }
+    }
+    pthread_rwlock_unlock(&routing_lock);
+    if (fclose(out) != 0) {
+        free(text);
+        return output_append(client, "ERR\n", 4);
+    }
+    snprintf(line, sizeof(line), "%ld\n", lines);
+    int result = output_append(client, line, strlen(line));
+    if (result == 0) {
+        result = output_append(client, text, length);
+    }
+    free(text);
+    return result;
+}
+
+int read_body(struct client *client, long length) {
+    struct reader *input = &client->input;
+
+    //Längen-Modus: genau length Bytes, ohne Zeilensuche
+    if (length >= 0) {
+        while (length > 0) {
+            if (input->start == input->end && fill_reader(input) == -1) {
+                return -1;
+            }
+            size_t available = input->end - input->start;
+            size_t chunk = available < (size_t)length ? available : (size_t)length;
+            if (spool_append(&client->body, input->data + input->start, chunk) == -1) {
+                return -1;
+            }
+            length -= chunk;
+            input->start += chunk;
+        }
+        return 0;
+    }
+
+    //Punkt-Modus: Zeilen unverändert übernehmen, die Zeile "." beendet den Text (wird mitgeschickt)
+    int at_line_start = 1;
+    while (1) {
+        if (input->start == input->end && fill_reader(input) == -1) {
+            return -1;
+        }
+        char *data = input->data + input->start;
+        size_t available = input->end - input->start;
+        char *newline = memchr(data, '\n', available);
+        if (!newline) {
+            if (at_line_start && data[0] == '.' && available < 3) {
+                if (fill_reader(input) == -1) { //auf den Rest der Zeile warten
+                    return -1;
+                }
+                continue;
+            }
+            if (spool_append(&client->body, data, available) == -1) {
+                return -1;
+            }
+            at_line_start = 0;
+            input->start = input->end;
+            continue;
+        }
+        size_t line_length = newline - data + 1;
+        int last = at_line_start && data[0] == '.' && (line_length == 2 || (line_length == 3 && data[1] == '\r'));
+        if (spool_append(&client->body, data, line_length) == -1) {
+            return -1;
+        }
+        input->start += line_length;
+        if (last) {
+            return 0;
+        }
+        at_line_start = 1;
+    }
+}
+
+void forward_data(struct send_target *targets, int count, const char *data, size_t len, int more) {
+    for (int t = 0; t < count; t++) {
+        if (targets[t].connection && send_all(targets[t].connection->socket, data, len, more) == -1) {
+            fprintf(stderr, "Failed to forward to node %s\n", nodes[targets[t].node].address);
+            shutdown(targets[t].connection->socket, SHUT_RDWR); //Antwort liest dann -1, Verbindung wird verworfen
+        }
+    }
+}
+
+void forward_spool(struct send_target *targets, int count, struct spool *spool) {
+    char chunk[BUF];
+    size_t remaining = spool->size - spool->len;
+
+    forward_data(targets, count, spool->data, spool->len, remaining > 0);
+    if (spool->file) {
+        rewind(spool->file);
+        while (remaining > 0) {
+            size_t n = fread(chunk, 1, remaining < sizeof(chunk) ? remaining : sizeof(chunk), spool->file);
+            if (n == 0) { //Datei nicht mehr lesbar: Knoten bekommen einen halben Text und werden verworfen
+                for (int t = 0; t < count; t++) {
+                    if (targets[t].connection) {
+                        shutdown(targets[t].connection->socket, SHUT_RDWR);
+                    }
+                }
+                return;
+            }
+            remaining -= n;
+            forward_data(targets, count, chunk, n, remaining > 0);
+        }
+    }
+}
+
+//Rückgabe: 0 = weitergereicht, 1 = Knoten antwortet nicht (Client bekommt ERR),
+//-1 = Antwort abgebrochen (Client-Verbindung ist nicht mehr synchron und wird beendet)
+int relay_reply(struct client *client, struct reader *connection, const char *command) {
+    char line[LINE_BUF];
+
+    if (read_line(connection, line, sizeof(line)) == -1) {
+        fprintf(stderr, "Node did not answer %s\n", command);
+        return output_append(client, "ERR\n", 4) == 0 ? 1 : -1;
+    }
+    output_append(client, line, strlen(line));
+    output_append(client, "\n", 1);
+    if (strcmp(line, "ERR") == 0 || strcmp(command, "DEL") == 0) {
+        return 0; //DEL: nur OK/ERR
+    }
+
+    if (strcmp(command, "READ") == 0) { //Länge, Nachricht, "OK"
+        long long remaining = atoll(line);
+        while (remaining > 0) {
+            if (connection->start == connection->end && fill_reader(connection) == -1) {
+                return -1;
+            }
+            size_t available = connection->end - connection->start;
+            size_t chunk = available < (unsigned long long)remaining ? available : (size_t)remaining;
+            if (output_append(client, connection->data + connection->start, chunk) == -1) {
+                return -1;
+            }
+            connection->start += chunk;
+            remaining -= chunk;
+        }
+        if (read_line(connection, line, sizeof(line)) == -1) {
+            return -1;
+        }
+        output_append(client, line, strlen(line));
+        return output_append(client, "\n", 1);
+    }
+
+    //LIST/SEARCH: Anzahl, dann eine Zeile pro Nachricht
+    for (long count = atol(line); count > 0; count--) {
+        if (read_line(connection, line, sizeof(line)) == -1) {
+            return -1;
+        }
+        output_append(client, line, strlen(line));
+        if (output_append(client, "\n", 1) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int route_username(const char *username) {
+    int node = -1;
+
+    //Noch nicht verschobene Mailboxen liegen auf ihrem alten Knoten, alle anderen (auch neue) auf dem des Rings:
+    if (pending) {
+        struct pending_mailbox key;
+        snprintf(key.username, sizeof(key.username), "%s", username);
+        struct pending_mailbox *entry = bsearch(&key, pending, pending_count, sizeof(struct pending_mailbox), compare_pending);
+        if (entry && !entry->moved) {
+            node = entry->node;
+        }
+    }
+    if (node == -1) {
+        node = ring_lookup(ring, username);
+    }
+
+    //Knoten werden gerade abgefragt: was jetzt noch beim alten Knoten landet, muss danach mit umziehen
+    if (next_ring && ring_lookup(next_ring, username) != node) {
+        pthread_mutex_lock(&touched_mutex);
+        long n = 0;
+        while (n < touched_count && (strcmp(touched[n].username, username) != 0 || touched[n].node != node)) {
+            n++;
+        }
+        if (n == touched_count) {
+            add_pending(&touched, &touched_count, &touched_capacity, username, node);
+        }
+        pthread_mutex_unlock(&touched_mutex);
+    }
+    return node;
+}
+
+pthread_rwlock_t *user_lock(const char *username) {
+    return &user_locks[hash_key(username) & (USER_LOCK_SHARDS - 1)];
+}
+
+void lock_users(char (*names)[9], int count) {
+    pthread_rwlock_t *locks[RECIPIENTS_MAX];
+
+    //Aufsteigend nach Adresse und ohne Duplikate (mehrere Empfänger im selben Shard):
+    for (int i = 0; i < count; i++) {
+        locks[i] = user_lock(names[i]);
+    }
+    qsort(locks, count, sizeof(pthread_rwlock_t *), compare_locks);
+    for (int i = 0; i < count; i++) {
+        if (i == 0 || locks[i] != locks[i - 1]) {
+            pthread_rwlock_rdlock(locks[i]);
+        }
+    }
+}
+
+void unlock_users(char (*names)[9], int count) {
+    pthread_rwlock_t *locks[RECIPIENTS_MAX];
+
+    for (int i = 0; i < count; i++) {
+        locks[i] = user_lock(names[i]);
+    }
+    qsort(locks, count, sizeof(pthread_rwlock_t *), compare_locks);
+    for (int i = 0; i < count; i++) {
+        if (i == 0 || locks[i] != locks[i - 1]) {
+            pthread_rwlock_unlock(locks[i]);
+        }
+    }
+}
+
+struct reader *node_connection(struct client *client, int node) {
+    struct addrinfo hints, *result, *entry;
+    struct timeval timeout = { NODE_TIMEOUT, 0 };
+
+    if (client->nodes[node]) {
+        return client->nodes[node];
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int error = getaddrinfo(nodes[node].host, nodes[node].port, &hints, &result);
+    if (error != 0) {
+        fprintf(stderr, "Failed to resolve node %s: %s\n", nodes[node].address, gai_strerror(error));
+        return NULL;
+    }
+    int sock = -1;
+    for (entry = result; entry && sock == -1; entry = entry->ai_next) {
+        sock = socket(entry->ai_family, entry->ai_socktype | SOCK_CLOEXEC, entry->ai_protocol);
+        if (sock == -1) {
+            continue;
+        }
+        //Hängender Knoten blockiert den Client höchstens NODE_TIMEOUT Sekunden (gilt auch für connect()):
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (connect(sock, entry->ai_addr, entry->ai_addrlen) == -1) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    freeaddrinfo(result);
+    if (sock == -1) {
+        fprintf(stderr, "Failed to connect to node %s: %s\n", nodes[node].address, strerror(errno));
+        return NULL;
+    }
+    int flag = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+    struct reader *reader = malloc(sizeof(struct reader));
+    if (!reader) {
+        close(sock);
+        return NULL;
+    }
+    reader->socket = sock;
+    reader->start = reader->end = 0;
+    client->nodes[node] = reader;
+    return reader;
+}
+
+void drop_node(struct client *client, int node) {
+    close(client->nodes[node]->socket);
+    free(client->nodes[node]);
+    client->nodes[node] = NULL;
+}
+
+int prepare_rebalance(struct client *rebalancer) {
+    char addresses[NODES_MAX][256], line[LINE_BUF];
+    int active[NODES_MAX] = { 0 };
+    struct pending_mailbox *found = NULL;
+    long found_count = 0, capacity = 0;
+
+    int count = read_nodes_file(addresses);
+    if (count <= 0) {
+        fprintf(stderr, count == 0 ? "No nodes in %s\n" : "Failed to read %s\n", nodes_file);
+        return -1;
+    }
+
+    //Neue Knoten kommen hinter node_count: unsichtbar für Anfragen, bis node_count umgeschaltet wird
+    //(die Knotentabelle ändert nur dieser Thread):
+    int new_count = node_count;
+    for (int a = 0; a < count; a++) {
+        int i = 0;
+        while (i < new_count && strcmp(nodes[i].address, addresses[a]) != 0) {
+            i++;
+        }
+        if (i == new_count) { //neuer Knoten
+            if (new_count == NODES_MAX) {
+                fprintf(stderr, "Too many nodes, ignoring %s\n", addresses[a]);
+                continue;
+            }
+            char *colon = strrchr(addresses[a], ':');
+            strcpy(nodes[i].address, addresses[a]);
+            snprintf(nodes[i].host, sizeof(nodes[i].host), "%.*s", (int)(colon - addresses[a]), addresses[a]);
+            snprintf(nodes[i].port, sizeof(nodes[i].port), "%s", colon + 1);
+            new_count++;
+        }
+        active[i] = 1;
+    }
+    struct ring *new_ring = build_ring(active, new_count);
+    if (!new_ring) {
+        perror("Failed to build hash ring");
+        return -1;
+    }
+
+    //Knoten ohne Lock abfragen (jeder bis zu NODE_TIMEOUT), Anfragen laufen solange über den alten Ring.
+    //Über next_ring merkt sich route_username, welche Mailboxen dabei noch auf dem alten Knoten entstehen:
+    pthread_rwlock_wrlock(&routing_lock);
+    next_ring = new_ring;
+    pthread_rwlock_unlock(&routing_lock);
+
+    //Mailboxen jedes Knotens einsammeln (auch entfernter), die nach dem neuen Ring woanders hingehören:
+    for (int i = 0; i < new_count; i++) {
+        struct reader *connection = node_connection(rebalancer, i);
+        if (!connection || send_all(connection->socket, "MAILBOXES\n", 10, 0) == -1 || read_line(connection, line, sizeof(line)) == -1 || strcmp(line, "ERR") == 0) {
+            fprintf(stderr, "Skipping node %s while rebalancing\n", nodes[i].address);
+            if (connection) {
+                drop_node(rebalancer, i);
+            }
+            continue;
+        }
+        for (long n = atol(line); n > 0; n--) {
+            if (read_line(connection, line, sizeof(line)) == -1) {
+                drop_node(rebalancer, i);
+                break;
+            }
+            if (!valid_username(line) || ring_lookup(new_ring, line) == i) {
+                continue; //liegt schon richtig
+            }
+            add_pending(&found, &found_count, &capacity, line, i);
+        }
+    }
+
+    //Nur das Umschalten braucht den exklusiven Lock:
+    pthread_rwlock_wrlock(&routing_lock);
+    for (long n = 0; n < touched_count; n++) {
+        add_pending(&found, &found_count, &capacity, touched[n].username, touched[n].node);
+    }
+    free(touched);
+    touched = NULL;
+    touched_count = touched_capacity = 0;
+    next_ring = NULL;
+
+    qsort(found, found_count, sizeof(struct pending_mailbox), compare_pending);
+    long unique = 0;
+    for (long n = 0; n < found_count; n++) { //auf zwei falschen Knoten: der erste, den Rest erledigt das nächste Umverteilen
+        if (unique == 0 || strcmp(found[n].username, found[unique - 1].username) != 0) {
+            found[unique++] = found[n];
+        }
+    }
+
+    for (int i = 0; i < new_count; i++) {
+        nodes[i].active = active[i];
+    }
+    node_count = new_count;
+    if (ring) {
+        free(ring->points);
+        free(ring);
+    }
+    ring = new_ring;
+    free(pending);
+    pending = unique > 0 ? found : NULL;
+    pending_count = unique;
+    if (unique == 0) {
+        free(found);
+    }
+    __atomic_store_n(&moved_count, 0, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&routing_lock);
+
+    printf("Hash ring: %d node(s), %ld mailbox(es) to move\n", count, unique);
+    fflush(stdout);
+    return 0;
+}
+
+void add_pending(struct pending_mailbox **list, long *count, long *capacity, const char *username, int node) {
+    if (*count == *capacity) {
+        long grown_capacity = *capacity ? *capacity * 2 : 64;
+        void *grown = realloc(*list, grown_capacity * sizeof(struct pending_mailbox));
+        if (!grown) {
+            perror("Failed to remember mailbox for rebalancing");
+            return; //bleibt auf dem alten Knoten, das nächste Umverteilen findet sie wieder
+        }
+        *list = grown;
+        *capacity = grown_capacity;
+    }
+    snprintf((*list)[*count].username, sizeof((*list)[*count].username), "%s", username);
+    (*list)[*count].node = node;
+    (*list)[(*count)++].moved = 0;
+}
+
+void move_pending(struct client *rebalancer) {
+    long failed = 0;
+
+    //pending ändert nur dieser Thread, lesen geht ohne routing_lock:
+    for (long n = 0; n < pending_count; n++) {
+        struct pending_mailbox *entry = &pending[n];
+        pthread_rwlock_rdlock(&routing_lock);
+        int target = ring_lookup(ring, entry->username);
+        pthread_rwlock_unlock(&routing_lock);
+
+        //Anfragen an diese Mailbox warten, bis sie vollständig auf dem neuen Knoten liegt:
+        pthread_rwlock_t *lock = user_lock(entry->username);
+        pthread_rwlock_wrlock(lock);
+        int moved = move_mailbox(rebalancer, entry->username, entry->node, target);
+        if (moved >= 0) {
+            entry->moved = 1;
+        }
+        pthread_rwlock_unlock(lock);
+
+        if (moved >= 0) {
+            __atomic_fetch_add(&moved_count, 1, __ATOMIC_RELAXED);
+            printf("Moved mailbox %s (%d message(s)) from %s to %s\n", entry->username, moved, nodes[entry->node].address, nodes[target].address);
+        } else {
+            fprintf(stderr, "Failed to move mailbox %s from %s to %s\n", entry->username, nodes[entry->node].address, nodes[target].address);
+            failed++;
+        }
+        fflush(stdout);
+    }
+    if (!pending) {
+        return;
+    }
+
+    //Fertig: nicht verschobene bleiben auf ihrem alten Knoten, bis das nächste SIGHUP es erneut versucht
+    pthread_rwlock_wrlock(&routing_lock);
+    long remaining = 0;
+    for (long n = 0; n < pending_count; n++) {
+        if (!pending[n].moved) {
+            pending[remaining++] = pending[n];
+        }
+    }
+    pending_count = remaining;
+    if (remaining == 0) {
+        free(pending);
+        pending = NULL;
+    }
+    pthread_rwlock_unlock(&routing_lock);
+    printf("Rebalancing finished: %ld moved, %ld failed\n", __atomic_load_n(&moved_count, __ATOMIC_RELAXED), failed);
+    fflush(stdout);
+}
+
+//Rückgabe: Anzahl verschobener Nachrichten, -1 = Fehler (Mailbox bleibt vollständig auf dem alten Knoten)
+int move_mailbox(struct client *rebalancer, const char *username, int from, int to) {
+    char line[LINE_BUF], request[LINE_BUF];
+    long *ids = NULL;
+    long count = 0;
+    int result = -1;
+
+    struct reader *source = node_connection(rebalancer, from);
+    struct reader *target = node_connection(rebalancer, to);
+    if (!source || !target) {
+        goto cleanup;
+    }
+
+    //Nummern aus LIST ("<id>: <Betreff>"):
+    int length = snprintf(request, sizeof(request), "LIST\n%s\n", username);
+    if (send_all(source->socket, request, length, 0) == -1 || read_line(source, line, sizeof(line)) == -1 || strcmp(line, "ERR") == 0) {
+        goto cleanup;
+    }
+    count = atol(line);
+    ids = malloc((count > 0 ? count : 1) * sizeof(long));
+    if (!ids) {
+        goto cleanup;
+    }
+    for (long i = 0; i < count; i++) {
+        if (read_line(source, line, sizeof(line)) == -1) {
+            goto cleanup;
+        }
+        ids[i] = atol(line);
+    }
+
+    //Jede Nachricht lesen und mit derselben Nummer beim neuen Knoten abgeben ("SEND <length> <id>", Knoten mit --accept-ids),
+    //nach einem Abbruch liefert der neue Knoten für schon übernommene Nummern einfach OK.
+    //Ist die Nummer dort schon vergeben gewesen (z.B. Mailbox kehrt zurück), bekommt die Nachricht eine neue:
+    for (long i = 0; i < count; i++) {
+        length = snprintf(request, sizeof(request), "READ\n%s\n%ld\n", username, ids[i]);
+        if (send_all(source->socket, request, length, 0) == -1 || read_line(source, line, sizeof(line)) == -1) {
+            goto cleanup;
+        }
+        if (strcmp(line, "ERR") == 0) {
+            goto cleanup;
+        }
+        size_t size = strtoul(line, NULL, 10);
+        char *message = malloc(size + 1);
+        if (!message || read_bytes(source, message, size) == -1 || read_line(source, line, sizeof(line)) == -1) {
+            free(message);
+            goto cleanup;
+        }
+        message[size] = '\0';
+
+        //Kopf: "Sender: ...\nReceiver: ...\nSubject: ...\nMessage:\n", Empfänger ist nur noch diese Mailbox
+        char *sender = strstr(message, "Sender: ");
+        char *subject = strstr(message, "\nSubject: ");
+        char *body = strstr(message, "\nMessage:\n");
+        if (!sender || !subject || !body || subject > body) {
+            fprintf(stderr, "Unexpected message format in %s/%ld\n", username, ids[i]);
+            free(message);
+            goto cleanup;
+        }
+        sender += 8;
+        subject += 10;
+        body += 10;
+        int sent = 0;
+        for (int keep_id = 1; keep_id >= 0; keep_id--) {
+            if (keep_id) {
+                length = snprintf(request, sizeof(request), "SEND %zu %ld\n%.*s\n%s\n%.*s\n", size - (body - message), ids[i], (int)strcspn(sender, "\n"), sender, username, (int)strcspn(subject, "\n"), subject);
+            } else {
+                length = snprintf(request, sizeof(request), "SEND %zu\n%.*s\n%s\n%.*s\n", size - (body - message), (int)strcspn(sender, "\n"), sender, username, (int)strcspn(subject, "\n"), subject);
+            }
+            sent = send_all(target->socket, request, length, 1) == 0 && send_all(target->socket, body, size - (body - message), 0) == 0 && read_line(target, line, sizeof(line)) == 0;
+            if (!sent || strcmp(line, "ERR") != 0) {
+                break;
+            }
+        }
+        free(message);
+        if (!sent || strcmp(line, "OK") != 0) {
+            goto cleanup;
+        }
+    }
+
+    //Erst wenn alles übernommen ist, beim alten Knoten löschen:
+    for (long i = 0; i < count; i++) {
+        length = snprintf(request, sizeof(request), "DEL\n%s\n%ld\n", username, ids[i]);
+        if (send_all(source->socket, request, length, 0) == -1 || read_line(source, line, sizeof(line)) == -1) {
+            goto cleanup;
+        }
+        if (strcmp(line, "OK") != 0) {
+            fprintf(stderr, "Failed to delete %s/%ld on %s after moving it\n", username, ids[i], nodes[from].address);
+        }
+    }
+    result = count;
+
+cleanup:
+    if (result == -1) { //Zustand der Verbindungen unbekannt
+        if (source) {
+            drop_node(rebalancer, from);
+        }
+        if (target) {
+            drop_node(rebalancer, to);
+        }
+    }
+    free(ids);
+    return result;
+}
+
+void *rebalanceThread(void *data) {
+    struct client *rebalancer = data;
+    sigset_t signals;
+    int sig;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    while (1) {
+        move_pending(rebalancer);
+        //SIGHUP: Knotendatei neu lesen (neue Knoten übernehmen ihren Anteil, entfernte geben alles ab)
+        if (sigwait(&signals, &sig) != 0) {
+            continue;
+        }
+        printf("Reloading %s\n", nodes_file);
+        prepare_rebalance(rebalancer);
+    }
+    return NULL;
+}
+
+int read_nodes_file(char (*addresses)[256]) {
+    char line[LINE_BUF];
+    int count = 0;
+
+    FILE *file = fopen(nodes_file, "r");
+    if (!file) {
+        return -1;
+    }
+    //Ein Knoten pro Zeile ("host:port"), # am Anfang = Kommentar:
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *address = line + strspn(line, " \t");
+        if (address[0] == '\0' || address[0] == '#') {
+            continue;
+        }
+        char *colon = strrchr(address, ':');
+        if (!colon || colon == address || atoi(colon + 1) <= 0 || strlen(address) >= 256) {
+            fprintf(stderr, "Invalid node address: %s\n", address);
+            continue;
+        }
+        int duplicate = 0;
+        for (int i = 0; i < count; i++) {
+            duplicate |= strcmp(addresses[i], address) == 0;
+        }
+        if (!duplicate && count < NODES_MAX) {
+            strcpy(addresses[count++], address);
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+struct ring *build_ring(const int *active, int count) {
+    char key[300];
+
+    struct ring *new_ring = malloc(sizeof(struct ring));
+    if (!new_ring) {
+        return NULL;
+    }
+    new_ring->count = 0;
+    new_ring->points = malloc((size_t)count * vnodes * sizeof(struct ring_point));
+    if (!new_ring->points) {
+        free(new_ring);
+        return NULL;
+    }
+    //vnodes Punkte pro Knoten ("host:port#i"): ein neuer Knoten übernimmt von jedem anderen einen kleinen Teil
+    for (int i = 0; i < count; i++) {
+        if (!active[i]) {
+            continue;
+        }
+        for (int v = 0; v < vnodes; v++) {
+            snprintf(key, sizeof(key), "%s#%d", nodes[i].address, v);
+            new_ring->points[new_ring->count].hash = hash_key(key);
+            new_ring->points[new_ring->count++].node = i;
+        }
+    }
+    qsort(new_ring->points, new_ring->count, sizeof(struct ring_point), compare_points);
+    return new_ring;
+}
+
+int ring_lookup(const struct ring *target, const char *username) {
+    uint32_t hash = hash_key(username);
+    long low = 0, high = target->count;
+
+    //Binärsuche nach dem ersten Punkt >= hash, hinter dem letzten geht es beim ersten weiter:
+    while (low < high) {
+        long middle = (low + high) / 2;
+        if (target->points[middle].hash < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return target->points[low == target->count ? 0 : low].node;
+}
+
+int compare_points(const void *a, const void *b) {
+    const struct ring_point *first = a, *second = b;
+    if (first->hash != second->hash) {
+        return first->hash < second->hash ? -1 : 1;
+    }
+    return first->node - second->node; //gleicher Hash: Reihenfolge trotzdem eindeutig
+}
+
+int compare_pending(const void *a, const void *b) {
+    return strcmp(((const struct pending_mailbox *)a)->username, ((const struct pending_mailbox *)b)->username);
+}
+
+int compare_locks(const void *a, const void *b) {
+    uintptr_t first = (uintptr_t)*(pthread_rwlock_t * const *)a, second = (uintptr_t)*(pthread_rwlock_t * const *)b;
+    return first < second ? -1 : first > second;
+}
+
+uint32_t hash_key(const char *key) {
+    uint32_t hash = 2166136261u;
+    for (; *key; key++) {
+        hash ^= (unsigned char)*key;
+        hash *= 16777619u;
+    }
+    //Ähnliche Schlüssel ("node#1", "node#2") lägen sonst dicht beieinander auf dem Ring:
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+int valid_username(const char *username) {
+    size_t length = strlen(username);
+    if (length < 1 || length > 8) {
+        return 0;
+    }
+    for (size_t i = 0; i < length; i++) {
+        if (!((username[i] >= 'a' && username[i] <= 'z') || (username[i] >= 'A' && username[i] <= 'Z') || (username[i] >= '0' && username[i] <= '9'))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int fill_reader(struct reader *reader) {
+    if (reader->start > 0) { //Ungelesenes an den Anfang schieben
+        memmove(reader->data, reader->data + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    ssize_t size = recv(reader->socket, reader->data + reader->end, sizeof(reader->data) - reader->end, 0);
+    if (size <= 0) {
+        return -1;
+    }
+    reader->end += size;
+    return 0;
+}
+
+int read_line(struct reader *reader, char *line, size_t size) {
+    while (1) {
+        char *newline = memchr(reader->data + reader->start, '\n', reader->end - reader->start);
+        if (newline) {
+            size_t length = newline - (reader->data + reader->start);
+            snprintf(line, size, "%.*s", (int)length, reader->data + reader->start);
+            reader->start += length + 1;
+            return 0;
+        }
+        if (reader->start == 0 && reader->end == sizeof(reader->data)) {
+            reader->end = 0; //überlange Zeile verwerfen
+        }
+        if (fill_reader(reader) == -1) {
+            return -1;
+        }
+    }
+}
+
+int read_bytes(struct reader *reader, char *data, size_t len) {
+    while (len > 0) {
+        if (reader->start == reader->end && fill_reader(reader) == -1) {
+            return -1;
+        }
+        size_t available = reader->end - reader->start;
+        size_t chunk = available < len ? available : len;
+        memcpy(data, reader->data + reader->start, chunk);
+        reader->start += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+int send_all(int socket, const char *data, size_t len, int more) {
+    while (len > 0) {
+        ssize_t written = send(socket, data, len, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (written <= 0) {
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+int output_append(struct client *client, const char *data, size_t len) {
+    return spool_append(&client->output, data, len);
+}
+
+int flush_output(struct client *client) {
+    return spool_send(&client->output, client->input.socket);
+}
+
+int spool_append(struct spool *spool, const char *data, size_t len) {
+    //Große Texte und Antworten (READ) nicht im Speicher halten:
+    if (!spool->file && spool->len + len > SPOOL_MEMORY_MAX && (spool->file = tmpfile()) == NULL) {
+        perror("Failed to create spool file");
+        return -1;
+    }
+    if (spool->file) {
+        if (fwrite(data, 1, len, spool->file) != len) {
+            perror("Failed to write spool file");
+            return -1;
+        }
+        spool->size += len;
+        return 0;
+    }
+    if (spool->len + len > spool->capacity) {
+        size_t capacity = spool->capacity ? spool->capacity : 4096;
+        while (capacity < spool->len + len) {
+            capacity *= 2;
+        }
+        char *grown = realloc(spool->data, capacity);
+        if (!grown) {
+            perror("Failed to allocate spool");
+            return -1;
+        }
+        spool->data = grown;
+        spool->capacity = capacity;
+    }
+    memcpy(spool->data + spool->len, data, len);
+    spool->len += len;
+    spool->size += len;
+    return 0;
+}
+
+int spool_send(struct spool *spool, int socket) {
+    char chunk[BUF];
+    size_t remaining = spool->size - spool->len;
+    int result = send_all(socket, spool->data, spool->len, 0);
+
+    if (spool->file && result == 0) {
+        rewind(spool->file);
+        while (remaining > 0 && result == 0) {
+            size_t n = fread(chunk, 1, remaining < sizeof(chunk) ? remaining : sizeof(chunk), spool->file);
+            result = n > 0 ? send_all(socket, chunk, n, 0) : -1;
+            remaining -= n;
+        }
+    }
+    spool_reset(spool);
+    return result;
+}
+
+void spool_reset(struct spool *spool) {
+    if (spool->file) {
+        fclose(spool->file);
+        spool->file = NULL;
+    }
+    if (spool->capacity > BUF) { //nach einer großen Antwort nicht dauerhaft belegt lassen
+        free(spool->data);
+        spool->data = NULL;
+        spool->capacity = 0;
+    }
+    spool->len = 0;
+    spool->size = 0;
+}
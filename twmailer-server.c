@@ -1,10 +1,11 @@
+#define _GNU_SOURCE //Für accept4() und pthread_setaffinity_np()
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h> //Für sockaddr_in Struktur und IP-Adressen
 #include <arpa/inet.h>
 #include <unistd.h> //Für Funktionen wie close() und read()
 #include <stdlib.h>
-#include <stdio.h>
+#include <stdio.h> //Für renameat2() wird _GNU_SOURCE benötigt
 #include <string.h>
 #include <dirent.h> //Für Verzeichnisfunktionen wie opendir()
 #include <errno.h>
@@ -12,36 +13,1017 @@
 #include <time.h> //Für die Zeitfunktion time()
 #include <signal.h>
 #include <pthread.h> //Für Threading und Mutex
+#include <fcntl.h> //Für open() und O_APPEND
+#include <poll.h> //Für poll() beim Warten auf Schreibbereitschaft
+#include <getopt.h> //Für --workers Option
+#include <sys/epoll.h> //Für den epoll Event-Loop
+#include <sys/resource.h> //Für RLIMIT_NOFILE
+#include <stdint.h> //Für feste Breiten im Manifest-Format
+#include <stddef.h> //Für offsetof()
+#include <sys/sendfile.h> //Für sendfile() bei READ
+#include <sys/mman.h> //Für mmap() als Fallback zu sendfile()
+#include <sys/uio.h> //Für writev()
+#include <netinet/tcp.h> //Für TCP_CORK
+#include <limits.h> //Für IOV_MAX
+#include <stdarg.h> //Für output_printf()
+#include <sys/syscall.h> //io_uring ohne liburing: syscall()
+#include <linux/io_uring.h> //Ring-Layout und Opcodes
+#include <zlib.h> //Für die Komprimierung der Nachrichtentexte (--compress)
+#include <sched.h> //Für CPU-Sets beim Pinnen der Event-Loops
+#include <sys/eventfd.h> //Für das Wecken aller Event-Loops beim Beenden
+#include <netdb.h> //Für getaddrinfo() beim Verbinden mit dem Primary (--follow)
 
 #define BUF 1024
 #define PATH_BUF 2048 //größerer Buffer für Dateipfade
+#define MAX_EVENTS 256 //Events pro epoll_wait Aufruf
+#define LISTEN_BACKLOG SOMAXCONN //Standard für --backlog (der Kernel begrenzt auf net.core.somaxconn)
+#define DRAIN_TIMEOUT 30 //Standard für --drain-timeout in Sekunden
+#define DRAIN_POLL_MS 100 //Event-Loops prüfen beim Drain so oft, ob alle Verbindungen zu sind
+#define LISTEN_FDS_ENV "TWMAILER_LISTEN_FDS" //Listen-Sockets für den neuen Prozess beim Neustart (SIGHUP)
+#define OUTPUT_PAUSE_BYTES (256 * 1024) //so viel ungesendete Antwort, dann keine weiteren Befehle bis EPOLLOUT
+#define OUTPUT_PAUSE_FILES 16 //offene Dateien (READ) im Ausgabepuffer, dann ebenso
+#define DISPATCH_BYTES_MAX (64 * 1024) //so viel Eingabe pro Job, danach kommt die Verbindung hinten in die Job-Queue
+#define MAILBOX_LOCK_SHARDS 256 //Anzahl der Reader/Writer-Locks für Mailboxen (Zweierpotenz)
+#define MAILBOX_TABLE_SIZE 4096 //Buckets der Mailbox-Hashtabelle (Zweierpotenz)
+#define MESSAGE_NAME_LEN 64 //max. Länge eines Nachrichten-Dateinamens
+#define MANIFEST_FILE ".manifest" //Manifest mit stabilen Nachrichten-ids pro Mailbox
+#define MANIFEST_MAGIC 0x464d5754 //"TWMF"
+#define MANIFEST_VERSION 2 //Version 1: Datensätze ohne Segment-Position (80 Bytes)
+#define MANIFEST_V1_RECORD 80
+#define MANIFEST_ADD 1 //Nachricht zugestellt
+#define MANIFEST_DELETE 2 //Tombstone: Nachricht gelöscht
+#define MANIFEST_COMPACT_MIN 64 //Kompaktierung erst ab so vielen Tombstones
+#define HEADERS_FILE ".headers" //Kopfdaten-Cache pro Mailbox (feste Datensätze, beim Laden per mmap gelesen)
+#define HEADERS_STRINGS_FILE ".headers.str" //String-Tabelle des Kopfdaten-Caches
+#define HEADERS_MAGIC 0x48485754 //"TWHH"
+#define HEADERS_STRINGS_MAGIC 0x53485754 //"TWHS"
+#define HEADERS_VERSION 1
+#define HEADERS_DELETED 1 //Flag im Datensatz: Nachricht gelöscht, fällt beim nächsten Neuschreiben weg
+#define INDEX_FILE ".index" //invertierter Suchindex pro Mailbox
+#define INDEX_MAGIC 0x58495754 //"TWIX"
+#define INDEX_VERSION 1
+#define INDEX_BUCKETS 256 //Start-Buckets der Wort-Hashtabelle (Zweierpotenz, wächst mit)
+#define TOKEN_MIN 2 //kürzere Wörter werden nicht indexiert
+#define TOKEN_MAX 32 //längere Wörter werden abgeschnitten
+#define SEARCH_TERMS_MAX 8 //max. Suchbegriffe pro SEARCH
+#define INPUT_BUF 4096 //Eingabepuffer pro Verbindung (längere Befehlszeilen werden abgeschnitten)
+#define BODY_BUF 65536 //stdio-Puffer beim Schreiben eines Nachrichtentexts
+#define POOL_SLAB_BYTES (256 * 1024) //Speicher pro malloc() eines Pools (mindestens ein Objekt)
+#define LIST_DEFAULT_LIMIT LONG_MAX //LIST ohne Paging liefert alle Nachrichten
+#define STATS_BUCKETS 64 //log2-Buckets der Latenz-Histogramme (Nanosekunden)
+#define STATS_INTERVAL 10 //Standard-Intervall für --stats-file in Sekunden
+#define SEGMENT_MAX (64L * 1024 * 1024) //ab dieser Größe wird ein neues Segment begonnen
+#define SEGMENT_INLINE_MAX (1024 * 1024) //größere Texte werden vor dem Anhängen in eine temporäre Datei ausgelagert
+#define SEGMENT_COMPACT_MIN (4L * 1024 * 1024) //Kompaktierung erst ab so vielen toten Bytes
+#define COMPACTION_INTERVAL 30 //Sekunden zwischen zwei Durchläufen des Kompaktierungs-Threads
+#define HEADER_READ 512 //Bytes, die für Sender und Betreff gelesen werden
+#define COMMIT_INTERVAL_MS 2 //Standard: max. Wartezeit, bis ein Group-Commit-Batch geschrieben wird
+#define COMMIT_BATCH 64 //Standard: so viele Nachrichten lösen den Batch sofort aus
+#define SYNCFS_THRESHOLD 8 //ab so vielen Deskriptoren pro Batch wird das ganze Dateisystem synchronisiert
+#define IO_QUEUE_DEPTH 64 //Einträge im Submission-Ring pro Thread (--io uring)
+#define IO_POOL_THREADS 4 //Standard: Threads des I/O-Pools (--io threads)
+#define COMPRESS_MIN 128 //kürzere Texte werden unkomprimiert gespeichert
+#define COMPRESS_LEVEL 1 //zlib-Stufe: schnell, das Wörterbuch bringt den Großteil der Ersparnis
+#define DICTIONARY_FILE ".dict" //Wörterbuch pro Mailbox (Beispiele aus den ersten Nachrichten)
+#define DICTIONARY_SIZE 4096 //deflateSetDictionary() läuft pro Nachricht, größere Wörterbücher kosten spürbar Durchsatz
+#define BLOB_DIR ".blobs" //Texte mit mehreren Empfängern, einmal gespeichert (kein gültiger Benutzername)
+#define RECIPIENTS_MAX 256 //max. Empfänger pro SEND (die Liste muss in eine Eingabezeile passen)
+#define DICTIONARY_SAMPLE 256 //Bytes pro Nachricht, die ins Wörterbuch eingehen (Anrede, häufige Wörter)
+#define QUARANTINE_DIR ".quarantine" //beim Start gefundene halbe oder kaputte Dateien (kein gültiger Benutzername)
+#define SCAN_PROGRESS_INTERVAL 1 //Sekunden zwischen zwei Fortschrittsmeldungen beim Start-Scan
+#define REPLICATION_LOG ".replog" //geordnetes Log aller SEND/DEL für Follower, Segmente .replog.<n> (kein gültiger Benutzername)
+#define REPLICATION_SEGMENT_SIZE (64L * 1024 * 1024) //ab dieser Größe beginnt ein neues Segment
+#define REPLICATION_RETAIN_MB 256 //Standard für --replication-retain
+#define REPLICATION_MARK_RECORDS 64 //jeder 64. Datensatz kommt in den Index seq -> Position
+#define REPLICATION_ACK_RECORDS 256 //Follower: spätestens nach so vielen Datensätzen bestätigen
+#define REPLICATION_MAGIC 0x52504c31 //"RPL1"
+#define REPLICATION_FOLLOWERS_MAX 16 //gleichzeitig verbundene Follower pro Primary
+#define REPLICATION_RETRY_MS 1000 //Follower: Wartezeit bis zum nächsten Verbindungsversuch
+
+//Zustände des Parsers einer Verbindung:
+enum parse_state {
+    STATE_COMMAND, //wartet auf Befehlszeile (SEND, LIST, ...)
+    STATE_FIELDS, //liest die Felder des Befehls zeilenweise
+    STATE_BODY_LINES, //SEND: Text bis zur Zeile "."
+    STATE_BODY_LENGTH //SEND <length>: genau body_remaining Bytes
+};
+
+//Speicherort neuer Nachrichten (--storage):
+enum storage_mode {
+    STORAGE_FILES, //eine Datei pro Nachricht
+    STORAGE_SEGMENTS //Anhängen an Segmentdateien pro Mailbox
+};
+
+//Wann SEND/DEL mit OK beantwortet werden (--durability):
+enum durability_mode {
+    DURABILITY_NONE, //sofort, Daten liegen nur im Page Cache
+    DURABILITY_FSYNC, //nach fsync() durch den Worker selbst
+    DURABILITY_GROUP //nach dem nächsten gemeinsamen fsync() des Commit-Threads
+};
+
+//Ausführung von Dateioperationen (--io):
+enum io_backend {
+    IO_BACKEND_SYNC, //direkt im aufrufenden Thread, eine nach der anderen
+    IO_BACKEND_URING, //alle Operationen eines Batches auf einmal an io_uring
+    IO_BACKEND_THREADS //Batch wird auf einen Thread-Pool verteilt (Fallback ohne io_uring)
+};
+
+enum io_opcode { IO_FSYNC, IO_FDATASYNC, IO_WRITE, IO_UNLINK };
+
+//Kodierung eines gespeicherten Texts, erkennbar an der vierten Kopfzeile:
+enum body_encoding {
+    BODY_PLAIN, //"Message:"
+    BODY_DEFLATE, //"Message-Deflate: <Länge>", zlib-Strom ohne Wörterbuch
+    BODY_DEFLATE_DICT //"Message-Deflate-Dict: <Länge>", zlib-Strom mit dem Wörterbuch der Mailbox
+};
+
+//Pools für Verbindungen und Puffer (Größenklassen 512 B bis 64 KB):
+enum pool_id { POOL_CONNECTION, POOL_BUFFER_512, POOL_BUFFER_4K, POOL_BUFFER_16K, POOL_BUFFER_64K, POOL_COUNT };
+
+enum command { CMD_NONE, CMD_SEND, CMD_LIST, CMD_READ, CMD_DEL, CMD_STATS, CMD_SEARCH, CMD_COUNT };
+
+//Art eines Datensatzes im Replikations-Log:
+enum replication_type { REPLICATION_SEND = 1, REPLICATION_DEL = 2, REPLICATION_REJECT = 3 }; //REJECT: Primary hat die angefragte Nummer nicht
+
+//Gemessene Abschnitte im Hot Path:
+enum stats_timer {
+    TIMER_PARSE, //Parser ohne Befehlsausführung
+    TIMER_LOCK_WAIT, //Warten auf den Mailbox-Lock
+    TIMER_DISK, //Dateisystem (Nachrichtendateien, Manifest)
+    TIMER_SEND, //writev()/sendfile() an den Client
+    TIMER_COMMIT, //Warten, bis SEND/DEL auf der Platte sind (--durability)
+    TIMER_COUNT
+};
+
+//Wörter einer Nachricht beim Indexieren (sortiert und ohne Duplikate nach finish_tokens()):
+struct token_set {
+    char (*tokens)[TOKEN_MAX + 1];
+    int count;
+    int capacity;
+    char current[TOKEN_MAX + 1]; //angefangenes Wort (Text kommt blockweise)
+    int current_len;
+};
+
+//Aktuell geparste Anfrage einer Verbindung:
+struct request {
+    enum command command;
+    int fields; //Anzahl bereits gelesener Felder
+    char sender[9];
+    char receiver[9]; //bei mehreren Empfängern der erste
+    char (*recipients)[9]; //SEND an mehrere Empfänger (sortiert, ohne Duplikate), NULL = nur receiver
+    int recipient_count;
+    char username[9]; //Mailbox bei LIST/READ/DEL
+    char subject[81];
+    char terms[256]; //SEARCH: Suchbegriffe
+    long message_id;
+    uint64_t replica_seq; //Follower: Nummer des angewendeten Log-Datensatzes, 0 = eigene Änderung
+    long replica_id; //feste id: Follower = id beim Primary, "SEND <length> <id>" = Router beim Umverteilen
+    long list_offset; //LIST <offset> <limit>: erste Position (0-basiert)
+    long list_limit; //max. Anzahl Einträge
+    long body_length; //-1 = Punkt-terminiert, sonst Länge aus "SEND <length>"
+    long body_remaining; //SEND <length>: noch fehlende Bytes
+    int at_line_start; //Punkt-Modus: nächstes Byte beginnt eine neue Zeile
+    int invalid; //1 = Anfrage fehlerhaft, Text wird verworfen und mit ERR beantwortet
+    FILE *body_file; //temporäre Nachrichtendatei (tmp_<key>) oder Speicherpuffer während SEND
+    char *stdio_buffer; //Puffer von body_file (POOL_BUFFER_64K)
+    char *body_buffer; //Segmente: Nachricht im Speicher
+    size_t body_buffer_len;
+    size_t body_buffer_capacity;
+    int body_buffer_pool; //Größenklasse von body_buffer, -1 = direkt von malloc()
+    int in_memory; //1 = Text wird in body_buffer gesammelt statt in body_file
+    char *packed_buffer; //komprimierte Nachricht (Kopf + zlib-Strom), NULL = unkomprimiert speichern
+    size_t packed_len;
+    int packed_pool; //Größenklasse von packed_buffer, -1 = direkt von malloc()
+    enum body_encoding encoding;
+    off_t plain_size; //Länge des Texts vor dem Komprimieren
+    char key[MESSAGE_NAME_LEN]; //gesetzt, solange tmp_<key> existiert
+    off_t size; //Größe der Nachrichtendatei
+    struct token_set tokens; //SEND: Wörter für den Suchindex, schon beim Empfang gesammelt
+    int token_lines; //bereits übersprungene Kopfzeilen (Sender, Empfänger, Betreff, "Message:")
+};
+
+//Block im Ausgabepuffer einer Verbindung, belegt einen Puffer aus dem Pool.
+//READ hängt statt Daten einen Dateibereich an (fd != -1, capacity 0), der per sendfile() rausgeht:
+struct output_chunk {
+    struct output_chunk *next;
+    size_t len; //belegte Bytes in data
+    size_t capacity; //Größe von data
+    enum pool_id pool; //Größenklasse des Puffers
+    int fd; //Dateiblock: offene Nachricht, -1 = Datenblock
+    int copy; //Dateiblock: sendfile() nicht unterstützt, mit pread()/send() kopieren
+    off_t offset; //Dateiblock: nächstes zu sendendes Byte
+    off_t end;
+    char data[];
+};
+
+//Zustand einer Client-Verbindung, gehört immer genau einem Thread
+//(Event-Loop oder Worker), weil der Socket mit EPOLLONESHOT registriert ist:
+struct connection {
+    int fd; //Client Socket (non-blocking)
+    struct event_loop *loop; //Event-Loop, in dessen epoll der Socket registriert ist
+    struct connection *open_prev; //Verkettung in loop->connections
+    struct connection *open_next;
+    int parked; //1 = wartet in epoll auf Daten (Worker setzt, Event-Loop löscht)
+    int drained; //1 = beim Drain bereits per shutdown() beendet
+    struct connection *next; //Verkettung in der Job-Queue
+    enum parse_state state;
+    int skip_line; //1 = Rest einer zu langen Zeile verwerfen
+    struct request request;
+    struct output_chunk *output_head; //wachsender Ausgabepuffer (Kette von Blöcken)
+    struct output_chunk *output_tail;
+    size_t output_sent; //bereits gesendete Bytes im ersten Block (Socket war voll)
+    size_t output_bytes; //noch ungesendete Bytes im Ausgabepuffer (inkl. Dateiblöcke)
+    int output_files; //Dateiblöcke im Ausgabepuffer
+    int input_paused; //1 = Eingabepuffer enthält noch Befehle, die erst nach dem Senden drankommen
+    int closing; //1 = QUIT/Fehler: nach der letzten Antwort schließen
+    int corked; //TCP_CORK aktiv bis zum nächsten flush (READ)
+    int output_failed; //1 = Antwort unvollständig (kein Speicher), Verbindung wird geschlossen
+    int deflate_passthrough; //1 = Client hat "CAPA deflate" geschickt, READ liefert zlib-Ströme unverändert
+    int *sync_fds; //Kopien der Deskriptoren, die vor der nächsten Antwort auf die Platte müssen
+    int sync_count;
+    int sync_capacity;
+    int sync_messages; //Anzahl SEND/DEL, die auf diese Deskriptoren warten
+    size_t input_len; //Bytes im Eingabepuffer (unvollständige Zeile)
+    char input[INPUT_BUF];
+};
+
+//Kopf des Manifests (<spool>/<user>/.manifest):
+struct manifest_header {
+    uint32_t magic;
+    uint32_t version;
+    int64_t next_id; //nächste freie id zum Zeitpunkt der letzten Kompaktierung
+};
+
+//Datensatz im Manifest, wird nur angehängt (append-only).
+//Version 1 endet nach file_name, offset und length sind dort 0:
+struct manifest_record {
+    uint32_t type; //MANIFEST_ADD oder MANIFEST_DELETE
+    uint32_t segment; //0 = eigene Datei (file_name), sonst Nummer des Segments
+    int64_t id;
+    char file_name[MESSAGE_NAME_LEN];
+    int64_t offset; //Position der Nachricht im Segment
+    int64_t length;
+};
+
+//Kopf von .headers und .headers.str. Beide tragen dieselbe Generation, damit nach einem Absturz
+//zwischen den beiden rename() keine Datensätze mit der falschen String-Tabelle gelesen werden:
+struct headers_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t generation;
+};
+
+//Datensatz im Kopfdaten-Cache (<spool>/<user>/.headers), feste Breite; SEND hängt an, DEL setzt nur flags:
+struct header_record {
+    int64_t id;
+    int64_t offset; //wie im Manifest, zum Abgleich
+    int64_t size;
+    int64_t plain_size;
+    int64_t timestamp;
+    uint32_t segment;
+    uint32_t encoding;
+    uint32_t name; //Offsets in .headers.str, jeweils mit '\0' abgeschlossen
+    uint32_t sender;
+    uint32_t subject;
+    uint32_t flags; //HEADERS_DELETED
+};
+
+//Eintrag im Index einer Mailbox (eine Nachrichtendatei):
+struct message_entry {
+    long id; //stabile Nachrichtennummer aus dem Manifest
+    char file_name[MESSAGE_NAME_LEN]; //leer bei Nachrichten in Segmenten
+    unsigned int segment; //0 = eigene Datei
+    off_t offset; //Position im Segment
+    off_t size; //Größe der Nachricht in Bytes
+    enum body_encoding encoding;
+    off_t plain_size; //Länge des entpackten Texts (nur bei komprimierten Nachrichten)
+    time_t timestamp; //Zeitpunkt der Zustellung
+    char sender[9];
+    char subject[81];
+    long header_slot; //Datensatz in .headers + 1, 0 = keiner
+};
+
+//Im Speicher gehaltener Index einer Mailbox, wird beim ersten Zugriff geladen.
+//Die Einträge sind durch den Mailbox-Lock des Benutzers geschützt:
+struct mailbox {
+    char username[9];
+    struct message_entry *messages; //aufsteigend nach id sortiert
+    int count;
+    int capacity;
+    long next_id; //nächste zu vergebende Nachrichtennummer (ids werden nie wiederverwendet)
+    int tombstones; //Anzahl DELETE-Datensätze im Manifest
+    int loaded; //1 = Manifest wurde eingelesen
+    unsigned int active_segment; //Segment, an das angehängt wird (0 = noch keines)
+    unsigned int compaction_segment; //Ziel der laufenden Kompaktierung (SEND überspringt diese Nummer), 0 = keine
+    int segment_fd; //offenes aktives Segment, -1 = geschlossen
+    int manifest_fd; //offenes Manifest zum Anhängen, -1 = geschlossen
+    int dir_fd; //Verzeichnis der Mailbox (für fsync nach rename/create), -1 = geschlossen
+    int index_fd; //offener Suchindex zum Anhängen, -1 = geschlossen
+    int headers_fd; //Kopfdaten-Cache und String-Tabelle zum Schreiben, -1 = geschlossen
+    int header_strings_fd;
+    long header_records; //Datensätze in .headers, -1 = Cache unbrauchbar (wird beim nächsten Laden neu geschrieben)
+    off_t header_strings_size; //Ende der String-Tabelle = Position des nächsten Anhängens
+    struct search_index *search; //Suchindex im Speicher, NULL = noch nicht geladen (erst beim ersten SEARCH)
+    struct compression_dictionary *dictionary; //NULL = noch nicht trainiert, danach unveränderlich
+    char *dictionary_samples; //Anfänge der ersten Nachrichten, bis DICTIONARY_SIZE erreicht ist
+    size_t dictionary_samples_len;
+    off_t segment_size; //Ende des aktiven Segments = Position des nächsten Anhängens
+    long live_bytes; //Bytes lebender Nachrichten in Segmenten
+    long dead_bytes; //Bytes gelöschter Nachrichten in Segmenten (werden bei der Kompaktierung frei)
+    pthread_mutex_t load_mutex; //verhindert paralleles Laden durch mehrere Leser
+    struct mailbox *next; //Verkettung im Hashtabellen-Bucket
+};
+
+//Wörterbuch einer Mailbox (<spool>/<user>/.dict), wird nie freigegeben, damit READ es
+//auch nach dem Freigeben des Mailbox-Locks noch verwenden kann:
+struct compression_dictionary {
+    unsigned long id; //Adler-32 der Daten, steht auch im Kopf jedes zlib-Stroms
+    size_t len;
+    unsigned char data[];
+};
+
+//zlib-Zustände eines Threads (deflateInit() belegt mehrere hundert KB, daher wiederverwenden):
+struct zlib_streams {
+    z_stream deflater;
+    z_stream inflater;
+    int deflate_ready; //1 = deflateInit() erfolgreich
+    int inflate_ready;
+};
+
+//Datensatz im Replikations-Log (<spool>/.replog.<n>), dahinter length Bytes Nutzdaten
+//(SEND: die Nachricht unkomprimiert, wie READ sie liefert; DEL: keine; REJECT: seq/id = neuester/ältester Datensatz des Primary):
+struct replication_record {
+    uint32_t magic;
+    uint32_t type; //enum replication_type
+    uint64_t seq; //fortlaufend über alle Mailboxen, Follower fragen ab einer Nummer an
+    int64_t id; //id der Nachricht in der Mailbox
+    char username[16];
+    uint32_t length;
+    uint32_t checksum; //CRC-32 der Nutzdaten
+};
+
+//Segment des Replikations-Logs (<spool>/.replog.<number>, Nummern lückenlos aufsteigend):
+struct replication_segment {
+    unsigned int number;
+    uint64_t first_seq; //erster Datensatz (leeres Segment: der nächste)
+    off_t size; //nur abgeschlossene Segmente, das aktive wächst in replication_state.size
+};
+
+//Jeder REPLICATION_MARK_RECORDS-te Datensatz und jeder Segmentanfang, Sender springen dorthin statt das Log von vorne zu lesen:
+struct replication_mark {
+    uint64_t seq;
+    unsigned int segment;
+    off_t offset;
+};
+
+//Replikation: Log, Follower-Verbindungen des Primary und Zustand des Follower-Threads:
+struct replication_state {
+    int fd; //aktives Segment (O_APPEND), -1 = Replikation aus
+    uint64_t seq; //letzter geschriebener Datensatz
+    off_t size; //Ende des letzten vollständigen Datensatzes im aktiven Segment, Sender lesen nur bis hier
+    struct replication_segment *segments; //älteste zuerst, das letzte ist das aktive
+    int segment_count;
+    int segment_capacity;
+    struct replication_mark *marks; //aufsteigend nach seq
+    size_t mark_count;
+    size_t mark_capacity;
+    int listen_fd; //--replication-port
+    int follower_fds[REPLICATION_FOLLOWERS_MAX]; //Sockets der verbundenen Follower, -1 = frei
+    pthread_t senders[REPLICATION_FOLLOWERS_MAX];
+    int sender_started[REPLICATION_FOLLOWERS_MAX]; //1 = Thread muss noch mit pthread_join abgeholt werden
+    uint64_t confirmed[REPLICATION_FOLLOWERS_MAX]; //vom Follower angewendet ("ACK <seq>"), ältere Segmente dürfen weg
+    int primary_fd; //Follower: Verbindung zum Primary
+    int connected; //Follower: 1 = verbunden
+    int shutdown;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; //neue Datensätze oder Beenden
+};
+
+//Kopf des Suchindex (<spool>/<user>/.index):
+struct index_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+//Datensatz im Suchindex, dahinter length Bytes Wörter (jeweils mit '\0' abgeschlossen):
+struct index_record {
+    int64_t id;
+    uint32_t length;
+    uint32_t reserved;
+};
+
+//Trefferliste eines Wortes, ids aufsteigend:
+struct posting_list {
+    struct posting_list *next; //Verkettung im Bucket
+    long *ids;
+    int count;
+    int capacity;
+    char token[TOKEN_MAX + 1];
+};
+
+//Invertierter Index einer Mailbox (Wort -> ids). Gelöschte ids bleiben bis zum
+//nächsten Laden stehen und werden beim Suchen gegen den Mailbox-Index geprüft:
+struct search_index {
+    struct posting_list **buckets;
+    unsigned long bucket_count; //Zweierpotenz
+    unsigned long token_count;
+    int stale; //gelöschte Nachrichten seit dem Laden
+};
+
+//Latenz-Histogramm, Bucket i zählt Werte unter 2^i Nanosekunden:
+struct latency_histogram {
+    unsigned long buckets[STATS_BUCKETS];
+    unsigned long count;
+    unsigned long sum_ns;
+    unsigned long max_ns;
+};
+
+//Statistik eines Worker-Threads. Nur der Worker selbst schreibt (relaxed atomics, kein Lock),
+//STATS und der Dump-Thread lesen und summieren über alle Worker:
+struct worker_stats {
+    struct latency_histogram commands[CMD_COUNT]; //Ausführungszeit pro Befehl
+    struct latency_histogram timers[TIMER_COUNT];
+    unsigned long bytes_received;
+    unsigned long bytes_sent;
+    unsigned long compressed_messages; //mit --compress komprimiert gespeicherte Nachrichten
+    unsigned long compressed_plain_bytes; //deren Größe vorher
+    unsigned long compressed_stored_bytes; //und nachher
+} __attribute__((aligned(64))); //eigene Cache-Lines pro Worker
+
+//Zu synchronisierende Datei in einem Batch (zum Entfernen von Duplikaten):
+struct sync_file {
+    dev_t dev;
+    ino_t ino;
+    int is_dir;
+    int fd;
+};
+
+//Group Commit: Worker hängen ihre Deskriptoren an, der Commit-Thread synchronisiert sie gemeinsam:
+struct commit_queue {
+    int *fds;
+    int count;
+    int capacity;
+    int messages; //Nachrichten im aktuellen Batch
+    unsigned long next_ticket; //Nummer des Batches, der gerade gesammelt wird
+    unsigned long durable_ticket; //alle Batches bis hier sind auf der Platte
+    int failed; //1 = fsync fehlgeschlagen, ab jetzt wird nichts mehr bestätigt
+    int shutdown;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; //weckt den Commit-Thread
+    pthread_cond_t done; //weckt wartende Worker
+};
+
+//Dateioperation für io_run():
+struct io_op {
+    enum io_opcode opcode;
+    int fd; //IO_FSYNC, IO_FDATASYNC, IO_WRITE
+    const char *path; //IO_UNLINK
+    const void *buf; //IO_WRITE
+    size_t len;
+    off_t offset;
+    long result; //Bytes bzw. 0, negativ = -errno
+};
+
+//io_uring eines Threads (Submission- und Completion-Ring im gemeinsamen Speicher mit dem Kernel):
+struct io_ring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map; //== sq_map bei IORING_FEAT_SINGLE_MMAP
+    size_t cq_map_len;
+    size_t sqes_len;
+};
+
+//Batch im I/O-Pool, liegt auf dem Stack des wartenden Threads:
+struct io_batch {
+    struct io_op *ops;
+    int count;
+    int next; //nächste noch nicht vergebene Operation
+    int pending; //noch nicht abgeschlossene Operationen
+    struct io_batch *next_batch;
+};
+
+//Thread-Pool für --io threads:
+struct io_pool {
+    struct io_batch *head; //Batches mit noch nicht vergebenen Operationen
+    struct io_batch *tail;
+    int shutdown;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; //weckt Pool-Threads
+    pthread_cond_t done; //weckt wartende Aufrufer
+};
+
+//Freies Objekt in einem Pool (Verkettung im Objekt selbst):
+struct pool_object {
+    struct pool_object *next;
+};
+
+//Slab-Pool für Objekte einer Größe. Threads nehmen und geben über ihren eigenen Cache,
+//nur beim Nachfüllen/Zurückgeben wird der gemeinsame Vorrat gesperrt:
+struct object_pool {
+    size_t size;
+    int cache_max; //Objekte pro Thread-Cache, darüber geht die Hälfte in den Vorrat
+    struct pool_object *depot; //gemeinsamer Vorrat
+    long depot_count;
+    unsigned long slabs; //malloc() Aufrufe (bleibt im eingeschwungenen Zustand konstant)
+    unsigned long objects; //insgesamt angelegte Objekte
+    pthread_mutex_t mutex;
+};
+
+//Cache eines Threads für einen Pool. Nur der Thread selbst schreibt (relaxed atomics für STATS):
+struct pool_cache {
+    struct pool_object *head;
+    long count;
+    unsigned long allocs;
+    unsigned long frees;
+};
+
+//Caches eines Threads, bleiben für die Statistik auch nach dem Thread-Ende erhalten:
+struct pool_thread {
+    struct pool_cache caches[POOL_COUNT];
+    struct pool_thread *next;
+};
+
+//Event-Loop mit eigenem Listen-Socket (SO_REUSEPORT) und eigener epoll Instanz,
+//der Kernel verteilt neue Verbindungen auf die Listen-Sockets:
+struct event_loop {
+    int listen_fd;
+    int epoll_fd;
+    int cpu; //-1 = nicht gepinnt
+    pthread_t thread;
+    unsigned long connections_accepted; //nur dieser Loop schreibt
+    struct connection *connections; //offene Verbindungen dieses Loops (für Drain und Beenden)
+    long open; //Anzahl in connections
+    pthread_mutex_t mutex; //schützt connections und open
+} __attribute__((aligned(64))); //eigene Cache-Line pro Loop
+
+//Prüfung des Spools beim Start, die Mailboxen werden auf --scan-threads Threads verteilt:
+struct spool_scan {
+    char (*names)[9]; //Mailbox-Verzeichnisse
+    long count;
+    long next; //nächste freie Mailbox (atomar)
+    long done; //fertig geprüfte Mailboxen (atomar, für die Fortschrittsmeldung)
+    long messages;
+    long quarantined; //nach .quarantine verschobene Dateien
+    long dropped; //Einträge ohne gültige Nachricht, mit Tombstone entfernt
+};
+
+//Job-Queue zwischen Event-Loop und Worker-Pool:
+struct job_queue {
+    struct connection *head;
+    struct connection *tail;
+    int shutdown; //1 = Worker sollen sich beenden
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
 
 char mail_spool_directory[BUF]; // Verzeichnis wo Email gespeichert
-int abortRequested = 0; //Flag für Abbruch
-int create_socket = -1; //Socket für Server
-pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex für Dateizugriff
-pthread_mutex_t abort_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex für abortRequested
+volatile sig_atomic_t abortRequested = 0; //Flag für Abbruch (SIGINT)
+struct event_loop *loops; //ein Event-Loop pro Listen-Socket, loops[0] läuft im Haupt-Thread
+long loop_count = 1; //--listeners
+int listen_backlog = LISTEN_BACKLOG; //--backlog
+int pin_cpus = 0; //--pin-cpus: jeden Event-Loop an eine eigene CPU binden
+int wake_fd = -1; //eventfd, weckt beim Beenden alle Event-Loops
+volatile sig_atomic_t drainRequested = 0; //SIGTERM/SIGHUP: keine neuen Verbindungen, laufende Befehle fertig machen
+volatile sig_atomic_t restartRequested = 0; //SIGHUP: nach dem Drain mit denselben Listen-Sockets neu starten
+long drain_timeout = DRAIN_TIMEOUT; //--drain-timeout
+long scan_thread_count = -1; //--scan-threads, -1 = eine pro CPU, 0 = kein Scan beim Start
+struct spool_scan spool_scan;
+pthread_rwlock_t mailbox_locks[MAILBOX_LOCK_SHARDS]; //Locks für Mailboxen, Index = Hash des Benutzernamens
+struct job_queue jobs = { NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+__thread unsigned int worker_id; //Nummer des Worker-Threads, Teil jeder Nachrichten-id
+__thread unsigned long message_sequence; //fortlaufende Nummer pro Worker-Thread
+struct mailbox *mailbox_table[MAILBOX_TABLE_SIZE]; //Index aller bisher verwendeten Mailboxen
+pthread_mutex_t mailbox_table_mutex = PTHREAD_MUTEX_INITIALIZER; //schützt nur die Bucket-Ketten
+struct worker_stats *worker_stats; //ein Eintrag pro Worker
+long worker_stats_count;
+__thread struct worker_stats *stats; //Statistik des aktuellen Workers
+__thread uint64_t accounted_ns; //Zeit in Befehlen und Dateizugriffen, wird von der Parse-Zeit abgezogen
+unsigned long connections_closed;
+time_t start_time;
+char stats_file[BUF]; //--stats-file, leer = kein periodischer Dump
+long stats_interval = STATS_INTERVAL;
+int stats_shutdown = 0;
+pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER; //nur für das Warten des Dump-Threads
+pthread_cond_t stats_cond = PTHREAD_COND_INITIALIZER;
+enum storage_mode storage_mode = STORAGE_FILES;
+enum durability_mode durability_mode = DURABILITY_NONE;
+long commit_interval_ms = COMMIT_INTERVAL_MS;
+int commit_batch = COMMIT_BATCH;
+int spool_fd = -1; //Spool-Verzeichnis, für syncfs() im Commit-Thread
+struct commit_queue commits = { NULL, 0, 0, 0, 1, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+enum io_backend io_backend = IO_BACKEND_SYNC;
+long io_thread_count = IO_POOL_THREADS;
+struct io_pool io_pool = { NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+pthread_key_t io_ring_key; //io_uring pro Thread, wird beim Beenden des Threads freigegeben
+struct object_pool pools[POOL_COUNT] = {
+    { sizeof(struct connection), 32, NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER },
+    { 512, 64, NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER },
+    { 4096, 32, NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER },
+    { 16384, 16, NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER },
+    { 65536, 4, NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER }
+};
+const char *pool_names[POOL_COUNT] = { "connection", "buffer_512", "buffer_4k", "buffer_16k", "buffer_64k" };
+__thread struct pool_thread *pool_thread; //Caches des aktuellen Threads
+struct pool_thread *pool_threads; //alle Threads mit Caches (für STATS)
+pthread_mutex_t pool_threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t pool_key; //gibt die Caches beim Thread-Ende an den Vorrat zurück
+unsigned long buffer_oversize; //Puffer über 64 KB, direkt von malloc()
+int compress_bodies = 0; //--compress deflate
+int compress_passthrough = 0; //--compress-passthrough: komprimierte Texte an Clients mit "CAPA deflate"
+pthread_mutex_t blob_mutex = PTHREAD_MUTEX_INITIALIZER; //Anlegen und Freigeben von Blobs (Referenzzähler = Anzahl Hardlinks)
+pthread_key_t zlib_key; //gibt die zlib-Zustände beim Thread-Ende frei
+struct replication_state replication = { -1, 0, 0, NULL, 0, 0, NULL, 0, 0, -1, { 0 }, { 0 }, { 0 }, { 0 }, -1, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+int replication_port = 0; //--replication-port, 0 = keine Follower annehmen
+off_t replication_retain = (off_t)REPLICATION_RETAIN_MB * 1024 * 1024; //--replication-retain: so viel bestätigtes Log bleibt für spätere Follower
+char follow_host[BUF]; //--follow <host>:<port>, leer = Primary
+char follow_port[16];
+int accept_ids = 0; //--accept-ids: "SEND <length> <id>" annehmen (nur für Knoten hinter dem Router)
+__thread struct zlib_streams *zlib_streams;
+int compaction_shutdown = 0;
+pthread_mutex_t compaction_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t compaction_cond = PTHREAD_COND_INITIALIZER; //weckt den Kompaktierungs-Thread vorzeitig
+const char *command_names[CMD_COUNT] = { "NONE", "SEND", "LIST", "READ", "DEL", "STATS", "SEARCH" };
+const char *timer_names[TIMER_COUNT] = { "parse", "lock_wait", "disk", "send", "commit" };
 
 void signalHandler(int sig); //Signalbehandlung
-void *clientCommunication(void *data); //Kommunikation mit Client
-void handle_send(int socket, char *buffer); //SEND
-void handle_list(int socket, char *buffer); //LIST
-void handle_read(int socket, char *buffer); //READ
-void handle_del(int socket, char *buffer); //DEL
+int open_listener(struct event_loop *loop, int port); //Listen-Socket und epoll Instanz eines Event-Loops anlegen
+int create_listener(struct event_loop *loop, int port); //Socket binden und lauschen (SO_REUSEPORT bei mehreren Loops)
+void *loopThread(void *data); //weiterer Event-Loop (ab loops[1])
+void run_event_loop(struct event_loop *loop); //epoll Event-Loop (Accept + Verteilung an Worker)
+void accept_connections(struct event_loop *loop); //Alle wartenden Verbindungen annehmen
+int adopt_listeners(const char *fds); //Listen-Sockets vom vorherigen Prozess übernehmen (Neustart)
+long close_idle_connections(struct event_loop *loop); //Drain: wartende Verbindungen ohne Befehl beenden, Rückgabe: noch offen
+void close_all_connections(void); //Beenden: übrige Verbindungen schließen (halbe SEND verwerfen)
+int restart_server(char **argv); //Listen-Sockets weitergeben und das Programm neu ausführen
+int loop_cpu(long index); //CPU für den Event-Loop index (reihum über die erlaubten CPUs)
+void pin_thread(int cpu); //aktuellen Thread an eine CPU binden
+void *workerThread(void *data); //Worker: verarbeitet Befehle von bereiten Verbindungen
+void job_queue_push(struct connection *conn);
+struct connection *job_queue_pop(void);
+int rearm_connection(struct connection *conn); //Socket wieder für epoll scharf schalten (EPOLLOUT, solange Ausgabe wartet)
+void close_connection(struct connection *conn);
+int output_append(struct connection *conn, const char *data, size_t len); //Antwort im Ausgabepuffer sammeln
+int output_printf(struct connection *conn, const char *format, ...);
+int flush_output(struct connection *conn); //Ausgabepuffer senden, 1 = Socket voll (Rest bleibt für EPOLLOUT)
+int send_file_chunk(struct connection *conn, struct output_chunk *chunk); //Dateiblock senden, 1 = Socket voll
+void uncork_connection(struct connection *conn);
+void free_output(struct connection *conn);
+int send_file(struct connection *conn, int fd, off_t offset, off_t size, const char *header, size_t header_len); //Kopf + Dateibereich + "OK\n" anhängen (übernimmt fd)
+unsigned long hash_username(const char *username); //FNV-1a Hash
+pthread_rwlock_t *lock_mailbox(const char *username, int exclusive); //shared für LIST/READ, exklusiv für SEND/DEL
+int valid_username(const char *username); //1-8 Zeichen, nur Buchstaben und Ziffern
+struct mailbox *get_mailbox(const char *username); //Index holen, bei Bedarf laden (Mailbox-Lock muss gehalten werden)
+int load_mailbox(struct mailbox *mailbox); //Manifest (oder einmalig das Verzeichnis) einlesen und Index aufbauen
+int load_manifest(struct mailbox *mailbox, const char *dirpath); //0 = geladen, 1 = kein Manifest, -1 = Fehler
+int write_manifest(struct mailbox *mailbox); //Manifest kompakt neu schreiben
+int append_manifest_record(struct mailbox *mailbox, uint32_t type, const struct message_entry *entry);
+int load_header_cache(struct mailbox *mailbox, const char *dirpath, char *cached); //Kopfdaten per mmap übernehmen, cached[i] = 1 für gefundene
+int read_entry_header(struct mailbox *mailbox, const char *dirpath, struct message_entry *entry, int *segment_fd, unsigned int *open_segment); //Kopf aus Datei bzw. Segment lesen
+int write_header_cache(struct mailbox *mailbox); //.headers und .headers.str aus dem Index neu schreiben
+int append_header_record(struct mailbox *mailbox, struct message_entry *entry); //Datensatz für eine neue Nachricht anhängen
+void delete_header_record(struct mailbox *mailbox, const struct message_entry *entry); //Datensatz als gelöscht markieren
+void close_header_cache(struct mailbox *mailbox);
+int compare_names(const void *a, const void *b);
+int find_message_entry(struct mailbox *mailbox, long id); //Binärsuche nach id, -1 = nicht vorhanden
+int read_message_header(const char *path, struct message_entry *entry); //Sender und Betreff lesen
+void parse_message_header(const char *data, size_t len, struct message_entry *entry);
+int add_message_entry(struct mailbox *mailbox, const struct message_entry *entry);
+void remove_message_entry(struct mailbox *mailbox, int index);
+int compare_message_entries(const void *a, const void *b);
+void generate_message_key(char *key, size_t size); //eindeutiger Schlüssel: Zeitstempel + Sequenz + Worker
+int deliver_message_file(const char *dirpath, const char *key, char *file_name, size_t size); //tmp_<key> atomar nach message_<key>.txt umbenennen
+int open_temp_body(struct request *request, const char *dirpath); //tmp_<key> zum Schreiben öffnen
+int spill_body(struct request *request); //Speicherpuffer in tmp_<key> auslagern
+int segment_path(char *path, size_t size, const char *username, unsigned int segment);
+int open_active_segment(struct mailbox *mailbox); //bei Bedarf öffnen oder ein neues Segment beginnen
+int append_to_segment(struct mailbox *mailbox, struct request *request, struct message_entry *entry); //Nachricht anhängen
+int copy_range(int source, off_t offset, int target, off_t target_offset, off_t length);
+int compact_segments(struct mailbox *mailbox, pthread_rwlock_t *lock, long *freed); //lebende Nachrichten in ein neues Segment kopieren (1 = nichts zu tun)
+void *compactionThread(void *data); //kompaktiert im Hintergrund Mailboxen mit vielen toten Bytes
+int mailbox_dir_fd(struct mailbox *mailbox); //Verzeichnis der Mailbox (offen gehalten)
+int sync_directory(const char *path); //Verzeichniseintrag (mkdir/rename) dauerhaft machen
+void sync_later(struct connection *conn, int fd); //Kopie von fd vor der nächsten Antwort synchronisieren
+int sync_fds(int *fds, int count); //fdatasync()/fsync() ohne Duplikate, schließt alle Deskriptoren
+int compare_sync_files(const void *a, const void *b);
+int commit_wait(struct connection *conn); //SEND/DEL der Verbindung dauerhaft machen (--durability)
+void *commitThread(void *data); //Group Commit
+int io_run(struct io_op *ops, int count); //alle Operationen ausführen, -1 (errno gesetzt) wenn eine fehlschlägt
+void io_execute(struct io_op *op); //eine Operation blockierend ausführen
+int io_uring_available(void); //io_uring und alle benötigten Opcodes vorhanden?
+struct io_ring *io_ring_get(void); //io_uring des aktuellen Threads, bei Bedarf anlegen
+int io_ring_setup(struct io_ring *ring);
+void io_ring_close(struct io_ring *ring);
+void io_ring_free(void *data); //Destruktor von io_ring_key
+void io_ring_run(struct io_ring *ring, struct io_op *ops, int count); //Batch einreichen und auf alle Ergebnisse warten
+void io_pool_run(struct io_op *ops, int count); //Batch auf den I/O-Pool verteilen und mitarbeiten
+void *ioThread(void *data); //Thread des I/O-Pools
+void *pool_alloc(enum pool_id id); //Objekt aus dem Cache des Threads (NULL = kein Speicher)
+void pool_free(enum pool_id id, void *object);
+struct pool_thread *pool_thread_get(void); //Caches des aktuellen Threads, bei Bedarf anlegen
+void pool_thread_exit(void *data); //Destruktor von pool_key
+int pool_refill(enum pool_id id, struct pool_cache *cache); //aus dem Vorrat oder einem neuen Slab nachfüllen
+void pool_flush(enum pool_id id, struct pool_cache *cache, long keep); //Objekte über keep an den Vorrat geben
+int buffer_pool(size_t size); //kleinste Größenklasse für size, -1 = zu groß
+int body_reserve(struct request *request, size_t needed); //Speicherpuffer einer SEND-Anfrage vergrößern
+int append_body(struct request *request, const char *data, size_t len); //in Speicherpuffer oder body_file, Wörter sammeln
+void release_body(struct request *request); //Speicherpuffer zurückgeben
+void start_tokens(struct request *request); //Wörter von Sender und Betreff, danach kommt der Text
+void release_tokens(struct request *request);
+int close_body_file(struct request *request); //fclose() und stdio-Puffer zurückgeben
+void *buffer_alloc(size_t size, int *pool); //Puffer aus dem Pool, größere direkt von malloc() (pool = -1)
+void buffer_free(void *buffer, int pool);
+struct zlib_streams *zlib_streams_get(void); //zlib-Zustände des aktuellen Threads, bei Bedarf anlegen
+void zlib_streams_free(void *data); //Destruktor von zlib_key
+int compress_body(struct request *request, const struct compression_dictionary *dictionary); //Text komprimieren, wenn es sich lohnt
+void release_packed(struct request *request);
+char *inflate_message(int fd, off_t offset, off_t size, const struct message_entry *entry, const struct compression_dictionary *dictionary, size_t *len, int *pool); //komprimierte Nachricht lesen und entpacken
+void sample_dictionary(struct mailbox *mailbox, const char *data, size_t len); //Textanfang sammeln, Wörterbuch anlegen sobald genug da ist
+int write_dictionary(struct mailbox *mailbox, const char *data, size_t len);
+int load_dictionary(struct mailbox *mailbox, const char *dirpath);
+int write_temp_body(struct request *request); //Nachricht aus dem Speicher in tmp_<key> schreiben (--storage files, mehrere Empfänger)
+int clientCommunication(struct connection *conn); //Kommunikation mit Client (0 = auf Daten warten, 1 = auf EPOLLOUT, 2 = wieder einreihen, -1 = schließen)
+int process_input(struct connection *conn); //Eingabepuffer durch den Parser schicken
+int process_line(struct connection *conn, char *line); //Befehls- oder Feldzeile verarbeiten
+int start_request(struct connection *conn, char *line); //Befehlszeile auswerten
+void store_field(struct connection *conn, char *line); //Feld der aktuellen Anfrage speichern
+void begin_send_body(struct connection *conn); //temporäre Datei öffnen und Kopf schreiben
+void write_body(struct connection *conn, const char *data, size_t len);
+void finish_send(struct connection *conn); //Text vollständig -> zustellen und antworten
+int store_message(struct connection *conn, struct request *request); //komprimieren, Datei schreiben, zustellen (Rückgabe: -1 = ERR)
+void abort_request(struct request *request); //temporäre Datei einer unvollständigen SEND-Anfrage löschen
+void execute_request(struct connection *conn); //LIST/READ/DEL mit Mailbox-Lock ausführen
+int handle_send(struct connection *conn, struct request *request, const char *receiver, const char *blob); //SEND an einen Empfänger (Mailbox-Lock muss gehalten werden)
+int send_to_recipients(struct connection *conn, struct request *request); //SEND an mehrere Empfänger über einen gemeinsamen Blob
+int parse_recipients(struct request *request, char *line); //"bob,carol,dave" -> recipients
+int compare_recipients(const void *a, const void *b);
+void free_recipients(struct request *request);
+void body_dirpath(struct request *request, char *dirpath, size_t size); //Verzeichnis von tmp_<key>: Mailbox oder .blobs
+int create_directory(const char *path); //mkdir, neuen Eintrag im Spool bei Bedarf synchronisieren
+int store_blob(struct connection *conn, struct request *request, char *blob, size_t size); //tmp_<key> als Blob ablegen oder gleichen Blob wiederverwenden
+int file_checksum(const char *path, unsigned long *checksum); //CRC-32 einer Datei
+int same_content(const char *path, const char *other_path); //1 = gleicher Inhalt, 0 = verschieden, -1 = Fehler
+int link_blob(const char *dirpath, const char *key, const char *blob, char *file_name, size_t size); //message_<key>@<blob>.txt als Hardlink anlegen
+void release_blob(const char *blob); //Blob löschen, wenn keine Mailbox mehr darauf verweist
+void handle_list(struct connection *conn, struct request *request); //LIST
+int open_message_file(struct request *request, off_t *offset, off_t *size, struct message_entry *message, const struct compression_dictionary **dictionary); //Nachricht öffnen (Mailbox-Lock muss gehalten werden)
+int open_message_entry(struct mailbox *mailbox, const struct message_entry *entry, off_t *offset, off_t *size);
+void handle_read(struct connection *conn, int fd, off_t offset, off_t size, const struct message_entry *message, const struct compression_dictionary *dictionary); //READ
+int handle_del(struct connection *conn, struct request *request); //DEL (Mailbox-Lock muss gehalten werden)
+void handle_search(struct connection *conn, struct request *request); //SEARCH
+int load_search_index(struct mailbox *mailbox); //.index einlesen, fehlende Nachrichten nachindexieren
+void free_search_index(struct search_index *index);
+int index_message(struct mailbox *mailbox, struct search_index *index, const struct message_entry *entry); //Nachricht von der Platte lesen und aufnehmen (Nachindexieren beim Laden)
+int store_tokens(struct mailbox *mailbox, struct search_index *index, long id, const struct token_set *set); //Datensatz anhängen, geladenen Index mitführen
+int append_index_record(struct mailbox *mailbox, long id, const struct token_set *set);
+int write_search_index(struct mailbox *mailbox, const char *data, size_t len); //.index mit den übergebenen Datensätzen neu schreiben
+int search_add(struct search_index *index, const char *token, long id);
+struct posting_list *search_find(struct search_index *index, const char *token);
+void add_tokens(struct token_set *set, const char *data, size_t len); //Text in Wörter zerlegen (blockweise)
+int finish_tokens(struct token_set *set); //letztes Wort abschließen, sortieren, Duplikate entfernen
+int compare_tokens(const void *a, const void *b);
+int compare_ids(const void *a, const void *b);
+void handle_mailboxes(struct connection *conn); //MAILBOXES: Mailboxen mit Nachrichten (für den Router)
+void handle_stats(struct connection *conn); //STATS
+int scan_spool(long threads); //alle Mailboxen parallel laden und prüfen, Fortschritt ausgeben
+void *scanThread(void *data); //nimmt sich Mailboxen aus spool_scan, bis alle geprüft sind
+void scan_mailbox(const char *username); //Index laden, halbe/verwaiste Dateien in Quarantäne, Einträge ohne Nachricht entfernen
+void scan_blobs(void); //.blobs: halbe und nicht mehr referenzierte Texte in Quarantäne
+int quarantine_file(const char *directory, const char *name); //<spool>/<directory>/<name> nach <spool>/.quarantine/<directory>/ verschieben
+void drop_message_entry(struct mailbox *mailbox, int index); //Eintrag wie bei DEL entfernen (ohne Datei zu löschen)
+uint64_t stats_now(void); //monotone Zeit in Nanosekunden
+uint64_t stats_record(struct latency_histogram *histogram, uint64_t start); //Dauer seit start eintragen
+void stats_sample(struct latency_histogram *histogram, uint64_t ns);
+void stats_add(unsigned long *counter, unsigned long value);
+unsigned long histogram_percentile(const struct latency_histogram *histogram, double percentile); //Obergrenze des Buckets in ns
+void merge_histogram(struct latency_histogram *total, const struct latency_histogram *histogram);
+void write_histogram(FILE *out, const char *kind, const char *name, const struct latency_histogram *histogram);
+int write_stats(FILE *out); //Summe über alle Worker schreiben, Rückgabe: Anzahl Zeilen
+int write_pool_stats(FILE *out); //Belegung der Pools, Rückgabe: Anzahl Zeilen
+void *statsThread(void *data); //schreibt alle stats_interval Sekunden nach stats_file
+int open_replication_log(void); //Segmente einlesen, Index aufbauen, unvollständigen letzten Datensatz abschneiden
+int open_replication_segment(unsigned int number, int flags); //<spool>/.replog.<number> öffnen
+void add_replication_mark(uint64_t seq, unsigned int segment, off_t offset); //Eintrag im Index seq -> Position (mutex gehalten)
+int rotate_replication_log(void); //neues aktives Segment beginnen (mutex gehalten)
+void trim_replication_log(void); //bestätigte Segmente über --replication-retain hinaus löschen
+int log_message(struct connection *conn, struct request *request, struct mailbox *mailbox, const struct message_entry *entry); //zugestellte Nachricht ins Log
+int log_replication(struct connection *conn, struct request *request, uint32_t type, const char *username, long id, const char *data, size_t len); //Datensatz anhängen und Sender wecken
+int open_replication_listener(void); //--replication-port
+void *replicationThread(void *data); //nimmt Follower an
+void *senderThread(void *data); //streamt das Log ab der angefragten Nummer an einen Follower
+int find_replication_offset(uint64_t seq, unsigned int *segment, off_t *offset); //Segment und Position des ersten Datensatzes >= seq, Rückgabe: fd
+void reject_follower(int socket, uint64_t seq); //angefragte Nummer nicht im Log: REJECT schicken
+void read_acks(int slot, int socket, char *buffer, size_t *len); //Bestätigungen des Followers ohne Blockieren abholen
+void stop_replication(pthread_t replication_thread, pthread_t follower_thread); //Replikations-Threads beenden
+void *followerThread(void *data); //holt das Log vom Primary und wendet es an
+int connect_primary(void);
+int apply_record(struct connection *conn, const struct replication_record *record, char *payload); //Datensatz im eigenen Spool ausführen
+int recv_all(int socket, void *data, size_t len);
 
 int main(int argc, char **argv)
 {
-    struct sockaddr_in address, cliaddress; //Strukturen für Server- und Client-Adressen
-    socklen_t addrlen; //Länge der Adresse
-    int reuseValue = 1; //Option für Wiederverwenden von Adressen
+    long worker_count = sysconf(_SC_NPROCESSORS_ONLN); //Standard: ein Worker pro CPU
+    int opt;
+
+    static struct option long_options[] = {
+        { "workers", required_argument, NULL, 'w' },
+        { "stats-file", required_argument, NULL, 's' },
+        { "stats-interval", required_argument, NULL, 'i' },
+        { "storage", required_argument, NULL, 'S' },
+        { "durability", required_argument, NULL, 'D' },
+        { "commit-interval", required_argument, NULL, 'I' },
+        { "commit-batch", required_argument, NULL, 'B' },
+        { "io", required_argument, NULL, 'o' },
+        { "io-threads", required_argument, NULL, 't' },
+        { "compress", required_argument, NULL, 'z' },
+        { "compress-passthrough", no_argument, NULL, 'P' },
+        { "listeners", required_argument, NULL, 'l' },
+        { "backlog", required_argument, NULL, 'b' },
+        { "pin-cpus", no_argument, NULL, 'c' },
+        { "drain-timeout", required_argument, NULL, 'd' },
+        { "replication-port", required_argument, NULL, 'r' },
+        { "replication-retain", required_argument, NULL, 'R' },
+        { "follow", required_argument, NULL, 'f' },
+        { "scan-threads", required_argument, NULL, 'T' },
+        { "accept-ids", no_argument, NULL, 'A' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    //Optionen parsen (Worker, Statistik, Speicher, Dauerhaftigkeit, I/O, Komprimierung, Listen-Sockets, Replikation, Start-Scan, feste ids):
+    while ((opt = getopt_long(argc, argv, "w:s:i:S:D:I:B:o:t:z:Pl:b:cd:r:R:f:T:A", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'w':
+            worker_count = strtol(optarg, NULL, 10);
+            if (worker_count < 1) {
+                fprintf(stderr, "Invalid worker count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            snprintf(stats_file, sizeof(stats_file), "%s", optarg);
+            break;
+        case 'i':
+            stats_interval = strtol(optarg, NULL, 10);
+            if (stats_interval < 1) {
+                fprintf(stderr, "Invalid stats interval: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'S':
+            if (strcmp(optarg, "files") == 0) {
+                storage_mode = STORAGE_FILES;
+            } else if (strcmp(optarg, "segments") == 0) {
+                storage_mode = STORAGE_SEGMENTS;
+            } else {
+                fprintf(stderr, "Invalid storage backend: %s (expected files or segments)\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'D':
+            if (strcmp(optarg, "none") == 0) {
+                durability_mode = DURABILITY_NONE;
+            } else if (strcmp(optarg, "fsync") == 0) {
+                durability_mode = DURABILITY_FSYNC;
+            } else if (strcmp(optarg, "group") == 0) {
+                durability_mode = DURABILITY_GROUP;
+            } else {
+                fprintf(stderr, "Invalid durability mode: %s (expected none, fsync or group)\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'I':
+            commit_interval_ms = strtol(optarg, NULL, 10);
+            if (commit_interval_ms < 0) {
+                fprintf(stderr, "Invalid commit interval: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'B':
+            commit_batch = atoi(optarg);
+            if (commit_batch < 1) {
+                fprintf(stderr, "Invalid commit batch size: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'o':
+            if (strcmp(optarg, "sync") == 0) {
+                io_backend = IO_BACKEND_SYNC;
+            } else if (strcmp(optarg, "uring") == 0) {
+                io_backend = IO_BACKEND_URING;
+            } else if (strcmp(optarg, "threads") == 0) {
+                io_backend = IO_BACKEND_THREADS;
+            } else {
+                fprintf(stderr, "Invalid I/O backend: %s (expected sync, uring or threads)\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 't':
+            io_thread_count = strtol(optarg, NULL, 10);
+            if (io_thread_count < 1) {
+                fprintf(stderr, "Invalid I/O thread count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'z':
+            if (strcmp(optarg, "none") == 0) {
+                compress_bodies = 0;
+            } else if (strcmp(optarg, "deflate") == 0) {
+                compress_bodies = 1;
+            } else {
+                fprintf(stderr, "Invalid compression: %s (expected none or deflate)\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'P':
+            compress_passthrough = 1;
+            break;
+        case 'l':
+            loop_count = strcmp(optarg, "auto") == 0 ? sysconf(_SC_NPROCESSORS_ONLN) : strtol(optarg, NULL, 10); //auto = ein Listener pro CPU
+            if (loop_count < 1) {
+                fprintf(stderr, "Invalid listener count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'b':
+            listen_backlog = atoi(optarg);
+            if (listen_backlog < 1) {
+                fprintf(stderr, "Invalid listen backlog: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'c':
+            pin_cpus = 1;
+            break;
+        case 'd':
+            drain_timeout = strtol(optarg, NULL, 10);
+            if (drain_timeout < 0) {
+                fprintf(stderr, "Invalid drain timeout: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'r':
+            replication_port = atoi(optarg);
+            if (replication_port < 1 || replication_port > 65535) {
+                fprintf(stderr, "Invalid replication port: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'R': {
+            char *end;
+            long retain = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || retain < 0) {
+                fprintf(stderr, "Invalid replication retention: %s (expected MB)\n", optarg);
+                return EXIT_FAILURE;
+            }
+            replication_retain = (off_t)retain * 1024 * 1024;
+            break;
+        }
+        case 'f': {
+            const char *colon = strrchr(optarg, ':');
+            if (!colon || colon == optarg || colon[1] == '\0' || (size_t)(colon - optarg) >= sizeof(follow_host) || strlen(colon + 1) >= sizeof(follow_port)) {
+                fprintf(stderr, "Invalid primary address: %s (expected host:port)\n", optarg);
+                return EXIT_FAILURE;
+            }
+            snprintf(follow_host, sizeof(follow_host), "%.*s", (int)(colon - optarg), optarg);
+            snprintf(follow_port, sizeof(follow_port), "%s", colon + 1);
+            break;
+        }
+        case 'T':
+            scan_thread_count = strtol(optarg, NULL, 10);
+            if (scan_thread_count < 0) {
+                fprintf(stderr, "Invalid scan thread count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'A':
+            accept_ids = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [--workers N] [--stats-file PATH] [--stats-interval SEC] [--storage files|segments] [--durability none|fsync|group] [--commit-interval MS] [--commit-batch N] [--io sync|uring|threads] [--io-threads N] [--compress none|deflate] [--compress-passthrough] [--listeners N|auto] [--backlog N] [--pin-cpus] [--drain-timeout SEC] [--replication-port PORT] [--replication-retain MB] [--follow HOST:PORT] [--scan-threads N] [--accept-ids] <port> <mail-spool-directory>\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (worker_count < 1) {
+        worker_count = 1;
+    }
 
-    if (argc < 3) { //Mind. 3 Argumente: Programmname, Port, Mail-Spool-Verzeichnis
-        fprintf(stderr, "Usage: %s <port> <mail-spool-directory>\n", argv[0]);
+    if (argc - optind < 2) { //Port und Mail-Spool-Verzeichnis müssen angegeben werden
+        fprintf(stderr, "Usage: %s [--workers N] [--stats-file PATH] [--stats-interval SEC] [--storage files|segments] [--durability none|fsync|group] [--commit-interval MS] [--commit-batch N] [--io sync|uring|threads] [--io-threads N] [--compress none|deflate] [--compress-passthrough] [--listeners N|auto] [--backlog N] [--pin-cpus] [--drain-timeout SEC] [--replication-port PORT] [--replication-retain MB] [--follow HOST:PORT] [--scan-threads N] [--accept-ids] <port> <mail-spool-directory>\n", argv[0]);
         return EXIT_FAILURE;
     }
 
-    int port = atoi(argv[1]); //Portnummer aus Argument holen
-    strcpy(mail_spool_directory, argv[2]); //Mail-Spool-Verzeichnis übernehmen
+    int port = atoi(argv[optind]); //Portnummer aus Argument holen
+    strcpy(mail_spool_directory, argv[optind + 1]); //Mail-Spool-Verzeichnis übernehmen
 
     //Verzeichnis öffnen oder erstellen falls es nicht existiert:
     DIR *dir = opendir(mail_spool_directory);
@@ -54,353 +1036,5786 @@ int main(int argc, char **argv)
         closedir(dir);
     }
 
-    // Signal handler für SIGINT:
-    if (signal(SIGINT, signalHandler) == SIG_ERR) {
-        perror("Signal cannot be registered");
+    //Replikations-Log: der Primary schreibt jede Änderung hinein, der Follower dieselben Datensätze
+    //(so kann ein Follower zum Primary werden und selbst Follower bedienen):
+    if ((replication_port || follow_host[0]) && open_replication_log() == -1) {
         return EXIT_FAILURE;
     }
 
-    //Socket erstellen
-    if ((create_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        perror("Socket error");
+    // Signal handler für SIGINT (sofort beenden), SIGTERM (Drain) und SIGHUP (Drain + Neustart):
+    if (signal(SIGINT, signalHandler) == SIG_ERR || signal(SIGTERM, signalHandler) == SIG_ERR || signal(SIGHUP, signalHandler) == SIG_ERR) {
+        perror("Signal cannot be registered");
         return EXIT_FAILURE;
     }
+    signal(SIGPIPE, SIG_IGN); //Abgebrochene Clients sollen den Server nicht beenden
 
-    //Setzen der Socket-Optionen, um Adresse und Port wiederzuverwenden:
-    if (setsockopt(create_socket, SOL_SOCKET, SO_REUSEADDR, &reuseValue, sizeof(reuseValue)) == -1) {
-        perror("Set socket options - reuseAddr");
-        return EXIT_FAILURE;
+    //Mailbox-Locks initialisieren:
+    for (int i = 0; i < MAILBOX_LOCK_SHARDS; i++) {
+        pthread_rwlock_init(&mailbox_locks[i], NULL);
     }
 
-    //Initialisieren der Serveradresse:
-    memset(&address, 0, sizeof(address));
-    address.sin_family = AF_INET; //Adressfamilie (IPv4)
-    address.sin_addr.s_addr = INADDR_ANY; //Akzeptiert Verbindungen von jeder IP
-    address.sin_port = htons(port); //Portnummer
-
-    // Binden der Adresse an Socket:
-    if (bind(create_socket, (struct sockaddr *)&address, sizeof(address)) == -1) {
-        perror("Bind error");
-        return EXIT_FAILURE;
+    //Limit für offene Dateien anheben, damit viele Verbindungen möglich sind:
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
     }
 
-    //Warten auf eingehende Verbindungen (max. 5 gleichzeitig):
-    if (listen(create_socket, 5) == -1) {
-        perror("Listen error");
+    //Ein Listen-Socket pro Event-Loop, alle auf demselben Port (nach SIGHUP: die des vorherigen Prozesses):
+    const char *listen_fds = getenv(LISTEN_FDS_ENV);
+    if (listen_fds) {
+        int count = 1;
+        for (const char *c = listen_fds; *c; c++) {
+            count += *c == ',';
+        }
+        loop_count = count; //Anzahl ergibt sich aus den übernommenen Sockets
+    }
+    loops = aligned_alloc(64, sizeof(struct event_loop) * loop_count);
+    if (!loops || (wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        perror("Failed to allocate event loops");
         return EXIT_FAILURE;
     }
+    memset(loops, 0, sizeof(struct event_loop) * loop_count);
+    for (long i = 0; i < loop_count; i++) {
+        loops[i].listen_fd = -1;
+        loops[i].cpu = pin_cpus ? loop_cpu(i) : -1;
+        pthread_mutex_init(&loops[i].mutex, NULL);
+    }
+    if (listen_fds) {
+        if (adopt_listeners(listen_fds) == -1) {
+            return EXIT_FAILURE;
+        }
+        unsetenv(LISTEN_FDS_ENV);
+        printf("Took over %ld listening sockets from the previous process\n", loop_count);
+    }
+    for (long i = 0; i < loop_count; i++) {
+        if (open_listener(&loops[i], port) == -1) {
+            return EXIT_FAILURE;
+        }
+    }
 
-    while (!abortRequested) {
-        int *new_socket = malloc(sizeof(int)); //Speicher für neuen Socket allokieren
-        addrlen = sizeof(struct sockaddr_in);
-        *new_socket = accept(create_socket, (struct sockaddr *)&cliaddress, &addrlen);
+    //Worker-Pool starten, Signale sollen nur im Event-Loop des Haupt-Threads ankommen:
+    pthread_key_create(&pool_key, pool_thread_exit);
+    pthread_key_create(&zlib_key, zlib_streams_free);
 
-        if (*new_socket == -1) {
-            if (abortRequested) {
-                perror("Accept error after aborted");
-            } else {
-                perror("Accept error");
+    //Spool prüfen, bevor Befehle angenommen werden (neue Verbindungen warten solange in der Warteschlange):
+    if (scan_thread_count != 0 && scan_spool(scan_thread_count > 0 ? scan_thread_count : sysconf(_SC_NPROCESSORS_ONLN)) == -1) {
+        return EXIT_FAILURE;
+    }
+    pthread_t *workers = malloc(sizeof(pthread_t) * worker_count);
+    worker_stats = aligned_alloc(64, sizeof(struct worker_stats) * (worker_count + 1)); //+1: Follower-Thread
+    worker_stats_count = worker_count + (follow_host[0] != '\0');
+    start_time = time(NULL);
+    if (!workers || !worker_stats) {
+        perror("Failed to allocate worker pool");
+        return EXIT_FAILURE;
+    }
+    memset(worker_stats, 0, sizeof(struct worker_stats) * (worker_count + 1));
+    sigset_t block_set, old_set;
+    sigemptyset(&block_set);
+    sigaddset(&block_set, SIGINT);
+    sigaddset(&block_set, SIGTERM);
+    sigaddset(&block_set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &block_set, &old_set);
+    for (long i = 0; i < worker_count; i++) {
+        if (pthread_create(&workers[i], NULL, workerThread, (void *)i) != 0) {
+            perror("Failed to create worker thread");
+            return EXIT_FAILURE;
+        }
+    }
+    pthread_t compaction_thread, stats_thread, commit_thread;
+    pthread_t *io_threads = NULL;
+    pthread_key_create(&io_ring_key, io_ring_free);
+    if (io_backend == IO_BACKEND_URING && !io_uring_available()) {
+        fprintf(stderr, "io_uring is not available, falling back to --io threads\n");
+        io_backend = IO_BACKEND_THREADS;
+    }
+    if (io_backend == IO_BACKEND_THREADS) {
+        io_threads = malloc(sizeof(pthread_t) * io_thread_count);
+        if (!io_threads) {
+            perror("Failed to allocate I/O pool");
+            return EXIT_FAILURE;
+        }
+        for (long i = 0; i < io_thread_count; i++) {
+            if (pthread_create(&io_threads[i], NULL, ioThread, NULL) != 0) {
+                perror("Failed to create I/O thread");
+                return EXIT_FAILURE;
             }
-            free(new_socket);
-            break;
         }
-        printf("Client connected from %s:%d...\n", inet_ntoa(cliaddress.sin_addr), ntohs(cliaddress.sin_port));
-        
-        pthread_t thread;
-        pthread_create(&thread, NULL, clientCommunication, new_socket); //Thread erstellen
-        pthread_detach(thread); //Thread als detached markieren
+    }
+    if (durability_mode == DURABILITY_GROUP) {
+        spool_fd = open(mail_spool_directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (durability_mode == DURABILITY_GROUP && pthread_create(&commit_thread, NULL, commitThread, NULL) != 0) {
+        perror("Failed to create commit thread");
+        return EXIT_FAILURE;
+    }
+    if (pthread_create(&compaction_thread, NULL, compactionThread, NULL) != 0) {
+        perror("Failed to create compaction thread");
+        return EXIT_FAILURE;
+    }
+    if (stats_file[0] != '\0' && pthread_create(&stats_thread, NULL, statsThread, NULL) != 0) {
+        perror("Failed to create stats thread");
+        return EXIT_FAILURE;
+    }
+    pthread_t replication_thread, follower_thread;
+    if (replication_port && (open_replication_listener() == -1 || pthread_create(&replication_thread, NULL, replicationThread, NULL) != 0)) {
+        perror("Failed to start replication");
+        return EXIT_FAILURE;
+    }
+    if (follow_host[0] && pthread_create(&follower_thread, NULL, followerThread, (void *)worker_count) != 0) {
+        perror("Failed to create follower thread");
+        return EXIT_FAILURE;
+    }
+    for (long i = 1; i < loop_count; i++) {
+        if (pthread_create(&loops[i].thread, NULL, loopThread, &loops[i]) != 0) {
+            perror("Failed to create event loop thread");
+            return EXIT_FAILURE;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+    const char *io_names[] = { "sync", "uring", "threads" };
+    printf("Server listening on port %d with %ld listeners and %ld worker threads (%s storage, %s I/O%s)...\n", port, loop_count, worker_count, storage_mode == STORAGE_SEGMENTS ? "segment" : "file", io_names[io_backend], compress_bodies ? ", deflate" : "");
+    if (replication_port) {
+        printf("Accepting followers on port %d (replication log at seq %llu)\n", replication_port, (unsigned long long)replication.seq);
+    }
+    if (follow_host[0]) {
+        printf("Following primary %s:%s from seq %llu (read-only)\n", follow_host, follow_port, (unsigned long long)replication.seq + 1);
+    }
+    pin_thread(loops[0].cpu);
+    run_event_loop(&loops[0]);
+    for (long i = 1; i < loop_count; i++) {
+        pthread_join(loops[i].thread, NULL); //wurden über wake_fd geweckt
     }
 
-    //Socket schließen, wenn das Programm beendet wird:
-    if (create_socket != -1) {
-        if (shutdown(create_socket, SHUT_RDWR) == -1) {
+    //Listen-Sockets schließen, damit keine neuen Verbindungen mehr angenommen werden
+    //(beim Neustart bleiben sie offen, neue Verbindungen warten in der Warteschlange auf den neuen Prozess):
+    for (long i = 0; i < loop_count && !restartRequested; i++) {
+        if (shutdown(loops[i].listen_fd, SHUT_RDWR) == -1) {
             perror("Shutdown server socket");
         }
-        if (close(create_socket) == -1) {
+        if (close(loops[i].listen_fd) == -1) {
             perror("Close server socket");
         }
-        create_socket = -1;
     }
 
-    pthread_mutex_destroy(&file_mutex); //Mutex zerstören
-    pthread_mutex_destroy(&abort_mutex); //Mutex zerstören
+    //Worker beenden:
+    pthread_mutex_lock(&jobs.mutex);
+    jobs.shutdown = 1;
+    pthread_cond_broadcast(&jobs.cond);
+    pthread_mutex_unlock(&jobs.mutex);
+    for (long i = 0; i < worker_count; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    stop_replication(replication_thread, follower_thread); //Follower-Thread wartet evtl. noch auf den Commit-Thread
+    if (durability_mode == DURABILITY_GROUP) { //erst nach den Workern: sie warten evtl. noch auf ihren Batch
+        pthread_mutex_lock(&commits.mutex);
+        commits.shutdown = 1;
+        pthread_cond_signal(&commits.cond);
+        pthread_mutex_unlock(&commits.mutex);
+        pthread_join(commit_thread, NULL);
+    }
+    pthread_mutex_lock(&compaction_mutex);
+    compaction_shutdown = 1;
+    pthread_cond_signal(&compaction_cond);
+    pthread_mutex_unlock(&compaction_mutex);
+    pthread_join(compaction_thread, NULL);
+    if (io_backend == IO_BACKEND_THREADS) { //erst nach allen Threads, die Dateioperationen einreichen
+        pthread_mutex_lock(&io_pool.mutex);
+        io_pool.shutdown = 1;
+        pthread_cond_broadcast(&io_pool.cond);
+        pthread_mutex_unlock(&io_pool.mutex);
+        for (long i = 0; i < io_thread_count; i++) {
+            pthread_join(io_threads[i], NULL);
+        }
+        free(io_threads);
+    }
+    if (stats_file[0] != '\0') {
+        pthread_mutex_lock(&stats_mutex);
+        stats_shutdown = 1;
+        pthread_cond_signal(&stats_cond);
+        pthread_mutex_unlock(&stats_mutex);
+        pthread_join(stats_thread, NULL); //schreibt vor dem Beenden einen letzten Stand
+    }
+    free(worker_stats);
+
+    //Alle Threads sind beendet: übrige Verbindungen schließen, halb empfangene Nachrichten verwerfen
+    close_all_connections();
+
+    //epoll Instanzen erst nach den Workern schließen (rearm_connection):
+    for (long i = 0; i < loop_count; i++) {
+        close(loops[i].epoll_fd);
+    }
+    close(wake_fd);
+    if (restartRequested) {
+        restart_server(argv); //kehrt nur bei einem Fehler zurück
+        return EXIT_FAILURE;
+    }
+    free(loops);
+
+    for (int i = 0; i < MAILBOX_LOCK_SHARDS; i++) {
+        pthread_rwlock_destroy(&mailbox_locks[i]); //Locks zerstören
+    }
     return EXIT_SUCCESS;
 }
 
 void signalHandler(int sig)
 {
-    if (sig == SIGINT) {
-        printf("Abort requested...\n");
-        pthread_mutex_lock(&abort_mutex); // Mutex für Zugriff auf abortRequested
-        abortRequested = 1; //Abbruchanforderung setzen
-        pthread_mutex_unlock(&abort_mutex);
-
-        if (create_socket != -1) { //Schließe Server-Socket
-            if (shutdown(create_socket, SHUT_RDWR) == -1) {
-                perror("Shutdown create_socket");
-            }
-            if (close(create_socket) == -1) {
-                perror("Close create_socket");
+    //Nur Flags setzen und wecken (async-signal-safe), die Meldungen schreibt run_event_loop:
+    if (sig == SIGINT || sig == SIGTERM || sig == SIGHUP) {
+        int saved_errno = errno;
+        if (sig == SIGINT) {
+            abortRequested = 1; //Abbruchanforderung setzen
+        } else {
+            if (sig == SIGHUP) {
+                restartRequested = 1;
             }
-            create_socket = -1;
+            drainRequested = 1;
         }
+
+        uint64_t wake = 1; //alle Event-Loops aus epoll_wait holen, die Listen-Sockets schließt main()
+        if (wake_fd != -1 && write(wake_fd, &wake, sizeof(wake)) == -1) {
+            //Zähler voll: die Loops sind ohnehin schon geweckt
+        }
+        errno = saved_errno;
     } else {
-        exit(sig); //bei anderen Signalen beenden
+        _exit(sig); //bei anderen Signalen beenden
     }
 }
 
-void *clientCommunication(void *data) //Kommunikation mit Client:
-{
-int client_socket = *((int *)data); //Socket-Deskriptor
-    free(data); //Speicher für den Socket freigeben
-
-    char buffer[BUF]; //Buffer für empfangene Nachrichten
-    int size;
-
-    //Nachrichten verarbeiten:
-    while ((size = recv(client_socket, buffer, BUF - 1, 0)) > 0) {
-        buffer[size] = '\0'; //Puffer null terminieren
-        if (strncmp(buffer, "SEND", 4) == 0) {
-            pthread_mutex_lock(&file_mutex); // Lock mutex for file operations
-            handle_send(client_socket, buffer); // Process SEND
-            pthread_mutex_unlock(&file_mutex); // Unlock mutex
-        } else if (strncmp(buffer, "LIST", 4) == 0) {
-            pthread_mutex_lock(&file_mutex); // Lock mutex for file operations
-            handle_list(client_socket, buffer); // Process LIST
-            pthread_mutex_unlock(&file_mutex); // Unlock mutex
-        } else if (strncmp(buffer, "READ", 4) == 0) {
-            pthread_mutex_lock(&file_mutex); // Lock mutex for file operations
-            handle_read(client_socket, buffer); // Process READ
-            pthread_mutex_unlock(&file_mutex); // Unlock mutex
-        } else if (strncmp(buffer, "DEL", 3) == 0) {
-            pthread_mutex_lock(&file_mutex); // Lock mutex for file operations
-            handle_del(client_socket, buffer); // Process DEL
-            pthread_mutex_unlock(&file_mutex); // Unlock mutex
-        } else if (strncmp(buffer, "QUIT", 4) == 0) {
-            break; // Exit loop if QUIT command is received
-        }
-    }
-
-    close(client_socket); // Close the client socket when done
-    return NULL;
-}
-
-void handle_send(int socket, char *buffer) {
-
-    char sender[9], receiver[9], subject[81], message[4096], filepath[PATH_BUF];
-    FILE *file;
-    
-    //Parst Sender, Empfänger und Betreff aus dem Puffer:
-    if (sscanf(buffer, "SEND\n%8s\n%8s\n%80[^\n]\n%[^\n]", sender, receiver, subject, message) != 4) {
-        fprintf(stderr, "Error: Invalid SEND format\n");
-        send(socket, "ERR\n", 4, 0); //Fehler senden
-        return;
+int open_listener(struct event_loop *loop, int port) {
+    //Übernommene Sockets (Neustart) sind schon gebunden:
+    if (loop->listen_fd == -1 && create_listener(loop, port) == -1) {
+        return -1;
     }
 
-    //Erstellt das Verzeichnis des Empfängers, falls es nicht existiert:
-    snprintf(filepath, sizeof(filepath), "%s/%s", mail_spool_directory, receiver);
-    
-    DIR *dir = opendir(filepath);
-    if (!dir) {
-        if (mkdir(filepath, 0777) == -1) {
-            perror("Failed to create inbox directory");
-            send(socket, "ERR\n", 4, 0);
-            return;
-        }
-    } else {
-        closedir(dir);
+    //epoll Instanz erstellen und Server-Socket registrieren (edge-triggered):
+    if ((loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("Epoll create error");
+        return -1;
     }
-
-    //Erstelle eine neue Nachrichtendatei mit Zeitstempel:
-    snprintf(filepath, sizeof(filepath), "%s/%s/message_%ld.txt", mail_spool_directory, receiver, (long)time(NULL));
-    
-    file = fopen(filepath, "w");
-    if (!file) {
-        perror("Failed to create message file");
-        send(socket, "ERR\n", 4, 0);
-        return;
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = loop; //der Loop selbst kennzeichnet den Server-Socket
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &event) == -1) {
+        perror("Epoll add server socket");
+        return -1;
     }
+    event.events = EPOLLIN; //level-triggered: bleibt für alle Loops lesbar
+    event.data.ptr = &wake_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) == -1) {
+        perror("Epoll add wake descriptor");
+        return -1;
+    }
+    return 0;
+}
 
-    // Schreibe Nachricht in die Datei:
-    fprintf(file, "Sender: %s\nReceiver: %s\nSubject: %s\nMessage:\n%s\n", sender, receiver, subject, message);
-    fclose(file);
+int create_listener(struct event_loop *loop, int port) {
+    struct sockaddr_in address; //Struktur für Server-Adresse
+    int reuseValue = 1; //Option für Wiederverwenden von Adressen
 
-    send(socket, "OK\n", 3, 0); //Erfolgsnachricht senden
-}
+    //Socket erstellen
+    if ((loop->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+        perror("Socket error");
+        return -1;
+    }
 
-void handle_list(int socket, char *buffer) {
-    char username[9], filepath[PATH_BUF], response[BUF];
-    struct dirent *entry;
-    DIR *dir;
-    int count = 0;
+    //Setzen der Socket-Optionen, um Adresse und Port wiederzuverwenden:
+    if (setsockopt(loop->listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuseValue, sizeof(reuseValue)) == -1) {
+        perror("Set socket options - reuseAddr");
+        return -1;
+    }
+    //Mehrere Listener: jeder Loop bindet denselben Port, der Kernel verteilt per Hash über die Sockets
+    if (loop_count > 1 && setsockopt(loop->listen_fd, SOL_SOCKET, SO_REUSEPORT, &reuseValue, sizeof(reuseValue)) == -1) {
+        perror("Set socket options - reusePort");
+        return -1;
+    }
 
-    sscanf(buffer, "LIST\n%8s", username); //Benutzername parsen
+    //Initialisieren der Serveradresse:
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET; //Adressfamilie (IPv4)
+    address.sin_addr.s_addr = INADDR_ANY; //Akzeptiert Verbindungen von jeder IP
+    address.sin_port = htons(port); //Portnummer
 
-    //Path zum Mailverzeichnis des Users erstellen:
-    int snprintf_result = snprintf(filepath, sizeof(filepath), "%s/%s", mail_spool_directory, username);
-    if (snprintf_result >= sizeof(filepath) || snprintf_result < 0) {
-        send(socket, "ERR\n", 4, 0);
-        return;
+    // Binden der Adresse an Socket:
+    if (bind(loop->listen_fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        perror("Bind error");
+        return -1;
     }
 
-    //Verzeichnis öffnen:
-    if ((dir = opendir(filepath)) == NULL) {
-        send(socket, "0\n", 2, 0);  //Kein Benutzerordner vorhanden
-        return;
+    //Warten auf eingehende Verbindungen (Warteschlange mit --backlog):
+    if (listen(loop->listen_fd, listen_backlog) == -1) {
+        perror("Listen error");
+        return -1;
     }
+    return 0;
+}
 
-    //Durchsuche das Verzeichnis nach Nachrichten
-    while ((entry = readdir(dir)) != NULL) {
-        if (strstr(entry->d_name, "message_") != NULL) {
-            count++;  //Nachrichtencounter erhöhen
-            FILE *file;
-            char message_path[PATH_BUF], line[BUF], subject[81];
+int adopt_listeners(const char *fds) {
+    const char *c = fds;
+    int accepting;
+    socklen_t len = sizeof(accepting);
 
-            //Gesamtes Verzeichnis bis Nachrichtenpfad erstellen:
-            snprintf_result = snprintf(message_path, sizeof(message_path), "%s/%s", filepath, entry->d_name);
-            if (snprintf_result >= sizeof(message_path) || snprintf_result < 0) {
-                send(socket, "ERR\n", 4, 0);
-                closedir(dir);
-                return;
-            }
-
-            //File öffnen und Betreff (subject) Line extrahieren:
-            file = fopen(message_path, "r");
-            if (file) {
-                //Sender und Empfänger überspringen:
-                fgets(line, sizeof(line), file);  //Skip sender
-                fgets(line, sizeof(line), file);  //Skip receiver
-                
-                //Dritte Zeile auslesen (Betreff):
-                fgets(subject, sizeof(subject), file);
-                subject[strcspn(subject, "\n")] = 0;  //Newline \n entfernen
-                fclose(file);
-
-                //Betreff zum Client senden:
-                snprintf_result = snprintf(response, sizeof(response), "%s\n", subject);
-                if (snprintf_result >= sizeof(response) || snprintf_result < 0) {
-                    send(socket, "ERR\n", 4, 0);
-                    closedir(dir);
-                    return;
-                }
-                send(socket, response, strlen(response), 0);  //Betreff zum Client senden
-            }
+    for (long i = 0; i < loop_count; i++) {
+        char *end;
+        long fd = strtol(c, &end, 10);
+        //Nur lauschende Sockets übernehmen, sonst stimmt die Umgebung nicht:
+        if (end == c || (*end != ',' && *end != '\0') || fd < 0 || fd > INT_MAX || getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len) == -1 || !accepting) {
+            fprintf(stderr, "Invalid listening socket in %s: %s\n", LISTEN_FDS_ENV, fds);
+            return -1;
         }
+        loops[i].listen_fd = fd;
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        c = end + 1;
     }
+    return 0;
+}
 
-    //Anzahl an Emails ausgeben:
-    snprintf_result = snprintf(response, sizeof(response), "%d\n", count);
-    if (snprintf_result >= sizeof(response) || snprintf_result < 0) {
-        send(socket, "ERR\n", 4, 0);
-        closedir(dir);
-        return;
+long close_idle_connections(struct event_loop *loop) {
+    //Nur dieser Thread holt Events aus loop->epoll_fd: eine geparkte Verbindung bleibt geparkt,
+    //solange wir die Liste durchgehen (close_connection wartet auf den Mutex)
+    pthread_mutex_lock(&loop->mutex);
+    for (struct connection *conn = loop->connections; conn; conn = conn->open_next) {
+        if (__atomic_load_n(&conn->parked, __ATOMIC_ACQUIRE) && !conn->drained && conn->state == STATE_COMMAND && conn->input_len == 0 && !conn->output_head) {
+            shutdown(conn->fd, SHUT_RDWR); //Worker sieht EOF und schließt die Verbindung
+            conn->drained = 1;
+        }
     }
-    send(socket, response, strlen(response), 0);  //Count zum Client schicken
-    closedir(dir);
-
+    long open = loop->open;
+    pthread_mutex_unlock(&loop->mutex);
+    return open;
 }
 
-void handle_read(int socket, char *buffer) {
+void close_all_connections(void) {
+    for (long i = 0; i < loop_count; i++) {
+        while (loops[i].connections) {
+            close_connection(loops[i].connections);
+        }
+    }
+}
 
-    char username[9], filepath[PATH_BUF];
-    int message_num, count = 0;
-    struct dirent *entry;
-    DIR *dir;
+int restart_server(char **argv) {
+    char fds[BUF] = "";
+    size_t len = 0;
 
-    sscanf(buffer, "READ\n%8s\n%d", username, &message_num); //Benutzername und Nachrichtennummer parsen
-    int snprintf_result = snprintf(filepath, sizeof(filepath), "%s/%s", mail_spool_directory, username);
-    if (snprintf_result >= sizeof(filepath) || snprintf_result < 0) {
-        send(socket, "ERR\n", 4, 0);
-        return;
+    //Listen-Sockets über exec() hinweg offen lassen und ihre Nummern in der Umgebung übergeben:
+    for (long i = 0; i < loop_count; i++) {
+        int snprintf_result = snprintf(fds + len, sizeof(fds) - len, "%s%d", i ? "," : "", loops[i].listen_fd);
+        if (snprintf_result >= sizeof(fds) - len || snprintf_result < 0 || fcntl(loops[i].listen_fd, F_SETFD, 0) == -1) {
+            fprintf(stderr, "Failed to pass listening sockets\n");
+            return -1;
+        }
+        len += snprintf_result;
     }
-
-    if ((dir = opendir(filepath)) == NULL) { //Fehler senden, wenn das Verzeichnis nicht existiert
-        send(socket, "ERR\n", 4, 0);
-        return;
+    if (setenv(LISTEN_FDS_ENV, fds, 1) == -1) {
+        perror("Failed to pass listening sockets");
+        return -1;
     }
+    printf("Restarting %s...\n", argv[0]);
+    fflush(stdout);
+    execvp(argv[0], argv); //neues Programm von der Platte, gleiche PID
+    perror("Failed to restart server");
+    return -1;
+}
 
-    while ((entry = readdir(dir)) != NULL) { //Durchsuche Verzeichnis nach gewünschter Nachricht
-        if (strstr(entry->d_name, "message_") != NULL) {
-            count++;
-            if (count == message_num) {
-                FILE *file;
-                char message_path[PATH_BUF], message[BUF];
-                snprintf_result = snprintf(message_path, sizeof(message_path), "%s/%s", filepath, entry->d_name);
-                if (snprintf_result >= sizeof(message_path) || snprintf_result < 0) {
-                    send(socket, "ERR\n", 4, 0);
-                    closedir(dir);
-                    return;
-                }
+void *loopThread(void *data) {
+    struct event_loop *loop = data;
 
-                file = fopen(message_path, "r");
-                if (!file) {
-                    send(socket, "ERR\n", 4, 0);
-                    closedir(dir);
-                    return;
-                }
+    pin_thread(loop->cpu);
+    run_event_loop(loop);
+    return NULL;
+}
 
-                //Nachricht Zeile für Zeile senden:
-                while (fgets(message, sizeof(message), file)) {
-                    send(socket, message, strlen(message), 0);
-                }
+int loop_cpu(long index) {
+    cpu_set_t allowed;
 
-                fclose(file);
-                closedir(dir);
-                send(socket, "OK\n", 3, 0); //Erfolgsnachricht senden
-                return;
-            }
+    //Nur CPUs aus der Affinitätsmaske des Prozesses (z.B. taskset, cgroups):
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1 || CPU_COUNT(&allowed) == 0) {
+        return -1;
+    }
+    long n = index % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && n-- == 0) {
+            return cpu;
         }
     }
-
-    send(socket, "ERR\n", 4, 0);
-    closedir(dir);
-
+    return -1;
 }
 
-void handle_del(int socket, char *buffer) {
-
-    char username[9], filepath[PATH_BUF];
-    int message_num, count = 0;
-    struct dirent *entry;
-    DIR *dir;
+void pin_thread(int cpu) {
+    cpu_set_t set;
 
-    sscanf(buffer, "DEL\n%8s\n%d", username, &message_num); //Benutzername und Nachrichtennummer parsen
-    int snprintf_result = snprintf(filepath, sizeof(filepath), "%s/%s", mail_spool_directory, username);
-    if (snprintf_result >= sizeof(filepath) || snprintf_result < 0) {
-        send(socket, "ERR\n", 4, 0); //Fehler senden, wenn das Verzeichnis nicht existiert
+    if (cpu < 0) {
         return;
     }
-
-    if ((dir = opendir(filepath)) == NULL) {
-        send(socket, "ERR\n", 4, 0);
-        return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int result = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (result != 0) {
+        errno = result;
+        perror("Failed to pin event loop");
     }
+}
 
-    //Durchsuche das Verzeichnis nach der zu löschenden Nachricht:
+void run_event_loop(struct event_loop *loop) {
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t drain_deadline = 0;
+
+    while (!abortRequested) {
+        if (drainRequested) {
+            if (!drain_deadline) { //keine neuen Verbindungen mehr annehmen, der Socket selbst bleibt offen
+                if (loop == &loops[0]) {
+                    printf(restartRequested ? "Restart requested, draining connections...\n" : "Shutdown requested, draining connections...\n");
+                }
+                epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->listen_fd, NULL);
+                drain_deadline = stats_now() + drain_timeout * 1000000000ULL;
+            }
+            //Fertig, wenn alle Verbindungen zu sind (Rest schließt main() nach dem Timeout):
+            if (close_idle_connections(loop) == 0 || stats_now() >= drain_deadline) {
+                break;
+            }
+        }
+        int ready = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, drainRequested ? DRAIN_POLL_MS : -1);
+        if (ready == -1) {
+            if (errno != EINTR) { //EINTR bei SIGINT -> Schleifenbedingung prüfen
+                perror("Epoll wait error");
+                break;
+            }
+            continue;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == loop) {
+                accept_connections(loop); //Server-Socket bereit
+            } else if (events[i].data.ptr == &wake_fd) {
+                epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, wake_fd, NULL); //bleibt lesbar: nur einmal pro Loop melden
+            } else {
+                struct connection *conn = events[i].data.ptr;
+                __atomic_store_n(&conn->parked, 0, __ATOMIC_RELAXED);
+                job_queue_push(conn); //Client bereit -> an Worker übergeben
+            }
+        }
+    }
+    if (abortRequested && loop == &loops[0]) {
+        printf("Abort requested...\n");
+    }
+}
+
+void accept_connections(struct event_loop *loop) {
+    struct sockaddr_in cliaddress;
+    socklen_t addrlen;
+
+    //Edge-triggered: so lange annehmen, bis keine Verbindung mehr wartet
+    while (!abortRequested && !drainRequested) {
+        addrlen = sizeof(struct sockaddr_in);
+        int new_socket = accept4(loop->listen_fd, (struct sockaddr *)&cliaddress, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_socket == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                if (abortRequested) {
+                    perror("Accept error after aborted");
+                } else {
+                    perror("Accept error");
+                }
+            }
+            return;
+        }
+        printf("Client connected from %s:%d...\n", inet_ntoa(cliaddress.sin_addr), ntohs(cliaddress.sin_port));
+
+        struct connection *conn = pool_alloc(POOL_CONNECTION);
+        if (!conn) {
+            perror("Failed to allocate connection");
+            close(new_socket);
+            continue;
+        }
+        stats_add(&loop->connections_accepted, 1);
+        memset(conn, 0, offsetof(struct connection, input)); //Eingabepuffer muss nicht genullt werden
+        conn->fd = new_socket;
+        conn->loop = loop;
+        conn->parked = 1;
+        conn->state = STATE_COMMAND;
+
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+        event.data.ptr = conn;
+        pthread_mutex_lock(&loop->mutex);
+        conn->open_next = loop->connections;
+        if (loop->connections) {
+            loop->connections->open_prev = conn;
+        }
+        loop->connections = conn;
+        loop->open++;
+        pthread_mutex_unlock(&loop->mutex);
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, new_socket, &event) == -1) {
+            perror("Epoll add client socket");
+            close_connection(conn);
+        }
+    }
+}
+
+void job_queue_push(struct connection *conn) {
+    pthread_mutex_lock(&jobs.mutex);
+    conn->next = NULL;
+    if (jobs.tail) {
+        jobs.tail->next = conn;
+    } else {
+        jobs.head = conn;
+    }
+    jobs.tail = conn;
+    pthread_cond_signal(&jobs.cond); //einen wartenden Worker wecken
+    pthread_mutex_unlock(&jobs.mutex);
+}
+
+struct connection *job_queue_pop(void) {
+    pthread_mutex_lock(&jobs.mutex);
+    while (!jobs.head && !jobs.shutdown) {
+        pthread_cond_wait(&jobs.cond, &jobs.mutex);
+    }
+    struct connection *conn = jobs.head;
+    if (conn) {
+        jobs.head = conn->next;
+        if (!jobs.head) {
+            jobs.tail = NULL;
+        }
+        conn->next = NULL;
+    }
+    pthread_mutex_unlock(&jobs.mutex);
+    return conn; //NULL = Shutdown
+}
+
+void *workerThread(void *data) {
+    struct connection *conn;
+
+    worker_id = (unsigned int)(long)data;
+    stats = &worker_stats[worker_id];
+
+    while ((conn = job_queue_pop()) != NULL) {
+        //1 = Socket voll: auf EPOLLOUT warten statt den Worker zu blockieren,
+        //2 = Anteil verbraucht: andere Verbindungen zuerst (ungelesene Daten meldet epoll nicht erneut).
+        //Beim Drain nach der Antwort schließen, sobald kein Befehl mehr offen ist:
+        int result = clientCommunication(conn);
+        int stopping = abortRequested || __atomic_load_n(&jobs.shutdown, __ATOMIC_RELAXED) || (drainRequested && conn->state == STATE_COMMAND);
+        if (result == 2 && !stopping) {
+            job_queue_push(conn);
+            continue;
+        }
+        if (result == 2) { //beim Beenden nicht endlos neu einreihen: Antworten noch zu Ende schreiben, sonst schließen
+            result = conn->output_head ? 1 : -1;
+        }
+        if ((result == 1 || (result == 0 && !(drainRequested && conn->state == STATE_COMMAND && conn->input_len == 0))) && rearm_connection(conn) == 0) {
+            continue; //Verbindung bleibt offen, wartet auf neue Daten bzw. Platz im Socket
+        }
+        close_connection(conn);
+    }
+    return NULL;
+}
+
+int rearm_connection(struct connection *conn) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    //Wartende Ausgabe: nur Schreibbereitschaft (ohne EPOLLRDHUP, ein halb geschlossener Client liest evtl. noch)
+    event.events = conn->output_head ? EPOLLOUT | EPOLLET | EPOLLONESHOT : EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+    event.data.ptr = conn;
+    __atomic_store_n(&conn->parked, 1, __ATOMIC_RELEASE); //vor epoll_ctl: danach gehört die Verbindung wieder dem Event-Loop
+    if (epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) == -1) {
+        perror("Epoll rearm client socket");
+        return -1;
+    }
+    return 0;
+}
+
+void close_connection(struct connection *conn) {
+    struct event_loop *loop = conn->loop;
+
+    //Zuerst austragen: close_idle_connections greift danach nicht mehr auf conn zu
+    pthread_mutex_lock(&loop->mutex);
+    if (conn->open_prev) {
+        conn->open_prev->open_next = conn->open_next;
+    } else {
+        loop->connections = conn->open_next;
+    }
+    if (conn->open_next) {
+        conn->open_next->open_prev = conn->open_prev;
+    }
+    loop->open--;
+    pthread_mutex_unlock(&loop->mutex);
+
+    abort_request(&conn->request); //Abbruch mitten in SEND: keine halbe Nachricht zurücklassen
+    free_output(conn);
+    for (int i = 0; i < conn->sync_count; i++) {
+        close(conn->sync_fds[i]);
+    }
+    free(conn->sync_fds);
+    close(conn->fd); //entfernt den Socket automatisch aus epoll
+    pool_free(POOL_CONNECTION, conn);
+    __atomic_fetch_add(&connections_closed, 1, __ATOMIC_RELAXED); //mehrere Worker schreiben
+}
+
+int output_append(struct connection *conn, const char *data, size_t len) {
+    while (len > 0) {
+        struct output_chunk *chunk = conn->output_tail;
+        if (!chunk || chunk->len == chunk->capacity) { //Puffer wächst blockweise, nichts wird umkopiert
+            //Kurze Antworten bleiben in 512 Bytes, lange LIST-Ausgaben wachsen bis 16 KB pro Block:
+            enum pool_id id = !chunk ? POOL_BUFFER_512 : chunk->pool < POOL_BUFFER_16K ? chunk->pool + 1 : POOL_BUFFER_16K;
+            chunk = pool_alloc(id);
+            if (!chunk) {
+                conn->output_failed = 1;
+                return -1;
+            }
+            chunk->next = NULL;
+            chunk->len = 0;
+            chunk->capacity = pools[id].size - offsetof(struct output_chunk, data);
+            chunk->pool = id;
+            chunk->fd = -1;
+            if (conn->output_tail) {
+                conn->output_tail->next = chunk;
+            } else {
+                conn->output_head = chunk;
+            }
+            conn->output_tail = chunk;
+        }
+
+        size_t space = chunk->capacity - chunk->len;
+        size_t part = len < space ? len : space;
+        memcpy(chunk->data + chunk->len, data, part);
+        chunk->len += part;
+        conn->output_bytes += part;
+        data += part;
+        len -= part;
+    }
+    return 0;
+}
+
+int output_printf(struct connection *conn, const char *format, ...) {
+    char line[BUF];
+    va_list args;
+
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length < 0 || length >= (int)sizeof(line)) {
+        conn->output_failed = 1;
+        return -1;
+    }
+    return output_append(conn, line, length);
+}
+
+int flush_output(struct connection *conn) {
+    struct iovec iov[IOV_MAX];
+
+    //Keine Antwort verlässt den Server, bevor die vorherigen SEND/DEL dauerhaft sind:
+    if (conn->sync_count > 0 && commit_wait(conn) == -1) {
+        free_output(conn);
+        return -1; //Client bekommt kein OK, Verbindung wird geschlossen
+    }
+    if (!conn->output_head) {
+        return 0; //nichts zu senden
+    }
+    uint64_t start = stats_now();
+    while (conn->output_head) {
+        if (conn->output_head->fd != -1) {
+            int result = send_file_chunk(conn, conn->output_head);
+            if (result != 0) {
+                stats_record(&stats->timers[TIMER_SEND], start);
+                if (result == -1) {
+                    free_output(conn);
+                }
+                return result;
+            }
+            struct output_chunk *done = conn->output_head;
+            conn->output_head = done->next;
+            close(done->fd);
+            conn->output_files--;
+            pool_free(done->pool, done);
+            continue;
+        }
+
+        //Alle Datenblöcke bis zum nächsten Dateiblock mit einem writev() übergeben:
+        int count = 0;
+        for (struct output_chunk *chunk = conn->output_head; chunk && chunk->fd == -1 && count < IOV_MAX; chunk = chunk->next) {
+            iov[count].iov_base = chunk->data + (count == 0 ? conn->output_sent : 0);
+            iov[count].iov_len = chunk->len - (count == 0 ? conn->output_sent : 0);
+            count++;
+        }
+
+        ssize_t written = writev(conn->fd, iov, count);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            stats_record(&stats->timers[TIMER_SEND], start);
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1; //Socket voll: Rest bleibt in conn, Worker wartet nicht
+            }
+            free_output(conn);
+            return -1;
+        }
+        stats_add(&stats->bytes_sent, written);
+        conn->output_bytes -= written;
+
+        //Vollständig gesendete Blöcke freigeben:
+        while (conn->output_head && conn->output_head->fd == -1 && written >= (ssize_t)(conn->output_head->len - conn->output_sent)) {
+            written -= conn->output_head->len - conn->output_sent;
+            conn->output_sent = 0;
+            struct output_chunk *done = conn->output_head;
+            conn->output_head = done->next;
+            pool_free(done->pool, done);
+        }
+        conn->output_sent += written;
+    }
+    conn->output_tail = NULL;
+    stats_record(&stats->timers[TIMER_SEND], start);
+    return 0;
+}
+
+int send_file_chunk(struct connection *conn, struct output_chunk *chunk) {
+    while (chunk->offset < chunk->end) {
+        ssize_t sent;
+        if (!chunk->copy) {
+            //Zero-Copy: Kernel kopiert direkt vom Page Cache in den Socket
+            sent = sendfile(conn->fd, chunk->fd, &chunk->offset, chunk->end - chunk->offset);
+            if (sent == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                chunk->copy = 1; //sendfile() nicht unterstützt: ab hier blockweise kopieren
+                continue;
+            }
+        } else {
+            //Nur so viel lesen wie ein Pool-Puffer fasst, was der Socket nicht nimmt, wird später erneut gelesen:
+            char *buffer = pool_alloc(POOL_BUFFER_64K);
+            if (!buffer) {
+                return -1;
+            }
+            off_t part = chunk->end - chunk->offset < (off_t)pools[POOL_BUFFER_64K].size ? chunk->end - chunk->offset : (off_t)pools[POOL_BUFFER_64K].size;
+            sent = pread(chunk->fd, buffer, part, chunk->offset);
+            if (sent > 0) {
+                sent = send(conn->fd, buffer, sent, MSG_NOSIGNAL);
+            } else if (sent == 0) {
+                errno = EIO;
+                sent = -1;
+            }
+            pool_free(POOL_BUFFER_64K, buffer);
+            if (sent > 0) {
+                chunk->offset += sent;
+            }
+        }
+        if (sent > 0) {
+            stats_add(&stats->bytes_sent, sent);
+            conn->output_bytes -= sent;
+            continue;
+        }
+        if (sent == -1 && errno == EINTR) {
+            continue;
+        }
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 1;
+        }
+        return -1; //Fehler oder Datei wurde gekürzt
+    }
+    return 0;
+}
+
+void uncork_connection(struct connection *conn) {
+    int cork = 0;
+    if (conn->corked) {
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork)); //Uncork: Rest sofort senden
+        conn->corked = 0;
+    }
+}
+
+void free_output(struct connection *conn) {
+    while (conn->output_head) {
+        struct output_chunk *chunk = conn->output_head;
+        conn->output_head = chunk->next;
+        if (chunk->fd != -1) {
+            close(chunk->fd);
+        }
+        pool_free(chunk->pool, chunk);
+    }
+    conn->output_tail = NULL;
+    conn->output_sent = 0;
+    conn->output_bytes = 0;
+    conn->output_files = 0;
+}
+
+int send_file(struct connection *conn, int fd, off_t offset, off_t size, const char *header, size_t header_len) {
+    int cork = 1;
+
+    //TCP_CORK: vorherige Antworten, Kopf, Dateiinhalt und "OK\n" gehen in möglichst vollen Segmenten raus
+    if (!conn->corked) {
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+        conn->corked = 1;
+    }
+    if (output_append(conn, header, header_len) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    //Dateibereich als eigener Block: Reihenfolge bleibt erhalten, gesendet wird erst beim flush
+    struct output_chunk *chunk = pool_alloc(POOL_BUFFER_512);
+    if (!chunk) {
+        close(fd);
+        conn->output_failed = 1;
+        return -1;
+    }
+    chunk->next = NULL;
+    chunk->len = 0;
+    chunk->capacity = 0; //output_append hängt dahinter einen neuen Datenblock an
+    chunk->pool = POOL_BUFFER_512;
+    chunk->fd = fd;
+    chunk->copy = 0;
+    chunk->offset = offset;
+    chunk->end = offset + size;
+    conn->output_tail->next = chunk;
+    conn->output_tail = chunk;
+    conn->output_bytes += size;
+    conn->output_files++;
+
+    //"OK\n" geht mit den folgenden Antworten raus, erst dann wird uncorked
+    return output_append(conn, "OK\n", 3);
+}
+
+unsigned long hash_username(const char *username) {
+    unsigned long hash = 14695981039346656037UL; //FNV-1a Offset
+    for (const unsigned char *c = (const unsigned char *)username; *c; c++) {
+        hash ^= *c;
+        hash *= 1099511628211UL; //FNV-1a Primzahl
+    }
+    return hash;
+}
+
+pthread_rwlock_t *lock_mailbox(const char *username, int exclusive) {
+    //Verschiedene Benutzer landen (fast immer) auf verschiedenen Locks:
+    pthread_rwlock_t *lock = &mailbox_locks[hash_username(username) & (MAILBOX_LOCK_SHARDS - 1)];
+    uint64_t start = stats_now();
+    if (exclusive) {
+        pthread_rwlock_wrlock(lock);
+    } else {
+        pthread_rwlock_rdlock(lock);
+    }
+    stats_record(&stats->timers[TIMER_LOCK_WAIT], start); //Wartezeit = Konkurrenz auf diesem Lock
+    return lock;
+}
+
+int valid_username(const char *username) {
+    size_t length = strlen(username);
+    if (length < 1 || length > 8) {
+        return 0;
+    }
+    //Keine Punkte oder Schrägstriche: Name wird direkt als Verzeichnis verwendet
+    for (size_t i = 0; i < length; i++) {
+        if (!((username[i] >= 'a' && username[i] <= 'z') || (username[i] >= 'A' && username[i] <= 'Z') || (username[i] >= '0' && username[i] <= '9'))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int clientCommunication(struct connection *conn) //Kommunikation mit Client:
+{
+    ssize_t size;
+
+    //Lesen, bis der Socket leer ist (edge-triggered); der Parser arbeitet inkrementell,
+    //Befehle und Nachrichtentexte dürfen also auf beliebig viele recv() verteilt sein
+    //und ein recv() darf mehrere Befehle enthalten (Pipelining).
+    //Ist der Socket voll, bleibt der Rest der Antworten in conn (Rückgabe 1: auf EPOLLOUT warten);
+    //bis er gesendet ist, werden keine weiteren Befehle ausgeführt.
+    //Nach DISPATCH_BYTES_MAX Eingabe ist der nächste dran (Rückgabe 2), auch wenn der Client weiter pipelined:
+    size_t received = 0;
+    while (1) {
+        //Antworten aller bisherigen Befehle gemeinsam und in Reihenfolge senden:
+        int flushed = conn->output_failed ? -1 : flush_output(conn);
+        if (flushed != 0) {
+            return flushed;
+        }
+        uncork_connection(conn);
+        if (conn->closing) {
+            return -1; //QUIT oder Fehler: letzte Antwort ist raus
+        }
+        if (received >= DISPATCH_BYTES_MAX) {
+            return 2;
+        }
+
+        if (conn->input_paused) {
+            conn->input_paused = 0; //schon gelesene Befehle zuerst
+        } else {
+            size = recv(conn->fd, conn->input + conn->input_len, INPUT_BUF - conn->input_len, 0);
+            if (size == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return 0; //Alles gelesen, Verbindung bleibt offen
+                }
+                return -1;
+            }
+            if (size == 0) {
+                return -1; //Client hat die Verbindung geschlossen
+            }
+            conn->input_len += size;
+            received += size;
+            stats_add(&stats->bytes_received, size);
+        }
+
+        //Parse-Zeit = Zeit in process_input() ohne Befehlsausführung und Dateizugriffe:
+        uint64_t accounted = accounted_ns;
+        uint64_t start = stats_now();
+        if (process_input(conn) == -1) { //vollständige Befehle der Reihe nach ausführen
+            conn->closing = 1;
+        }
+        stats_sample(&stats->timers[TIMER_PARSE], stats_now() - start - (accounted_ns - accounted));
+    }
+}
+
+int process_input(struct connection *conn) {
+    char *data = conn->input;
+    size_t available = conn->input_len;
+
+    while (available > 0) {
+        //Zu viel ungesendete Antwort (z.B. gepipelinte READs an einen Client, der nicht liest):
+        //restliche Befehle erst ausführen, wenn der Ausgabepuffer leer ist
+        if (conn->state == STATE_COMMAND && (conn->output_bytes >= OUTPUT_PAUSE_BYTES || conn->output_files >= OUTPUT_PAUSE_FILES)) {
+            conn->input_paused = 1;
+            break;
+        }
+        if (conn->state == STATE_BODY_LENGTH) {
+            //Längen-Modus: Bytes ohne Zeilensuche direkt in die Datei
+            size_t chunk = available < (size_t)conn->request.body_remaining ? available : (size_t)conn->request.body_remaining;
+            write_body(conn, data, chunk);
+            data += chunk;
+            available -= chunk;
+            conn->request.body_remaining -= chunk;
+            if (conn->request.body_remaining == 0) {
+                finish_send(conn);
+            }
+            continue;
+        }
+
+        char *newline = memchr(data, '\n', available);
+        if (conn->state == STATE_BODY_LINES) {
+            if (!newline) {
+                //Unvollständige Zeile: kann nur der Abschluss sein, wenn sie mit "." beginnt
+                if (conn->request.at_line_start && data[0] == '.' && available < 3) {
+                    break; //auf den Rest der Zeile warten
+                }
+                write_body(conn, data, available);
+                conn->request.at_line_start = 0;
+                data += available;
+                available = 0;
+                break;
+            }
+
+            size_t length = newline - data + 1;
+            if (conn->request.at_line_start && (length == 2 || (length == 3 && data[1] == '\r')) && data[0] == '.') {
+                finish_send(conn); //Zeile "." beendet den Text
+            } else {
+                write_body(conn, data, length);
+                conn->request.at_line_start = 1;
+            }
+            data += length;
+            available -= length;
+            continue;
+        }
+
+        //Befehls- und Feldzeilen:
+        if (!newline) {
+            if (data != conn->input || available < INPUT_BUF) {
+                break; //auf den Rest der Zeile warten
+            }
+            //Puffer voll ohne Zeilenende: Zeile abschneiden, Rest verwerfen
+            data[INPUT_BUF - 1] = '\0';
+            if (!conn->skip_line && process_line(conn, data) == -1) {
+                return -1;
+            }
+            conn->skip_line = 1;
+            data += available;
+            available = 0;
+            break;
+        }
+
+        size_t length = newline - data + 1;
+        *newline = '\0';
+        if (newline > data && newline[-1] == '\r') {
+            newline[-1] = '\0'; //CRLF erlauben
+        }
+        int skip = conn->skip_line;
+        conn->skip_line = 0;
+        if (!skip && process_line(conn, data) == -1) {
+            return -1;
+        }
+        data += length;
+        available -= length;
+    }
+
+    //Unvollständigen Rest an den Pufferanfang schieben:
+    if (available > 0 && data != conn->input) {
+        memmove(conn->input, data, available);
+    }
+    conn->input_len = available;
+    return 0;
+}
+
+int process_line(struct connection *conn, char *line) {
+    if (conn->state == STATE_COMMAND) {
+        return start_request(conn, line);
+    }
+
+    store_field(conn, line);
+    struct request *request = &conn->request;
+    int required = request->command == CMD_SEND ? 3 : request->command == CMD_LIST ? 1 : 2;
+    if (request->fields < required) {
+        return 0; //weitere Felder folgen
+    }
+
+    if (request->command == CMD_SEND) {
+        uint64_t start = stats_now();
+        begin_send_body(conn);
+        accounted_ns += stats_record(&stats->timers[TIMER_DISK], start);
+        if (request->body_length >= 0) {
+            conn->state = STATE_BODY_LENGTH;
+            request->body_remaining = request->body_length;
+            if (request->body_remaining == 0) {
+                finish_send(conn);
+            }
+        } else {
+            conn->state = STATE_BODY_LINES;
+            request->at_line_start = 1;
+        }
+    } else {
+        execute_request(conn);
+        conn->state = STATE_COMMAND;
+    }
+    return 0;
+}
+
+int start_request(struct connection *conn, char *line) {
+    struct request *request = &conn->request;
+
+    memset(request, 0, sizeof(struct request));
+    request->body_length = -1;
+    request->list_limit = LIST_DEFAULT_LIMIT;
+
+    if (strncmp(line, "SEND", 4) == 0 && (line[4] == '\0' || line[4] == ' ')) {
+        request->command = CMD_SEND;
+        if (line[4] == ' ') { //"SEND <length>": Text ohne Punkt-Abschluss, genau <length> Bytes
+            char *end, *id;
+            request->body_length = strtol(line + 5, &end, 10);
+            if (*end == ' ') { //"SEND <length> <id>": Nachricht behält ihre Nummer (Router beim Umverteilen, nur mit --accept-ids)
+                request->replica_id = strtol(id = end + 1, &end, 10);
+                if (end == id || *end != '\0' || request->replica_id <= 0 || !accept_ids) {
+                    request->invalid = 1; //Länge stimmt: Text wird gelesen und verworfen
+                    end = id + strlen(id);
+                }
+            }
+            if (end == line + 5 || *end != '\0' || request->body_length < 0) {
+                request->body_length = 0;
+                request->invalid = 1;
+            }
+        }
+    } else if (strncmp(line, "LIST", 4) == 0 && (line[4] == '\0' || line[4] == ' ')) {
+        request->command = CMD_LIST;
+        if (line[4] == ' ') { //"LIST <offset> <limit>": nur einen Ausschnitt der Mailbox liefern
+            char extra;
+            if (sscanf(line + 5, "%ld %ld %c", &request->list_offset, &request->list_limit, &extra) != 2 || request->list_offset < 0 || request->list_limit < 0) {
+                request->invalid = 1;
+            }
+        }
+    } else if (strcmp(line, "READ") == 0) {
+        request->command = CMD_READ;
+    } else if (strcmp(line, "DEL") == 0) {
+        request->command = CMD_DEL;
+    } else if (strcmp(line, "SEARCH") == 0) {
+        request->command = CMD_SEARCH;
+    } else if (strcmp(line, "STATS") == 0) {
+        handle_stats(conn); //keine Felder, sofort beantworten
+        return 0;
+    } else if (strcmp(line, "MAILBOXES") == 0) {
+        handle_mailboxes(conn);
+        return 0;
+    } else if (strncmp(line, "CAPA", 4) == 0 && (line[4] == '\0' || line[4] == ' ')) {
+        //"CAPA deflate": Client kann zlib-Ströme selbst entpacken, Antwort nennt die genutzten Fähigkeiten
+        conn->deflate_passthrough = compress_passthrough && strstr(line + 4, " deflate") != NULL;
+        return conn->deflate_passthrough ? output_append(conn, "OK deflate\n", 11) : output_append(conn, "OK\n", 3);
+    } else if (strcmp(line, "QUIT") == 0) {
+        return -1; // Exit if QUIT command is received
+    } else {
+        if (line[0] != '\0') { //Leerzeilen zwischen Befehlen ignorieren
+            fprintf(stderr, "Error: Unknown command\n");
+            return output_append(conn, "ERR\n", 4);
+        }
+        return 0;
+    }
+
+    if (follow_host[0] && (request->command == CMD_SEND || request->command == CMD_DEL)) {
+        request->invalid = 1; //Follower: nur lesen, Änderungen kommen über das Replikations-Log
+    }
+    conn->state = STATE_FIELDS;
+    return 0;
+}
+
+void store_field(struct connection *conn, char *line) {
+    struct request *request = &conn->request;
+    int field = request->fields++;
+
+    if (request->command == CMD_SEND) { //Sender, Empfänger, Betreff
+        if (field == 0) {
+            snprintf(request->sender, sizeof(request->sender), "%s", line);
+            request->invalid |= !valid_username(line);
+        } else if (field == 1) {
+            request->invalid |= parse_recipients(request, line) == -1;
+            request->invalid |= request->replica_id && request->recipients; //feste id nur für einen Empfänger
+        } else {
+            snprintf(request->subject, sizeof(request->subject), "%s", line); //max. 80 Zeichen
+        }
+    } else if (field == 0) { //LIST/READ/DEL/SEARCH: Benutzername
+        snprintf(request->username, sizeof(request->username), "%s", line);
+        request->invalid |= !valid_username(line);
+    } else if (request->command == CMD_SEARCH) { //Suchbegriffe
+        snprintf(request->terms, sizeof(request->terms), "%s", line);
+    } else { //READ/DEL: Nachrichtennummer
+        char *end;
+        request->message_id = strtol(line, &end, 10);
+        request->invalid |= (end == line || *end != '\0');
+    }
+}
+
+void begin_send_body(struct connection *conn) {
+    struct request *request = &conn->request;
+    char dirpath[PATH_BUF];
+
+    if (request->invalid) {
+        fprintf(stderr, "Error: Invalid SEND format\n");
+        return; //Text wird nur gelesen und verworfen
+    }
+
+    //Erstellt das Verzeichnis des Empfängers (bzw. .blobs bei mehreren), falls es nicht existiert:
+    body_dirpath(request, dirpath, sizeof(dirpath));
+    if (create_directory(dirpath) == -1) {
+        request->invalid = 1;
+        return;
+    }
+
+    //Segmente: Nachricht im Speicher sammeln, beim Zustellen ein einziges Anhängen
+    //(bekannte große Texte gleich in eine Datei, unbekannte werden bei Bedarf ausgelagert).
+    //Mit --compress auch bei Dateien, komprimiert wird erst am Ende des Texts:
+    if ((storage_mode == STORAGE_SEGMENTS || compress_bodies) && request->body_length <= SEGMENT_INLINE_MAX) {
+        request->in_memory = 1;
+        if (request->body_length > 0 && body_reserve(request, request->body_length + BUF) == -1) { //Länge bekannt: passende Größenklasse
+            perror("Failed to allocate message buffer");
+            request->invalid = 1;
+            request->in_memory = 0;
+            return;
+        }
+    } else if (open_temp_body(request, dirpath) == -1) {
+        //Text wird ohne Lock in eine temporäre Datei gestreamt (Name beginnt nicht mit "message_"):
+        request->invalid = 1;
+        return;
+    }
+
+    // Schreibe Kopf der Nachricht in die Datei (mehrere Empfänger durch Komma getrennt):
+    char header[BUF + RECIPIENTS_MAX * 9], receivers[RECIPIENTS_MAX * 9];
+    size_t receivers_len = 0;
+    for (int i = 0; i < request->recipient_count; i++) {
+        receivers_len += snprintf(receivers + receivers_len, sizeof(receivers) - receivers_len, "%s%s", i ? "," : "", request->recipients[i]);
+    }
+    int header_len = snprintf(header, sizeof(header), "Sender: %s\nReceiver: %s\nSubject: %s\nMessage:\n", request->sender, request->recipients ? receivers : request->receiver, request->subject);
+    start_tokens(request);
+    if (append_body(request, header, header_len) == -1) {
+        perror("Failed to write message file");
+        abort_request(request);
+        request->invalid = 1;
+    }
+}
+
+void write_body(struct connection *conn, const char *data, size_t len) {
+    struct request *request = &conn->request;
+    if (!request->body_file && !request->in_memory) {
+        return; //ungültige Anfrage: Text wird verworfen
+    }
+    uint64_t start = stats_now();
+    if ((request->in_memory && request->body_buffer_len + len > SEGMENT_INLINE_MAX && spill_body(request) == -1) || append_body(request, data, len) == -1) {
+        perror("Failed to write message file");
+        abort_request(request);
+        request->invalid = 1;
+    }
+    accounted_ns += stats_record(&stats->timers[TIMER_DISK], start);
+}
+
+int open_temp_body(struct request *request, const char *dirpath) {
+    char temp_path[PATH_BUF];
+
+    generate_message_key(request->key, sizeof(request->key));
+    int snprintf_result = snprintf(temp_path, sizeof(temp_path), "%s/tmp_%s", dirpath, request->key);
+    if (snprintf_result >= sizeof(temp_path) || snprintf_result < 0) {
+        request->key[0] = '\0';
+        return -1;
+    }
+
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd == -1 || (request->body_file = fdopen(fd, "w")) == NULL) {
+        perror("Failed to create message file");
+        if (fd != -1) {
+            close(fd);
+            unlink(temp_path);
+        }
+        request->key[0] = '\0';
+        return -1;
+    }
+    request->stdio_buffer = pool_alloc(POOL_BUFFER_64K); //statt eines neuen stdio-Puffers pro Nachricht
+    setvbuf(request->body_file, request->stdio_buffer, _IOFBF, BODY_BUF);
+    return 0;
+}
+
+int spill_body(struct request *request) {
+    char dirpath[PATH_BUF];
+
+    //Bisherigen Inhalt des Speicherpuffers in die temporäre Datei übernehmen:
+    request->in_memory = 0;
+    body_dirpath(request, dirpath, sizeof(dirpath));
+    int result = open_temp_body(request, dirpath);
+    if (result == 0 && fwrite(request->body_buffer, 1, request->body_buffer_len, request->body_file) != request->body_buffer_len) {
+        result = -1;
+    }
+    release_body(request);
+    return result;
+}
+
+int write_temp_body(struct request *request) {
+    char dirpath[PATH_BUF];
+    const char *data = request->packed_buffer ? request->packed_buffer : request->body_buffer;
+    size_t len = request->packed_buffer ? request->packed_len : request->body_buffer_len;
+
+    //Gespeichert wird die komprimierte Form, body_buffer bleibt für das Wörterbuch erhalten:
+    body_dirpath(request, dirpath, sizeof(dirpath));
+    if (open_temp_body(request, dirpath) == -1) {
+        return -1;
+    }
+    if (fwrite(data, 1, len, request->body_file) != len) {
+        perror("Failed to write message file");
+        return -1;
+    }
+    return 0;
+}
+
+void finish_send(struct connection *conn) {
+    struct request *request = &conn->request;
+    uint64_t start = stats_now();
+
+    conn->state = STATE_COMMAND;
+    if (store_message(conn, request) == -1) {
+        output_append(conn, "ERR\n", 4); //Fehler senden
+    } else {
+        output_append(conn, "OK\n", 3); //Erfolgsnachricht senden
+    }
+    accounted_ns += stats_record(&stats->commands[CMD_SEND], start);
+}
+
+int store_message(struct connection *conn, struct request *request) {
+    uint64_t start = stats_now();
+    int result = -1;
+
+    //Wörter ohne Lock fertig sortieren, unter dem Lock wird nur noch der Datensatz angehängt:
+    if (!request->invalid && finish_tokens(&request->tokens) == -1) {
+        perror("Failed to tokenize message");
+    }
+
+    if (request->in_memory && compress_bodies && !request->invalid) {
+        //Wörterbuch unter dem geteilten Lock holen, komprimiert wird ohne Lock
+        //(ein Blob für mehrere Empfänger kommt ohne aus, jedes Wörterbuch gehört einer Mailbox):
+        const struct compression_dictionary *dictionary = NULL;
+        if (!request->recipients) {
+            pthread_rwlock_t *lock = lock_mailbox(request->receiver, 0);
+            struct mailbox *mailbox = get_mailbox(request->receiver);
+            dictionary = mailbox ? mailbox->dictionary : NULL;
+            pthread_rwlock_unlock(lock);
+        }
+        if (compress_body(request, dictionary) == -1) {
+            perror("Failed to compress message");
+            request->invalid = 1;
+        }
+    }
+    if (request->in_memory && (storage_mode == STORAGE_FILES || request->recipients) && !request->invalid && write_temp_body(request) == -1) {
+        request->invalid = 1;
+    }
+    if (request->in_memory && !request->body_file) {
+        request->size = request->packed_buffer ? request->packed_len : request->body_buffer_len;
+    } else if (request->body_file) {
+        request->size = ftell(request->body_file);
+        if (durability_mode != DURABILITY_NONE && (storage_mode == STORAGE_FILES || request->recipients) && !request->invalid) {
+            //Datei-Inhalt zusammen mit rename und Manifest synchronisieren
+            if (fflush(request->body_file) == 0) {
+                sync_later(conn, fileno(request->body_file));
+            } else {
+                request->invalid = 1;
+            }
+        }
+        if (close_body_file(request) != 0) {
+            perror("Failed to write message file");
+            request->invalid = 1;
+        }
+        stats_record(&stats->timers[TIMER_DISK], start);
+    }
+
+    if (request->invalid) {
+        abort_request(request);
+    } else if (request->recipients) {
+        result = send_to_recipients(conn, request);
+    } else {
+        //Nur das Zustellen (rename + Manifest + Index) braucht den exklusiven Mailbox-Lock:
+        pthread_rwlock_t *lock = lock_mailbox(request->receiver, 1);
+        uint64_t disk_start = stats_now();
+        result = handle_send(conn, request, request->receiver, NULL);
+        stats_record(&stats->timers[TIMER_DISK], disk_start);
+        pthread_rwlock_unlock(lock);
+        if (result != 0) {
+            abort_request(request);
+        }
+        result = result == 1 ? 0 : result; //schon vorhanden: wie zugestellt antworten
+        request->key[0] = '\0'; //Datei gehört jetzt der Mailbox
+    }
+    release_body(request);
+    release_packed(request);
+    release_tokens(request);
+    free_recipients(request);
+    request->in_memory = 0;
+    return result;
+}
+
+void abort_request(struct request *request) {
+    char temp_path[PATH_BUF], dirpath[PATH_BUF];
+
+    if (request->body_file) {
+        close_body_file(request);
+    }
+    release_body(request);
+    release_packed(request);
+    release_tokens(request);
+    request->in_memory = 0;
+    if (request->key[0] != '\0') {
+        body_dirpath(request, dirpath, sizeof(dirpath));
+        int snprintf_result = snprintf(temp_path, sizeof(temp_path), "%s/tmp_%s", dirpath, request->key);
+        if (snprintf_result < sizeof(temp_path) && snprintf_result >= 0) {
+            unlink(temp_path);
+        }
+        request->key[0] = '\0';
+    }
+    free_recipients(request);
+}
+
+void execute_request(struct connection *conn) {
+    struct request *request = &conn->request;
+    uint64_t start = stats_now();
+
+    if (request->invalid) {
+        output_append(conn, "ERR\n", 4);
+    } else if (request->command == CMD_LIST) {
+        pthread_rwlock_t *lock = lock_mailbox(request->username, 0); //Mailbox zum Lesen sperren
+        handle_list(conn, request); // Process LIST
+        pthread_rwlock_unlock(lock);
+    } else if (request->command == CMD_SEARCH) {
+        pthread_rwlock_t *lock = lock_mailbox(request->username, 0); //Mailbox zum Lesen sperren
+        handle_search(conn, request); // Process SEARCH
+        pthread_rwlock_unlock(lock);
+    } else if (request->command == CMD_READ) {
+        pthread_rwlock_t *lock = lock_mailbox(request->username, 0); //Mailbox zum Lesen sperren
+        uint64_t disk_start = stats_now();
+        off_t offset, size;
+        struct message_entry message;
+        const struct compression_dictionary *dictionary = NULL;
+        int fd = open_message_file(request, &offset, &size, &message, &dictionary);
+        stats_record(&stats->timers[TIMER_DISK], disk_start);
+        pthread_rwlock_unlock(lock); //Offener Deskriptor bleibt gültig, Streamen braucht keinen Lock
+        handle_read(conn, fd, offset, size, &message, dictionary); // Process READ
+    } else {
+        pthread_rwlock_t *lock = lock_mailbox(request->username, 1); //Mailbox exklusiv sperren
+        uint64_t disk_start = stats_now();
+        int result = handle_del(conn, request); // Process DEL
+        stats_record(&stats->timers[TIMER_DISK], disk_start);
+        pthread_rwlock_unlock(lock);
+        output_append(conn, result == 0 ? "OK\n" : "ERR\n", result == 0 ? 3 : 4);
+    }
+    accounted_ns += stats_record(&stats->commands[request->command], start);
+}
+
+struct mailbox *get_mailbox(const char *username) {
+    unsigned long bucket = hash_username(username) & (MAILBOX_TABLE_SIZE - 1);
+    struct mailbox *mailbox;
+
+    pthread_mutex_lock(&mailbox_table_mutex);
+    for (mailbox = mailbox_table[bucket]; mailbox; mailbox = mailbox->next) {
+        if (strcmp(mailbox->username, username) == 0) {
+            break;
+        }
+    }
+    if (!mailbox) { //Erster Zugriff: leeren Index anlegen
+        mailbox = calloc(1, sizeof(struct mailbox));
+        if (!mailbox) {
+            pthread_mutex_unlock(&mailbox_table_mutex);
+            return NULL;
+        }
+        snprintf(mailbox->username, sizeof(mailbox->username), "%s", username);
+        mailbox->segment_fd = -1;
+        mailbox->manifest_fd = -1;
+        mailbox->dir_fd = -1;
+        mailbox->index_fd = -1;
+        mailbox->headers_fd = -1;
+        mailbox->header_strings_fd = -1;
+        pthread_mutex_init(&mailbox->load_mutex, NULL);
+        mailbox->next = mailbox_table[bucket];
+        mailbox_table[bucket] = mailbox;
+    }
+    pthread_mutex_unlock(&mailbox_table_mutex);
+
+    //Lazy Loading: nur der erste Zugriff liest das Verzeichnis ein
+    if (!__atomic_load_n(&mailbox->loaded, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&mailbox->load_mutex);
+        if (!mailbox->loaded && load_mailbox(mailbox) == -1) {
+            pthread_mutex_unlock(&mailbox->load_mutex);
+            return NULL;
+        }
+        pthread_mutex_unlock(&mailbox->load_mutex);
+    }
+    return mailbox;
+}
+
+int load_mailbox(struct mailbox *mailbox) {
+    char filepath[PATH_BUF], message_path[PATH_BUF];
+    struct dirent *entry;
+    DIR *dir;
+
+    int snprintf_result = snprintf(filepath, sizeof(filepath), "%s/%s", mail_spool_directory, mailbox->username);
+    if (snprintf_result >= sizeof(filepath) || snprintf_result < 0) {
+        return -1;
+    }
+
+    mailbox->count = 0;
+    mailbox->next_id = 1;
+    mailbox->tombstones = 0;
+    if (mailbox->segment_fd != -1) { //erneutes Laden
+        close(mailbox->segment_fd);
+        mailbox->segment_fd = -1;
+    }
+    if (mailbox->manifest_fd != -1) {
+        close(mailbox->manifest_fd);
+        mailbox->manifest_fd = -1;
+    }
+    close_header_cache(mailbox);
+    mailbox->header_records = -1;
+    mailbox->active_segment = 0;
+    mailbox->live_bytes = 0;
+    mailbox->dead_bytes = 0;
+    if (!mailbox->dictionary && load_dictionary(mailbox, filepath) == -1) {
+        perror("Failed to load compression dictionary"); //damit komprimierte Nachrichten liefern bei READ ERR
+    }
+    int result = load_manifest(mailbox, filepath);
+    if (result == -1) {
+        return -1;
+    }
+    if (result == 1 && (dir = opendir(filepath)) != NULL) { //Noch kein Manifest: Verzeichnis einmalig einlesen
+        while ((entry = readdir(dir)) != NULL) {
+            if (strncmp(entry->d_name, "message_", 8) != 0 || strlen(entry->d_name) >= MESSAGE_NAME_LEN) {
+                continue;
+            }
+            struct message_entry message;
+            memset(&message, 0, sizeof(message));
+            strcpy(message.file_name, entry->d_name);
+            message.id = strtol(entry->d_name + 8, NULL, 10); //vorläufig: Zeitstempel aus dem Dateinamen
+
+            snprintf_result = snprintf(message_path, sizeof(message_path), "%s/%s", filepath, entry->d_name);
+            if (snprintf_result >= sizeof(message_path) || snprintf_result < 0) {
+                continue;
+            }
+            if (read_message_header(message_path, &message) == -1 || add_message_entry(mailbox, &message) == -1) {
+                continue;
+            }
+        }
+        closedir(dir);
+
+        //Nach Zustellzeit sortieren und stabile ids 1..n vergeben:
+        qsort(mailbox->messages, mailbox->count, sizeof(struct message_entry), compare_message_entries);
+        for (int i = 0; i < mailbox->count; i++) {
+            mailbox->messages[i].id = i + 1;
+        }
+        mailbox->next_id = mailbox->count + 1;
+        if (mailbox->count > 0 && write_manifest(mailbox) == -1) {
+            perror("Failed to write mailbox manifest");
+        }
+    }
+    if (result == 1 && mailbox->count == 0) { //leere Mailbox: alter Cache darf nicht weiterverwendet werden
+        snprintf_result = snprintf(message_path, sizeof(message_path), "%s/%s", filepath, HEADERS_FILE);
+        if (snprintf_result < sizeof(message_path) && snprintf_result >= 0) {
+            unlink(message_path);
+        }
+        mailbox->header_records = 0; //erstes SEND legt ihn neu an
+        mailbox->header_strings_size = 0;
+    }
+
+    __atomic_store_n(&mailbox->loaded, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int load_manifest(struct mailbox *mailbox, const char *dirpath) {
+    char path[PATH_BUF];
+    struct manifest_header header;
+    struct stat st;
+
+    int snprintf_result = snprintf(path, sizeof(path), "%s/%s", dirpath, MANIFEST_FILE);
+    if (snprintf_result >= sizeof(path) || snprintf_result < 0) {
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd == -1) {
+        return errno == ENOENT ? 1 : -1;
+    }
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(header)) {
+        close(fd);
+        return 1; //leeres oder kaputtes Manifest -> neu aufbauen
+    }
+
+    //Gesamtes Manifest mit einem read() laden:
+    char *data = malloc(st.st_size);
+    if (!data) {
+        close(fd);
+        return -1;
+    }
+    ssize_t total = 0;
+    while (total < st.st_size) {
+        ssize_t n = read(fd, data + total, st.st_size - total);
+        if (n <= 0) {
+            break;
+        }
+        total += n;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (total < (ssize_t)sizeof(header) || header.magic != MANIFEST_MAGIC || (header.version != 1 && header.version != MANIFEST_VERSION)) {
+        free(data);
+        close(fd);
+        return 1;
+    }
+
+    //Unvollständigen letzten Datensatz (Absturz beim Anhängen) abschneiden:
+    size_t record_size = header.version == 1 ? MANIFEST_V1_RECORD : sizeof(struct manifest_record);
+    size_t records = (total - sizeof(header)) / record_size;
+    if (sizeof(header) + records * record_size != (size_t)total) {
+        if (ftruncate(fd, sizeof(header) + records * record_size) == -1) {
+            perror("Failed to truncate mailbox manifest");
+        }
+    }
+    close(fd);
+
+    mailbox->next_id = header.next_id;
+    for (size_t i = 0; i < records; i++) {
+        struct manifest_record record;
+        memset(&record, 0, sizeof(record));
+        memcpy(&record, data + sizeof(header) + i * record_size, record_size);
+        record.file_name[MESSAGE_NAME_LEN - 1] = '\0';
+        if (record.id >= mailbox->next_id) {
+            mailbox->next_id = record.id + 1;
+        }
+        if (record.segment > mailbox->active_segment) {
+            mailbox->active_segment = record.segment;
+        }
+
+        if (record.type == MANIFEST_DELETE) {
+            int index = find_message_entry(mailbox, record.id);
+            if (index != -1) {
+                if (mailbox->messages[index].segment != 0) {
+                    mailbox->live_bytes -= mailbox->messages[index].size;
+                    mailbox->dead_bytes += mailbox->messages[index].size;
+                }
+                remove_message_entry(mailbox, index);
+            }
+            mailbox->tombstones++;
+        } else if (record.type == MANIFEST_ADD) {
+            struct message_entry message;
+            memset(&message, 0, sizeof(message));
+            message.id = record.id;
+            message.segment = record.segment;
+            message.offset = record.offset;
+            message.size = record.length;
+            strcpy(message.file_name, record.file_name);
+            if (record.segment != 0) {
+                mailbox->live_bytes += record.length;
+            }
+            add_message_entry(mailbox, &message);
+        }
+    }
+    free(data);
+
+    //Sender, Betreff usw. aus dem Kopfdaten-Cache, nur was dort fehlt aus den Nachrichten selbst lesen:
+    char *cached = calloc(mailbox->count ? mailbox->count : 1, 1);
+    if (!cached) {
+        return -1;
+    }
+    int missing = load_header_cache(mailbox, dirpath, cached);
+    int segment_fd = -1; //zuletzt gelesenes Segment (Einträge liegen meist hintereinander im selben)
+    unsigned int open_segment = 0;
+    for (int i = 0; i < mailbox->count && missing != 0; i++) {
+        if (!cached[i]) {
+            read_entry_header(mailbox, dirpath, &mailbox->messages[i], &segment_fd, &open_segment);
+        }
+    }
+    if (segment_fd != -1) {
+        close(segment_fd);
+    }
+    free(cached);
+
+    //Altes Format: einmalig im aktuellen Format neu schreiben, damit angehängt werden kann
+    if (header.version != MANIFEST_VERSION && write_manifest(mailbox) == -1) {
+        perror("Failed to upgrade mailbox manifest");
+        return -1;
+    }
+    if (header.version == MANIFEST_VERSION && missing != 0 && write_header_cache(mailbox) == -1) {
+        perror("Failed to write mailbox header cache");
+    }
+    return 0;
+}
+
+int load_header_cache(struct mailbox *mailbox, const char *dirpath, char *cached) {
+    char path[PATH_BUF];
+    struct headers_header header, strings_header;
+    struct stat st, strings_st;
+    char (*names)[MESSAGE_NAME_LEN] = NULL;
+    size_t name_count = 0, name_capacity = 0;
+    int missing = mailbox->count;
+
+    //Beide Dateien einblenden: ein Page-in statt open()/read() pro Nachricht
+    int snprintf_result = snprintf(path, sizeof(path), "%s/%s", dirpath, HEADERS_FILE);
+    int fd = snprintf_result >= sizeof(path) || snprintf_result < 0 ? -1 : open(path, O_RDWR | O_CLOEXEC);
+    snprintf_result = snprintf(path, sizeof(path), "%s/%s", dirpath, HEADERS_STRINGS_FILE);
+    int strings_fd = snprintf_result >= sizeof(path) || snprintf_result < 0 ? -1 : open(path, O_RDWR | O_CLOEXEC);
+    if (fd == -1 || strings_fd == -1 || fstat(fd, &st) == -1 || fstat(strings_fd, &strings_st) == -1 ||
+        st.st_size < (off_t)sizeof(header) || strings_st.st_size < (off_t)sizeof(strings_header) || strings_st.st_size > UINT32_MAX) {
+        if (fd != -1) {
+            close(fd);
+        }
+        if (strings_fd != -1) {
+            close(strings_fd);
+        }
+        return missing; //fehlt oder leer: alles aus den Nachrichten lesen, danach neu schreiben
+    }
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    char *strings = mmap(NULL, strings_st.st_size, PROT_READ, MAP_PRIVATE, strings_fd, 0);
+    if (data == MAP_FAILED || strings == MAP_FAILED) {
+        goto unusable;
+    }
+    memcpy(&header, data, sizeof(header));
+    memcpy(&strings_header, strings, sizeof(strings_header));
+    if (header.magic != HEADERS_MAGIC || header.version != HEADERS_VERSION || strings_header.magic != HEADERS_STRINGS_MAGIC ||
+        strings_header.version != HEADERS_VERSION || strings_header.generation != header.generation) {
+        goto unusable;
+    }
+
+    //Abgleich mit dem Verzeichnis: Dateinamen einmal mit readdir() holen (kein open() pro Nachricht)
+    DIR *dir = opendir(dirpath);
+    struct dirent *dirent;
+    while (dir && (dirent = readdir(dir)) != NULL) {
+        if (strncmp(dirent->d_name, "message_", 8) != 0 || strlen(dirent->d_name) >= MESSAGE_NAME_LEN) {
+            continue;
+        }
+        if (name_count == name_capacity) {
+            name_capacity = name_capacity ? name_capacity * 2 : 64;
+            void *grown = realloc(names, name_capacity * MESSAGE_NAME_LEN);
+            if (!grown) {
+                closedir(dir);
+                goto unusable;
+            }
+            names = grown;
+        }
+        strcpy(names[name_count++], dirent->d_name);
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    if (name_count > 0) {
+        qsort(names, name_count, MESSAGE_NAME_LEN, compare_names);
+    }
+
+    //Datensätze übernehmen, die zu einem Eintrag aus dem Manifest passen (unvollständiger letzter wird überschrieben):
+    long records = (st.st_size - sizeof(header)) / sizeof(struct header_record);
+    for (long i = 0; i < records; i++) {
+        struct header_record record;
+        memcpy(&record, data + sizeof(header) + i * sizeof(record), sizeof(record));
+        int index = record.flags & HEADERS_DELETED ? -1 : find_message_entry(mailbox, record.id);
+        if (index == -1 || cached[index] || record.name >= strings_st.st_size || record.sender >= strings_st.st_size || record.subject >= strings_st.st_size ||
+            !memchr(strings + record.name, '\0', strings_st.st_size - record.name) || !memchr(strings + record.sender, '\0', strings_st.st_size - record.sender) ||
+            !memchr(strings + record.subject, '\0', strings_st.st_size - record.subject)) {
+            continue;
+        }
+        struct message_entry *entry = &mailbox->messages[index];
+        if (record.segment != entry->segment || strcmp(strings + record.name, entry->file_name) != 0) {
+            continue; //andere Nachricht mit derselben id (z.B. Mailbox verschoben und zurückgeholt)
+        }
+        if (entry->segment != 0 ? record.offset != entry->offset || record.size != entry->size :
+                                  !bsearch(entry->file_name, names, name_count, MESSAGE_NAME_LEN, compare_names)) {
+            continue; //Segment kompaktiert bzw. Datei fehlt: wie bisher aus der Nachricht lesen
+        }
+        entry->size = record.size;
+        entry->plain_size = record.plain_size;
+        entry->encoding = record.encoding;
+        entry->timestamp = record.timestamp;
+        snprintf(entry->sender, sizeof(entry->sender), "%s", strings + record.sender);
+        snprintf(entry->subject, sizeof(entry->subject), "%s", strings + record.subject);
+        entry->header_slot = i + 1;
+        cached[index] = 1;
+        missing--;
+    }
+
+    //Offen lassen: SEND hängt an, DEL markiert
+    mailbox->headers_fd = fd;
+    mailbox->header_strings_fd = strings_fd;
+    mailbox->header_records = records;
+    mailbox->header_strings_size = strings_st.st_size;
+    munmap(data, st.st_size);
+    munmap(strings, strings_st.st_size);
+    free(names);
+    return missing;
+
+unusable:
+    if (data != MAP_FAILED) {
+        munmap(data, st.st_size);
+    }
+    if (strings != MAP_FAILED) {
+        munmap(strings, strings_st.st_size);
+    }
+    free(names);
+    close(fd);
+    close(strings_fd);
+    return mailbox->count;
+}
+
+int read_entry_header(struct mailbox *mailbox, const char *dirpath, struct message_entry *entry, int *segment_fd, unsigned int *open_segment) {
+    char message_path[PATH_BUF];
+
+    if (entry->segment == 0) {
+        int snprintf_result = snprintf(message_path, sizeof(message_path), "%s/%s", dirpath, entry->file_name);
+        if (snprintf_result >= sizeof(message_path) || snprintf_result < 0) {
+            return -1;
+        }
+        return read_message_header(message_path, entry); //Betreff für LIST, fehlt die Datei bleibt er leer
+    }
+
+    //Kopf der Nachricht direkt aus dem Segment lesen:
+    char buffer[HEADER_READ];
+    if (*open_segment != entry->segment) {
+        if (*segment_fd != -1) {
+            close(*segment_fd);
+        }
+        *open_segment = entry->segment;
+        *segment_fd = segment_path(message_path, sizeof(message_path), mailbox->username, entry->segment) == 0 ? open(message_path, O_RDONLY | O_CLOEXEC) : -1;
+    }
+    ssize_t length = *segment_fd == -1 ? -1 : pread(*segment_fd, buffer, entry->size < HEADER_READ ? entry->size : HEADER_READ, entry->offset);
+    if (length <= 0) {
+        return -1;
+    }
+    parse_message_header(buffer, length, entry);
+    return 0;
+}
+
+int write_header_cache(struct mailbox *mailbox) {
+    char path[PATH_BUF], temp_path[PATH_BUF], strings_path[PATH_BUF], strings_temp_path[PATH_BUF];
+    struct headers_header header = { HEADERS_MAGIC, HEADERS_VERSION, stats_now() ^ ((uint64_t)getpid() << 40) };
+    struct headers_header strings_header = { HEADERS_STRINGS_MAGIC, HEADERS_VERSION, header.generation };
+
+    close_header_cache(mailbox);
+    mailbox->header_records = -1; //bis beide Dateien ersetzt sind
+    int snprintf_result = snprintf(path, sizeof(path), "%s/%s/%s", mail_spool_directory, mailbox->username, HEADERS_FILE);
+    if (snprintf_result >= sizeof(path) || snprintf_result < 0) {
+        return -1;
+    }
+    snprintf_result = snprintf(strings_path, sizeof(strings_path), "%s/%s/%s", mail_spool_directory, mailbox->username, HEADERS_STRINGS_FILE);
+    if (snprintf_result >= sizeof(strings_path) || snprintf_result < 0) {
+        return -1;
+    }
+    snprintf_result = snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    if (snprintf_result >= sizeof(temp_path) || snprintf_result < 0) {
+        return -1;
+    }
+    snprintf_result = snprintf(strings_temp_path, sizeof(strings_temp_path), "%s.tmp", strings_path);
+    if (snprintf_result >= sizeof(strings_temp_path) || snprintf_result < 0) {
+        return -1;
+    }
+
+    //Der Cache lässt sich jederzeit aus den Nachrichten neu aufbauen: kein fsync nötig
+    FILE *file = fopen(temp_path, "w");
+    FILE *strings = file ? fopen(strings_temp_path, "w") : NULL;
+    if (!strings) {
+        if (file) {
+            fclose(file);
+            unlink(temp_path);
+        }
+        return -1;
+    }
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(&strings_header, sizeof(strings_header), 1, strings);
+    uint32_t position = sizeof(strings_header);
+    for (int i = 0; i < mailbox->count; i++) {
+        const struct message_entry *entry = &mailbox->messages[i];
+        struct header_record record;
+        memset(&record, 0, sizeof(record));
+        record.id = entry->id;
+        record.offset = entry->offset;
+        record.size = entry->size;
+        record.plain_size = entry->plain_size;
+        record.timestamp = entry->timestamp;
+        record.segment = entry->segment;
+        record.encoding = entry->encoding;
+        record.name = position;
+        record.sender = record.name + strlen(entry->file_name) + 1;
+        record.subject = record.sender + strlen(entry->sender) + 1;
+        position = record.subject + strlen(entry->subject) + 1;
+        fwrite(entry->file_name, strlen(entry->file_name) + 1, 1, strings);
+        fwrite(entry->sender, strlen(entry->sender) + 1, 1, strings);
+        fwrite(entry->subject, strlen(entry->subject) + 1, 1, strings);
+        fwrite(&record, sizeof(record), 1, file);
+    }
+    //String-Tabelle zuerst ersetzen; passt die Generation nicht, wird der Cache beim Laden verworfen
+    int failed = ferror(file) || ferror(strings);
+    failed |= fclose(file) != 0;
+    failed |= fclose(strings) != 0;
+    if (failed || rename(strings_temp_path, strings_path) == -1 || rename(temp_path, path) == -1) {
+        unlink(temp_path);
+        unlink(strings_temp_path);
+        return -1;
+    }
+    for (int i = 0; i < mailbox->count; i++) {
+        mailbox->messages[i].header_slot = i + 1;
+    }
+    mailbox->header_records = mailbox->count;
+    mailbox->header_strings_size = position;
+    return 0;
+}
+
+int append_header_record(struct mailbox *mailbox, struct message_entry *entry) {
+    char path[PATH_BUF];
+    struct header_record record;
+    char strings[MESSAGE_NAME_LEN + sizeof(entry->sender) + sizeof(entry->subject)];
+
+    if (mailbox->header_records == -1) {
+        return 0; //Cache unbrauchbar, wird beim nächsten Laden neu geschrieben
+    }
+    if (mailbox->headers_fd == -1) {
+        if (mailbox->header_records == 0 && write_header_cache(mailbox) == -1) { //leere Mailbox: Cache neu anlegen
+            return -1;
+        }
+        int snprintf_result = snprintf(path, sizeof(path), "%s/%s/%s", mail_spool_directory, mailbox->username, HEADERS_FILE);
+        mailbox->headers_fd = snprintf_result >= sizeof(path) || snprintf_result < 0 ? -1 : open(path, O_RDWR | O_CLOEXEC);
+        snprintf_result = snprintf(path, sizeof(path), "%s/%s/%s", mail_spool_directory, mailbox->username, HEADERS_STRINGS_FILE);
+        mailbox->header_strings_fd = snprintf_result >= sizeof(path) || snprintf_result < 0 ? -1 : open(path, O_RDWR | O_CLOEXEC);
+        if (mailbox->headers_fd == -1 || mailbox->header_strings_fd == -1) {
+            close_header_cache(mailbox);
+            mailbox->header_records = -1;
+            return -1;
+        }
+    }
+
+    //Erst die Strings, dann der Datensatz: ein abgebrochener Datensatz zeigt nie auf fehlende Strings
+    memset(&record, 0, sizeof(record));
+    record.id = entry->id;
+    record.offset = entry->offset;
+    record.size = entry->size;
+    record.plain_size = entry->plain_size;
+    record.timestamp = entry->timestamp;
+    record.segment = entry->segment;
+    record.encoding = entry->encoding;
+    size_t name_len = strlen(entry->file_name) + 1, sender_len = strlen(entry->sender) + 1, subject_len = strlen(entry->subject) + 1;
+    memcpy(strings, entry->file_name, name_len);
+    memcpy(strings + name_len, entry->sender, sender_len);
+    memcpy(strings + name_len + sender_len, entry->subject, subject_len);
+    record.name = mailbox->header_strings_size;
+    record.sender = record.name + name_len;
+    record.subject = record.sender + sender_len;
+    size_t len = name_len + sender_len + subject_len;
+    off_t record_offset = sizeof(struct headers_header) + mailbox->header_records * sizeof(record);
+    if (pwrite(mailbox->header_strings_fd, strings, len, mailbox->header_strings_size) != (ssize_t)len ||
+        pwrite(mailbox->headers_fd, &record, sizeof(record), record_offset) != sizeof(record)) {
+        close_header_cache(mailbox);
+        mailbox->header_records = -1;
+        return -1;
+    }
+    mailbox->header_strings_size += len;
+    entry->header_slot = ++mailbox->header_records;
+    return 0;
+}
+
+void delete_header_record(struct mailbox *mailbox, const struct message_entry *entry) {
+    uint32_t flags = HEADERS_DELETED;
+
+    //Fehlt die Markierung, fällt der Datensatz beim Laden trotzdem weg (id steht nicht mehr im Manifest)
+    if (entry->header_slot == 0 || mailbox->headers_fd == -1) {
+        return;
+    }
+    off_t offset = sizeof(struct headers_header) + (entry->header_slot - 1) * sizeof(struct header_record) + offsetof(struct header_record, flags);
+    if (pwrite(mailbox->headers_fd, &flags, sizeof(flags), offset) != sizeof(flags)) {
+        perror("Failed to update mailbox header cache");
+    }
+}
+
+void close_header_cache(struct mailbox *mailbox) {
+    if (mailbox->headers_fd != -1) {
+        close(mailbox->headers_fd);
+        mailbox->headers_fd = -1;
+    }
+    if (mailbox->header_strings_fd != -1) {
+        close(mailbox->header_strings_fd);
+        mailbox->header_strings_fd = -1;
+    }
+}
+
+int compare_names(const void *a, const void *b) {
+    return strcmp(a, b);
+}
+
+int write_manifest(struct mailbox *mailbox) {
+    char path[PATH_BUF], temp_path[PATH_BUF];
+    struct manifest_header header = { MANIFEST_MAGIC, MANIFEST_VERSION, mailbox->next_id };
+
+    int snprintf_result = snprintf(path, sizeof(path), "%s/%s/%s", mail_spool_directory, mailbox->username, MANIFEST_FILE);
+    if (snprintf_result >= sizeof(path) || snprintf_result < 0) {
+        return -1;
+    }
+    snprintf_result = snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    if (snprintf_result >= sizeof(temp_path) || snprintf_result < 0) {
+        return -1;
+    }
+
+    //Neues Manifest nur mit lebenden Nachrichten schreiben, dann atomar ersetzen:
+    FILE *file = fopen(temp_path, "w");
+    if (!file) {
+        return -1;
+    }
+    fwrite(&header, sizeof(header), 1, file);
+    for (int i = 0; i < mailbox->count; i++) {
+        struct manifest_record record;
+        memset(&record, 0, sizeof(record));
+        record.type = MANIFEST_ADD;
+        record.segment = mailbox->messages[i].segment;
+        record.id = mailbox->messages[i].id;
+        strcpy(record.file_name, mailbox->messages[i].file_name);
+        record.offset = mailbox->messages[i].offset;
+        record.length = mailbox->messages[i].size;
+        fwrite(&record, sizeof(record), 1, file);
+    }
+    //Mit --durability muss das neue Manifest auf der Platte sein, bevor es das alte ersetzt:
+    int synced = durability_mode == DURABILITY_NONE || (fflush(file) == 0 && fdatasync(fileno(file)) == 0);
+    if (fclose(file) != 0 || !synced || rename(temp_path, path) == -1) {
+        unlink(temp_path);
+        return -1;
+    }
+    if (mailbox->manifest_fd != -1) { //zeigt noch auf das alte Manifest
+        close(mailbox->manifest_fd);
+        mailbox->manifest_fd = -1;
+    }
+    int dir_fd = durability_mode == DURABILITY_NONE ? -1 : mailbox_dir_fd(mailbox);
+    if (dir_fd != -1 && fsync(dir_fd) == -1) {
+        return -1;
+    }
+    mailbox->tombstones = 0;
+    if (write_header_cache(mailbox) == -1) { //gelöschte Datensätze und alte Segment-Positionen fallen weg
+        perror("Failed to write mailbox header cache");
+    }
+    return 0;
+}
+
+int append_manifest_record(struct mailbox *mailbox, uint32_t type, const struct message_entry *entry) {
+    char path[PATH_BUF];
+    struct manifest_record record;
+
+    int snprintf_result = snprintf(path, sizeof(path), "%s/%s/%s", mail_spool_directory, mailbox->username, MANIFEST_FILE);
+    if (snprintf_result >= sizeof(path) || snprintf_result < 0) {
+        return -1;
+    }
+
+    //Manifest bleibt offen: ein write() pro Datensatz, kein open()/close()
+    int fd = mailbox->manifest_fd;
+    if (fd == -1) {
+        fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    }
+    if (fd == -1 && errno == ENOENT) { //Erste Nachricht: Manifest mit Kopf anlegen
+        struct manifest_header header = { MANIFEST_MAGIC, MANIFEST_VERSION, mailbox->next_id };
+        fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (fd != -1 && write(fd, &header, sizeof(header)) != sizeof(header)) {
+            close(fd);
+            unlink(path);
+            return -1;
+        }
+    }
+    if (fd == -1) {
+        return -1;
+    }
+    mailbox->manifest_fd = fd;
+
+    memset(&record, 0, sizeof(record));
+    record.type = type;
+    record.segment = entry->segment;
+    record.id = entry->id;
+    strcpy(record.file_name, entry->file_name);
+    record.offset = entry->offset;
+    record.length = entry->size;
+    ssize_t written = write(fd, &record, sizeof(record)); //O_APPEND: ein write pro Datensatz
+    return written == sizeof(record) ? 0 : -1;
+}
+
+int find_message_entry(struct mailbox *mailbox, long id) {
+    int low = 0, high = mailbox->count - 1;
+    while (low <= high) {
+        int middle = low + (high - low) / 2;
+        if (mailbox->messages[middle].id == id) {
+            return middle;
+        }
+        if (mailbox->messages[middle].id < id) {
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return -1;
+}
+
+int read_message_header(const char *path, struct message_entry *entry) {
+    char buffer[HEADER_READ];
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == 0) {
+        entry->size = st.st_size;
+        entry->timestamp = st.st_mtime;
+    }
+    ssize_t length = read(fd, buffer, sizeof(buffer));
+    close(fd);
+    if (length > 0) {
+        parse_message_header(buffer, length, entry);
+    }
+    return 0;
+}
+
+void parse_message_header(const char *data, size_t len, struct message_entry *entry) {
+    char number[24];
+
+    //Die ersten drei Zeilen: Sender, Empfänger, Betreff, die vierte sagt, ob der Text komprimiert ist
+    for (int i = 0; i < 4 && len > 0; i++) {
+        const char *newline = memchr(data, '\n', len);
+        size_t line_len = newline ? (size_t)(newline - data) : len;
+        if (line_len > 8 && strncmp(data, "Sender: ", 8) == 0) {
+            snprintf(entry->sender, sizeof(entry->sender), "%.*s", (int)(line_len - 8), data + 8);
+        } else if (line_len > 9 && strncmp(data, "Subject: ", 9) == 0) {
+            snprintf(entry->subject, sizeof(entry->subject), "%.*s", (int)(line_len - 9), data + 9);
+        } else if (i == 3 && line_len > 17 && line_len < 17 + sizeof(number) && strncmp(data, "Message-Deflate: ", 17) == 0) {
+            snprintf(number, sizeof(number), "%.*s", (int)(line_len - 17), data + 17);
+            entry->encoding = BODY_DEFLATE;
+            entry->plain_size = strtoll(number, NULL, 10);
+        } else if (i == 3 && line_len > 22 && line_len < 22 + sizeof(number) && strncmp(data, "Message-Deflate-Dict: ", 22) == 0) {
+            snprintf(number, sizeof(number), "%.*s", (int)(line_len - 22), data + 22);
+            entry->encoding = BODY_DEFLATE_DICT;
+            entry->plain_size = strtoll(number, NULL, 10);
+        }
+        if (!newline) {
+            break;
+        }
+        len -= line_len + 1;
+        data = newline + 1;
+    }
+}
+
+int add_message_entry(struct mailbox *mailbox, const struct message_entry *entry) {
+    if (mailbox->count == mailbox->capacity) { //Array bei Bedarf verdoppeln
+        int capacity = mailbox->capacity ? mailbox->capacity * 2 : 16;
+        struct message_entry *messages = realloc(mailbox->messages, capacity * sizeof(struct message_entry));
+        if (!messages) {
+            return -1;
+        }
+        mailbox->messages = messages;
+        mailbox->capacity = capacity;
+    }
+
+    //Neue Nachrichten haben fast immer die größte id -> meist Anhängen am Ende
+    int index = mailbox->count;
+    while (index > 0 && compare_message_entries(&mailbox->messages[index - 1], entry) > 0) {
+        index--;
+    }
+    memmove(&mailbox->messages[index + 1], &mailbox->messages[index], (mailbox->count - index) * sizeof(struct message_entry));
+    mailbox->messages[index] = *entry;
+    mailbox->count++;
+    return 0;
+}
+
+void remove_message_entry(struct mailbox *mailbox, int index) {
+    memmove(&mailbox->messages[index], &mailbox->messages[index + 1], (mailbox->count - index - 1) * sizeof(struct message_entry));
+    mailbox->count--;
+}
+
+int compare_message_entries(const void *a, const void *b) {
+    const struct message_entry *first = a, *second = b;
+    if (first->id != second->id) {
+        return first->id < second->id ? -1 : 1;
+    }
+    return strcmp(first->file_name, second->file_name);
+}
+
+void generate_message_key(char *key, size_t size) {
+    //Sekunden + Sequenz des Workers + Worker-Nummer: eindeutig ohne gemeinsamen Zähler
+    snprintf(key, size, "%ld_%lu_%u", (long)time(NULL), message_sequence++, worker_id);
+}
+
+int deliver_message_file(const char *dirpath, const char *key, char *file_name, size_t size) {
+    char temp_path[PATH_BUF], message_path[PATH_BUF], new_key[MESSAGE_NAME_LEN];
+
+    int snprintf_result = snprintf(temp_path, sizeof(temp_path), "%s/tmp_%s", dirpath, key);
+    if (snprintf_result >= sizeof(temp_path) || snprintf_result < 0) {
+        return -1;
+    }
+
+    //RENAME_NOREPLACE: existiert der Name schon (z.B. nach Neustart in derselben Sekunde), neuen Schlüssel nehmen
+    snprintf(new_key, sizeof(new_key), "%s", key);
+    for (int attempt = 0; attempt < 16; attempt++) {
+        if (attempt > 0) {
+            generate_message_key(new_key, sizeof(new_key));
+        }
+        snprintf(file_name, size, "message_%s.txt", new_key);
+        snprintf_result = snprintf(message_path, sizeof(message_path), "%s/%s", dirpath, file_name);
+        if (snprintf_result >= sizeof(message_path) || snprintf_result < 0) {
+            return -1;
+        }
+        if (renameat2(AT_FDCWD, temp_path, AT_FDCWD, message_path, RENAME_NOREPLACE) == 0) {
+            return 0;
+        }
+        if (errno != EEXIST) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+int handle_send(struct connection *conn, struct request *request, const char *receiver, const char *blob) {
+
+    char dirpath[PATH_BUF], message_path[PATH_BUF];
+    struct message_entry entry;
+
+    struct mailbox *mailbox = get_mailbox(receiver);
+    if (!mailbox) {
+        return -1;
+    }
+    if (request->replica_id && find_message_entry(mailbox, request->replica_id) != -1) {
+        return 1; //feste id schon vorhanden: Router wiederholt ein abgebrochenes Umverteilen, nichts zu tun
+    }
+    if (request->replica_id && !request->replica_seq && request->replica_id < mailbox->next_id) {
+        return -1; //schon vergebene (evtl. gelöschte) id darf nicht wiederverwendet werden
+    }
+
+    //Atomar zustellen: erst nach dem rename ist die Nachricht sichtbar
+    memset(&entry, 0, sizeof(entry));
+    entry.timestamp = time(NULL);
+    entry.size = request->size;
+    entry.encoding = request->encoding;
+    entry.plain_size = request->plain_size;
+    snprintf(dirpath, sizeof(dirpath), "%s/%s", mail_spool_directory, receiver);
+    if (blob) { //mehrere Empfänger: Hardlink auf den gemeinsamen Text, der Link-Zähler zählt die Referenzen
+        if (link_blob(dirpath, request->key, blob, entry.file_name, sizeof(entry.file_name)) == -1) {
+            perror("Failed to link message blob");
+            return -1;
+        }
+    } else if (storage_mode == STORAGE_SEGMENTS) {
+        if (append_to_segment(mailbox, request, &entry) == -1) {
+            perror("Failed to append message to segment");
+            return -1;
+        }
+    } else if (deliver_message_file(dirpath, request->key, entry.file_name, sizeof(entry.file_name)) == -1) {
+        perror("Failed to deliver message file");
+        return -1;
+    }
+
+    //Stabile id vergeben (Follower: die des Primary), im Manifest festhalten und Index aktualisieren:
+    if (request->replica_id) {
+        entry.id = request->replica_id;
+        mailbox->next_id = entry.id >= mailbox->next_id ? entry.id + 1 : mailbox->next_id;
+    } else {
+        entry.id = mailbox->next_id++;
+    }
+    strcpy(entry.sender, request->sender);
+    strcpy(entry.subject, request->subject);
+    if (append_manifest_record(mailbox, MANIFEST_ADD, &entry) == -1) {
+        perror("Failed to update mailbox manifest");
+        if (entry.segment != 0) { //angehängte Nachricht ohne Manifest-Eintrag wieder abschneiden
+            if (ftruncate(mailbox->segment_fd, entry.offset) == -1) {
+                perror("Failed to truncate segment");
+            }
+            mailbox->segment_size = entry.offset;
+            mailbox->live_bytes -= entry.size;
+        } else {
+            int snprintf_result = snprintf(message_path, sizeof(message_path), "%s/%s", dirpath, entry.file_name);
+            if (snprintf_result < sizeof(message_path) && snprintf_result >= 0) {
+                remove(message_path); //zugestellte Datei ohne Manifest-Eintrag wieder entfernen
+            }
+        }
+        return -1;
+    }
+    if (append_header_record(mailbox, &entry) == -1) {
+        perror("Failed to update mailbox header cache");
+    }
+    if (add_message_entry(mailbox, &entry) == -1) {
+        __atomic_store_n(&mailbox->loaded, 0, __ATOMIC_RELEASE); //beim nächsten Zugriff neu einlesen
+    }
+    //Suchindex: die Wörter wurden schon beim Empfang gesammelt, hier nur Datensatz anhängen
+    //(fehlt der Datensatz, wird beim Laden nachindexiert; ein geladener Index wird dafür verworfen)
+    if (request->tokens.count < 0 || store_tokens(mailbox, mailbox->search, entry.id, &request->tokens) == -1) {
+        perror("Failed to update search index");
+        if (mailbox->search) {
+            free_search_index(mailbox->search);
+            mailbox->search = NULL;
+        }
+    }
+    if (compress_bodies && !mailbox->dictionary && request->in_memory) {
+        sample_dictionary(mailbox, request->body_buffer, request->body_buffer_len);
+    }
+    //Unter dem Mailbox-Lock: Reihenfolge im Log = Reihenfolge der ids
+    if (replication.fd != -1 && log_message(conn, request, mailbox, &entry) == -1) {
+        perror("Failed to append to replication log");
+    }
+    if (durability_mode != DURABILITY_NONE) { //Segment bzw. Verzeichnis (rename) und Manifest
+        if (entry.segment != 0) {
+            sync_later(conn, mailbox->segment_fd);
+        }
+        sync_later(conn, mailbox_dir_fd(mailbox));
+        sync_later(conn, mailbox->manifest_fd);
+        conn->sync_messages++;
+    }
+    return 0;
+}
+
+int send_to_recipients(struct connection *conn, struct request *request) {
+    char dirpath[PATH_BUF], blob[MESSAGE_NAME_LEN];
+    int failed = 0;
+
+    //Text einmal als Blob ablegen, tmp_<key> bleibt bis zum Ende als zusätzlicher Link bestehen
+    //(hält den Blob am Leben, auch wenn parallel alle anderen Referenzen gelöscht werden):
+    pthread_mutex_lock(&blob_mutex);
+    int result = store_blob(conn, request, blob, sizeof(blob));
+    pthread_mutex_unlock(&blob_mutex);
+    if (result == -1) {
+        perror("Failed to store message blob");
+        abort_request(request);
+        return -1;
+    }
+
+    //Jeder Empfänger bekommt einen Hardlink und einen Manifest-Eintrag, jeweils nur unter seinem eigenen Lock:
+    for (int i = 0; i < request->recipient_count; i++) {
+        snprintf(dirpath, sizeof(dirpath), "%s/%s", mail_spool_directory, request->recipients[i]);
+        if (create_directory(dirpath) == -1) {
+            failed = 1;
+            continue;
+        }
+        pthread_rwlock_t *lock = lock_mailbox(request->recipients[i], 1);
+        uint64_t disk_start = stats_now();
+        if (handle_send(conn, request, request->recipients[i], blob) == -1) {
+            failed = 1;
+        }
+        stats_record(&stats->timers[TIMER_DISK], disk_start);
+        pthread_rwlock_unlock(lock);
+    }
+
+    //tmp_<key> entfernen, ohne erfolgreiche Zustellung ist der Blob danach wieder weg.
+    //ERR, sobald ein Empfänger fehlt (die anderen haben die Nachricht dann trotzdem):
+    abort_request(request);
+    release_blob(blob);
+    return failed ? -1 : 0;
+}
+
+int parse_recipients(struct request *request, char *line) {
+    char *save, *name;
+
+    //Ein Empfänger wie bisher, mehrere durch Komma getrennt ("bob,carol,dave"):
+    if (!strchr(line, ',')) {
+        snprintf(request->receiver, sizeof(request->receiver), "%s", line);
+        return valid_username(line) ? 0 : -1;
+    }
+    int count = 1;
+    for (char *c = line; *c; c++) {
+        count += *c == ',';
+    }
+    if (count > RECIPIENTS_MAX || (request->recipients = malloc(count * sizeof(*request->recipients))) == NULL) {
+        return -1;
+    }
+    for (name = strtok_r(line, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        while (*name == ' ') {
+            name++;
+        }
+        if (!valid_username(name)) {
+            return -1;
+        }
+        strcpy(request->recipients[request->recipient_count++], name);
+    }
+    if (request->recipient_count == 0) {
+        return -1;
+    }
+
+    //Sortieren und Duplikate entfernen, sonst bekäme ein Empfänger die Nachricht doppelt:
+    qsort(request->recipients, request->recipient_count, sizeof(*request->recipients), compare_recipients);
+    int unique = 1;
+    for (int i = 1; i < request->recipient_count; i++) {
+        if (strcmp(request->recipients[i], request->recipients[unique - 1]) != 0) {
+            strcpy(request->recipients[unique++], request->recipients[i]);
+        }
+    }
+    request->recipient_count = unique;
+    strcpy(request->receiver, request->recipients[0]);
+    if (unique == 1) { //nur Duplikate: normaler SEND
+        free_recipients(request);
+    }
+    return 0;
+}
+
+int compare_recipients(const void *a, const void *b) {
+    return strcmp(a, b);
+}
+
+void free_recipients(struct request *request) {
+    free(request->recipients);
+    request->recipients = NULL;
+    request->recipient_count = 0;
+}
+
+void body_dirpath(struct request *request, char *dirpath, size_t size) {
+    snprintf(dirpath, size, "%s/%s", mail_spool_directory, request->recipients ? BLOB_DIR : request->receiver);
+}
+
+int create_directory(const char *path) {
+    if (mkdir(path, 0777) == 0) {
+        if (durability_mode != DURABILITY_NONE && sync_directory(mail_spool_directory) == -1) { //neue Mailbox im Spool festschreiben
+            perror("Failed to sync mail spool directory");
+            return -1;
+        }
+    } else if (errno != EEXIST) {
+        perror("Failed to create inbox directory");
+        return -1;
+    }
+    return 0;
+}
+
+int store_blob(struct connection *conn, struct request *request, char *blob, size_t size) {
+    char temp_path[PATH_BUF], blob_path[PATH_BUF];
+    unsigned long checksum;
+
+    int snprintf_result = snprintf(temp_path, sizeof(temp_path), "%s/%s/tmp_%s", mail_spool_directory, BLOB_DIR, request->key);
+    if (snprintf_result >= sizeof(temp_path) || snprintf_result < 0 || file_checksum(temp_path, &checksum) == -1) {
+        return -1;
+    }
+
+    //Name aus Prüfsumme und Länge (inhaltsadressiert), gleicher Name mit anderem Inhalt wird durchnummeriert:
+    for (int attempt = 0; attempt < 16; attempt++) {
+        if (attempt == 0) {
+            snprintf(blob, size, "%08lx_%lld", checksum, (long long)request->size);
+        } else {
+            snprintf(blob, size, "%08lx_%lld_%d", checksum, (long long)request->size, attempt);
+        }
+        snprintf_result = snprintf(blob_path, sizeof(blob_path), "%s/%s/%s", mail_spool_directory, BLOB_DIR, blob);
+        if (snprintf_result >= sizeof(blob_path) || snprintf_result < 0) {
+            return -1;
+        }
+        if (link(temp_path, blob_path) == 0) {
+            return 0; //neuer Blob
+        }
+        if (errno != EEXIST) {
+            return -1;
+        }
+        int same = same_content(temp_path, blob_path);
+        if (same == -1) {
+            return -1;
+        }
+        if (same) {
+            //Gleicher Text liegt schon da: tmp_<key> durch einen Link auf den vorhandenen Blob ersetzen
+            if (unlink(temp_path) == -1 || link(blob_path, temp_path) == -1) {
+                return -1;
+            }
+            if (durability_mode != DURABILITY_NONE) {
+                int fd = open(blob_path, O_RDONLY | O_CLOEXEC);
+                if (fd == -1) {
+                    return -1;
+                }
+                sync_later(conn, fd);
+                close(fd);
+            }
+            return 0;
+        }
+    }
+    errno = EEXIST;
+    return -1;
+}
+
+int file_checksum(const char *path, unsigned long *checksum) {
+    char *buffer = pool_alloc(POOL_BUFFER_64K);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n = -1;
+
+    *checksum = crc32(0, NULL, 0);
+    while (fd != -1 && buffer && (n = read(fd, buffer, pools[POOL_BUFFER_64K].size)) > 0) {
+        *checksum = crc32(*checksum, (const Bytef *)buffer, n);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    if (buffer) {
+        pool_free(POOL_BUFFER_64K, buffer);
+    }
+    return n == 0 ? 0 : -1;
+}
+
+int same_content(const char *path, const char *other_path) {
+    char *buffer = pool_alloc(POOL_BUFFER_64K), *other = pool_alloc(POOL_BUFFER_64K);
+    int fd = open(path, O_RDONLY | O_CLOEXEC), other_fd = open(other_path, O_RDONLY | O_CLOEXEC);
+    int result = buffer && other && fd != -1 && other_fd != -1 ? 1 : -1;
+
+    //Blockweise vergleichen (gleiche Länge ist durch den Namen schon sichergestellt):
+    while (result == 1) {
+        ssize_t n = read(fd, buffer, pools[POOL_BUFFER_64K].size);
+        ssize_t other_n = n > 0 ? read(other_fd, other, n) : 0;
+        if (n < 0 || other_n < 0) {
+            result = -1;
+        } else if (n == 0) {
+            break;
+        } else if (other_n != n || memcmp(buffer, other, n) != 0) {
+            result = 0;
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    if (other_fd != -1) {
+        close(other_fd);
+    }
+    if (buffer) {
+        pool_free(POOL_BUFFER_64K, buffer);
+    }
+    if (other) {
+        pool_free(POOL_BUFFER_64K, other);
+    }
+    return result;
+}
+
+int link_blob(const char *dirpath, const char *key, const char *blob, char *file_name, size_t size) {
+    char temp_path[PATH_BUF], message_path[PATH_BUF], new_key[MESSAGE_NAME_LEN];
+
+    int snprintf_result = snprintf(temp_path, sizeof(temp_path), "%s/%s/tmp_%s", mail_spool_directory, BLOB_DIR, key);
+    if (snprintf_result >= sizeof(temp_path) || snprintf_result < 0) {
+        return -1;
+    }
+
+    //Der Blob-Name steht im Dateinamen, damit DEL die Referenz wieder freigeben kann
+    for (int attempt = 0; attempt < 16; attempt++) {
+        generate_message_key(new_key, sizeof(new_key));
+        snprintf_result = snprintf(file_name, size, "message_%s@%s.txt", new_key, blob);
+        if (snprintf_result >= size || snprintf_result < 0) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        snprintf_result = snprintf(message_path, sizeof(message_path), "%s/%s", dirpath, file_name);
+        if (snprintf_result >= sizeof(message_path) || snprintf_result < 0) {
+            return -1;
+        }
+        if (link(temp_path, message_path) == 0) {
+            return 0;
+        }
+        if (errno != EEXIST) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+void release_blob(const char *blob) {
+    char blob_path[PATH_BUF];
+    struct stat st;
+
+    int snprintf_result = snprintf(blob_path, sizeof(blob_path), "%s/%s/%s", mail_spool_directory, BLOB_DIR, blob);
+    if (snprintf_result >= sizeof(blob_path) || snprintf_result < 0) {
+        return;
+    }
+    //Nur noch der Eintrag in .blobs übrig: die letzte Mailbox hat ihre Referenz gelöscht
+    pthread_mutex_lock(&blob_mutex);
+    if (stat(blob_path, &st) == 0 && st.st_nlink == 1 && unlink(blob_path) == -1) {
+        perror("Failed to remove message blob");
+    }
+    pthread_mutex_unlock(&blob_mutex);
+}
+
+void handle_list(struct connection *conn, struct request *request) {
+    struct mailbox *mailbox = get_mailbox(request->username);
+    if (!mailbox) {
+        output_append(conn, "ERR\n", 4);
+        return;
+    }
+
+    //Ausschnitt bestimmen (ohne Paging: ganze Mailbox):
+    long first = request->list_offset < mailbox->count ? request->list_offset : mailbox->count;
+    long count = mailbox->count - first < request->list_limit ? mailbox->count - first : request->list_limit;
+
+    //Anzahl zuerst, dann "<Nummer>: <Betreff>" pro Zeile, alles im Ausgabepuffer sammeln:
+    int result = output_printf(conn, "%ld\n", count);
+    for (long i = first; i < first + count && result == 0; i++) {
+        result = output_printf(conn, "%ld: %s\n", mailbox->messages[i].id, mailbox->messages[i].subject);
+    }
+    //Gesendet wird am Ende des Blocks mit einem writev(), bei Fehler wird die Verbindung geschlossen
+}
+
+int open_message_file(struct request *request, off_t *offset, off_t *size, struct message_entry *message, const struct compression_dictionary **dictionary) {
+    struct mailbox *mailbox = get_mailbox(request->username);
+    int index = mailbox ? find_message_entry(mailbox, request->message_id) : -1;
+    if (index == -1) { //Nachricht existiert nicht
+        return -1;
+    }
+    *message = mailbox->messages[index]; //Kopie: der Eintrag kann sich nach dem Unlock verschieben
+    *dictionary = mailbox->dictionary;
+    return open_message_entry(mailbox, &mailbox->messages[index], offset, size);
+}
+
+int open_message_entry(struct mailbox *mailbox, const struct message_entry *entry, off_t *offset, off_t *size) {
+    char message_path[PATH_BUF];
+    struct stat st;
+
+    if (entry->segment != 0) { //Bereich im Segment, gelesen wird mit einem sendfile() ab offset
+        *offset = entry->offset;
+        *size = entry->size;
+        if (entry->segment == mailbox->active_segment && mailbox->segment_fd != -1) {
+            return fcntl(mailbox->segment_fd, F_DUPFD_CLOEXEC, 0); //aktives Segment ist schon offen
+        }
+        if (segment_path(message_path, sizeof(message_path), mailbox->username, entry->segment) == -1) {
+            return -1;
+        }
+        return open(message_path, O_RDONLY | O_CLOEXEC);
+    }
+
+    int snprintf_result = snprintf(message_path, sizeof(message_path), "%s/%s/%s", mail_spool_directory, mailbox->username, entry->file_name);
+    if (snprintf_result >= sizeof(message_path) || snprintf_result < 0) {
+        return -1;
+    }
+    int fd = open(message_path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1 && fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    *offset = 0;
+    *size = st.st_size;
+    return fd;
+}
+
+void handle_read(struct connection *conn, int fd, off_t offset, off_t size, const struct message_entry *message, const struct compression_dictionary *dictionary) {
+    char header[32];
+
+    if (fd == -1) {
+        output_append(conn, "ERR\n", 4);
+        return;
+    }
+
+    //Komprimiert: entpacken, außer der Client kann den Strom selbst lesen (nur ohne Wörterbuch)
+    if (message->encoding == BODY_DEFLATE_DICT || (message->encoding == BODY_DEFLATE && !conn->deflate_passthrough)) {
+        uint64_t start = stats_now();
+        size_t len;
+        int pool;
+        char *plain = inflate_message(fd, offset, size, message, dictionary, &len, &pool);
+        close(fd);
+        stats_record(&stats->timers[TIMER_DISK], start);
+        if (!plain) {
+            perror("Failed to decompress message");
+            output_append(conn, "ERR\n", 4);
+            return;
+        }
+        output_printf(conn, "%zu\n", len);
+        output_append(conn, plain, len);
+        output_append(conn, "OK\n", 3);
+        buffer_free(plain, pool);
+        return;
+    }
+
+    //Ein Kopf mit der Länge, danach die Nachricht unverändert und "OK\n" (Deskriptor gehört danach dem Ausgabepuffer):
+    int header_len = snprintf(header, sizeof(header), "%lld\n", (long long)size);
+    if (send_file(conn, fd, offset, size, header, header_len) == -1) {
+        perror("Failed to send message file");
+    }
+}
+
+int handle_del(struct connection *conn, struct request *request) {
+
+    char message_path[PATH_BUF];
+
+    struct mailbox *mailbox = get_mailbox(request->username);
+    int index = mailbox ? find_message_entry(mailbox, request->message_id) : -1;
+    if (index == -1) { //Fehler, wenn die Nachricht nicht existiert
+        return -1;
+    }
+
+    struct message_entry *entry = &mailbox->messages[index];
+    if (entry->segment == 0) { //eigene Datei löschen, in Segmenten genügt der Tombstone
+        int snprintf_result = snprintf(message_path, sizeof(message_path), "%s/%s/%s", mail_spool_directory, request->username, entry->file_name);
+        if (snprintf_result >= sizeof(message_path) || snprintf_result < 0 || (unlink(message_path) == -1 && errno != ENOENT)) {
+            return -1;
+        }
+        const char *blob = strchr(entry->file_name, '@'); //message_<key>@<blob>.txt: Referenz auf einen gemeinsamen Text
+        if (blob && strlen(blob + 1) > 4) {
+            char blob_name[MESSAGE_NAME_LEN];
+            snprintf(blob_name, sizeof(blob_name), "%.*s", (int)strlen(blob + 1) - 4, blob + 1);
+            release_blob(blob_name);
+        }
+    }
+
+    //Tombstone anhängen, bei vielen Tombstones das Manifest kompaktieren:
+    if (append_manifest_record(mailbox, MANIFEST_DELETE, entry) == -1) {
+        perror("Failed to update mailbox manifest");
+    }
+    delete_header_record(mailbox, entry);
+    if (replication.fd != -1 && log_replication(conn, request, REPLICATION_DEL, request->username, entry->id, NULL, 0) == -1) {
+        perror("Failed to append to replication log");
+    }
+    if (entry->segment != 0) {
+        mailbox->live_bytes -= entry->size;
+        mailbox->dead_bytes += entry->size;
+    }
+    remove_message_entry(mailbox, index); //Eintrag aus dem Index entfernen
+    if (mailbox->search && ++mailbox->search->stale >= MANIFEST_COMPACT_MIN && mailbox->search->stale > mailbox->count) {
+        free_search_index(mailbox->search); //nächstes SEARCH lädt neu und schreibt .index ohne die Gelöschten
+        mailbox->search = NULL;
+    }
+    if (++mailbox->tombstones >= MANIFEST_COMPACT_MIN && mailbox->tombstones > mailbox->count && write_manifest(mailbox) == -1) {
+        perror("Failed to compact mailbox manifest");
+    }
+    if (durability_mode != DURABILITY_NONE) { //Tombstone und gelöschter Verzeichniseintrag
+        sync_later(conn, mailbox->manifest_fd);
+        sync_later(conn, mailbox_dir_fd(mailbox));
+        conn->sync_messages++;
+    }
+    if (mailbox->dead_bytes >= SEGMENT_COMPACT_MIN && mailbox->dead_bytes > mailbox->live_bytes) {
+        pthread_mutex_lock(&compaction_mutex);
+        pthread_cond_signal(&compaction_cond); //Segmente im Hintergrund kompaktieren
+        pthread_mutex_unlock(&compaction_mutex);
+    }
+    return 0;
+}
+
+void handle_search(struct connection *conn, struct request *request) {
+    struct posting_list *lists[SEARCH_TERMS_MAX];
+    struct token_set terms;
+
+    struct mailbox *mailbox = get_mailbox(request->username);
+    if (!mailbox) {
+        output_append(conn, "ERR\n", 4);
+        return;
+    }
+
+    //Index beim ersten SEARCH laden (wie get_mailbox: nur ein Thread lädt, Leser haben den Mailbox-Lock shared)
+    if (!__atomic_load_n(&mailbox->search, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&mailbox->load_mutex);
+        if (!mailbox->search && load_search_index(mailbox) == -1) {
+            pthread_mutex_unlock(&mailbox->load_mutex);
+            perror("Failed to load search index");
+            output_append(conn, "ERR\n", 4);
+            return;
+        }
+        pthread_mutex_unlock(&mailbox->load_mutex);
+    }
+    struct search_index *index = mailbox->search;
+
+    //Suchbegriffe wie Nachrichten zerlegen, alle müssen vorkommen:
+    memset(&terms, 0, sizeof(terms));
+    add_tokens(&terms, request->terms, strlen(request->terms));
+    if (finish_tokens(&terms) == -1 || terms.count == 0) {
+        free(terms.tokens);
+        output_append(conn, "ERR\n", 4);
+        return;
+    }
+    int list_count = terms.count < SEARCH_TERMS_MAX ? terms.count : SEARCH_TERMS_MAX;
+    for (int i = 0; i < list_count; i++) {
+        lists[i] = search_find(index, terms.tokens[i]);
+        if (!lists[i]) {
+            free(terms.tokens);
+            output_append(conn, "0\n", 2); //ein Wort kommt nirgends vor
+            return;
+        }
+    }
+    free(terms.tokens);
+
+    //Kürzeste Liste zuerst, deren ids in den anderen per Binärsuche nachschlagen:
+    for (int i = 1; i < list_count; i++) {
+        for (int j = i; j > 0 && lists[j]->count < lists[j - 1]->count; j--) {
+            struct posting_list *swap = lists[j];
+            lists[j] = lists[j - 1];
+            lists[j - 1] = swap;
+        }
+    }
+    int *matches = malloc(sizeof(int) * lists[0]->count);
+    if (!matches) {
+        output_append(conn, "ERR\n", 4);
+        return;
+    }
+    int match_count = 0;
+    for (int i = 0; i < lists[0]->count; i++) {
+        long id = lists[0]->ids[i];
+        int found = 1;
+        for (int k = 1; k < list_count && found; k++) {
+            int low = 0, high = lists[k]->count - 1;
+            found = 0;
+            while (low <= high) {
+                int middle = low + (high - low) / 2;
+                if (lists[k]->ids[middle] == id) {
+                    found = 1;
+                    break;
+                }
+                if (lists[k]->ids[middle] < id) {
+                    low = middle + 1;
+                } else {
+                    high = middle - 1;
+                }
+            }
+        }
+        int entry = found ? find_message_entry(mailbox, id) : -1; //gelöschte Nachrichten überspringen
+        if (entry != -1) {
+            matches[match_count++] = entry;
+        }
+    }
+
+    //Antwort im Format von LIST:
+    int result = output_printf(conn, "%d\n", match_count);
+    for (int i = 0; i < match_count && result == 0; i++) {
+        result = output_printf(conn, "%ld: %s\n", mailbox->messages[matches[i]].id, mailbox->messages[matches[i]].subject);
+    }
+    free(matches);
+}
+
+int load_search_index(struct mailbox *mailbox) {
+    char path[PATH_BUF];
+    struct index_header header;
+    struct stat st;
+    char *data = NULL, *keep = NULL;
+    size_t total = 0, keep_len = sizeof(header);
+    int rewrite = 0;
+
+    struct search_index *index = calloc(1, sizeof(struct search_index));
+    char *indexed = calloc(mailbox->count ? mailbox->count : 1, 1); //1 = Nachricht steht im Index
+    if (!index || !indexed || (index->buckets = calloc(INDEX_BUCKETS, sizeof(struct posting_list *))) == NULL) {
+        free(indexed);
+        free(index);
+        return -1;
+    }
+    index->bucket_count = INDEX_BUCKETS;
+
+    //Gesamten Index mit einem read() laden:
+    int snprintf_result = snprintf(path, sizeof(path), "%s/%s/%s", mail_spool_directory, mailbox->username, INDEX_FILE);
+    int fd = snprintf_result >= sizeof(path) || snprintf_result < 0 ? -1 : open(path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1 && fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(header) && (data = malloc(st.st_size)) != NULL) {
+        while (total < (size_t)st.st_size) {
+            ssize_t n = read(fd, data + total, st.st_size - total);
+            if (n <= 0) {
+                break;
+            }
+            total += n;
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    if (data) {
+        memcpy(&header, data, sizeof(header));
+    }
+    if (!data || total < sizeof(header) || header.magic != INDEX_MAGIC || header.version != INDEX_VERSION) {
+        total = 0; //fehlt oder unbekanntes Format: komplett neu aufbauen
+        rewrite = 1;
+    }
+    keep = malloc(total > sizeof(header) ? total : sizeof(header));
+    if (!keep) {
+        free(data);
+        free(indexed);
+        free_search_index(index);
+        return -1;
+    }
+    header.magic = INDEX_MAGIC;
+    header.version = INDEX_VERSION;
+    memcpy(keep, &header, sizeof(header));
+
+    //Datensätze lebender Nachrichten übernehmen, gelöschte (und doppelte) fallen weg:
+    size_t position = total ? sizeof(header) : 0;
+    while (position < total) {
+        struct index_record record;
+        if (total - position < sizeof(record)) {
+            rewrite = 1; //unvollständiger letzter Datensatz (Absturz beim Anhängen)
+            break;
+        }
+        memcpy(&record, data + position, sizeof(record));
+        if (record.length > total - position - sizeof(record)) {
+            rewrite = 1;
+            break;
+        }
+        char *tokens = data + position + sizeof(record);
+        size_t record_size = sizeof(record) + record.length;
+        int entry = find_message_entry(mailbox, record.id);
+        if (entry == -1 || indexed[entry]) {
+            rewrite = 1;
+            position += record_size;
+            continue;
+        }
+        indexed[entry] = 1;
+        for (size_t offset = 0; offset < record.length;) {
+            size_t token_len = strnlen(tokens + offset, record.length - offset);
+            if (token_len > 0 && token_len <= TOKEN_MAX && offset + token_len < record.length && search_add(index, tokens + offset, record.id) == -1) {
+                free(data);
+                free(keep);
+                free(indexed);
+                free_search_index(index);
+                return -1;
+            }
+            offset += token_len + 1;
+        }
+        memcpy(keep + keep_len, data + position, record_size);
+        keep_len += record_size;
+        position += record_size;
+    }
+    free(data);
+
+    //Index kompakt neu schreiben, danach fehlende Nachrichten (z.B. von vor dem Index) anhängen:
+    if (rewrite && write_search_index(mailbox, keep, keep_len) == -1) {
+        perror("Failed to rewrite search index");
+    }
+    free(keep);
+    for (int i = 0; i < mailbox->count; i++) {
+        if (!indexed[i] && index_message(mailbox, index, &mailbox->messages[i]) == -1) {
+            perror("Failed to index message");
+        }
+    }
+    free(indexed);
+
+    //Nachindexierte ids können kleiner sein als schon vorhandene: Listen sortieren
+    for (unsigned long bucket = 0; bucket < index->bucket_count; bucket++) {
+        for (struct posting_list *list = index->buckets[bucket]; list; list = list->next) {
+            for (int i = 1; i < list->count; i++) {
+                if (list->ids[i - 1] > list->ids[i]) {
+                    qsort(list->ids, list->count, sizeof(long), compare_ids);
+                    break;
+                }
+            }
+        }
+    }
+    __atomic_store_n(&mailbox->search, index, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void free_search_index(struct search_index *index) {
+    for (unsigned long bucket = 0; bucket < index->bucket_count; bucket++) {
+        struct posting_list *list = index->buckets[bucket];
+        while (list) {
+            struct posting_list *next = list->next;
+            free(list->ids);
+            free(list);
+            list = next;
+        }
+    }
+    free(index->buckets);
+    free(index);
+}
+
+int index_message(struct mailbox *mailbox, struct search_index *index, const struct message_entry *entry) {
+    struct token_set set;
+    int header_lines = 0; //Sender, Empfänger, Betreff, "Message:" werden übersprungen
+    size_t len;
+
+    //Sender und Betreff aus dem Index der Mailbox, danach der Text:
+    memset(&set, 0, sizeof(set));
+    add_tokens(&set, entry->sender, strlen(entry->sender));
+    add_tokens(&set, " ", 1);
+    add_tokens(&set, entry->subject, strlen(entry->subject));
+    add_tokens(&set, " ", 1);
+    off_t offset, size;
+    int fd = open_message_entry(mailbox, entry, &offset, &size);
+    if (fd != -1 && entry->encoding != BODY_PLAIN) { //komprimiert: ganz entpacken
+        int plain_pool = -1;
+        char *plain = inflate_message(fd, offset, size, entry, mailbox->dictionary, &len, &plain_pool);
+        close(fd);
+        if (!plain) {
+            free(set.tokens);
+            return -1;
+        }
+        size_t position = 0;
+        while (header_lines < 4 && position < len) {
+            header_lines += plain[position++] == '\n';
+        }
+        add_tokens(&set, plain + position, len - position);
+        buffer_free(plain, plain_pool);
+    } else {
+        char *buffer = fd == -1 ? NULL : pool_alloc(POOL_BUFFER_64K);
+        if (!buffer) {
+            if (fd != -1) {
+                close(fd);
+            }
+            free(set.tokens);
+            return -1;
+        }
+        while (size > 0) {
+            ssize_t n = pread(fd, buffer, size < (off_t)pools[POOL_BUFFER_64K].size ? size : (off_t)pools[POOL_BUFFER_64K].size, offset);
+            if (n <= 0) {
+                break;
+            }
+            size_t position = 0;
+            while (header_lines < 4 && position < (size_t)n) {
+                header_lines += buffer[position++] == '\n';
+            }
+            add_tokens(&set, buffer + position, n - position);
+            offset += n;
+            size -= n;
+        }
+        pool_free(POOL_BUFFER_64K, buffer);
+        close(fd);
+    }
+    int result = finish_tokens(&set) == -1 ? -1 : store_tokens(mailbox, index, entry->id, &set);
+    free(set.tokens);
+    return result;
+}
+
+int store_tokens(struct mailbox *mailbox, struct search_index *index, long id, const struct token_set *set) {
+    int result = append_index_record(mailbox, id, set);
+    for (int i = 0; i < set->count && index; i++) {
+        if (search_add(index, set->tokens[i], id) == -1) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+int append_index_record(struct mailbox *mailbox, long id, const struct token_set *set) {
+    char path[PATH_BUF];
+    struct index_record record;
+
+    int snprintf_result = snprintf(path, sizeof(path), "%s/%s/%s", mail_spool_directory, mailbox->username, INDEX_FILE);
+    if (snprintf_result >= sizeof(path) || snprintf_result < 0) {
+        return -1;
+    }
+
+    //Wie das Manifest: offen halten, ein write() pro Nachricht
+    int fd = mailbox->index_fd;
+    if (fd == -1) {
+        fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    }
+    if (fd == -1 && errno == ENOENT) {
+        struct index_header header = { INDEX_MAGIC, INDEX_VERSION };
+        fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (fd != -1 && write(fd, &header, sizeof(header)) != sizeof(header)) {
+            close(fd);
+            unlink(path);
+            return -1;
+        }
+    }
+    if (fd == -1) {
+        return -1;
+    }
+    mailbox->index_fd = fd;
+
+    size_t length = 0;
+    for (int i = 0; i < set->count; i++) {
+        length += strlen(set->tokens[i]) + 1;
+    }
+    int pool = buffer_pool(sizeof(record) + length); //übliche Nachrichten: Puffer aus dem Pool
+    char *buffer = pool != -1 ? pool_alloc(pool) : malloc(sizeof(record) + length);
+    if (!buffer) {
+        return -1;
+    }
+    memset(&record, 0, sizeof(record));
+    record.id = id;
+    record.length = length;
+    memcpy(buffer, &record, sizeof(record));
+    char *position = buffer + sizeof(record);
+    for (int i = 0; i < set->count; i++) {
+        size_t token_len = strlen(set->tokens[i]) + 1;
+        memcpy(position, set->tokens[i], token_len);
+        position += token_len;
+    }
+    ssize_t written = write(fd, buffer, sizeof(record) + length); //O_APPEND: ein write pro Datensatz
+    if (pool != -1) {
+        pool_free(pool, buffer);
+    } else {
+        free(buffer);
+    }
+    return written == (ssize_t)(sizeof(record) + length) ? 0 : -1;
+}
+
+int write_search_index(struct mailbox *mailbox, const char *data, size_t len) {
+    char path[PATH_BUF], temp_path[PATH_BUF];
+
+    int snprintf_result = snprintf(path, sizeof(path), "%s/%s/%s", mail_spool_directory, mailbox->username, INDEX_FILE);
+    if (snprintf_result >= sizeof(path) || snprintf_result < 0) {
+        return -1;
+    }
+    snprintf_result = snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    if (snprintf_result >= sizeof(temp_path) || snprintf_result < 0) {
+        return -1;
+    }
+
+    //Der Index lässt sich jederzeit aus den Nachrichten neu aufbauen: kein fsync nötig
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        return -1;
+    }
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(fd, data + written, len - written);
+        if (n <= 0) {
+            close(fd);
+            unlink(temp_path);
+            return -1;
+        }
+        written += n;
+    }
+    if (close(fd) == -1 || rename(temp_path, path) == -1) {
+        unlink(temp_path);
+        return -1;
+    }
+    if (mailbox->index_fd != -1) { //zeigt noch auf den alten Index
+        close(mailbox->index_fd);
+        mailbox->index_fd = -1;
+    }
+    return 0;
+}
+
+int search_add(struct search_index *index, const char *token, long id) {
+    struct posting_list *list = search_find(index, token);
+
+    if (!list) {
+        //Tabelle verdoppeln, wenn im Schnitt mehr als zwei Wörter pro Bucket liegen:
+        if (index->token_count >= index->bucket_count * 2) {
+            unsigned long bucket_count = index->bucket_count * 2;
+            struct posting_list **buckets = calloc(bucket_count, sizeof(struct posting_list *));
+            if (buckets) {
+                for (unsigned long bucket = 0; bucket < index->bucket_count; bucket++) {
+                    while (index->buckets[bucket]) {
+                        struct posting_list *moved = index->buckets[bucket];
+                        index->buckets[bucket] = moved->next;
+                        unsigned long target = hash_username(moved->token) & (bucket_count - 1);
+                        moved->next = buckets[target];
+                        buckets[target] = moved;
+                    }
+                }
+                free(index->buckets);
+                index->buckets = buckets;
+                index->bucket_count = bucket_count;
+            }
+        }
+        list = calloc(1, sizeof(struct posting_list));
+        if (!list) {
+            return -1;
+        }
+        snprintf(list->token, sizeof(list->token), "%s", token);
+        unsigned long bucket = hash_username(token) & (index->bucket_count - 1);
+        list->next = index->buckets[bucket];
+        index->buckets[bucket] = list;
+        index->token_count++;
+    }
+    if (list->count > 0 && list->ids[list->count - 1] == id) {
+        return 0;
+    }
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 4;
+        long *ids = realloc(list->ids, capacity * sizeof(long));
+        if (!ids) {
+            return -1;
+        }
+        list->ids = ids;
+        list->capacity = capacity;
+    }
+    list->ids[list->count++] = id; //SEND vergibt aufsteigende ids -> Liste bleibt sortiert
+    return 0;
+}
+
+struct posting_list *search_find(struct search_index *index, const char *token) {
+    struct posting_list *list = index->buckets[hash_username(token) & (index->bucket_count - 1)]; //FNV-1a wie bei Benutzernamen
+    while (list && strcmp(list->token, token) != 0) {
+        list = list->next;
+    }
+    return list;
+}
+
+void add_tokens(struct token_set *set, const char *data, size_t len) {
+    for (size_t i = 0; i < len && set->count >= 0; i++) {
+        unsigned char c = data[i];
+        //Buchstaben, Ziffern und Nicht-ASCII (UTF-8 Umlaute) gehören zum Wort, Großbuchstaben werden klein
+        if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80) {
+            if (set->current_len < TOKEN_MAX) {
+                set->current[set->current_len++] = c;
+            }
+            continue;
+        }
+        if (c >= 'A' && c <= 'Z') {
+            if (set->current_len < TOKEN_MAX) {
+                set->current[set->current_len++] = c - 'A' + 'a';
+            }
+            continue;
+        }
+        if (set->current_len < TOKEN_MIN) {
+            set->current_len = 0;
+            continue;
+        }
+
+        //Wort fertig: bei vollem Array erst Duplikate entfernen, nur wenn das nicht reicht wachsen
+        if (set->count == set->capacity) {
+            if (set->count > 0) {
+                qsort(set->tokens, set->count, TOKEN_MAX + 1, compare_tokens);
+                int unique = 1;
+                for (int k = 1; k < set->count; k++) {
+                    if (strcmp(set->tokens[k], set->tokens[unique - 1]) != 0) {
+                        memcpy(set->tokens[unique++], set->tokens[k], TOKEN_MAX + 1);
+                    }
+                }
+                set->count = unique;
+            }
+            if (set->count * 4 >= set->capacity * 3) {
+                int capacity = set->capacity ? set->capacity * 2 : 64;
+                char (*tokens)[TOKEN_MAX + 1] = realloc(set->tokens, capacity * (size_t)(TOKEN_MAX + 1));
+                if (!tokens) {
+                    set->count = -1; //merkt den Fehler für finish_tokens()
+                    set->current_len = 0;
+                    return;
+                }
+                set->tokens = tokens;
+                set->capacity = capacity;
+            }
+        }
+        memcpy(set->tokens[set->count], set->current, set->current_len);
+        set->tokens[set->count++][set->current_len] = '\0';
+        set->current_len = 0;
+    }
+}
+
+int finish_tokens(struct token_set *set) {
+    if (set->count < 0) {
+        return -1;
+    }
+    add_tokens(set, " ", 1); //letztes Wort abschließen
+    if (set->count < 0) {
+        return -1;
+    }
+    if (set->count == 0) {
+        return 0;
+    }
+    qsort(set->tokens, set->count, TOKEN_MAX + 1, compare_tokens);
+    int unique = 1;
+    for (int i = 1; i < set->count; i++) {
+        if (strcmp(set->tokens[i], set->tokens[unique - 1]) != 0) {
+            memcpy(set->tokens[unique++], set->tokens[i], TOKEN_MAX + 1);
+        }
+    }
+    set->count = unique;
+    return 0;
+}
+
+int compare_tokens(const void *a, const void *b) {
+    return strcmp(a, b);
+}
+
+int compare_ids(const void *a, const void *b) {
+    long first = *(const long *)a, second = *(const long *)b;
+    return first < second ? -1 : first > second;
+}
+
+int segment_path(char *path, size_t size, const char *username, unsigned int segment) {
+    int snprintf_result = snprintf(path, size, "%s/%s/segment_%u.dat", mail_spool_directory, username, segment);
+    return (snprintf_result >= size || snprintf_result < 0) ? -1 : 0;
+}
+
+int open_active_segment(struct mailbox *mailbox) {
+    char path[PATH_BUF];
+    struct stat st;
+
+    if (mailbox->segment_fd != -1) {
+        if (mailbox->segment_size < SEGMENT_MAX) {
+            return 0;
+        }
+        close(mailbox->segment_fd); //Segment voll: ab jetzt nur noch gelesen
+        mailbox->segment_fd = -1;
+        mailbox->active_segment++;
+        if (mailbox->active_segment == mailbox->compaction_segment) {
+            mailbox->active_segment++; //Nummer gehört der laufenden Kompaktierung
+        }
+    }
+    if (mailbox->active_segment == 0) {
+        mailbox->active_segment = 1;
+    }
+    if (segment_path(path, sizeof(path), mailbox->username, mailbox->active_segment) == -1) {
+        return -1;
+    }
+
+    //Nach einem Absturz kann hinter dem letzten Manifest-Eintrag noch Müll stehen: dahinter anhängen
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    mailbox->segment_fd = fd;
+    mailbox->segment_size = st.st_size;
+    return mailbox->segment_size < SEGMENT_MAX ? 0 : open_active_segment(mailbox);
+}
+
+int append_to_segment(struct mailbox *mailbox, struct request *request, struct message_entry *entry) {
+    char temp_path[PATH_BUF];
+
+    if (open_active_segment(mailbox) == -1) {
+        return -1;
+    }
+    off_t offset = mailbox->segment_size;
+
+    if (request->in_memory) {
+        //Normalfall: Kopf und Text liegen im Speicher (ggf. komprimiert) -> ein Schreibvorgang
+        char *data = request->packed_buffer ? request->packed_buffer : request->body_buffer;
+        //Einzelner Schreibvorgang direkt: io_run lohnt sich erst für echte Stapel (sync_fds, Aufräumen)
+        size_t written = 0;
+        while (written < (size_t)request->size) {
+            ssize_t result = pwrite(mailbox->segment_fd, data + written, request->size - written, offset + written);
+            if (result == -1 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                if (ftruncate(mailbox->segment_fd, offset) == -1) {
+                    perror("Failed to truncate segment");
+                }
+                return -1;
+            }
+            written += result;
+        }
+    } else {
+        //Großer Text wurde ausgelagert: im Kernel aus tmp_<key> kopieren, danach löschen
+        int snprintf_result = snprintf(temp_path, sizeof(temp_path), "%s/%s/tmp_%s", mail_spool_directory, request->receiver, request->key);
+        if (snprintf_result >= sizeof(temp_path) || snprintf_result < 0) {
+            return -1;
+        }
+        int source = open(temp_path, O_RDONLY | O_CLOEXEC);
+        if (source == -1) {
+            return -1;
+        }
+        int result = copy_range(source, 0, mailbox->segment_fd, offset, request->size);
+        close(source);
+        if (result == -1) {
+            if (ftruncate(mailbox->segment_fd, offset) == -1) {
+                perror("Failed to truncate segment");
+            }
+            return -1;
+        }
+        unlink(temp_path);
+        request->key[0] = '\0';
+    }
+
+    entry->segment = mailbox->active_segment;
+    entry->offset = offset;
+    entry->size = request->size;
+    mailbox->segment_size += request->size;
+    mailbox->live_bytes += request->size;
+    return 0;
+}
+
+int copy_range(int source, off_t offset, int target, off_t target_offset, off_t length) {
+    char buffer[BODY_BUF];
+
+    while (length > 0) {
+        ssize_t copied = copy_file_range(source, &offset, target, &target_offset, length, 0);
+        if (copied == -1 && errno == EINTR) {
+            continue;
+        }
+        if (copied == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+            //Kein copy_file_range() möglich: über einen Puffer kopieren
+            ssize_t part = pread(source, buffer, length < (off_t)sizeof(buffer) ? length : (off_t)sizeof(buffer), offset);
+            if (part <= 0 || pwrite(target, buffer, part, target_offset) != part) {
+                return -1;
+            }
+            copied = part;
+            offset += part;
+            target_offset += part;
+        }
+        if (copied <= 0) {
+            return -1; //Fehler oder Quelle zu kurz
+        }
+        length -= copied;
+    }
+    return 0;
+}
+
+int compact_segments(struct mailbox *mailbox, pthread_rwlock_t *lock, long *freed) {
+    char path[PATH_BUF], source_path[PATH_BUF];
+    struct segment_copy {
+        long id; //erstes Feld: Suche mit compare_ids
+        unsigned int segment;
+        off_t offset;
+        off_t size;
+        off_t target_offset;
+    } *copies;
+    struct segment_position {
+        unsigned int segment;
+        off_t offset;
+    } *previous = NULL;
+    long copy_count = 0;
+
+    //1. Unter dem geteilten Lock festhalten, was kopiert wird:
+    pthread_rwlock_rdlock(lock);
+    if (!mailbox->loaded || mailbox->dead_bytes < SEGMENT_COMPACT_MIN || mailbox->dead_bytes <= mailbox->live_bytes) {
+        pthread_rwlock_unlock(lock);
+        return 1;
+    }
+    copies = malloc(sizeof(struct segment_copy) * (mailbox->count ? mailbox->count : 1));
+    if (!copies) {
+        pthread_rwlock_unlock(lock);
+        return -1;
+    }
+    for (int i = 0; i < mailbox->count; i++) {
+        struct message_entry *entry = &mailbox->messages[i];
+        if (entry->segment != 0) { //eigene Dateien bleiben, wo sie sind
+            copies[copy_count].id = entry->id;
+            copies[copy_count].segment = entry->segment;
+            copies[copy_count].offset = entry->offset;
+            copies[copy_count++].size = entry->size;
+        }
+    }
+    *freed = mailbox->dead_bytes;
+    unsigned int target_segment = mailbox->active_segment + 1;
+    mailbox->compaction_segment = target_segment; //keine Schreiber, solange wir den Lock haben
+    pthread_rwlock_unlock(lock);
+
+    //2. Ohne Lock kopieren: Segmente werden nur angehängt und DEL ändert keine Bytes,
+    //SEND/DEL/READ laufen solange weiter (nur dieser Thread löscht Segmente):
+    int target = segment_path(path, sizeof(path), mailbox->username, target_segment) == 0 ? open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666) : -1;
+    int source = -1, result = target == -1 ? -1 : 0;
+    unsigned int source_segment = 0;
+    off_t target_size = 0;
+    for (long i = 0; i < copy_count && result == 0; i++) {
+        if (copies[i].segment != source_segment) {
+            if (source != -1) {
+                close(source);
+            }
+            source_segment = copies[i].segment;
+            source = segment_path(source_path, sizeof(source_path), mailbox->username, source_segment) == 0 ? open(source_path, O_RDONLY | O_CLOEXEC) : -1;
+        }
+        if (source == -1 || copy_range(source, copies[i].offset, target, target_size, copies[i].size) == -1) {
+            result = -1;
+            break;
+        }
+        copies[i].target_offset = target_size;
+        target_size += copies[i].size;
+    }
+    if (result == 0 && durability_mode != DURABILITY_NONE && fdatasync(target) == -1) {
+        result = -1;
+    }
+
+    //3. Exklusiv: inzwischen angehängte Nachrichten hinterher kopieren, Positionen umstellen, Manifest schreiben
+    pthread_rwlock_wrlock(lock);
+    off_t copied_size = target_size;
+    long live = 0;
+    int moved = 0;
+    if (result == 0 && (!mailbox->loaded || (previous = malloc(sizeof(struct segment_position) * (mailbox->count ? mailbox->count : 1))) == NULL)) {
+        result = -1;
+    }
+    for (; result == 0 && moved < mailbox->count; moved++) {
+        struct message_entry *entry = &mailbox->messages[moved];
+        previous[moved].segment = entry->segment;
+        previous[moved].offset = entry->offset;
+        if (entry->segment == 0) {
+            continue;
+        }
+        struct segment_copy *copy = bsearch(&entry->id, copies, copy_count, sizeof(struct segment_copy), compare_ids);
+        if (copy) {
+            entry->offset = copy->target_offset;
+        } else { //seit Schritt 1 zugestellt
+            if (entry->segment != source_segment) {
+                if (source != -1) {
+                    close(source);
+                }
+                source_segment = entry->segment;
+                source = segment_path(source_path, sizeof(source_path), mailbox->username, source_segment) == 0 ? open(source_path, O_RDONLY | O_CLOEXEC) : -1;
+            }
+            if (source == -1 || copy_range(source, entry->offset, target, target_size, entry->size) == -1) {
+                result = -1;
+                break;
+            }
+            entry->offset = target_size;
+            target_size += entry->size;
+        }
+        entry->segment = target_segment;
+        live += entry->size;
+    }
+    if (source != -1) {
+        close(source);
+    }
+    free(copies);
+
+    //Neues Manifest ist der Umschaltpunkt, erst danach werden die alten Segmente gelöscht:
+    if (result == 0 && target_size > copied_size && durability_mode != DURABILITY_NONE && fdatasync(target) == -1) {
+        result = -1;
+    }
+    if (result == -1 || write_manifest(mailbox) == -1) {
+        for (int i = 0; i < moved; i++) {
+            mailbox->messages[i].segment = previous[i].segment;
+            mailbox->messages[i].offset = previous[i].offset;
+        }
+        mailbox->compaction_segment = 0;
+        pthread_rwlock_unlock(lock);
+        free(previous);
+        if (target != -1) {
+            close(target);
+            unlink(path);
+        }
+        return -1;
+    }
+    free(previous);
+
+    if (mailbox->segment_fd != -1) {
+        close(mailbox->segment_fd); //laufende READs haben eigene Deskriptoren
+    }
+    //Alle anderen Segmente gemeinsam löschen (mit --io uring/threads parallel), auch solche,
+    //die SEND während des Kopierens hinter dem Ziel begonnen hat:
+    unsigned int last_segment = mailbox->active_segment > target_segment ? mailbox->active_segment : target_segment;
+    char (*old_paths)[PATH_BUF] = malloc(sizeof(*old_paths) * last_segment);
+    struct io_op *ops = malloc(sizeof(struct io_op) * last_segment);
+    int op_count = 0;
+    for (unsigned int segment = 1; segment <= last_segment; segment++) {
+        if (segment == target_segment) {
+            continue;
+        }
+        if (!old_paths || !ops) {
+            if (segment_path(path, sizeof(path), mailbox->username, segment) == 0) {
+                unlink(path);
+            }
+        } else if (segment_path(old_paths[op_count], PATH_BUF, mailbox->username, segment) == 0) {
+            struct io_op op = { IO_UNLINK, -1, old_paths[op_count], NULL, 0, 0, 0 };
+            ops[op_count++] = op;
+        }
+    }
+    io_run(ops, op_count); //fehlende Segmente (ENOENT) sind kein Fehler
+    free(ops);
+    free(old_paths);
+    mailbox->active_segment = target_segment;
+    mailbox->compaction_segment = 0;
+    mailbox->segment_fd = target;
+    mailbox->segment_size = target_size;
+    mailbox->live_bytes = live;
+    mailbox->dead_bytes = target_size - live;
+    pthread_rwlock_unlock(lock);
+    return 0;
+}
+
+void *compactionThread(void *data) {
+    struct timespec deadline;
+
+    while (1) {
+        //Alle COMPACTION_INTERVAL Sekunden oder wenn DEL viele tote Bytes hinterlassen hat:
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += COMPACTION_INTERVAL;
+        pthread_mutex_lock(&compaction_mutex);
+        if (!compaction_shutdown) {
+            pthread_cond_timedwait(&compaction_cond, &compaction_mutex, &deadline);
+        }
+        int done = compaction_shutdown;
+        pthread_mutex_unlock(&compaction_mutex);
+        if (done) {
+            return NULL;
+        }
+
+        //Mailboxen werden nie freigegeben und neue nur vorne eingehängt: Ketten ohne Mutex durchlaufen
+        for (int bucket = 0; bucket < MAILBOX_TABLE_SIZE; bucket++) {
+            pthread_mutex_lock(&mailbox_table_mutex);
+            struct mailbox *mailbox = mailbox_table[bucket];
+            pthread_mutex_unlock(&mailbox_table_mutex);
+
+            for (; mailbox; mailbox = mailbox->next) {
+                long dead = __atomic_load_n(&mailbox->dead_bytes, __ATOMIC_RELAXED);
+                if (dead < SEGMENT_COMPACT_MIN || dead <= __atomic_load_n(&mailbox->live_bytes, __ATOMIC_RELAXED)) {
+                    continue;
+                }
+                //kein lock_mailbox(): dieser Thread hat keine Worker-Statistik, compact_segments sperrt selbst
+                pthread_rwlock_t *lock = &mailbox_locks[hash_username(mailbox->username) & (MAILBOX_LOCK_SHARDS - 1)];
+                long freed = 0;
+                int result = compact_segments(mailbox, lock, &freed);
+                if (result == -1) {
+                    perror("Failed to compact mailbox segments");
+                } else if (result == 0) {
+                    printf("Compacted segments of %s, %ld bytes freed\n", mailbox->username, freed);
+                }
+            }
+        }
+    }
+}
+
+int mailbox_dir_fd(struct mailbox *mailbox) {
+    char path[PATH_BUF];
+
+    if (mailbox->dir_fd == -1) {
+        int snprintf_result = snprintf(path, sizeof(path), "%s/%s", mail_spool_directory, mailbox->username);
+        if (snprintf_result < sizeof(path) && snprintf_result >= 0) {
+            mailbox->dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+    }
+    return mailbox->dir_fd;
+}
+
+int sync_directory(const char *path) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    int result = fsync(fd);
+    close(fd);
+    return result;
+}
+
+void sync_later(struct connection *conn, int fd) {
+    //Kopie, weil das Original (z.B. bei Kompaktierung) geschlossen werden kann, bevor synchronisiert wird
+    int copy = fd == -1 ? -1 : fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (copy == -1) {
+        conn->output_failed = 1; //ohne Deskriptor keine Garantie -> kein OK
+        return;
+    }
+    if (conn->sync_count == conn->sync_capacity) {
+        int capacity = conn->sync_capacity ? conn->sync_capacity * 2 : 8;
+        int *fds = realloc(conn->sync_fds, capacity * sizeof(int));
+        if (!fds) {
+            close(copy);
+            conn->output_failed = 1;
+            return;
+        }
+        conn->sync_fds = fds;
+        conn->sync_capacity = capacity;
+    }
+    conn->sync_fds[conn->sync_count++] = copy;
+}
+
+int sync_fds(int *fds, int count) {
+    int result = 0;
+
+    //Dieselbe Datei (Manifest, Segment, Verzeichnis) nur einmal pro Batch synchronisieren:
+    struct sync_file *files = malloc(sizeof(struct sync_file) * (count ? count : 1));
+    struct io_op *ops = malloc(sizeof(struct io_op) * (count ? count : 1));
+    if (!files || !ops) {
+        result = -1;
+        count = 0;
+    }
+    int unique = 0;
+    for (int i = 0; i < count; i++) {
+        struct stat st;
+        if (fstat(fds[i], &st) == -1) {
+            result = -1;
+            continue;
+        }
+        files[unique].dev = st.st_dev;
+        files[unique].ino = st.st_ino;
+        files[unique].is_dir = S_ISDIR(st.st_mode);
+        files[unique].fd = fds[i];
+        unique++;
+    }
+    qsort(files, unique, sizeof(struct sync_file), compare_sync_files);
+
+    //Erst alle Dateiinhalte gemeinsam, dann die Verzeichnisse (Sortierung legt Verzeichnisse ans Ende):
+    int op_count = 0, file_count = 0;
+    for (int i = 0; i < unique; i++) {
+        if (i > 0 && files[i].dev == files[i - 1].dev && files[i].ino == files[i - 1].ino) {
+            continue;
+        }
+        if (!files[i].is_dir) {
+            file_count++;
+        }
+        memset(&ops[op_count], 0, sizeof(struct io_op));
+        ops[op_count].opcode = files[i].is_dir ? IO_FSYNC : IO_FDATASYNC;
+        ops[op_count].fd = files[i].fd;
+        op_count++;
+    }
+    if (io_run(ops, file_count) == -1 || io_run(ops + file_count, op_count - file_count) == -1) {
+        perror("Failed to sync mailbox data");
+        result = -1;
+    }
+    free(ops);
+    free(files);
+    for (int i = 0; i < count; i++) {
+        close(fds[i]);
+    }
+    return result;
+}
+
+int compare_sync_files(const void *a, const void *b) {
+    const struct sync_file *first = a, *second = b;
+    if (first->is_dir != second->is_dir) {
+        return first->is_dir - second->is_dir;
+    }
+    if (first->dev != second->dev) {
+        return first->dev < second->dev ? -1 : 1;
+    }
+    if (first->ino != second->ino) {
+        return first->ino < second->ino ? -1 : 1;
+    }
+    return 0;
+}
+
+int commit_wait(struct connection *conn) {
+    uint64_t start = stats_now();
+    int result = 0;
+
+    if (durability_mode == DURABILITY_FSYNC) {
+        result = sync_fds(conn->sync_fds, conn->sync_count); //selbst synchronisieren
+    } else {
+        //Deskriptoren an den aktuellen Batch hängen und warten, bis er auf der Platte ist:
+        pthread_mutex_lock(&commits.mutex);
+        if (commits.count + conn->sync_count > commits.capacity) {
+            int capacity = commits.capacity ? commits.capacity : 64;
+            while (capacity < commits.count + conn->sync_count) {
+                capacity *= 2;
+            }
+            int *fds = realloc(commits.fds, capacity * sizeof(int));
+            if (!fds) {
+                pthread_mutex_unlock(&commits.mutex);
+                for (int i = 0; i < conn->sync_count; i++) {
+                    close(conn->sync_fds[i]);
+                }
+                conn->sync_count = 0;
+                conn->sync_messages = 0;
+                return -1;
+            }
+            commits.fds = fds;
+            commits.capacity = capacity;
+        }
+        memcpy(commits.fds + commits.count, conn->sync_fds, conn->sync_count * sizeof(int));
+        commits.count += conn->sync_count;
+        commits.messages += conn->sync_messages;
+        unsigned long ticket = commits.next_ticket;
+        pthread_cond_signal(&commits.cond);
+        while (commits.durable_ticket < ticket && !commits.failed) {
+            pthread_cond_wait(&commits.done, &commits.mutex);
+        }
+        result = commits.failed ? -1 : 0;
+        pthread_mutex_unlock(&commits.mutex);
+    }
+    conn->sync_count = 0;
+    conn->sync_messages = 0;
+    stats_record(&stats->timers[TIMER_COMMIT], start);
+    return result;
+}
+
+void *commitThread(void *data) {
+    struct timespec deadline;
+    int *fds = NULL;
+    int capacity = 0;
+
+    pthread_mutex_lock(&commits.mutex);
+    while (1) {
+        while (commits.count == 0 && !commits.shutdown) {
+            pthread_cond_wait(&commits.cond, &commits.mutex);
+        }
+        if (commits.count == 0) {
+            break; //Shutdown und nichts mehr offen
+        }
+
+        //Batch sammeln: bis commit_interval_ms nach dem ersten Eintrag oder commit_batch Nachrichten
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += commit_interval_ms * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (commits.messages < commit_batch && !commits.shutdown) {
+            if (pthread_cond_timedwait(&commits.cond, &commits.mutex, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+
+        //Batch übernehmen, neue SEND/DEL sammeln sich währenddessen im nächsten:
+        int *batch = commits.fds;
+        int count = commits.count;
+        int batch_capacity = commits.capacity;
+        unsigned long ticket = commits.next_ticket++;
+        commits.fds = fds;
+        commits.capacity = capacity;
+        commits.count = 0;
+        commits.messages = 0;
+        pthread_mutex_unlock(&commits.mutex);
+
+        int result;
+        if (count > SYNCFS_THRESHOLD && spool_fd != -1) {
+            //Viele verschiedene Dateien: ein syncfs() schreibt alles mit einem Journal-Commit
+            result = syncfs(spool_fd);
+            if (result == -1) {
+                perror("Failed to sync mail spool");
+            }
+            for (int i = 0; i < count; i++) {
+                close(batch[i]);
+            }
+        } else {
+            result = sync_fds(batch, count);
+        }
+        fds = batch; //Puffer für den übernächsten Batch wiederverwenden
+        capacity = batch_capacity;
+
+        pthread_mutex_lock(&commits.mutex);
+        commits.durable_ticket = ticket;
+        if (result == -1) {
+            commits.failed = 1; //Zustand der Daten nach fehlgeschlagenem fsync unbekannt
+        }
+        pthread_cond_broadcast(&commits.done);
+    }
+    pthread_mutex_unlock(&commits.mutex);
+    free(fds);
+    return NULL;
+}
+
+int io_run(struct io_op *ops, int count) {
+    struct io_ring *ring;
+
+    if (count == 0) {
+        return 0;
+    }
+    if (io_backend == IO_BACKEND_URING && (ring = io_ring_get()) != NULL) {
+        io_ring_run(ring, ops, count);
+    } else if (io_backend == IO_BACKEND_THREADS && count > 1) {
+        io_pool_run(ops, count);
+    } else {
+        for (int i = 0; i < count; i++) { //einzelne Operation oder kein Ring: direkt ausführen
+            io_execute(&ops[i]);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (ops[i].result < 0) {
+            errno = -ops[i].result;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void io_execute(struct io_op *op) {
+    long result;
+
+    do {
+        switch (op->opcode) {
+        case IO_FSYNC:
+            result = fsync(op->fd);
+            break;
+        case IO_FDATASYNC:
+            result = fdatasync(op->fd);
+            break;
+        case IO_WRITE:
+            result = pwrite(op->fd, op->buf, op->len, op->offset);
+            break;
+        default:
+            result = unlink(op->path);
+            break;
+        }
+    } while (result == -1 && errno == EINTR);
+    op->result = result == -1 ? -errno : result;
+}
+
+int io_uring_available(void) {
+    struct io_ring ring;
+    struct io_uring_probe *probe;
+    int available = 0;
+
+    if (io_ring_setup(&ring) == -1) {
+        return 0;
+    }
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    probe = calloc(1, probe_size);
+    if (probe && syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        int opcodes[] = { IORING_OP_FSYNC, IORING_OP_WRITE, IORING_OP_UNLINKAT };
+        available = 1;
+        for (int i = 0; i < 3; i++) {
+            if (opcodes[i] > probe->last_op || !(probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED)) {
+                available = 0;
+            }
+        }
+    }
+    free(probe);
+    io_ring_close(&ring);
+    return available;
+}
+
+struct io_ring *io_ring_get(void) {
+    struct io_ring *ring = pthread_getspecific(io_ring_key);
+
+    if (!ring) {
+        ring = malloc(sizeof(struct io_ring));
+        if (!ring || io_ring_setup(ring) == -1) {
+            perror("Failed to set up io_uring, using blocking I/O in this thread");
+            free(ring);
+            return NULL;
+        }
+        pthread_setspecific(io_ring_key, ring);
+    }
+    return ring;
+}
+
+int io_ring_setup(struct io_ring *ring) {
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, IO_QUEUE_DEPTH, &params);
+    if (ring->fd == -1) {
+        return -1;
+    }
+
+    //Ringe einblenden (bei IORING_FEAT_SINGLE_MMAP liegen SQ und CQ in einem Bereich):
+    ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_len > ring->sq_map_len) {
+            ring->sq_map_len = ring->cq_map_len;
+        }
+        ring->cq_map_len = ring->sq_map_len;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            munmap(ring->sq_map, ring->sq_map_len);
+            close(ring->fd);
+            return -1;
+        }
+    }
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_map != ring->sq_map) {
+            munmap(ring->cq_map, ring->cq_map_len);
+        }
+        munmap(ring->sq_map, ring->sq_map_len);
+        close(ring->fd);
+        return -1;
+    }
+
+    char *sq = ring->sq_map, *cq = ring->cq_map;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+void io_ring_close(struct io_ring *ring) {
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_len);
+    }
+    munmap(ring->sq_map, ring->sq_map_len);
+    close(ring->fd);
+}
+
+void io_ring_free(void *data) {
+    io_ring_close(data);
+    free(data);
+}
+
+void io_ring_run(struct io_ring *ring, struct io_op *ops, int count) {
+    //Höchstens sq_entries Operationen gleichzeitig im Ring, Rest in weiteren Runden:
+    for (int first = 0; first < count; first += ring->sq_entries) {
+        int batch = count - first < (int)ring->sq_entries ? count - first : (int)ring->sq_entries;
+
+        unsigned tail = *ring->sq_tail; //nur dieser Thread schreibt in den Ring
+        for (int i = 0; i < batch; i++) {
+            struct io_op *op = &ops[first + i];
+            unsigned index = (tail + i) & ring->sq_mask;
+            struct io_uring_sqe *sqe = &ring->sqes[index];
+
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->user_data = first + i;
+            switch (op->opcode) {
+            case IO_FSYNC:
+            case IO_FDATASYNC:
+                sqe->opcode = IORING_OP_FSYNC;
+                sqe->fd = op->fd;
+                sqe->fsync_flags = op->opcode == IO_FDATASYNC ? IORING_FSYNC_DATASYNC : 0;
+                break;
+            case IO_WRITE: //kurze Schreibvorgänge wie bei pwrite(), der Aufrufer schreibt den Rest
+                sqe->opcode = IORING_OP_WRITE;
+                sqe->fd = op->fd;
+                sqe->addr = (uintptr_t)op->buf;
+                sqe->len = op->len;
+                sqe->off = op->offset;
+                break;
+            default:
+                sqe->opcode = IORING_OP_UNLINKAT;
+                sqe->fd = AT_FDCWD;
+                sqe->addr = (uintptr_t)op->path;
+                break;
+            }
+            ring->sq_array[index] = index;
+        }
+        __atomic_store_n(ring->sq_tail, tail + batch, __ATOMIC_RELEASE);
+
+        //Einreichen und warten, bis alle Ergebnisse im Completion-Ring stehen:
+        int submitted = 0, completed = 0;
+        while (completed < batch) {
+            long result = syscall(__NR_io_uring_enter, ring->fd, batch - submitted, batch - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (result == -1 && submitted == 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                //Ring unbrauchbar: Einträge zurücknehmen und blockierend ausführen
+                __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+                for (int i = 0; i < batch; i++) {
+                    io_execute(&ops[first + i]);
+                }
+                break;
+            }
+            if (result > 0) {
+                submitted += result;
+            }
+
+            unsigned head = *ring->cq_head;
+            while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+                struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+                ops[cqe->user_data].result = cqe->res;
+                head++;
+                completed++;
+            }
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+void io_pool_run(struct io_op *ops, int count) {
+    struct io_batch batch = { ops, count, 0, count, NULL };
+
+    pthread_mutex_lock(&io_pool.mutex);
+    if (io_pool.tail) {
+        io_pool.tail->next_batch = &batch;
+    } else {
+        io_pool.head = &batch;
+    }
+    io_pool.tail = &batch;
+    pthread_cond_broadcast(&io_pool.cond);
+
+    //Selbst mitarbeiten, statt nur zu warten:
+    while (batch.next < batch.count) {
+        struct io_op *op = &ops[batch.next++];
+        if (batch.next == batch.count) { //alle vergeben: aus der Warteschlange nehmen
+            struct io_batch **link = &io_pool.head;
+            struct io_batch *previous = NULL;
+            while (*link != &batch) {
+                previous = *link;
+                link = &(*link)->next_batch;
+            }
+            *link = batch.next_batch;
+            if (io_pool.tail == &batch) {
+                io_pool.tail = previous;
+            }
+        }
+        pthread_mutex_unlock(&io_pool.mutex);
+        io_execute(op);
+        pthread_mutex_lock(&io_pool.mutex);
+        batch.pending--;
+    }
+    while (batch.pending > 0) {
+        pthread_cond_wait(&io_pool.done, &io_pool.mutex);
+    }
+    pthread_mutex_unlock(&io_pool.mutex);
+}
+
+void *ioThread(void *data) {
+    pthread_mutex_lock(&io_pool.mutex);
+    while (1) {
+        while (!io_pool.head && !io_pool.shutdown) {
+            pthread_cond_wait(&io_pool.cond, &io_pool.mutex);
+        }
+        struct io_batch *batch = io_pool.head;
+        if (!batch) {
+            break; //Shutdown
+        }
+        struct io_op *op = &batch->ops[batch->next++];
+        if (batch->next == batch->count) {
+            io_pool.head = batch->next_batch;
+            if (!io_pool.head) {
+                io_pool.tail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&io_pool.mutex);
+        io_execute(op);
+        pthread_mutex_lock(&io_pool.mutex);
+        if (--batch->pending == 0) {
+            pthread_cond_broadcast(&io_pool.done);
+        }
+    }
+    pthread_mutex_unlock(&io_pool.mutex);
+    return NULL;
+}
+
+void *pool_alloc(enum pool_id id) {
+    struct pool_thread *thread = pool_thread_get();
+    if (!thread) {
+        return NULL;
+    }
+    struct pool_cache *cache = &thread->caches[id];
+    if (!cache->head && pool_refill(id, cache) == -1) {
+        return NULL;
+    }
+    struct pool_object *object = cache->head;
+    cache->head = object->next;
+    __atomic_store_n(&cache->count, cache->count - 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&cache->allocs, cache->allocs + 1, __ATOMIC_RELAXED);
+    return object;
+}
+
+void pool_free(enum pool_id id, void *object) {
+    struct pool_thread *thread = pool_thread_get();
+    if (!thread) {
+        //Ohne eigenen Cache direkt in den Vorrat
+        pthread_mutex_lock(&pools[id].mutex);
+        ((struct pool_object *)object)->next = pools[id].depot;
+        pools[id].depot = object;
+        pools[id].depot_count++;
+        pthread_mutex_unlock(&pools[id].mutex);
+        return;
+    }
+    struct pool_cache *cache = &thread->caches[id];
+    ((struct pool_object *)object)->next = cache->head;
+    cache->head = object;
+    __atomic_store_n(&cache->count, cache->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&cache->frees, cache->frees + 1, __ATOMIC_RELAXED);
+    if (cache->count > pools[id].cache_max) {
+        pool_flush(id, cache, pools[id].cache_max / 2); //Objekte wandern z.B. von Workern zum Event-Loop
+    }
+}
+
+struct pool_thread *pool_thread_get(void) {
+    if (!pool_thread) {
+        pool_thread = calloc(1, sizeof(struct pool_thread));
+        if (!pool_thread) {
+            return NULL;
+        }
+        pthread_mutex_lock(&pool_threads_mutex);
+        pool_thread->next = pool_threads;
+        pool_threads = pool_thread;
+        pthread_mutex_unlock(&pool_threads_mutex);
+        pthread_setspecific(pool_key, pool_thread);
+    }
+    return pool_thread;
+}
+
+void pool_thread_exit(void *data) {
+    struct pool_thread *thread = data;
+    for (int id = 0; id < POOL_COUNT; id++) {
+        pool_flush(id, &thread->caches[id], 0); //Zähler bleiben für STATS stehen
+    }
+}
+
+int pool_refill(enum pool_id id, struct pool_cache *cache) {
+    struct object_pool *pool = &pools[id];
+    long wanted = pool->cache_max / 2 > 0 ? pool->cache_max / 2 : 1;
+    long taken = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->depot && taken < wanted) {
+        struct pool_object *object = pool->depot;
+        pool->depot = object->next;
+        object->next = cache->head;
+        cache->head = object;
+        taken++;
+    }
+    pool->depot_count -= taken;
+    if (taken == 0) {
+        //Vorrat leer: neuen Slab anlegen und in Objekte zerteilen (Slabs werden nie freigegeben)
+        long count = POOL_SLAB_BYTES / pool->size > 0 ? POOL_SLAB_BYTES / pool->size : 1;
+        char *slab = malloc(count * pool->size);
+        if (!slab) {
+            pthread_mutex_unlock(&pool->mutex);
+            return -1;
+        }
+        for (long i = count - 1; i >= 0; i--) {
+            struct pool_object *object = (struct pool_object *)(slab + i * pool->size);
+            object->next = cache->head;
+            cache->head = object;
+        }
+        taken = count;
+        __atomic_store_n(&pool->slabs, pool->slabs + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&pool->objects, pool->objects + count, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    __atomic_store_n(&cache->count, cache->count + taken, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void pool_flush(enum pool_id id, struct pool_cache *cache, long keep) {
+    struct object_pool *pool = &pools[id];
+    struct pool_object *first = NULL, *last = NULL;
+    long moved = 0;
+
+    while (cache->count - moved > keep) {
+        struct pool_object *object = cache->head;
+        cache->head = object->next;
+        object->next = first;
+        first = object;
+        if (!last) {
+            last = object;
+        }
+        moved++;
+    }
+    if (moved == 0) {
+        return;
+    }
+    __atomic_store_n(&cache->count, cache->count - moved, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&pool->mutex);
+    last->next = pool->depot;
+    pool->depot = first;
+    pool->depot_count += moved;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+int buffer_pool(size_t size) {
+    for (int id = POOL_BUFFER_512; id < POOL_COUNT; id++) {
+        if (size <= pools[id].size) {
+            return id;
+        }
+    }
+    return -1;
+}
+
+int body_reserve(struct request *request, size_t needed) {
+    if (needed <= request->body_buffer_capacity) {
+        return 0;
+    }
+
+    //Mindestens verdoppeln, damit ein wachsender Text nicht bei jedem Block umkopiert wird:
+    size_t size = request->body_buffer_capacity * 2;
+    if (size < needed) {
+        size = needed;
+    }
+    int id = buffer_pool(size < pools[POOL_BUFFER_4K].size ? pools[POOL_BUFFER_4K].size : size);
+    char *buffer;
+    if (id != -1) {
+        buffer = pool_alloc(id);
+        size = pools[id].size;
+    } else if (request->body_buffer && request->body_buffer_pool == -1) {
+        buffer = realloc(request->body_buffer, size); //bereits zu groß für den Pool
+        if (buffer) {
+            request->body_buffer = NULL;
+        }
+    } else {
+        buffer = malloc(size);
+        __atomic_fetch_add(&buffer_oversize, 1, __ATOMIC_RELAXED);
+    }
+    if (!buffer) {
+        return -1;
+    }
+    if (request->body_buffer) {
+        memcpy(buffer, request->body_buffer, request->body_buffer_len);
+        pool_free(request->body_buffer_pool, request->body_buffer);
+    }
+    request->body_buffer = buffer;
+    request->body_buffer_capacity = size;
+    request->body_buffer_pool = id;
+    return 0;
+}
+
+int append_body(struct request *request, const char *data, size_t len) {
+    //Wörter für den Suchindex gleich beim Empfang sammeln (ohne Lock, Kopfzeilen überspringen):
+    size_t position = 0;
+    while (request->token_lines < 4 && position < len) {
+        request->token_lines += data[position++] == '\n';
+    }
+    add_tokens(&request->tokens, data + position, len - position);
+
+    if (!request->in_memory) {
+        return fwrite(data, 1, len, request->body_file) == len ? 0 : -1;
+    }
+    if (body_reserve(request, request->body_buffer_len + len) == -1) {
+        return -1;
+    }
+    memcpy(request->body_buffer + request->body_buffer_len, data, len);
+    request->body_buffer_len += len;
+    return 0;
+}
+
+void start_tokens(struct request *request) {
+    release_tokens(request);
+    add_tokens(&request->tokens, request->sender, strlen(request->sender));
+    add_tokens(&request->tokens, " ", 1);
+    add_tokens(&request->tokens, request->subject, strlen(request->subject));
+    add_tokens(&request->tokens, " ", 1);
+}
+
+void release_tokens(struct request *request) {
+    free(request->tokens.tokens);
+    memset(&request->tokens, 0, sizeof(request->tokens));
+    request->token_lines = 0;
+}
+
+void release_body(struct request *request) {
+    if (request->body_buffer) {
+        buffer_free(request->body_buffer, request->body_buffer_pool);
+    }
+    request->body_buffer = NULL;
+    request->body_buffer_len = 0;
+    request->body_buffer_capacity = 0;
+}
+
+int close_body_file(struct request *request) {
+    int result = fclose(request->body_file);
+    request->body_file = NULL;
+    if (request->stdio_buffer) {
+        pool_free(POOL_BUFFER_64K, request->stdio_buffer);
+        request->stdio_buffer = NULL;
+    }
+    return result;
+}
+
+void *buffer_alloc(size_t size, int *pool) {
+    *pool = buffer_pool(size);
+    if (*pool != -1) {
+        return pool_alloc(*pool);
+    }
+    __atomic_fetch_add(&buffer_oversize, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+void buffer_free(void *buffer, int pool) {
+    if (pool == -1) {
+        free(buffer);
+    } else {
+        pool_free(pool, buffer);
+    }
+}
+
+struct zlib_streams *zlib_streams_get(void) {
+    if (!zlib_streams) {
+        zlib_streams = calloc(1, sizeof(struct zlib_streams));
+        if (!zlib_streams) {
+            return NULL;
+        }
+        pthread_setspecific(zlib_key, zlib_streams);
+    }
+    return zlib_streams;
+}
+
+void zlib_streams_free(void *data) {
+    struct zlib_streams *streams = data;
+    if (streams->deflate_ready) {
+        deflateEnd(&streams->deflater);
+    }
+    if (streams->inflate_ready) {
+        inflateEnd(&streams->inflater);
+    }
+    free(streams);
+}
+
+int compress_body(struct request *request, const struct compression_dictionary *dictionary) {
+    char line[48];
+    size_t header_len = 0;
+    int lines = 0;
+
+    //Kopf (Sender, Empfänger, Betreff) bleibt lesbar, "Message:" wird durch die Längenzeile ersetzt:
+    while (lines < 4 && header_len < request->body_buffer_len) {
+        lines += request->body_buffer[header_len++] == '\n';
+    }
+    size_t plain_len = request->body_buffer_len - header_len;
+    if (lines < 4 || plain_len < COMPRESS_MIN) {
+        return 0; //bleibt unkomprimiert
+    }
+    size_t prefix_len = header_len - strlen("Message:\n");
+
+    struct zlib_streams *streams = zlib_streams_get();
+    if (!streams) {
+        return -1;
+    }
+    z_stream *z = &streams->deflater;
+    if (!streams->deflate_ready) {
+        if (deflateInit(z, COMPRESS_LEVEL) != Z_OK) {
+            return -1;
+        }
+        streams->deflate_ready = 1;
+    }
+    if (deflateReset(z) != Z_OK || (dictionary && deflateSetDictionary(z, dictionary->data, dictionary->len) != Z_OK)) {
+        return -1;
+    }
+
+    int line_len = snprintf(line, sizeof(line), "Message-Deflate%s: %zu\n", dictionary ? "-Dict" : "", plain_len);
+    size_t capacity = prefix_len + line_len + deflateBound(z, plain_len);
+    char *packed = buffer_alloc(capacity, &request->packed_pool);
+    if (!packed) {
+        return -1;
+    }
+    memcpy(packed, request->body_buffer, prefix_len);
+    memcpy(packed + prefix_len, line, line_len);
+    z->next_in = (Bytef *)request->body_buffer + header_len;
+    z->avail_in = plain_len;
+    z->next_out = (Bytef *)packed + prefix_len + line_len;
+    z->avail_out = capacity - prefix_len - line_len;
+    int result = deflate(z, Z_FINISH);
+    size_t packed_len = capacity - z->avail_out;
+    if (result != Z_STREAM_END || packed_len >= request->body_buffer_len) { //lohnt sich nicht (z.B. schon komprimierte Daten)
+        buffer_free(packed, request->packed_pool);
+        return 0;
+    }
+
+    request->packed_buffer = packed;
+    request->packed_len = packed_len;
+    request->encoding = dictionary ? BODY_DEFLATE_DICT : BODY_DEFLATE;
+    request->plain_size = plain_len;
+    stats_add(&stats->compressed_messages, 1);
+    stats_add(&stats->compressed_plain_bytes, request->body_buffer_len);
+    stats_add(&stats->compressed_stored_bytes, packed_len);
+    return 0;
+}
+
+void release_packed(struct request *request) {
+    if (request->packed_buffer) {
+        buffer_free(request->packed_buffer, request->packed_pool);
+    }
+    request->packed_buffer = NULL;
+    request->packed_len = 0;
+    request->encoding = BODY_PLAIN;
+}
+
+char *inflate_message(int fd, off_t offset, off_t size, const struct message_entry *entry, const struct compression_dictionary *dictionary, size_t *len, int *pool) {
+    int packed_pool;
+    char *plain = NULL;
+
+    //Komprimiert werden nur Nachrichten, die im Speicher gesammelt wurden -> ganz einlesen
+    if (entry->plain_size < 0 || entry->plain_size > SEGMENT_INLINE_MAX || size > SEGMENT_INLINE_MAX + BUF) {
+        errno = EINVAL;
+        return NULL;
+    }
+    char *packed = buffer_alloc(size, &packed_pool);
+    if (!packed) {
+        return NULL;
+    }
+    off_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, packed + done, size - done, offset + done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+
+    //Ende des Betreffs und Beginn des zlib-Stroms (nach der vierten Zeile) suchen:
+    size_t prefix_len = 0, header_len = 0;
+    int lines = 0;
+    while (lines < 4 && header_len < (size_t)done) {
+        if (packed[header_len++] == '\n' && ++lines == 3) {
+            prefix_len = header_len;
+        }
+    }
+    struct zlib_streams *streams = zlib_streams_get();
+    if (lines == 4 && streams && (streams->inflate_ready || inflateInit(&streams->inflater) == Z_OK)) {
+        streams->inflate_ready = 1;
+        *len = prefix_len + strlen("Message:\n") + entry->plain_size;
+        plain = buffer_alloc(*len, pool);
+    }
+    if (plain) {
+        z_stream *z = &streams->inflater;
+        memcpy(plain, packed, prefix_len);
+        memcpy(plain + prefix_len, "Message:\n", strlen("Message:\n"));
+        inflateReset(z);
+        z->next_in = (Bytef *)packed + header_len;
+        z->avail_in = done - header_len;
+        z->next_out = (Bytef *)plain + prefix_len + strlen("Message:\n");
+        z->avail_out = entry->plain_size;
+        int result = inflate(z, Z_FINISH);
+        if (result == Z_NEED_DICT && dictionary && z->adler == dictionary->id && inflateSetDictionary(z, dictionary->data, dictionary->len) == Z_OK) {
+            result = inflate(z, Z_FINISH);
+        }
+        if (result != Z_STREAM_END || z->avail_out != 0) { //beschädigt, falsches Wörterbuch oder falsche Länge
+            buffer_free(plain, *pool);
+            plain = NULL;
+            errno = EIO;
+        }
+    }
+    buffer_free(packed, packed_pool);
+    return plain;
+}
+
+void sample_dictionary(struct mailbox *mailbox, const char *data, size_t len) {
+    size_t position = 0;
+    int lines = 0;
+
+    //Textanfänge der ersten Nachrichten sammeln (Anreden, Signaturen, wiederkehrende Wörter):
+    while (lines < 4 && position < len) {
+        lines += data[position++] == '\n';
+    }
+    if (!mailbox->dictionary_samples && (mailbox->dictionary_samples = malloc(DICTIONARY_SIZE)) == NULL) {
+        return;
+    }
+    size_t part = len - position < DICTIONARY_SAMPLE ? len - position : DICTIONARY_SAMPLE;
+    if (part > DICTIONARY_SIZE - mailbox->dictionary_samples_len) {
+        part = DICTIONARY_SIZE - mailbox->dictionary_samples_len;
+    }
+    memcpy(mailbox->dictionary_samples + mailbox->dictionary_samples_len, data + position, part);
+    mailbox->dictionary_samples_len += part;
+    if (mailbox->dictionary_samples_len < DICTIONARY_SIZE) {
+        return;
+    }
+
+    //Voll: als Wörterbuch festschreiben, erst danach damit komprimieren
+    if (write_dictionary(mailbox, mailbox->dictionary_samples, mailbox->dictionary_samples_len) == -1) {
+        perror("Failed to write compression dictionary");
+        mailbox->dictionary_samples_len = 0; //mit neuen Beispielen später nochmal versuchen
+        return;
+    }
+    free(mailbox->dictionary_samples);
+    mailbox->dictionary_samples = NULL;
+    mailbox->dictionary_samples_len = 0;
+}
+
+int write_dictionary(struct mailbox *mailbox, const char *data, size_t len) {
+    char path[PATH_BUF], temp_path[PATH_BUF];
+
+    int snprintf_result = snprintf(path, sizeof(path), "%s/%s/%s", mail_spool_directory, mailbox->username, DICTIONARY_FILE);
+    if (snprintf_result >= sizeof(path) || snprintf_result < 0) {
+        return -1;
+    }
+    snprintf_result = snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    if (snprintf_result >= sizeof(temp_path) || snprintf_result < 0) {
+        return -1;
+    }
+    struct compression_dictionary *dictionary = malloc(sizeof(struct compression_dictionary) + len);
+    if (!dictionary) {
+        return -1;
+    }
+
+    //Ohne Wörterbuch sind die damit komprimierten Nachrichten verloren: immer vor der ersten Verwendung auf die Platte
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        free(dictionary);
+        return -1;
+    }
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(fd, data + written, len - written);
+        if (n <= 0) {
+            break;
+        }
+        written += n;
+    }
+    int result = written == len && fdatasync(fd) == 0 ? 0 : -1;
+    if (close(fd) == -1 || result == -1 || rename(temp_path, path) == -1 || fsync(mailbox_dir_fd(mailbox)) == -1) {
+        unlink(temp_path);
+        free(dictionary);
+        return -1;
+    }
+    memcpy(dictionary->data, data, len);
+    dictionary->len = len;
+    dictionary->id = adler32(adler32(0, NULL, 0), dictionary->data, len);
+    mailbox->dictionary = dictionary;
+    return 0;
+}
+
+int load_dictionary(struct mailbox *mailbox, const char *dirpath) {
+    char path[PATH_BUF];
+    struct stat st;
+
+    int snprintf_result = snprintf(path, sizeof(path), "%s/%s", dirpath, DICTIONARY_FILE);
+    if (snprintf_result >= sizeof(path) || snprintf_result < 0) {
+        return -1;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return errno == ENOENT ? 0 : -1; //noch nicht trainiert
+    }
+    if (fstat(fd, &st) == -1 || st.st_size <= 0 || st.st_size > DICTIONARY_SIZE) {
+        close(fd);
+        return -1;
+    }
+    struct compression_dictionary *dictionary = malloc(sizeof(struct compression_dictionary) + st.st_size);
+    if (!dictionary) {
+        close(fd);
+        return -1;
+    }
+    ssize_t length = read(fd, dictionary->data, st.st_size);
+    close(fd);
+    if (length != st.st_size) {
+        free(dictionary);
+        return -1;
+    }
+    dictionary->len = length;
+    dictionary->id = adler32(adler32(0, NULL, 0), dictionary->data, length);
+    mailbox->dictionary = dictionary;
+    return 0;
+}
+
+int scan_spool(long threads) {
+    struct dirent *entry;
+    uint64_t start = stats_now();
+    long capacity = 0;
+
+    //Mailbox-Verzeichnisse sammeln (.blobs, .replog, .quarantine usw. sind keine gültigen Benutzernamen):
+    DIR *dir = opendir(mail_spool_directory);
+    if (!dir) {
+        perror("Failed to open mail spool directory");
+        return -1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (!valid_username(entry->d_name) || (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN)) {
+            continue;
+        }
+        if (spool_scan.count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            void *names = realloc(spool_scan.names, capacity * sizeof(*spool_scan.names));
+            if (!names) {
+                perror("Failed to allocate spool scan");
+                closedir(dir);
+                return -1;
+            }
+            spool_scan.names = names;
+        }
+        strcpy(spool_scan.names[spool_scan.count++], entry->d_name);
+    }
+    closedir(dir);
+
+    //Threads holen sich die Mailboxen einzeln, große Mailboxen halten so nicht den ganzen Scan auf:
+    if (threads > spool_scan.count) {
+        threads = spool_scan.count > 0 ? spool_scan.count : 1;
+    }
+    pthread_t *scan_threads = malloc(sizeof(pthread_t) * threads);
+    if (!scan_threads) {
+        perror("Failed to allocate spool scan");
+        return -1;
+    }
+    for (long i = 0; i < threads; i++) {
+        if (pthread_create(&scan_threads[i], NULL, scanThread, NULL) != 0) {
+            perror("Failed to create scan thread");
+            return -1;
+        }
+    }
+    uint64_t reported = start;
+    while (__atomic_load_n(&spool_scan.done, __ATOMIC_RELAXED) < spool_scan.count) {
+        usleep(DRAIN_POLL_MS * 1000);
+        if (stats_now() - reported >= SCAN_PROGRESS_INTERVAL * 1000000000ULL) {
+            reported = stats_now();
+            printf("Scanning mail spool: %ld/%ld mailboxes, %ld files quarantined\n", __atomic_load_n(&spool_scan.done, __ATOMIC_RELAXED), spool_scan.count,
+                   __atomic_load_n(&spool_scan.quarantined, __ATOMIC_RELAXED));
+            fflush(stdout);
+        }
+    }
+    for (long i = 0; i < threads; i++) {
+        pthread_join(scan_threads[i], NULL);
+    }
+    free(scan_threads);
+    scan_blobs(); //erst jetzt: verwaiste Links aus den Mailboxen zählen bis hierher noch als Referenz
+
+    printf("Mail spool scanned in %.2f s with %ld threads: %ld mailboxes, %ld messages, %ld files quarantined, %ld entries without message removed\n",
+           (stats_now() - start) / 1e9, threads, spool_scan.count, spool_scan.messages, spool_scan.quarantined, spool_scan.dropped);
+    fflush(stdout);
+    free(spool_scan.names);
+    spool_scan.names = NULL;
+    return 0;
+}
+
+void *scanThread(void *data) {
+    (void)data;
+    stats = calloc(1, sizeof(struct worker_stats)); //lock_mailbox() misst die Wartezeit, gezählt wird hier nichts
+    if (!stats) {
+        perror("Failed to allocate scan statistics");
+        return NULL;
+    }
+    long index;
+    while ((index = __atomic_fetch_add(&spool_scan.next, 1, __ATOMIC_RELAXED)) < spool_scan.count) {
+        scan_mailbox(spool_scan.names[index]);
+        __atomic_fetch_add(&spool_scan.done, 1, __ATOMIC_RELAXED);
+    }
+    free(stats);
+    stats = NULL;
+    return NULL;
+}
+
+void scan_mailbox(const char *username) {
+    char dirpath[PATH_BUF], path[PATH_BUF];
+    char (*names)[MESSAGE_NAME_LEN] = NULL;
+    char *referenced = NULL;
+    size_t name_count = 0, name_capacity = 0;
+    struct dirent *entry;
+    struct stat st;
+
+    //Laden baut den Index bzw. prüft Manifest und Kopfdaten-Cache:
+    pthread_rwlock_t *lock = lock_mailbox(username, 1);
+    struct mailbox *mailbox = get_mailbox(username);
+    int snprintf_result = snprintf(dirpath, sizeof(dirpath), "%s/%s", mail_spool_directory, username);
+    DIR *dir = snprintf_result >= sizeof(dirpath) || snprintf_result < 0 ? NULL : opendir(dirpath);
+    if (!mailbox || !dir) {
+        fprintf(stderr, "Failed to scan mailbox %s\n", username);
+        if (dir) {
+            closedir(dir);
+        }
+        pthread_rwlock_unlock(lock);
+        return;
+    }
+
+    //tmp_<key>: SEND beim Absturz nicht fertig geworden; *.tmp: abgebrochenes Neuschreiben von Manifest, Index oder Cache
+    while ((entry = readdir(dir)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        if (strncmp(entry->d_name, "tmp_", 4) == 0 || (length > 4 && strcmp(entry->d_name + length - 4, ".tmp") == 0)) {
+            quarantine_file(username, entry->d_name);
+        } else if (strncmp(entry->d_name, "message_", 8) == 0 && length < MESSAGE_NAME_LEN) {
+            if (name_count == name_capacity) {
+                name_capacity = name_capacity ? name_capacity * 2 : 64;
+                void *grown = realloc(names, name_capacity * MESSAGE_NAME_LEN);
+                if (!grown) {
+                    break;
+                }
+                names = grown;
+            }
+            strcpy(names[name_count++], entry->d_name);
+        }
+    }
+    if (name_count > 0) {
+        qsort(names, name_count, MESSAGE_NAME_LEN, compare_names);
+    }
+    referenced = calloc(name_count ? name_count : 1, 1);
+
+    //Jede Nachricht muss vollständig vorhanden sein (Datei mit der gespeicherten Größe bzw. Bereich im Segment):
+    unsigned int checked_segment = 0;
+    off_t segment_size = -1;
+    for (int i = 0; i < mailbox->count && referenced;) {
+        struct message_entry *message = &mailbox->messages[i];
+        int valid;
+        if (message->segment != 0) {
+            if (message->segment != checked_segment) {
+                checked_segment = message->segment;
+                segment_size = segment_path(path, sizeof(path), username, checked_segment) == 0 && stat(path, &st) == 0 ? st.st_size : -1;
+            }
+            valid = message->offset + message->size <= segment_size;
+        } else {
+            char (*name)[MESSAGE_NAME_LEN] = name_count ? bsearch(message->file_name, names, name_count, MESSAGE_NAME_LEN, compare_names) : NULL;
+            valid = name && fstatat(dirfd(dir), message->file_name, &st, 0) == 0 && st.st_size == message->size;
+            if (name) {
+                referenced[name - names] = 1;
+                if (!valid) {
+                    quarantine_file(username, message->file_name); //abgeschnitten (Absturz ohne --durability)
+                }
+            }
+        }
+        if (valid) {
+            i++;
+            continue;
+        }
+        drop_message_entry(mailbox, i);
+        __atomic_fetch_add(&spool_scan.dropped, 1, __ATOMIC_RELAXED);
+    }
+
+    //Dateien ohne Eintrag im Manifest: zugestellt, aber vor dem Manifest-Eintrag abgebrochen (nie mit OK bestätigt)
+    for (size_t i = 0; i < name_count && referenced; i++) {
+        if (!referenced[i]) {
+            quarantine_file(username, names[i]);
+        }
+    }
+    __atomic_fetch_add(&spool_scan.messages, mailbox->count, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(lock);
+    closedir(dir);
+    free(referenced);
+    free(names);
+}
+
+void scan_blobs(void) {
+    char dirpath[PATH_BUF];
+    struct dirent *entry;
+    struct stat st;
+
+    int snprintf_result = snprintf(dirpath, sizeof(dirpath), "%s/%s", mail_spool_directory, BLOB_DIR);
+    DIR *dir = snprintf_result >= sizeof(dirpath) || snprintf_result < 0 ? NULL : opendir(dirpath);
+    if (!dir) {
+        return; //noch nie an mehrere Empfänger gesendet
+    }
+    //Erst die tmp_<key>: ist der Text schon als Blob abgelegt, ist tmp_ nur ein zusätzlicher Link
+    for (int pass = 0; pass < 2; pass++) {
+        rewinddir(dir);
+        while ((entry = readdir(dir)) != NULL) {
+            int temp = strncmp(entry->d_name, "tmp_", 4) == 0;
+            if (entry->d_name[0] == '.' || temp != (pass == 0) || fstatat(dirfd(dir), entry->d_name, &st, 0) == -1) {
+                continue;
+            }
+            if (temp && st.st_nlink > 1) {
+                if (unlinkat(dirfd(dir), entry->d_name, 0) == -1) {
+                    perror("Failed to remove temporary blob link");
+                }
+            } else if (temp || st.st_nlink == 1) { //halber Text bzw. Blob ohne Mailbox, die darauf verweist
+                quarantine_file(BLOB_DIR, entry->d_name);
+            }
+        }
+    }
+    closedir(dir);
+}
+
+int quarantine_file(const char *directory, const char *name) {
+    char path[PATH_BUF], target[PATH_BUF];
+
+    int snprintf_result = snprintf(target, sizeof(target), "%s/%s", mail_spool_directory, QUARANTINE_DIR);
+    if (snprintf_result >= sizeof(target) || snprintf_result < 0 || create_directory(target) == -1) {
+        return -1;
+    }
+    snprintf_result = snprintf(target, sizeof(target), "%s/%s/%s", mail_spool_directory, QUARANTINE_DIR, directory);
+    if (snprintf_result >= sizeof(target) || snprintf_result < 0 || create_directory(target) == -1) {
+        return -1;
+    }
+    snprintf_result = snprintf(target, sizeof(target), "%s/%s/%s/%s", mail_spool_directory, QUARANTINE_DIR, directory, name);
+    if (snprintf_result >= sizeof(target) || snprintf_result < 0) {
+        return -1;
+    }
+    snprintf_result = snprintf(path, sizeof(path), "%s/%s/%s", mail_spool_directory, directory, name);
+    if (snprintf_result >= sizeof(path) || snprintf_result < 0) {
+        return -1;
+    }
+    if (rename(path, target) == -1) {
+        perror("Failed to quarantine file");
+        return -1;
+    }
+    fprintf(stderr, "Quarantined %s/%s\n", directory, name);
+    __atomic_fetch_add(&spool_scan.quarantined, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void drop_message_entry(struct mailbox *mailbox, int index) {
+    struct message_entry *entry = &mailbox->messages[index];
+
+    if (append_manifest_record(mailbox, MANIFEST_DELETE, entry) == -1) {
+        perror("Failed to update mailbox manifest");
+    }
+    delete_header_record(mailbox, entry);
+    if (entry->segment != 0) {
+        mailbox->live_bytes -= entry->size;
+        mailbox->dead_bytes += entry->size;
+    }
+    remove_message_entry(mailbox, index);
+    mailbox->tombstones++;
+}
+
+void handle_mailboxes(struct connection *conn) {
+    char (*names)[9] = NULL;
+    long count = 0, capacity = 0;
+    struct dirent *entry;
+
+    DIR *dir = opendir(mail_spool_directory);
+    if (!dir) {
+        output_append(conn, "ERR\n", 4);
+        return;
+    }
+    //Nur Mailboxen mit Nachrichten (nach dem Umverteilen bleiben leere Verzeichnisse zurück),
+    //.blobs, .replog usw. sind keine gültigen Benutzernamen:
+    while ((entry = readdir(dir)) != NULL) {
+        if (!valid_username(entry->d_name) || (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN)) {
+            continue;
+        }
+        pthread_rwlock_t *lock = lock_mailbox(entry->d_name, 0);
+        struct mailbox *mailbox = get_mailbox(entry->d_name);
+        long messages = mailbox ? mailbox->count : 0;
+        pthread_rwlock_unlock(lock);
+        if (messages == 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            void *grown = realloc(names, capacity * sizeof(*names));
+            if (!grown) {
+                break;
+            }
+            names = grown;
+        }
+        strcpy(names[count++], entry->d_name);
+    }
+    closedir(dir);
+
+    //Antwort im LIST-Format: Anzahl, dann ein Benutzername pro Zeile
+    int result = output_printf(conn, "%ld\n", count);
+    for (long i = 0; i < count && result == 0; i++) {
+        result = output_printf(conn, "%s\n", names[i]);
+    }
+    free(names);
+}
+
+void handle_stats(struct connection *conn) {
+    char *text = NULL;
+    size_t length = 0;
+    uint64_t start = stats_now();
+
+    //Antwort im LIST-Format: Anzahl Zeilen, danach die Zeilen
+    FILE *out = open_memstream(&text, &length);
+    if (!out) {
+        output_append(conn, "ERR\n", 4);
+        return;
+    }
+    int lines = write_stats(out);
+    if (fclose(out) != 0 || lines < 0) {
+        free(text);
+        output_append(conn, "ERR\n", 4);
+        return;
+    }
+    output_printf(conn, "%d\n", lines);
+    output_append(conn, text, length);
+    free(text);
+    accounted_ns += stats_record(&stats->commands[CMD_STATS], start);
+}
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts); //vDSO, kein Systemaufruf
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_add(unsigned long *counter, unsigned long value) {
+    //Nur ein Schreiber pro Zähler: load + store statt eines teuren atomaren Read-Modify-Write
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+void stats_sample(struct latency_histogram *histogram, uint64_t ns) {
+    int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    if (bucket >= STATS_BUCKETS) {
+        bucket = STATS_BUCKETS - 1;
+    }
+    stats_add(&histogram->buckets[bucket], 1);
+    stats_add(&histogram->count, 1);
+    stats_add(&histogram->sum_ns, ns);
+    if (ns > __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&histogram->max_ns, ns, __ATOMIC_RELAXED);
+    }
+}
+
+uint64_t stats_record(struct latency_histogram *histogram, uint64_t start) {
+    uint64_t ns = stats_now() - start;
+    stats_sample(histogram, ns);
+    return ns;
+}
+
+unsigned long histogram_percentile(const struct latency_histogram *histogram, double percentile) {
+    unsigned long rank = (unsigned long)(histogram->count * percentile / 100.0);
+    unsigned long seen = 0;
+
+    for (int bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+        seen += histogram->buckets[bucket];
+        if (seen > rank) {
+            unsigned long upper = bucket == 0 ? 0 : (1UL << bucket) - 1;
+            return upper < histogram->max_ns ? upper : histogram->max_ns;
+        }
+    }
+    return histogram->max_ns;
+}
+
+//Histogramme aller Worker summieren (Momentaufnahme, Werte können leicht auseinanderlaufen):
+void merge_histogram(struct latency_histogram *total, const struct latency_histogram *histogram) {
+    for (int bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+        total->buckets[bucket] += __atomic_load_n(&histogram->buckets[bucket], __ATOMIC_RELAXED);
+    }
+    total->count += __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    total->sum_ns += __atomic_load_n(&histogram->sum_ns, __ATOMIC_RELAXED);
+    unsigned long max_ns = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    if (max_ns > total->max_ns) {
+        total->max_ns = max_ns;
+    }
+}
+
+void write_histogram(FILE *out, const char *kind, const char *name, const struct latency_histogram *histogram) {
+    fprintf(out, "%s=%s count=%lu avg_us=%.1f p50_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f\n", kind, name, histogram->count,
+            histogram->count ? histogram->sum_ns / 1000.0 / histogram->count : 0.0,
+            histogram_percentile(histogram, 50.0) / 1000.0, histogram_percentile(histogram, 99.0) / 1000.0,
+            histogram_percentile(histogram, 99.9) / 1000.0, histogram->max_ns / 1000.0);
+}
+
+int write_stats(FILE *out) {
+    struct latency_histogram commands[CMD_COUNT], timers[TIMER_COUNT];
+    unsigned long bytes_received = 0, bytes_sent = 0;
+    unsigned long compressed = 0, plain_bytes = 0, stored_bytes = 0;
+    int lines = 0;
+
+    memset(commands, 0, sizeof(commands));
+    memset(timers, 0, sizeof(timers));
+    for (long i = 0; i < worker_stats_count; i++) {
+        for (int c = 0; c < CMD_COUNT; c++) {
+            merge_histogram(&commands[c], &worker_stats[i].commands[c]);
+        }
+        for (int t = 0; t < TIMER_COUNT; t++) {
+            merge_histogram(&timers[t], &worker_stats[i].timers[t]);
+        }
+        bytes_received += __atomic_load_n(&worker_stats[i].bytes_received, __ATOMIC_RELAXED);
+        bytes_sent += __atomic_load_n(&worker_stats[i].bytes_sent, __ATOMIC_RELAXED);
+        compressed += __atomic_load_n(&worker_stats[i].compressed_messages, __ATOMIC_RELAXED);
+        plain_bytes += __atomic_load_n(&worker_stats[i].compressed_plain_bytes, __ATOMIC_RELAXED);
+        stored_bytes += __atomic_load_n(&worker_stats[i].compressed_stored_bytes, __ATOMIC_RELAXED);
+    }
+
+    unsigned long accepted = 0;
+    for (long i = 0; i < loop_count; i++) {
+        accepted += __atomic_load_n(&loops[i].connections_accepted, __ATOMIC_RELAXED);
+    }
+    unsigned long closed = __atomic_load_n(&connections_closed, __ATOMIC_RELAXED);
+    fprintf(out, "uptime_s=%ld workers=%ld listeners=%ld connections_accepted=%lu connections_open=%lu bytes_received=%lu bytes_sent=%lu\n",
+            (long)(time(NULL) - start_time), worker_stats_count, loop_count, accepted, accepted - closed, bytes_received, bytes_sent);
+    lines++;
+    fprintf(out, "compression=%s messages=%lu plain_bytes=%lu stored_bytes=%lu\n", compress_bodies ? "deflate" : "none", compressed, plain_bytes, stored_bytes);
+    lines++;
+    pthread_mutex_lock(&replication.mutex);
+    int followers = 0;
+    for (int i = 0; i < REPLICATION_FOLLOWERS_MAX; i++) {
+        followers += replication.follower_fds[i] != -1 && replication.sender_started[i];
+    }
+    off_t log_bytes = replication.size;
+    for (int i = 0; i < replication.segment_count - 1; i++) {
+        log_bytes += replication.segments[i].size;
+    }
+    fprintf(out, "replication=%s seq=%llu first_seq=%llu log_bytes=%lld log_segments=%d followers=%d primary_connected=%d\n", follow_host[0] ? "follower" : replication.fd != -1 ? "primary" : "off",
+            (unsigned long long)replication.seq, replication.segment_count ? (unsigned long long)replication.segments[0].first_seq : 0ULL, (long long)log_bytes, replication.segment_count, followers, replication.connected);
+    pthread_mutex_unlock(&replication.mutex);
+    lines++;
+    for (int c = CMD_SEND; c < CMD_COUNT; c++) {
+        write_histogram(out, "command", command_names[c], &commands[c]);
+        lines++;
+    }
+    for (int t = 0; t < TIMER_COUNT; t++) {
+        write_histogram(out, "timer", timer_names[t], &timers[t]);
+        lines++;
+    }
+
+    //Pro Worker: Auslastung und Lock-Konkurrenz (Summen in Mikrosekunden)
+    for (long i = 0; i < worker_stats_count; i++) {
+        unsigned long commands_done = 0;
+        for (int c = CMD_SEND; c < CMD_COUNT; c++) {
+            commands_done += __atomic_load_n(&worker_stats[i].commands[c].count, __ATOMIC_RELAXED);
+        }
+        fprintf(out, "worker=%ld commands=%lu", i, commands_done);
+        for (int t = 0; t < TIMER_COUNT; t++) {
+            fprintf(out, " %s_us=%lu", timer_names[t], __atomic_load_n(&worker_stats[i].timers[t].sum_ns, __ATOMIC_RELAXED) / 1000);
+        }
+        fprintf(out, "\n");
+        lines++;
+    }
+    lines += write_pool_stats(out);
+    return ferror(out) ? -1 : lines;
+}
+
+int write_pool_stats(FILE *out) {
+    int lines = 0;
+
+    for (int id = 0; id < POOL_COUNT; id++) {
+        unsigned long allocs = 0, frees = 0;
+        long cached = 0;
+        pthread_mutex_lock(&pool_threads_mutex);
+        for (struct pool_thread *thread = pool_threads; thread; thread = thread->next) {
+            allocs += __atomic_load_n(&thread->caches[id].allocs, __ATOMIC_RELAXED);
+            frees += __atomic_load_n(&thread->caches[id].frees, __ATOMIC_RELAXED);
+            cached += __atomic_load_n(&thread->caches[id].count, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&pool_threads_mutex);
+        pthread_mutex_lock(&pools[id].mutex);
+        cached += pools[id].depot_count;
+        unsigned long slabs = pools[id].slabs, objects = pools[id].objects;
+        pthread_mutex_unlock(&pools[id].mutex);
+        fprintf(out, "pool=%s size=%zu allocs=%lu in_use=%ld cached=%ld slabs=%lu bytes=%lu\n",
+                pool_names[id], pools[id].size, allocs, (long)(allocs - frees), cached, slabs, objects * pools[id].size);
+        lines++;
+    }
+    fprintf(out, "pool=oversize allocs=%lu\n", __atomic_load_n(&buffer_oversize, __ATOMIC_RELAXED));
+    return lines + 1;
+}
+
+void *statsThread(void *data) {
+    char temp_path[PATH_BUF];
+    struct timespec deadline;
+    int done = 0;
+
+    int snprintf_result = snprintf(temp_path, sizeof(temp_path), "%s.tmp", stats_file);
+    if (snprintf_result >= sizeof(temp_path) || snprintf_result < 0) {
+        fprintf(stderr, "Stats file path too long\n");
+        return NULL;
+    }
+
+    while (!done) {
+        //Bis zum nächsten Intervall oder bis zum Herunterfahren warten:
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += stats_interval;
+        pthread_mutex_lock(&stats_mutex);
+        while (!stats_shutdown) {
+            if (pthread_cond_timedwait(&stats_cond, &stats_mutex, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        done = stats_shutdown;
+        pthread_mutex_unlock(&stats_mutex);
+
+        //Neuen Stand in eine temporäre Datei schreiben und atomar ersetzen:
+        FILE *out = fopen(temp_path, "w");
+        if (!out) {
+            perror("Failed to write stats file");
+            continue;
+        }
+        fprintf(out, "time=%ld\n", (long)time(NULL));
+        int lines = write_stats(out);
+        if (fclose(out) != 0 || lines < 0 || rename(temp_path, stats_file) == -1) {
+            perror("Failed to write stats file");
+            unlink(temp_path);
+        }
+    }
+    return NULL;
+}
+
+int open_replication_log(void) {
+    char path[PATH_BUF], legacy[PATH_BUF];
+    struct replication_record record;
+    struct stat st;
+    struct dirent *entry;
+    long *numbers = NULL;
+    int count = 0, capacity = 0;
+
+    //Log aus der Zeit vor den Segmenten wird zum ersten Segment:
+    int snprintf_result = snprintf(path, sizeof(path), "%s/%s.1", mail_spool_directory, REPLICATION_LOG);
+    int legacy_result = snprintf(legacy, sizeof(legacy), "%s/%s", mail_spool_directory, REPLICATION_LOG);
+    if (snprintf_result >= sizeof(path) || snprintf_result < 0 || legacy_result >= sizeof(legacy) || legacy_result < 0) {
+        fprintf(stderr, "Replication log path too long\n");
+        return -1;
+    }
+    if (access(path, F_OK) == -1 && rename(legacy, path) == -1 && errno != ENOENT) {
+        perror("Failed to rename replication log");
+        return -1;
+    }
+
+    //Segmente suchen, nur die lückenlose Folge bis zum neuesten zählt:
+    DIR *dir = opendir(mail_spool_directory);
+    if (!dir) {
+        perror("Failed to open mail spool directory");
+        return -1;
+    }
     while ((entry = readdir(dir)) != NULL) {
-        if (strstr(entry->d_name, "message_") != NULL) {
-            count++;
-            if (count == message_num) {
-                char message_path[PATH_BUF];
-                snprintf_result = snprintf(message_path, sizeof(message_path), "%s/%s", filepath, entry->d_name);
-                if (snprintf_result >= sizeof(message_path) || snprintf_result < 0) {
-                    send(socket, "ERR\n", 4, 0);
-                    closedir(dir);
-                    return;
+        unsigned int number;
+        int end = 0;
+        if (sscanf(entry->d_name, REPLICATION_LOG ".%u%n", &number, &end) != 1 || entry->d_name[end] != '\0' || number == 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            long *grown = realloc(numbers, capacity * sizeof(long));
+            if (!grown) {
+                perror("Failed to allocate replication segments");
+                free(numbers);
+                closedir(dir);
+                return -1;
+            }
+            numbers = grown;
+        }
+        numbers[count++] = number;
+    }
+    closedir(dir);
+    if (count == 0 && (numbers = malloc(sizeof(long))) != NULL) {
+        numbers[count++] = 1;
+    }
+    qsort(numbers, count, sizeof(long), compare_ids);
+    int start = count - 1;
+    while (start > 0 && numbers[start - 1] == numbers[start] - 1) {
+        start--;
+    }
+    if (start > 0) {
+        fprintf(stderr, "Ignoring replication log segments before %ld (gap in numbering)\n", numbers[start]);
+    }
+    replication.segment_capacity = count - start;
+    if (!numbers || (replication.segments = calloc(replication.segment_capacity, sizeof(struct replication_segment))) == NULL) {
+        perror("Failed to allocate replication segments");
+        free(numbers);
+        return -1;
+    }
+
+    //Datensätze durchgehen: erste/letzte Nummer je Segment, Index und Ende des letzten vollständigen Datensatzes
+    for (int i = start; i < count; i++) {
+        int last = i == count - 1;
+        int fd = open_replication_segment(numbers[i], last ? O_RDWR | O_CREAT | O_APPEND : O_RDONLY);
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            perror("Failed to open replication log");
+            free(numbers);
+            return -1;
+        }
+        struct replication_segment *segment = &replication.segments[replication.segment_count++];
+        segment->number = numbers[i];
+        segment->first_seq = replication.seq + 1;
+        off_t offset = 0;
+        while (offset + (off_t)sizeof(record) <= st.st_size && pread(fd, &record, sizeof(record), offset) == sizeof(record) &&
+               record.magic == REPLICATION_MAGIC && offset + (off_t)sizeof(record) + record.length <= st.st_size) {
+            if (offset == 0) {
+                segment->first_seq = record.seq;
+            }
+            add_replication_mark(record.seq, segment->number, offset);
+            replication.seq = record.seq;
+            offset += sizeof(record) + record.length;
+        }
+        if (!last) {
+            segment->size = offset;
+            close(fd);
+            continue;
+        }
+        if (offset < st.st_size) { //Absturz mitten im Schreiben: Rest abschneiden, Follower lesen nur vollständige Datensätze
+            fprintf(stderr, "Truncating %lld incomplete bytes after seq %llu from replication log\n", (long long)(st.st_size - offset), (unsigned long long)replication.seq);
+            if (ftruncate(fd, offset) == -1) {
+                perror("Failed to truncate replication log");
+                close(fd);
+                free(numbers);
+                return -1;
+            }
+        }
+        replication.fd = fd;
+        replication.size = offset;
+    }
+    free(numbers);
+    trim_replication_log(); //noch kein Follower verbunden: nur --replication-retain zählt
+    return 0;
+}
+
+int open_replication_segment(unsigned int number, int flags) {
+    char path[PATH_BUF];
+
+    int snprintf_result = snprintf(path, sizeof(path), "%s/%s.%u", mail_spool_directory, REPLICATION_LOG, number);
+    if (snprintf_result >= sizeof(path) || snprintf_result < 0) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return open(path, flags | O_CLOEXEC, 0666);
+}
+
+void add_replication_mark(uint64_t seq, unsigned int segment, off_t offset) {
+    struct replication_mark *last = replication.mark_count ? &replication.marks[replication.mark_count - 1] : NULL;
+
+    if (last && last->segment == segment && seq < last->seq + REPLICATION_MARK_RECORDS) {
+        return;
+    }
+    if (replication.mark_count == replication.mark_capacity) {
+        size_t capacity = replication.mark_capacity ? replication.mark_capacity * 2 : 1024;
+        struct replication_mark *marks = realloc(replication.marks, capacity * sizeof(struct replication_mark));
+        if (!marks) { //ohne Eintrag liest find_replication_offset nur weiter ab der vorigen Marke
+            return;
+        }
+        replication.marks = marks;
+        replication.mark_capacity = capacity;
+    }
+    replication.marks[replication.mark_count++] = (struct replication_mark){ seq, segment, offset };
+}
+
+int rotate_replication_log(void) {
+    if (replication.segment_count == replication.segment_capacity) {
+        int capacity = replication.segment_capacity * 2;
+        struct replication_segment *segments = realloc(replication.segments, capacity * sizeof(struct replication_segment));
+        if (!segments) {
+            return -1;
+        }
+        replication.segments = segments;
+        replication.segment_capacity = capacity;
+    }
+    struct replication_segment *active = &replication.segments[replication.segment_count - 1];
+    int fd = open_replication_segment(active->number + 1, O_RDWR | O_CREAT | O_APPEND | O_TRUNC);
+    if (fd == -1) {
+        return -1;
+    }
+    if (durability_mode != DURABILITY_NONE) { //neuer Verzeichniseintrag muss vor dem ersten Datensatz darin auf der Platte sein
+        int dir_fd = open(mail_spool_directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd == -1 || fsync(dir_fd) == -1) {
+            perror("Failed to sync mail spool directory");
+        }
+        if (dir_fd != -1) {
+            close(dir_fd);
+        }
+    }
+    active->size = replication.size;
+    close(replication.fd); //ausstehende Syncs halten eigene Kopien (sync_later)
+    replication.fd = fd;
+    replication.size = 0;
+    replication.segments[replication.segment_count++] = (struct replication_segment){ active->number + 1, replication.seq + 1, 0 };
+    return 0;
+}
+
+void trim_replication_log(void) {
+    off_t retained = 0;
+    int drop = 0;
+
+    //Abgeschlossene Segmente von vorne: weg, wenn jeder verbundene Follower sie bestätigt hat und danach noch --replication-retain übrig bleibt
+    pthread_mutex_lock(&replication.mutex);
+    for (int i = 0; i < replication.segment_count - 1; i++) {
+        retained += replication.segments[i].size;
+    }
+    while (drop < replication.segment_count - 1 && retained - replication.segments[drop].size >= replication_retain) {
+        uint64_t last_seq = replication.segments[drop + 1].first_seq - 1;
+        int confirmed = 1;
+        for (int i = 0; i < REPLICATION_FOLLOWERS_MAX && confirmed; i++) {
+            confirmed = replication.follower_fds[i] == -1 || replication.confirmed[i] >= last_seq;
+        }
+        if (!confirmed) {
+            break;
+        }
+        retained -= replication.segments[drop++].size;
+    }
+    unsigned int first = replication.segments[0].number;
+    if (drop > 0) {
+        replication.segment_count -= drop;
+        memmove(replication.segments, replication.segments + drop, replication.segment_count * sizeof(struct replication_segment));
+        size_t marks = 0;
+        while (marks < replication.mark_count && replication.marks[marks].segment < replication.segments[0].number) {
+            marks++;
+        }
+        replication.mark_count -= marks;
+        memmove(replication.marks, replication.marks + marks, replication.mark_count * sizeof(struct replication_mark));
+    }
+    pthread_mutex_unlock(&replication.mutex);
+
+    //Löschen außerhalb des Locks, Sender haben diese Segmente schon hinter sich:
+    for (int i = 0; i < drop; i++) {
+        char path[PATH_BUF];
+        int snprintf_result = snprintf(path, sizeof(path), "%s/%s.%u", mail_spool_directory, REPLICATION_LOG, first + i);
+        if (snprintf_result < sizeof(path) && snprintf_result >= 0 && unlink(path) == -1) {
+            perror("Failed to delete replication log segment");
+        }
+    }
+}
+
+int log_message(struct connection *conn, struct request *request, struct mailbox *mailbox, const struct message_entry *entry) {
+    off_t offset, size;
+    size_t len = 0;
+    int pool = -1;
+    char *data = NULL;
+
+    //Im Speicher liegt der Text unkomprimiert vor, sonst die zugestellte Datei zurücklesen (liegt noch im Page Cache):
+    if (request->in_memory) {
+        return log_replication(conn, request, REPLICATION_SEND, mailbox->username, entry->id, request->body_buffer, request->body_buffer_len);
+    }
+    int fd = open_message_entry(mailbox, entry, &offset, &size);
+    if (fd == -1) {
+        return -1;
+    }
+    if (entry->encoding != BODY_PLAIN) {
+        data = inflate_message(fd, offset, size, entry, mailbox->dictionary, &len, &pool);
+    } else if ((data = buffer_alloc(size, &pool)) != NULL) {
+        for (len = 0; len < (size_t)size; ) {
+            ssize_t n = pread(fd, data + len, size - len, offset + len);
+            if (n <= 0) {
+                buffer_free(data, pool);
+                data = NULL;
+                break;
+            }
+            len += n;
+        }
+    }
+    close(fd);
+    if (!data) {
+        return -1;
+    }
+    int result = log_replication(conn, request, REPLICATION_SEND, mailbox->username, entry->id, data, len);
+    buffer_free(data, pool);
+    return result;
+}
+
+int log_replication(struct connection *conn, struct request *request, uint32_t type, const char *username, long id, const char *data, size_t len) {
+    struct replication_record record;
+
+    if (len > UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+    memset(&record, 0, sizeof(record));
+    record.magic = REPLICATION_MAGIC;
+    record.type = type;
+    record.id = id;
+    snprintf(record.username, sizeof(record.username), "%s", username);
+    record.length = len;
+    record.checksum = len ? crc32(crc32(0, NULL, 0), (const Bytef *)data, len) : 0;
+    struct iovec iov[2] = { { &record, sizeof(record) }, { (void *)data, len } };
+
+    //Nummer vergeben und anhängen in einem Schritt (Follower übernehmen die Nummer des Primary):
+    pthread_mutex_lock(&replication.mutex);
+    int rotated = replication.size >= REPLICATION_SEGMENT_SIZE && rotate_replication_log() == 0;
+    if (replication.size >= REPLICATION_SEGMENT_SIZE && !rotated) {
+        perror("Failed to start replication log segment"); //weiter im bisherigen Segment
+    }
+    record.seq = request->replica_seq ? request->replica_seq : replication.seq + 1;
+    ssize_t written = writev(replication.fd, iov, len ? 2 : 1);
+    if (written != (ssize_t)(sizeof(record) + len)) {
+        if (ftruncate(replication.fd, replication.size) == -1) { //halben Datensatz entfernen
+            perror("Failed to truncate replication log");
+        }
+        pthread_mutex_unlock(&replication.mutex);
+        return -1;
+    }
+    add_replication_mark(record.seq, replication.segments[replication.segment_count - 1].number, replication.size);
+    replication.seq = record.seq;
+    replication.size += written;
+    if (durability_mode != DURABILITY_NONE) { //OK erst, wenn auch der Datensatz auf der Platte ist (Kopie, bevor ein neues Segment das fd schließt)
+        sync_later(conn, replication.fd);
+    }
+    pthread_cond_broadcast(&replication.cond); //wartende Sender wecken
+    pthread_mutex_unlock(&replication.mutex);
+
+    if (rotated) {
+        trim_replication_log();
+    }
+    return 0;
+}
+
+int open_replication_listener(void) {
+    struct sockaddr_in address;
+    int reuseValue = 1;
+
+    for (int i = 0; i < REPLICATION_FOLLOWERS_MAX; i++) {
+        replication.follower_fds[i] = -1;
+    }
+    if ((replication.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+        return -1;
+    }
+    if (setsockopt(replication.listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuseValue, sizeof(reuseValue)) == -1) {
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(replication_port);
+    if (bind(replication.listen_fd, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(replication.listen_fd, REPLICATION_FOLLOWERS_MAX) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+void *replicationThread(void *data) {
+    //Blockierendes accept(), beendet wird über shutdown() des Sockets in stop_replication:
+    while (1) {
+        int socket = accept4(replication.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (socket == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (!__atomic_load_n(&replication.shutdown, __ATOMIC_RELAXED)) {
+                perror("Accept follower error");
+            }
+            break;
+        }
+
+        //Freien Platz suchen, der Thread eines früheren Followers wird dabei abgeholt:
+        pthread_mutex_lock(&replication.mutex);
+        int slot = -1;
+        for (int i = 0; i < REPLICATION_FOLLOWERS_MAX && slot == -1; i++) {
+            slot = replication.follower_fds[i] == -1 ? i : -1;
+        }
+        if (slot != -1 && replication.sender_started[slot]) {
+            pthread_join(replication.senders[slot], NULL); //hat sich schon ausgetragen, endet sofort
+            replication.sender_started[slot] = 0;
+        }
+        if (slot != -1 && !replication.shutdown) {
+            replication.follower_fds[slot] = socket;
+            replication.confirmed[slot] = 0; //hält Segmente fest, bis der Sender die Anfrage kennt
+            if (pthread_create(&replication.senders[slot], NULL, senderThread, (void *)(long)slot) == 0) {
+                replication.sender_started[slot] = 1;
+                socket = -1;
+            } else {
+                replication.follower_fds[slot] = -1;
+            }
+        }
+        pthread_mutex_unlock(&replication.mutex);
+        if (socket != -1) {
+            fprintf(stderr, "Rejecting follower: no free replication slot\n");
+            close(socket);
+        }
+    }
+    return NULL;
+}
+
+void *senderThread(void *data) {
+    int slot = (int)(long)data;
+    int socket = replication.follower_fds[slot];
+    char line[64], acks[64];
+    size_t len = 0, ack_len = 0;
+    unsigned long long from;
+    unsigned int segment;
+    off_t offset;
+    int fd = -1;
+
+    //Anfrage "REPLICATE <seq>": der Follower hat alles vor <seq>
+    while (len < sizeof(line) - 1 && recv(socket, line + len, 1, 0) == 1 && line[len] != '\n') {
+        len++;
+    }
+    line[len] = '\0';
+    if (sscanf(line, "REPLICATE %llu", &from) == 1 && (fd = find_replication_offset(from, &segment, &offset)) == -1) {
+        reject_follower(socket, from); //gelöscht oder neuer als alles hier: Warten hilft nicht
+    }
+    if (fd != -1) {
+        pthread_mutex_lock(&replication.mutex);
+        replication.confirmed[slot] = from - 1;
+        pthread_mutex_unlock(&replication.mutex);
+        printf("Follower connected, streaming replication log from seq %llu...\n", from);
+        while (offset != -1) {
+            read_acks(slot, socket, acks, &ack_len);
+            pthread_mutex_lock(&replication.mutex);
+            int index, active;
+            while (1) {
+                index = (int)(segment - replication.segments[0].number);
+                active = index == replication.segment_count - 1;
+                if (replication.shutdown || !active || offset < replication.size) {
+                    break;
+                }
+                pthread_cond_wait(&replication.cond, &replication.mutex);
+            }
+            off_t end = replication.shutdown || index < 0 ? -1 : active ? replication.size : replication.segments[index].size;
+            pthread_mutex_unlock(&replication.mutex);
+
+            //Vollständige Datensätze ohne Umweg über den Userspace in den Socket:
+            while (end != -1 && offset < end) {
+                ssize_t sent = sendfile(socket, fd, &offset, end - offset);
+                if (sent == -1 && errno == EINTR) {
+                    continue;
                 }
+                if (sent <= 0) {
+                    end = -1; //Follower getrennt
+                }
+            }
 
-                if (remove(message_path) == 0) {
-                    send(socket, "OK\n", 3, 0); //Erfolgsnachricht senden
-                } else {
-                    send(socket, "ERR\n", 4, 0); //Fehler senden
+            //Abgeschlossenes Segment fertig: weiter im nächsten (wird erst gelöscht, wenn der Follower es bestätigt hat)
+            if (end != -1 && !active) {
+                close(fd);
+                if ((fd = open_replication_segment(++segment, O_RDONLY)) == -1) {
+                    perror("Failed to open replication log segment");
+                    end = -1;
                 }
-                closedir(dir);
-                return;
+                offset = 0;
             }
+            offset = end == -1 ? -1 : offset;
         }
+        if (fd != -1) {
+            close(fd);
+        }
+        printf("Follower disconnected\n");
     }
 
-    send(socket, "ERR\n", 4, 0); //Fehler, wenn die Nachricht nicht gefunden wurde
-    closedir(dir);
+    pthread_mutex_lock(&replication.mutex);
+    replication.follower_fds[slot] = -1; //Thread wird beim nächsten Follower oder in stop_replication abgeholt
+    pthread_mutex_unlock(&replication.mutex);
+    close(socket);
+    trim_replication_log(); //hat dieser Follower als letzter Segmente festgehalten?
+    return NULL;
+}
+
+int find_replication_offset(uint64_t seq, unsigned int *segment, off_t *offset) {
+    struct replication_record record;
+
+    //Nur, was noch im Log liegt oder als nächstes geschrieben wird:
+    pthread_mutex_lock(&replication.mutex);
+    if (seq < replication.segments[0].first_seq || seq > replication.seq + 1) {
+        pthread_mutex_unlock(&replication.mutex);
+        return -1;
+    }
+    //Letzte Marke mit seq <= gesuchter Nummer (binäre Suche):
+    size_t low = 0, high = replication.mark_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (replication.marks[middle].seq <= seq) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    *segment = low ? replication.marks[low - 1].segment : replication.segments[0].number;
+    *offset = low ? replication.marks[low - 1].offset : 0;
+    pthread_mutex_unlock(&replication.mutex);
+
+    //Ab der Marke nur die Köpfe lesen, Nutzdaten überspringen (höchstens REPLICATION_MARK_RECORDS Datensätze):
+    while (1) {
+        int fd = open_replication_segment(*segment, O_RDONLY);
+        if (fd == -1) {
+            return -1;
+        }
+        pthread_mutex_lock(&replication.mutex);
+        int index = (int)(*segment - replication.segments[0].number);
+        int active = index == replication.segment_count - 1;
+        off_t end = index < 0 || index >= replication.segment_count ? -1 : active ? replication.size : replication.segments[index].size;
+        pthread_mutex_unlock(&replication.mutex);
+        if (end == -1) { //inzwischen gelöscht
+            close(fd);
+            return -1;
+        }
+        while (*offset < end && pread(fd, &record, sizeof(record), *offset) == sizeof(record) && record.seq < seq) {
+            *offset += sizeof(record) + record.length;
+        }
+        if (*offset < end || active) {
+            return fd;
+        }
+        close(fd); //Marke fehlte (kein Speicher): im nächsten Segment weitersuchen
+        (*segment)++;
+        *offset = 0;
+    }
+}
+
+void reject_follower(int socket, uint64_t seq) {
+    struct replication_record record;
+
+    memset(&record, 0, sizeof(record));
+    record.magic = REPLICATION_MAGIC;
+    record.type = REPLICATION_REJECT;
+    pthread_mutex_lock(&replication.mutex);
+    record.seq = replication.seq;
+    record.id = replication.segments[0].first_seq;
+    pthread_mutex_unlock(&replication.mutex);
+    fprintf(stderr, "Rejecting follower: seq %llu is not in the replication log (at seq %llu, oldest kept seq %llu)\n", (unsigned long long)seq, (unsigned long long)record.seq, (unsigned long long)record.id);
+    send(socket, &record, sizeof(record), MSG_NOSIGNAL);
+}
+
+void read_acks(int slot, int socket, char *buffer, size_t *len) {
+    unsigned long long seq, confirmed = 0;
+    ssize_t received;
+
+    //Zeilen "ACK <seq>\n", nur die höchste zählt:
+    while ((received = recv(socket, buffer + *len, 63 - *len, MSG_DONTWAIT)) > 0) {
+        *len += received;
+        buffer[*len] = '\0';
+        char *line = buffer, *newline;
+        while ((newline = strchr(line, '\n')) != NULL) {
+            if (sscanf(line, "ACK %llu", &seq) == 1 && seq > confirmed) {
+                confirmed = seq;
+            }
+            line = newline + 1;
+        }
+        *len -= line - buffer;
+        memmove(buffer, line, *len);
+        if (*len == 63) { //Zeile zu lang: verwerfen
+            *len = 0;
+        }
+    }
+    if (confirmed == 0) {
+        return;
+    }
+    pthread_mutex_lock(&replication.mutex);
+    int advanced = confirmed > replication.confirmed[slot] && confirmed <= replication.seq;
+    if (advanced) {
+        replication.confirmed[slot] = confirmed;
+    }
+    pthread_mutex_unlock(&replication.mutex);
+    if (advanced) {
+        trim_replication_log();
+    }
+}
+
+void stop_replication(pthread_t replication_thread, pthread_t follower_thread) {
+    //Wartende Sender wecken, blockierte send/recv über shutdown() abbrechen:
+    pthread_mutex_lock(&replication.mutex);
+    replication.shutdown = 1;
+    pthread_cond_broadcast(&replication.cond);
+    for (int i = 0; i < REPLICATION_FOLLOWERS_MAX; i++) {
+        if (replication.sender_started[i] && replication.follower_fds[i] != -1) {
+            shutdown(replication.follower_fds[i], SHUT_RDWR);
+        }
+    }
+    if (replication.primary_fd != -1) {
+        shutdown(replication.primary_fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&replication.mutex);
+
+    if (follow_host[0]) {
+        pthread_join(follower_thread, NULL);
+    }
+    if (replication_port) {
+        shutdown(replication.listen_fd, SHUT_RDWR); //accept() im Replikations-Thread abbrechen
+        pthread_join(replication_thread, NULL);
+        close(replication.listen_fd);
+        for (int i = 0; i < REPLICATION_FOLLOWERS_MAX; i++) {
+            if (replication.sender_started[i]) {
+                pthread_join(replication.senders[i], NULL);
+            }
+        }
+    }
+    if (replication.fd != -1) {
+        close(replication.fd);
+        replication.fd = -1;
+    }
+    free(replication.segments);
+    free(replication.marks);
+}
+
+void *followerThread(void *data) {
+    struct replication_record record;
+    struct timespec deadline;
+    int stop = 0;
+
+    worker_id = (unsigned int)(long)data; //eigener Statistik-Eintrag hinter den Workern
+    stats = &worker_stats[worker_id];
+    struct connection *conn = calloc(1, sizeof(struct connection)); //sammelt nur die Deskriptoren für --durability
+    if (!conn) {
+        perror("Failed to allocate follower state");
+        return NULL;
+    }
+
+    while (!stop) {
+        int socket = connect_primary();
+        pthread_mutex_lock(&replication.mutex);
+        stop = replication.shutdown;
+        if (socket != -1 && !stop) {
+            replication.primary_fd = socket;
+            replication.connected = 1;
+        } else if (!stop) { //Primary nicht erreichbar: später erneut versuchen
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += REPLICATION_RETRY_MS / 1000;
+            deadline.tv_nsec += (REPLICATION_RETRY_MS % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&replication.cond, &replication.mutex, &deadline);
+            stop = replication.shutdown;
+        }
+        pthread_mutex_unlock(&replication.mutex);
+        if (socket == -1 || stop) {
+            if (socket != -1) {
+                close(socket);
+            }
+            continue;
+        }
+
+        //Ab dem ersten fehlenden Datensatz anfragen, danach der Reihe nach anwenden:
+        char line[64];
+        int line_len = snprintf(line, sizeof(line), "REPLICATE %llu\n", (unsigned long long)replication.seq + 1);
+        if (send(socket, line, line_len, MSG_NOSIGNAL) == line_len) {
+            printf("Connected to primary %s:%s, replicating from seq %llu...\n", follow_host, follow_port, (unsigned long long)replication.seq + 1);
+        }
+        int unconfirmed = 0;
+        while (recv_all(socket, &record, sizeof(record)) == 0) {
+            if (record.magic == REPLICATION_MAGIC && record.type == REPLICATION_REJECT) {
+                //Primary hat den Anfang schon gelöscht oder ist hinter uns: Spool muss neu kopiert werden
+                fprintf(stderr, "Primary cannot replicate from seq %llu (it is at seq %llu, oldest kept seq %llu), stopped following\n",
+                        (unsigned long long)replication.seq + 1, (unsigned long long)record.seq, (unsigned long long)record.id);
+                stop = 1;
+                break;
+            }
+            if (record.magic != REPLICATION_MAGIC || record.seq != replication.seq + 1) {
+                //Lücke: der Primary hat den Anfang nicht mehr (anderes Log), Spool muss neu kopiert werden
+                fprintf(stderr, "Replication stream out of order (expected seq %llu, got %llu), stopped following\n", (unsigned long long)replication.seq + 1, (unsigned long long)record.seq);
+                stop = 1;
+                break;
+            }
+            int pool = -1;
+            char *payload = record.length ? buffer_alloc(record.length, &pool) : NULL;
+            int result = record.length && (!payload || recv_all(socket, payload, record.length) == -1) ? -1 : 0;
+            if (result == 0 && record.length && crc32(crc32(0, NULL, 0), (const Bytef *)payload, record.length) != record.checksum) {
+                fprintf(stderr, "Replication record %llu has a bad checksum\n", (unsigned long long)record.seq);
+                result = -1;
+            }
+            if (result == 0 && apply_record(conn, &record, payload) == -1) {
+                fprintf(stderr, "Failed to apply replication record %llu\n", (unsigned long long)record.seq);
+                result = -1;
+            }
+            if (payload) {
+                buffer_free(payload, pool);
+            }
+            if (result == -1) {
+                break; //neu verbinden, der Datensatz wird noch einmal geschickt
+            }
+
+            //Bestätigen, wenn nichts mehr ansteht (oder regelmäßig beim Aufholen), erst dann darf der Primary das Segment löschen:
+            char peek;
+            if (++unconfirmed >= REPLICATION_ACK_RECORDS || recv(socket, &peek, 1, MSG_PEEK | MSG_DONTWAIT) == -1) {
+                line_len = snprintf(line, sizeof(line), "ACK %llu\n", (unsigned long long)record.seq);
+                send(socket, line, line_len, MSG_NOSIGNAL); //Fehler zeigt das nächste recv
+                unconfirmed = 0;
+            }
+        }
+
+        pthread_mutex_lock(&replication.mutex);
+        replication.primary_fd = -1;
+        replication.connected = 0;
+        stop |= replication.shutdown;
+        pthread_mutex_unlock(&replication.mutex);
+        close(socket);
+        if (!stop) {
+            fprintf(stderr, "Lost connection to primary %s:%s\n", follow_host, follow_port);
+        }
+    }
+    free(conn->sync_fds);
+    free(conn);
+    return NULL;
+}
+
+int connect_primary(void) {
+    struct addrinfo hints, *addresses;
+    int socket_fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(follow_host, follow_port, &hints, &addresses) != 0) {
+        return -1;
+    }
+    for (struct addrinfo *address = addresses; address && socket_fd == -1; address = address->ai_next) {
+        socket_fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+        if (socket_fd != -1 && connect(socket_fd, address->ai_addr, address->ai_addrlen) == -1) {
+            close(socket_fd);
+            socket_fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    return socket_fd;
+}
+
+int apply_record(struct connection *conn, const struct replication_record *record, char *payload) {
+    struct request *request = &conn->request;
+    struct message_entry header;
+    char dirpath[PATH_BUF];
+    int result;
+
+    memset(request, 0, sizeof(struct request));
+    request->replica_seq = record->seq;
+    request->replica_id = record->id;
+    snprintf(request->username, sizeof(request->username), "%.8s", record->username);
+    if (!valid_username(request->username) || record->id < 1 || (record->type != REPLICATION_SEND && record->type != REPLICATION_DEL)) {
+        return -1;
+    }
 
+    //Schon angewendet (Abbruch zwischen Zustellen und Log) bzw. schon gelöscht: nur ins eigene Log übernehmen
+    pthread_rwlock_t *lock = lock_mailbox(request->username, record->type == REPLICATION_DEL);
+    struct mailbox *mailbox = get_mailbox(request->username);
+    int present = mailbox && find_message_entry(mailbox, record->id) != -1;
+    if (record->type == REPLICATION_DEL) {
+        request->command = CMD_DEL;
+        request->message_id = record->id;
+        result = present ? handle_del(conn, request) : log_replication(conn, request, REPLICATION_DEL, request->username, record->id, NULL, 0);
+        pthread_rwlock_unlock(lock);
+    } else {
+        pthread_rwlock_unlock(lock); //nur der Follower-Thread ändert Mailboxen, store_message sperrt selbst
+        if (present) {
+            result = log_replication(conn, request, REPLICATION_SEND, request->username, record->id, payload, record->length);
+        } else {
+            //Wie ein SEND von einem Client, nur mit fertigem Kopf und der id des Primary:
+            memset(&header, 0, sizeof(header));
+            parse_message_header(payload, record->length, &header);
+            request->command = CMD_SEND;
+            strcpy(request->receiver, request->username);
+            strcpy(request->sender, header.sender);
+            strcpy(request->subject, header.subject);
+            start_tokens(request);
+            snprintf(dirpath, sizeof(dirpath), "%s/%s", mail_spool_directory, request->receiver);
+            if (create_directory(dirpath) == -1) {
+                return -1;
+            }
+            if (record->length <= SEGMENT_INLINE_MAX) {
+                request->in_memory = 1;
+                result = body_reserve(request, record->length);
+            } else {
+                result = open_temp_body(request, dirpath);
+            }
+            if (result == 0 && append_body(request, payload, record->length) == 0) {
+                result = store_message(conn, request);
+            } else {
+                abort_request(request);
+                result = -1;
+            }
+        }
+    }
+
+    //Erst weiter, wenn Nachricht und Log-Datensatz auf der Platte sind (--durability):
+    if (result == 0 && (conn->output_failed || (conn->sync_count > 0 && commit_wait(conn) == -1))) {
+        result = -1;
+    }
+    conn->output_failed = 0;
+    return result;
+}
+
+int recv_all(int socket, void *data, size_t len) {
+    char *position = data;
+
+    while (len > 0) {
+        ssize_t received = recv(socket, position, len, 0);
+        if (received == -1 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return -1;
+        }
+        position += received;
+        len -= received;
+    }
+    return 0;
 }